@@ -16,51 +16,507 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <float.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#include <vector>
+#include <map>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <queue>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <thread>
+
+#include <zlib.h>
+#include <snappy-c.h>
 
 #include "erl_nif_compat.h"
 #include "ups/upscaledb.h"
 #include "ups/upscaledb_uqi.h"
+#include "ups/upscaledb_int.h"
 
 ERL_NIF_TERM g_atom_ok;
 ERL_NIF_TERM g_atom_error;
 ERL_NIF_TERM g_atom_key_not_found;
 ERL_NIF_TERM g_atom_duplicate_key;
+ERL_NIF_TERM g_atom_not_found;
 ErlNifResourceType *g_ups_env_resource;
 ErlNifResourceType *g_ups_db_resource;
 ErlNifResourceType *g_ups_txn_resource;
 ErlNifResourceType *g_ups_cursor_resource;
 ErlNifResourceType *g_ups_result_resource;
+ErlNifResourceType *g_ups_find_many_resource;
+ErlNifResourceType *g_ups_blob_resource;
+ErlNifResourceType *g_ups_stream_resource;
+ErlNifResourceType *g_ups_statement_resource;
+ErlNifResourceType *g_ups_compact_resource;
+
+bool g_dirty_supported;
+
+// how blocking calls of an Environment are scheduled (see dirty_job_flags())
+enum {
+  DIRTY_POLICY_AUTO = 0,
+  DIRTY_POLICY_ALWAYS,
+  DIRTY_POLICY_NEVER
+};
+
+// records of at least this size are inserted on a dirty scheduler
+#define DEFAULT_DIRTY_THRESHOLD   (64 * 1024)
+
+// uqi_result_slice decodes at least this many rows on a dirty scheduler
+#define DIRTY_SLICE_THRESHOLD     10000
+
+// db_find_many prepares at least this many keys on a dirty scheduler
+#define DIRTY_FIND_MANY_THRESHOLD 10000
+
+// group commits are flushed when this many commits are pending
+#define DEFAULT_GROUP_COMMIT_SIZE 64
+
+// Bloom filters are sized for this many keys
+#define BLOOM_DEFAULT_KEYS        1000000
+
+struct async_worker;
+struct group_committer;
+struct write_buffer;
+struct read_cache;
+struct bloom_filter;
+struct record_codec;
+struct db_wrapper;
+struct backup_job;
+struct stream_state;
 
 struct env_wrapper {
   ups_env_t *env;
   bool is_closed;
+  uint32_t flags;
+  int dirty_policy;
+  uint32_t dirty_threshold;
+  ErlNifMutex *lock;
+  async_worker *worker;
+  bool worker_stopped;
+  uint32_t group_commit_window; // in usec; 0 if group commit is disabled
+  uint32_t group_commit_size;
+  group_committer *committer;
+  bool sync_writes;             // UPS_ENABLE_FSYNC was removed (see env_sync)
+  ErlNifRWLock *dbs_lock;       // protects attached_dbs
+  db_wrapper *attached_dbs;     // the open Databases
+  ErlNifRWLock *write_gate;     // held exclusively while a backup freezes
+                                // or the first codec training escapes
+  backup_job *backup;           // the running or finished backup, or 0
+  ups_db_t *codec_catalog;      // the dictionaries (see codec_catalog)
 };
 
 struct db_wrapper {
   ups_db_t *db;
   bool is_closed;
+  env_wrapper *ewrapper;
+  uint16_t name;
+  uint32_t key_type;
+  uint32_t record_type;
+  bool typed_terms;       // return numeric keys/records as numbers
+  bool term_keys;         // keys are Erlang terms (see get_key_binary)
+  uint32_t zero_copy_threshold;
+  write_buffer *buffer;   // 0 if writes are not buffered
+  db_wrapper *next_attached;
+  read_cache *cache;      // 0 if records are not cached
+  bloom_filter *bloom;    // 0 if there is no Bloom filter
+  std::atomic<record_codec *> codec; // 0 if records are not compressed
+  ErlNifRWLock *close_lock; // read: the handle is used outside of its NIF
+                            // (async jobs, dumps, queries, streams);
+                            // write: closing
+  ErlNifMutex *streams_lock;  // protects |streams|
+  stream_state *streams;      // the running streams (see stream_stop_db)
+};
+
+// storage for a numeric key or record which was encoded from an Erlang
+// integer or float (see get_typed_binary)
+union typed_value {
+  uint8_t u8;
+  uint16_t u16;
+  uint32_t u32;
+  uint64_t u64;
+  float r32;
+  double r64;
 };
 
 struct txn_wrapper {
   ups_txn_t *txn;
   bool is_closed;
+  env_wrapper *ewrapper;
+  ErlNifRWLock *close_lock; // read: the handle is used by an async job
+                            // or a stream; write: commit and abort
 };
 
 struct cursor_wrapper {
   ups_cursor_t *cursor;
   bool is_closed;
+  bool in_txn;      // the cursor belongs to a Transaction
+  db_wrapper *dwrapper;
 };
 
 struct result_wrapper {
   uqi_result_t *result;
   bool is_closed;
+  bool is_pinned;   // binaries point into the result
+};
+
+// a query of ups_nifs_uqi_prepare
+struct statement_wrapper {
+  env_wrapper *ewrapper;
+  std::string *query;
+  uint16_t dbname;      // the Database in the FROM clause
+};
+
+// a range scan which is driven by a native producer thread
+// (see ups_nifs_stream_range)
+struct stream_state {
+  db_wrapper *dwrapper;
+  txn_wrapper *twrapper;
+  ErlNifPid pid;
+  ErlNifEnv *env;         // owns the ref, the start and end key
+  ERL_NIF_TERM ref;
+  ErlNifBinary start;
+  ErlNifBinary end;
+  typed_value start_value;
+  typed_value end_value;
+  bool has_start;
+  bool has_end;
+  uint32_t batch_size;
+  ErlNifMutex *lock;
+  ErlNifCond *cond;
+  uint32_t credit;        // batches which may be sent without an ack
+  bool cancelled;
+  ErlNifTid tid;          // 0 if the thread was joined
+  stream_state *next_stream;
+};
+
+// a record which was copied by upscaledb into memory owned by the NIF
+// layer (UPS_RECORD_USER_ALLOC); returned as a resource binary
+struct record_blob {
+  uint32_t size;
+  unsigned char data[1];
+};
+
+// the state of a (yielding) ups_nifs_db_find_many call
+struct find_many_item {
+  unsigned index;         // position in the caller's list
+  ErlNifBinary key;       // points into the caller's list or |value|, or
+                          // is owned (an encoded term key)
+  typed_value value;
+  bool is_typed;
+  bool owns_key;
+  ups_status_t status;
+  ErlNifBinary record;    // owned until it is returned
+
+  // items are moved when they are sorted; therefore |key| must not be
+  // used directly for numeric keys
+  const unsigned char *key_data() const {
+    return (is_typed ? (const unsigned char *)&value : key.data);
+  }
+};
+
+struct find_many_state {
+  std::vector<find_many_item> *items;
+  size_t position;        // the next item to look up (in sorted order)
 };
 
 #define MAX_PARAMETERS   64
 #define MAX_STRING     2048
 
+// parameters which are handled by the NIF layer and are not passed to
+// upscaledb
+struct nif_options {
+  int dirty_policy;
+  uint32_t dirty_threshold;
+  uint32_t zero_copy_threshold;
+  bool typed_terms;
+  bool term_keys;
+  bool key_codec_set;     // key_codec was passed (see key_codec_sync)
+  uint32_t group_commit_window;
+  uint32_t group_commit_size;
+  uint32_t write_buffer_size;
+  uint32_t write_buffer_age;
+  bool write_buffer_durable;
+  uint32_t read_cache_size;
+  double bloom_filter_fpr;
+  uint32_t bloom_filter_keys;
+
+  nif_options()
+    : dirty_policy(DIRTY_POLICY_AUTO),
+      dirty_threshold(DEFAULT_DIRTY_THRESHOLD),
+      zero_copy_threshold(0),
+      typed_terms(false),
+      term_keys(false),
+      key_codec_set(false),
+      group_commit_window(0),
+      group_commit_size(DEFAULT_GROUP_COMMIT_SIZE),
+      write_buffer_size(0),
+      write_buffer_age(0),
+      write_buffer_durable(false),
+      read_cache_size(0),
+      bloom_filter_fpr(0),
+      bloom_filter_keys(BLOOM_DEFAULT_KEYS) {
+  }
+};
+
+typedef ERL_NIF_TERM (*nif_function_t)(ErlNifEnv *, int, const ERL_NIF_TERM[]);
+
+// every NIF has an operation code; used for dispatching, metrics and traces
+enum nif_op {
+  OP_STRERROR,
+  OP_ENV_CREATE,
+  OP_ENV_OPEN,
+  OP_ENV_CREATE_DB,
+  OP_ENV_OPEN_DB,
+  OP_ENV_RENAME_DB,
+  OP_ENV_ERASE_DB,
+  OP_DB_INSERT,
+  OP_DB_ERASE,
+  OP_DB_FIND,
+  OP_DB_FIND_FLAGS,
+  OP_DB_CLOSE,
+  OP_TXN_BEGIN,
+  OP_TXN_ABORT,
+  OP_TXN_COMMIT,
+  OP_ENV_CLOSE,
+  OP_CURSOR_CREATE,
+  OP_CURSOR_CLONE,
+  OP_CURSOR_MOVE,
+  OP_CURSOR_OVERWRITE,
+  OP_CURSOR_FIND,
+  OP_CURSOR_INSERT,
+  OP_CURSOR_ERASE,
+  OP_CURSOR_GET_DUPLICATE_COUNT,
+  OP_CURSOR_GET_RECORD_SIZE,
+  OP_CURSOR_CLOSE,
+  OP_UQI_SELECT_RANGE,
+  OP_UQI_RESULT_GET_ROW_COUNT,
+  OP_UQI_RESULT_GET_KEY_TYPE,
+  OP_UQI_RESULT_GET_RECORD_TYPE,
+  OP_UQI_RESULT_GET_KEY,
+  OP_UQI_RESULT_GET_RECORD,
+  OP_UQI_RESULT_CLOSE,
+  OP_ASYNC_INSERT,
+  OP_ASYNC_FIND,
+  OP_ASYNC_ERASE,
+  OP_DB_INSERT_MANY,
+  OP_DB_FIND_MANY,
+  OP_CURSOR_FOLD,
+  OP_STREAM_RANGE,
+  OP_STREAM_ACK,
+  OP_STREAM_CANCEL,
+  OP_UQI_RESULT_SLICE,
+  OP_ENV_METRICS,
+  OP_TRACE_THRESHOLD,
+  OP_TRACE_DUMP,
+  OP_TRACE_SUBSCRIBE,
+  OP_TRACE_UNSUBSCRIBE,
+  OP_DB_FLUSH_BUFFER,
+  OP_DB_CACHE_STATS,
+  OP_DB_BLOOM_STATS,
+  OP_UQI_PREPARE,
+  OP_UQI_EXECUTE,
+  OP_DB_BULK_INSERT,
+  OP_ENV_BACKUP,
+  OP_ENV_COMPACT,
+  OP_ENV_COMPACT_CANCEL,
+  OP_ENV_DUMP,
+  OP_ENV_RESTORE,
+  OP_DB_TRAIN_CODEC,
+  OP_DB_ERASE_RANGE,
+  OP_MAX
+};
+
+static const char *g_op_names[OP_MAX] = {
+  "strerror",
+  "env_create",
+  "env_open",
+  "env_create_db",
+  "env_open_db",
+  "env_rename_db",
+  "env_erase_db",
+  "db_insert",
+  "db_erase",
+  "db_find",
+  "db_find_flags",
+  "db_close",
+  "txn_begin",
+  "txn_abort",
+  "txn_commit",
+  "env_close",
+  "cursor_create",
+  "cursor_clone",
+  "cursor_move",
+  "cursor_overwrite",
+  "cursor_find",
+  "cursor_insert",
+  "cursor_erase",
+  "cursor_get_duplicate_count",
+  "cursor_get_record_size",
+  "cursor_close",
+  "uqi_select_range",
+  "uqi_result_get_row_count",
+  "uqi_result_get_key_type",
+  "uqi_result_get_record_type",
+  "uqi_result_get_key",
+  "uqi_result_get_record",
+  "uqi_result_close",
+  "async_insert",
+  "async_find",
+  "async_erase",
+  "db_insert_many",
+  "db_find_many",
+  "cursor_fold",
+  "stream_range",
+  "stream_ack",
+  "stream_cancel",
+  "uqi_result_slice",
+  "env_metrics",
+  "trace_threshold",
+  "trace_dump",
+  "trace_subscribe",
+  "trace_unsubscribe",
+  "db_flush_buffer",
+  "db_cache_stats",
+  "db_bloom_stats",
+  "uqi_prepare",
+  "uqi_execute",
+  "db_bulk_insert",
+  "env_backup",
+  "env_compact",
+  "env_compact_cancel",
+  "env_dump",
+  "env_restore",
+  "db_train_codec",
+  "db_erase_range"
+};
+
+//
+// Metrics
+//
+// The NIF layer counts calls, errors, copied bytes and binary allocations.
+// Each thread increments the counters of its own (cache-line aligned) slot;
+// threads are assigned to the slots round-robin, therefore the counters are
+// atomic but practically never contended. The slots are only summed when
+// the metrics are read (ups_nifs_env_metrics).
+//
+
+#define METRICS_SLOTS             32
+
+// upscaledb status codes are in the range ]-METRICS_STATUS_MAX, 0]
+#define METRICS_STATUS_MAX        512
+
+// counters per operation
+enum {
+  METRIC_CALLS,
+  METRIC_BYTES_IN,
+  METRIC_BYTES_OUT,
+  METRIC_ALLOCS,
+  METRIC_MAX
+};
+
+static const char *g_metric_names[METRIC_MAX] = {
+  "calls",
+  "bytes_in",
+  "bytes_out",
+  "allocs"
+};
+
+struct alignas(64) metrics_slot {
+  std::atomic<uint64_t> ops[METRIC_MAX][OP_MAX];
+  std::atomic<uint64_t> errors[METRICS_STATUS_MAX];
+};
+
+static metrics_slot g_metrics[METRICS_SLOTS];
+static std::atomic<unsigned> g_next_slot(0);
+static thread_local int t_slot = -1;
+static thread_local int t_metrics_op = OP_MAX;  // the current operation
+static thread_local ups_status_t t_trace_status = 0; // the last error
+
+// returns the slot of the current thread; used for the metrics and the
+// trace rings
+static inline unsigned
+thread_slot()
+{
+  if (t_slot < 0)
+    t_slot = (int)(g_next_slot.fetch_add(1, std::memory_order_relaxed)
+                    % METRICS_SLOTS);
+  return ((unsigned)t_slot);
+}
+
+static inline metrics_slot *
+metrics_slot_get()
+{
+  return (&g_metrics[thread_slot()]);
+}
+
+static inline void
+metrics_increment(std::atomic<uint64_t> &counter, uint64_t value)
+{
+  counter.fetch_add(value, std::memory_order_relaxed);
+}
+
+// sets the operation which is executed by the current thread; byte and
+// allocation counters are attributed to this operation
+static inline void
+metrics_enter(nif_op op)
+{
+  t_metrics_op = op;
+}
+
+// counts a call and enters the operation
+static inline void
+metrics_call(nif_op op)
+{
+  metrics_enter(op);
+  metrics_increment(metrics_slot_get()->ops[METRIC_CALLS][op], 1);
+}
+
+// counts a key or record which was passed to the NIF layer
+static inline void
+metrics_bytes_in(size_t size)
+{
+  if (t_metrics_op < OP_MAX)
+    metrics_increment(metrics_slot_get()->ops[METRIC_BYTES_IN][t_metrics_op],
+                    size);
+}
+
+// counts a binary which was allocated and filled by the NIF layer
+static inline void
+metrics_output(size_t size)
+{
+  if (t_metrics_op < OP_MAX) {
+    metrics_slot *slot = metrics_slot_get();
+    metrics_increment(slot->ops[METRIC_ALLOCS][t_metrics_op], 1);
+    metrics_increment(slot->ops[METRIC_BYTES_OUT][t_metrics_op], size);
+  }
+}
+
+static inline void
+metrics_error(ups_status_t st)
+{
+  if (st < 0 && st > -METRICS_STATUS_MAX)
+    metrics_increment(metrics_slot_get()->errors[-st], 1);
+}
+
 static ERL_NIF_TERM
-status_to_atom(ErlNifEnv *env, ups_status_t st)
+status_name(ErlNifEnv *env, ups_status_t st)
 {
   switch (st) {
     case UPS_SUCCESS:
@@ -137,9 +593,274 @@ status_to_atom(ErlNifEnv *env, ups_status_t st)
   return (0);
 }
 
+// translates a status code to an atom, and counts the error
+static ERL_NIF_TERM
+status_to_atom(ErlNifEnv *env, ups_status_t st)
+{
+  metrics_error(st);
+  t_trace_status = st;
+  return (status_name(env, st));
+}
+
+//
+// Flight recorder
+//
+// Calls which take longer than a threshold (ups:trace_threshold/1) are
+// recorded in a fixed-size ring per thread slot (see thread_slot) and sent
+// to all subscribers. Entries are written with a sequence number (a seqlock)
+// and never block the writer; readers skip entries which are modified while
+// they are copied. Without a threshold, the recorder costs one relaxed
+// atomic load per call.
+//
+
+#define TRACE_RING_SIZE           256
+#define TRACE_KEY_PREFIX          16
+
+struct trace_entry {
+  std::atomic<uint64_t> seq;  // 0: never written or being written
+  ErlNifTime start;           // monotonic time, in ns
+  ErlNifTime duration;        // in ns
+  int op;
+  int status;
+  uint32_t db_name;
+  uint32_t key_size;
+  uint32_t record_size;
+  unsigned char key[TRACE_KEY_PREFIX];
+};
+
+struct alignas(64) trace_ring {
+  std::atomic<uint64_t> head;
+  trace_entry entries[TRACE_RING_SIZE];
+};
+
+static trace_ring g_trace_rings[METRICS_SLOTS];
+static std::atomic<ErlNifTime> g_trace_threshold(0);  // in ns; 0 is off
+static std::atomic<int> g_trace_subscriber_count(0);
+static std::mutex g_trace_subscribers_mutex;
+static std::vector<ErlNifPid> g_trace_subscribers;
+
+// returns the trace threshold, or 0 if tracing is disabled
+static inline ErlNifTime
+trace_threshold()
+{
+  return (g_trace_threshold.load(std::memory_order_relaxed));
+}
+
+static ERL_NIF_TERM
+trace_entry_term(ErlNifEnv *env, const trace_entry &e)
+{
+  ERL_NIF_TERM keys[] = {
+    enif_make_atom(env, "op"),
+    enif_make_atom(env, "db"),
+    enif_make_atom(env, "key"),
+    enif_make_atom(env, "key_size"),
+    enif_make_atom(env, "record_size"),
+    enif_make_atom(env, "status"),
+    enif_make_atom(env, "duration_ns"),
+    enif_make_atom(env, "timestamp")
+  };
+  ERL_NIF_TERM key;
+  uint32_t prefix = e.key_size < TRACE_KEY_PREFIX
+                        ? e.key_size
+                        : TRACE_KEY_PREFIX;
+  memcpy(enif_make_new_binary(env, prefix, &key), e.key, prefix);
+  ERL_NIF_TERM values[] = {
+    enif_make_atom(env, e.op < OP_MAX ? g_op_names[e.op] : "undefined"),
+    e.db_name ? enif_make_uint(env, e.db_name) : enif_make_atom(env, "undefined"),
+    key,
+    enif_make_uint(env, e.key_size),
+    enif_make_uint(env, e.record_size),
+    status_name(env, e.status),
+    enif_make_int64(env, e.duration),
+    // system time in nanoseconds, like erlang:system_time(nanosecond)
+    enif_make_int64(env, e.start + enif_time_offset(ERL_NIF_NSEC))
+  };
+
+  ERL_NIF_TERM map = enif_make_new_map(env);
+  for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+    (void)enif_make_map_put(env, map, keys[i], values[i], &map);
+  return (map);
+}
+
+static bool
+trace_entry_older(const trace_entry *lhs, const trace_entry *rhs)
+{
+  return (lhs->start < rhs->start);
+}
+
+// returns the size of the binary |term|, or 0 if it is not a binary
+static uint32_t
+trace_binary_size(ErlNifEnv *env, ERL_NIF_TERM term)
+{
+  ErlNifBinary bin;
+  return (enif_inspect_binary(env, term, &bin) ? (uint32_t)bin.size : 0);
+}
+
+// Records a slow call. The key and the record are taken from the
+// arguments; the record of a lookup from its result.
+static void
+trace_record(ErlNifEnv *env, nif_op op, int argc, const ERL_NIF_TERM argv[],
+                ERL_NIF_TERM result, ErlNifTime start, ErlNifTime duration)
+{
+  db_wrapper *dwrapper = 0;
+  cursor_wrapper *cwrapper;
+  ErlNifBinary key;
+  int key_arg = -1;
+  int record_arg = -1;
+
+  switch (op) {
+    case OP_DB_INSERT:
+    case OP_ASYNC_INSERT:
+      key_arg = 2;
+      record_arg = 3;
+      break;
+    case OP_DB_ERASE:
+    case OP_DB_FIND:
+    case OP_DB_FIND_FLAGS:
+    case OP_ASYNC_FIND:
+    case OP_ASYNC_ERASE:
+      key_arg = 2;
+      break;
+    case OP_CURSOR_FIND:
+      key_arg = 1;
+      break;
+    case OP_CURSOR_INSERT:
+      key_arg = 1;
+      record_arg = 2;
+      break;
+    case OP_CURSOR_OVERWRITE:
+      record_arg = 1;
+      break;
+    default:
+      break;
+  }
+
+  if (argc > 0) {
+    if (!enif_get_resource(env, argv[0], g_ups_db_resource,
+                (void **)&dwrapper)
+          && enif_get_resource(env, argv[0], g_ups_cursor_resource,
+                (void **)&cwrapper))
+      dwrapper = cwrapper->dwrapper;
+  }
+
+  trace_ring &ring = g_trace_rings[thread_slot()];
+  uint64_t pos = ring.head.fetch_add(1, std::memory_order_relaxed);
+  trace_entry &e = ring.entries[pos % TRACE_RING_SIZE];
+
+  e.seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  e.start = start;
+  e.duration = duration;
+  e.op = op;
+  e.status = t_trace_status;
+  e.db_name = dwrapper ? dwrapper->name : 0;
+  e.key_size = 0;
+  e.record_size = 0;
+  if (key_arg >= 0 && enif_inspect_binary(env, argv[key_arg], &key)) {
+    e.key_size = (uint32_t)key.size;
+    memcpy(e.key, key.data,
+            key.size < TRACE_KEY_PREFIX ? key.size : TRACE_KEY_PREFIX);
+  }
+  if (record_arg >= 0)
+    e.record_size = trace_binary_size(env, argv[record_arg]);
+  else {
+    // {ok, Record} or {ok, Key, Record}
+    int arity;
+    const ERL_NIF_TERM *array;
+    if (enif_get_tuple(env, result, &arity, &array) && arity >= 2
+          && enif_is_identical(array[0], g_atom_ok))
+      e.record_size = trace_binary_size(env, array[arity - 1]);
+  }
+  e.seq.store(pos + 1, std::memory_order_release);
+
+  if (g_trace_subscriber_count.load(std::memory_order_relaxed) == 0)
+    return;
+
+  ErlNifEnv *msg_env = enif_alloc_env();
+  std::lock_guard<std::mutex> guard(g_trace_subscribers_mutex);
+  std::vector<ErlNifPid>::iterator it = g_trace_subscribers.begin();
+  while (it != g_trace_subscribers.end()) {
+    ERL_NIF_TERM msg = enif_make_tuple2(msg_env,
+                    enif_make_atom(msg_env, "ups_trace"),
+                    trace_entry_term(msg_env, e));
+    // processes which no longer exist are removed
+    if (enif_send(env, &*it, msg_env, msg))
+      ++it;
+    else
+      it = g_trace_subscribers.erase(it);
+    enif_clear_env(msg_env);
+  }
+  g_trace_subscriber_count.store((int)g_trace_subscribers.size(),
+                  std::memory_order_relaxed);
+  enif_free_env(msg_env);
+}
+
+// runs a NIF and records it if it exceeds the trace threshold
+template<nif_op Op, nif_function_t Fn>
+static ERL_NIF_TERM
+trace_call(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ErlNifTime threshold = trace_threshold();
+  if (!threshold)
+    return (Fn(env, argc, argv));
+
+  t_trace_status = 0;
+  ErlNifTime start = enif_monotonic_time(ERL_NIF_NSEC);
+  ERL_NIF_TERM result = Fn(env, argc, argv);
+  ErlNifTime duration = enif_monotonic_time(ERL_NIF_NSEC) - start;
+  if (duration >= threshold)
+    trace_record(env, Op, argc, argv, result, start, duration);
+  return (result);
+}
+
+// Batch operations process this many items before they check whether
+// their timeslice is used up
+#define YIELD_INTERVAL  64
+
+// the length of a timeslice in microseconds, as assumed by
+// enif_consume_timeslice()
+#define TIMESLICE_USEC  1000
+
+// Reports the time spent since |*start| to the scheduler; returns true if
+// the calling NIF should yield. NIFs running on dirty schedulers never
+// yield.
+static bool
+consume_timeslice(ErlNifEnv *env, ErlNifTime *start)
+{
+  if (enif_thread_type() != ERL_NIF_THR_NORMAL_SCHEDULER)
+    return (false);
+
+  ErlNifTime now = enif_monotonic_time(ERL_NIF_USEC);
+  int percent = (int)((now - *start) * 100 / TIMESLICE_USEC);
+  *start = now;
+  if (percent < 1)
+    percent = 1;
+  else if (percent > 100)
+    percent = 100;
+  return (enif_consume_timeslice(env, percent) != 0);
+}
+
+static int
+get_dirty_policy(ErlNifEnv *env, ERL_NIF_TERM term, int *policy)
+{
+  char atom[16];
+
+  if (enif_get_atom(env, term, &atom[0], sizeof(atom), ERL_NIF_LATIN1) <= 0)
+    return (0);
+  if (!strcmp(atom, "auto"))
+    *policy = DIRTY_POLICY_AUTO;
+  else if (!strcmp(atom, "always"))
+    *policy = DIRTY_POLICY_ALWAYS;
+  else if (!strcmp(atom, "never"))
+    *policy = DIRTY_POLICY_NEVER;
+  else
+    return (0);
+  return (1);
+}
+
 static int
 get_parameters(ErlNifEnv *env, ERL_NIF_TERM term, ups_parameter_t *parameters,
-            char *logdir_buf, char *aeskey_buf)
+            char *logdir_buf, char *aeskey_buf, nif_options *options)
 {
   unsigned i = 0;
   ERL_NIF_TERM cell;
@@ -261,6 +982,89 @@ get_parameters(ErlNifEnv *env, ERL_NIF_TERM term, ups_parameter_t *parameters,
       continue;
     }
 
+    // the following parameters are consumed by the NIF layer
+    if (!strcmp(atom, "dirty_policy")) {
+      if (!get_dirty_policy(env, array[1], &options->dirty_policy))
+        return (0);
+      continue;
+    }
+    if (!strcmp(atom, "dirty_threshold")) {
+      if (!enif_get_uint(env, array[1], &options->dirty_threshold))
+        return (0);
+      continue;
+    }
+    if (!strcmp(atom, "zero_copy_threshold")) {
+      if (!enif_get_uint(env, array[1], &options->zero_copy_threshold))
+        return (0);
+      continue;
+    }
+    if (!strcmp(atom, "typed_terms")) {
+      if (enif_is_identical(array[1], enif_make_atom(env, "true")))
+        options->typed_terms = true;
+      else if (enif_is_identical(array[1], enif_make_atom(env, "false")))
+        options->typed_terms = false;
+      else
+        return (0);
+      continue;
+    }
+    if (!strcmp(atom, "key_codec")) {
+      if (enif_is_identical(array[1], enif_make_atom(env, "term")))
+        options->term_keys = true;
+      else if (enif_is_identical(array[1], enif_make_atom(env, "binary")))
+        options->term_keys = false;
+      else
+        return (0);
+      options->key_codec_set = true;
+      continue;
+    }
+    if (!strcmp(atom, "group_commit_window")) {
+      if (!enif_get_uint(env, array[1], &options->group_commit_window))
+        return (0);
+      continue;
+    }
+    if (!strcmp(atom, "group_commit_size")) {
+      if (!enif_get_uint(env, array[1], &options->group_commit_size)
+          || options->group_commit_size == 0)
+        return (0);
+      continue;
+    }
+    if (!strcmp(atom, "write_buffer_size")) {
+      if (!enif_get_uint(env, array[1], &options->write_buffer_size))
+        return (0);
+      continue;
+    }
+    if (!strcmp(atom, "write_buffer_age")) {
+      if (!enif_get_uint(env, array[1], &options->write_buffer_age))
+        return (0);
+      continue;
+    }
+    if (!strcmp(atom, "read_cache_size")) {
+      if (!enif_get_uint(env, array[1], &options->read_cache_size))
+        return (0);
+      continue;
+    }
+    if (!strcmp(atom, "bloom_filter_fpr")) {
+      if (!enif_get_double(env, array[1], &options->bloom_filter_fpr)
+          || options->bloom_filter_fpr <= 0 || options->bloom_filter_fpr >= 1)
+        return (0);
+      continue;
+    }
+    if (!strcmp(atom, "bloom_filter_keys")) {
+      if (!enif_get_uint(env, array[1], &options->bloom_filter_keys)
+          || options->bloom_filter_keys == 0)
+        return (0);
+      continue;
+    }
+    if (!strcmp(atom, "write_buffer_durability")) {
+      if (enif_is_identical(array[1], enif_make_atom(env, "flush")))
+        options->write_buffer_durable = true;
+      else if (enif_is_identical(array[1], enif_make_atom(env, "none")))
+        options->write_buffer_durable = false;
+      else
+        return (0);
+      continue;
+    }
+
     // the following parameters are read-only; we do not need to
     // extract a value
     if (!strcmp(atom, "flags")) {
@@ -296,946 +1100,7640 @@ get_parameters(ErlNifEnv *env, ERL_NIF_TERM term, ups_parameter_t *parameters,
   return (1);
 }
 
-ERL_NIF_TERM
-ups_nifs_strerror(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// decodes a numeric key or record of the given type; returns false if
+// |type| is not numeric or the size does not match
+static bool
+make_typed_term(ErlNifEnv *env, uint32_t type, const void *data, size_t size,
+                ERL_NIF_TERM *term)
 {
-  ups_status_t st;
-
-  if (argc != 1)
-    return (enif_make_badarg(env));
-  if (!enif_get_int(env, argv[0], &st))
-    return (enif_make_badarg(env));
-
-  return (enif_make_string(env, ups_strerror(st), ERL_NIF_LATIN1));
+#define MAKE_NUMERIC(T, make)                                 \
+  if (size == sizeof(T)) {                                    \
+    T v;                                                      \
+    memcpy(&v, data, sizeof(T));                              \
+    *term = make(env, v);                                     \
+    return (true);                                            \
+  }                                                           \
+  break;
+
+  switch (type) {
+    case UPS_TYPE_UINT8:
+      MAKE_NUMERIC(uint8_t, enif_make_uint)
+    case UPS_TYPE_UINT16:
+      MAKE_NUMERIC(uint16_t, enif_make_uint)
+    case UPS_TYPE_UINT32:
+      MAKE_NUMERIC(uint32_t, enif_make_uint)
+    case UPS_TYPE_UINT64:
+      MAKE_NUMERIC(ErlNifUInt64, enif_make_uint64)
+    case UPS_TYPE_REAL32:
+      MAKE_NUMERIC(float, enif_make_double)
+    case UPS_TYPE_REAL64:
+      MAKE_NUMERIC(double, enif_make_double)
+    default:
+      break;
+  }
+#undef MAKE_NUMERIC
+  return (false);
 }
 
-ERL_NIF_TERM
-ups_nifs_env_create(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// Retrieves a key or record from |term|. Binaries are used as they are;
+// integers and floats are encoded in |value| if |type| is numeric. Returns
+// false if |term| is neither or if the number is out of range.
+static bool
+get_typed_binary(ErlNifEnv *env, ERL_NIF_TERM term, uint32_t type,
+                typed_value *value, ErlNifBinary *bin)
 {
-  ups_env_t *henv;
-  uint32_t flags = 0;
-  uint32_t mode = 0;
-  char filename[MAX_STRING];
-  ups_parameter_t params[MAX_PARAMETERS] = {{0, 0}};
-  char logdir_buf[MAX_STRING];
-  char aesdir_buf[MAX_STRING];
-
-  if (argc != 4)
-    return (enif_make_badarg(env));
-  if (enif_get_string(env, argv[0], &filename[0], sizeof(filename),
-              ERL_NIF_LATIN1) <= 0)
-    return (enif_make_badarg(env));
-  if (!enif_get_uint(env, argv[1], &flags))
-    return (enif_make_badarg(env));
-  if (!enif_get_uint(env, argv[2], &mode))
-    return (enif_make_badarg(env));
-  if (!get_parameters(env, argv[3], &params[0],
-              &logdir_buf[0], &aesdir_buf[0]))
-    return (enif_make_badarg(env));
+  ErlNifUInt64 u;
+  ErlNifSInt64 i;
+  double d;
 
-  ups_status_t st = ups_env_create(&henv, filename, flags, mode, &params[0]);
-  if (st)
-    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+  if (enif_inspect_binary(env, term, bin)) {
+    metrics_bytes_in(bin->size);
+    return (true);
+  }
 
-  env_wrapper *ewrapper = (env_wrapper *)enif_alloc_resource_compat(env,
-                                g_ups_env_resource, sizeof(*ewrapper));
-  ewrapper->env = henv;
-  ewrapper->is_closed = false;
-  ERL_NIF_TERM result = enif_make_resource(env, ewrapper);
-  enif_release_resource_compat(env, ewrapper);
+  switch (type) {
+    case UPS_TYPE_UINT8:
+      if (!enif_get_uint64(env, term, &u) || u > UINT8_MAX)
+        return (false);
+      value->u8 = (uint8_t)u;
+      bin->size = sizeof(value->u8);
+      break;
+    case UPS_TYPE_UINT16:
+      if (!enif_get_uint64(env, term, &u) || u > UINT16_MAX)
+        return (false);
+      value->u16 = (uint16_t)u;
+      bin->size = sizeof(value->u16);
+      break;
+    case UPS_TYPE_UINT32:
+      if (!enif_get_uint64(env, term, &u) || u > UINT32_MAX)
+        return (false);
+      value->u32 = (uint32_t)u;
+      bin->size = sizeof(value->u32);
+      break;
+    case UPS_TYPE_UINT64:
+      if (!enif_get_uint64(env, term, &u))
+        return (false);
+      value->u64 = (uint64_t)u;
+      bin->size = sizeof(value->u64);
+      break;
+    case UPS_TYPE_REAL32:
+    case UPS_TYPE_REAL64:
+      if (enif_get_int64(env, term, &i))
+        d = (double)i;
+      else if (!enif_get_double(env, term, &d))
+        return (false);
+      if (type == UPS_TYPE_REAL64) {
+        value->r64 = d;
+        bin->size = sizeof(value->r64);
+        break;
+      }
+      if (d > FLT_MAX || d < -FLT_MAX)
+        return (false);
+      value->r32 = (float)d;
+      bin->size = sizeof(value->r32);
+      break;
+    default:
+      return (false);
+  }
 
-  return (enif_make_tuple2(env, g_atom_ok, result));
+  bin->data = (unsigned char *)value;
+  metrics_bytes_in(bin->size);
+  return (true);
 }
 
-ERL_NIF_TERM
-ups_nifs_env_open(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// Creates the term of a key or record of the given type. Numeric values
+// are decoded if the Database was opened with "typed_terms"; everything
+// else is copied to a new binary.
+static ERL_NIF_TERM
+make_value_term(ErlNifEnv *env, const db_wrapper *dwrapper, uint32_t type,
+                const void *data, size_t size)
 {
-  ups_env_t *henv;
-  uint32_t flags;
-  char filename[MAX_STRING];
-  ups_parameter_t params[MAX_PARAMETERS] = {{0, 0}};
-  char logdir_buf[MAX_STRING];
-  char aesdir_buf[MAX_STRING];
+  ERL_NIF_TERM term;
 
-  if (argc != 3)
-    return (enif_make_badarg(env));
-  if (enif_get_string(env, argv[0], &filename[0], sizeof(filename),
-              ERL_NIF_LATIN1) <= 0)
-    return (enif_make_badarg(env));
-  if (!enif_get_uint(env, argv[1], &flags))
-    return (enif_make_badarg(env));
-  if (!get_parameters(env, argv[2], &params[0],
-              &logdir_buf[0], &aesdir_buf[0]))
-    return (enif_make_badarg(env));
+  if (dwrapper->typed_terms && make_typed_term(env, type, data, size, &term))
+    return (term);
+  memcpy(enif_make_new_binary(env, size, &term), data, size);
+  metrics_output(size);
+  return (term);
+}
 
-  ups_status_t st = ups_env_open(&henv, filename, flags, &params[0]);
-  if (st)
-    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+//
+// Term keys
+//
+// A Database opened with {key_codec, term} stores its keys as Erlang
+// terms (integers, floats, atoms, binaries, tuples and lists). They are
+// encoded so that memcmp sorts them like Erlang's term order, therefore
+// the btree (and every range scan) sorts the terms. Each term starts with
+// a type tag which sorts like the types (number < atom < tuple < list <
+// binary). Numbers are stored as an order-preserving double, followed by
+// the difference of an integer to this double and a byte which sorts
+// integers before equal floats. Atoms and binaries are terminated by 0x00;
+// 0x00 bytes in their contents are escaped as 0x00 0xFF. The elements of
+// tuples and lists are followed by 0x00, which sorts before every tag.
+//
+// Unlike Erlang, tuples of different sizes are compared element by element
+// (a shorter tuple sorts first if it is a prefix of the longer one). The
+// keys which start with the elements of a tuple prefix are therefore a
+// single range of the btree (see ups_nifs_cursor_fold).
+//
+
+#define TERM_KEY_END            0x00
+#define TERM_KEY_NUMBER         0x10
+#define TERM_KEY_ATOM           0x20
+#define TERM_KEY_TUPLE          0x60
+#define TERM_KEY_LIST           0x70
+#define TERM_KEY_BINARY         0x80
+// the first byte after a prefix which is greater than all keys with this
+// prefix
+#define TERM_KEY_PREFIX_END     0xFF
+#define TERM_KEY_MAX_DEPTH      64
 
-  env_wrapper *ewrapper = (env_wrapper *)enif_alloc_resource_compat(env,
-                                g_ups_env_resource, sizeof(*ewrapper));
-  ewrapper->env = henv;
-  ewrapper->is_closed = false;
-  ERL_NIF_TERM result = enif_make_resource(env, ewrapper);
-  enif_release_resource_compat(env, ewrapper);
+static void
+term_key_put_number(std::string *out, double d, int16_t diff, bool is_float)
+{
+  uint64_t bits;
+  memcpy(&bits, &d, sizeof(bits));
+  // negative doubles sort in reverse
+  bits = (bits & 0x8000000000000000ull) ? ~bits : bits | 0x8000000000000000ull;
+  out->push_back((char)TERM_KEY_NUMBER);
+  for (int shift = 56; shift >= 0; shift -= 8)
+    out->push_back((char)(bits >> shift));
+  uint16_t u = (uint16_t)diff ^ 0x8000;
+  out->push_back((char)(u >> 8));
+  out->push_back((char)u);
+  out->push_back(is_float ? 1 : 0);
+}
 
-  return (enif_make_tuple2(env, g_atom_ok, result));
+static void
+term_key_put_bytes(std::string *out, unsigned char tag,
+                const unsigned char *data, size_t size)
+{
+  out->push_back((char)tag);
+  for (size_t i = 0; i < size; i++) {
+    out->push_back((char)data[i]);
+    if (data[i] == 0)
+      out->push_back((char)0xFF);
+  }
+  out->push_back((char)TERM_KEY_END);
 }
 
-ERL_NIF_TERM
-ups_nifs_env_create_db(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+// encodes a term; returns false if its type is not supported
+static bool
+term_key_encode(ErlNifEnv *env, ERL_NIF_TERM term, std::string *out,
+                int depth)
 {
-  ups_db_t *hdb;
-  uint32_t dbname;
-  uint32_t flags;
-  ups_parameter_t params[MAX_PARAMETERS] = {{0, 0}};
-  char logdir_buf[MAX_STRING];
-  char aesdir_buf[MAX_STRING];
-  env_wrapper *ewrapper;
+  ErlNifSInt64 i;
+  double d;
+  unsigned length;
+  int arity;
+  const ERL_NIF_TERM *array;
+  ErlNifBinary bin;
 
-  if (argc != 4)
+  if (depth > TERM_KEY_MAX_DEPTH)
+    return (false);
+
+  if (enif_get_int64(env, term, &i)) {
+    d = (double)i;
+    // the rounding error of the double is at most 2^10
+    int64_t diff = d >= 9223372036854775808.0
+            ? (i - INT64_MAX) - 1
+            : i - (int64_t)d;
+    term_key_put_number(out, d, (int16_t)diff, false);
+    return (true);
+  }
+  if (enif_get_double(env, term, &d)) {
+    term_key_put_number(out, d, 0, true);
+    return (true);
+  }
+  if (enif_get_atom_length(env, term, &length, ERL_NIF_LATIN1)) {
+    std::vector<char> atom(length + 1);
+    if (enif_get_atom(env, term, &atom[0], length + 1, ERL_NIF_LATIN1) <= 0)
+      return (false);
+    term_key_put_bytes(out, TERM_KEY_ATOM, (const unsigned char *)&atom[0],
+                    length);
+    return (true);
+  }
+  if (enif_inspect_binary(env, term, &bin)) {
+    term_key_put_bytes(out, TERM_KEY_BINARY, bin.data, bin.size);
+    return (true);
+  }
+  if (enif_get_tuple(env, term, &arity, &array)) {
+    out->push_back((char)TERM_KEY_TUPLE);
+    for (int j = 0; j < arity; j++)
+      if (!term_key_encode(env, array[j], out, depth + 1))
+        return (false);
+    out->push_back((char)TERM_KEY_END);
+    return (true);
+  }
+  if (enif_is_list(env, term)) {
+    ERL_NIF_TERM cell;
+    out->push_back((char)TERM_KEY_LIST);
+    while (enif_get_list_cell(env, term, &cell, &term))
+      if (!term_key_encode(env, cell, out, depth + 1))
+        return (false);
+    // improper lists are not supported
+    if (!enif_is_empty_list(env, term))
+      return (false);
+    out->push_back((char)TERM_KEY_END);
+    return (true);
+  }
+  return (false);
+}
+
+// encodes the range of the keys which start with the elements of |prefix|
+// (a tuple): |low| is the prefix, |high| is greater than all its keys
+static bool
+term_key_encode_prefix(ErlNifEnv *env, ERL_NIF_TERM prefix, std::string *low,
+                std::string *high)
+{
+  int arity;
+  const ERL_NIF_TERM *array;
+
+  if (!enif_get_tuple(env, prefix, &arity, &array))
+    return (false);
+  low->push_back((char)TERM_KEY_TUPLE);
+  for (int i = 0; i < arity; i++)
+    if (!term_key_encode(env, array[i], low, 1))
+      return (false);
+  *high = *low;
+  high->push_back((char)TERM_KEY_PREFIX_END);
+  return (true);
+}
+
+static bool
+term_key_get_bytes(const unsigned char **p, const unsigned char *end,
+                std::string *bytes)
+{
+  while (*p < end) {
+    unsigned char c = *(*p)++;
+    if (c != 0) {
+      bytes->push_back((char)c);
+      continue;
+    }
+    if (*p < end && **p == 0xFF) {
+      bytes->push_back(0);
+      (*p)++;
+      continue;
+    }
+    return (true);
+  }
+  return (false);
+}
+
+static bool
+term_key_decode(ErlNifEnv *env, const unsigned char **p,
+                const unsigned char *end, ERL_NIF_TERM *term, int depth)
+{
+  if (*p >= end || depth > TERM_KEY_MAX_DEPTH)
+    return (false);
+
+  unsigned char tag = *(*p)++;
+  switch (tag) {
+    case TERM_KEY_NUMBER: {
+      if (end - *p < 11)
+        return (false);
+      uint64_t bits = 0;
+      for (int i = 0; i < 8; i++)
+        bits = (bits << 8) | *(*p)++;
+      bits = (bits & 0x8000000000000000ull) ? bits & ~0x8000000000000000ull
+                                            : ~bits;
+      double d;
+      memcpy(&d, &bits, sizeof(d));
+      int16_t diff = (int16_t)((((*p)[0] << 8) | (*p)[1]) ^ 0x8000);
+      bool is_float = (*p)[2] != 0;
+      *p += 3;
+      if (is_float) {
+        *term = enif_make_double(env, d);
+        return (true);
+      }
+      if (d >= 9223372036854775808.0)
+        *term = enif_make_int64(env, INT64_MAX + (diff + 1));
+      else
+        *term = enif_make_int64(env, (int64_t)d + diff);
+      return (true);
+    }
+    case TERM_KEY_ATOM: {
+      std::string bytes;
+      if (!term_key_get_bytes(p, end, &bytes))
+        return (false);
+      *term = enif_make_atom_len(env, bytes.data(), bytes.size());
+      return (true);
+    }
+    case TERM_KEY_BINARY: {
+      std::string bytes;
+      if (!term_key_get_bytes(p, end, &bytes))
+        return (false);
+      memcpy(enif_make_new_binary(env, bytes.size(), term), bytes.data(),
+                      bytes.size());
+      return (true);
+    }
+    case TERM_KEY_TUPLE:
+    case TERM_KEY_LIST: {
+      std::vector<ERL_NIF_TERM> elements;
+      while (*p < end && **p != TERM_KEY_END) {
+        ERL_NIF_TERM element;
+        if (!term_key_decode(env, p, end, &element, depth + 1))
+          return (false);
+        elements.push_back(element);
+      }
+      if (*p >= end)
+        return (false);
+      (*p)++;
+      ERL_NIF_TERM *data = elements.empty() ? 0 : &elements[0];
+      *term = tag == TERM_KEY_TUPLE
+            ? enif_make_tuple_from_array(env, data, (unsigned)elements.size())
+            : enif_make_list_from_array(env, data, (unsigned)elements.size());
+      return (true);
+    }
+    default:
+      return (false);
+  }
+}
+
+// Retrieves a key from |term|; see get_typed_binary. The encoded term
+// keys are stored in a new binary which lives as long as |env|.
+static bool
+get_key_binary(ErlNifEnv *env, ERL_NIF_TERM term, const db_wrapper *dwrapper,
+                typed_value *value, ErlNifBinary *bin)
+{
+  if (!dwrapper->term_keys)
+    return (get_typed_binary(env, term, dwrapper->key_type, value, bin));
+
+  std::string encoded;
+  if (!term_key_encode(env, term, &encoded, 0))
+    return (false);
+  ERL_NIF_TERM binterm;
+  bin->data = enif_make_new_binary(env, encoded.size(), &binterm);
+  bin->size = encoded.size();
+  memcpy(bin->data, encoded.data(), encoded.size());
+  metrics_bytes_in(bin->size);
+  return (true);
+}
+
+// Creates the term of a key; term keys are decoded, other keys are
+// returned like make_value_term. Keys which cannot be decoded are returned
+// as binaries.
+static ERL_NIF_TERM
+make_key_term(ErlNifEnv *env, const db_wrapper *dwrapper, const void *data,
+                size_t size)
+{
+  ERL_NIF_TERM term;
+  const unsigned char *p = (const unsigned char *)data;
+  const unsigned char *end = p + size;
+
+  if (dwrapper->term_keys && term_key_decode(env, &p, end, &term, 0)
+      && p == end) {
+    metrics_output(size);
+    return (term);
+  }
+  return (make_value_term(env, dwrapper, dwrapper->key_type, data, size));
+}
+
+// adds an open Database to its Environment, which flushes or saves the
+// native state of the Database (a write buffer or a Bloom filter) when it
+// is closed, and which looks up Databases by name for prepared queries
+static void
+env_attach_db(db_wrapper *dwrapper)
+{
+  env_wrapper *ewrapper = dwrapper->ewrapper;
+  enif_rwlock_rwlock(ewrapper->dbs_lock);
+  dwrapper->next_attached = ewrapper->attached_dbs;
+  ewrapper->attached_dbs = dwrapper;
+  enif_rwlock_rwunlock(ewrapper->dbs_lock);
+}
+
+// removes a Database from its Environment; waits till running prepared
+// queries no longer use it
+static void
+env_detach_db(db_wrapper *dwrapper)
+{
+  env_wrapper *ewrapper = dwrapper->ewrapper;
+  enif_rwlock_rwlock(ewrapper->dbs_lock);
+  db_wrapper **p = &ewrapper->attached_dbs;
+  while (*p && *p != dwrapper)
+    p = &(*p)->next_attached;
+  if (*p)
+    *p = dwrapper->next_attached;
+  enif_rwlock_rwunlock(ewrapper->dbs_lock);
+}
+
+// returns the open Database |name|, or 0; the caller holds a read lock of
+// the dbs_lock
+static db_wrapper *
+env_find_db(env_wrapper *ewrapper, uint16_t name)
+{
+  for (db_wrapper *d = ewrapper->attached_dbs; d; d = d->next_attached)
+    if (d->name == name)
+      return (d);
+  return (0);
+}
+
+// returns the open Database |name| and locks it against closing, or 0 if
+// it is not open; the dbs_lock is only held for the lookup. A Database
+// which is still attached is not yet closed or destroyed: both detach it
+// first. The caller releases the handle with db_unpin().
+static db_wrapper *
+env_pin_db(env_wrapper *ewrapper, uint16_t name)
+{
+  enif_rwlock_rlock(ewrapper->dbs_lock);
+  db_wrapper *dwrapper = env_find_db(ewrapper, name);
+  if (dwrapper)
+    enif_rwlock_rlock(dwrapper->close_lock);
+  enif_rwlock_runlock(ewrapper->dbs_lock);
+  return (dwrapper);
+}
+
+static void
+db_unpin(db_wrapper *dwrapper)
+{
+  enif_rwlock_runlock(dwrapper->close_lock);
+}
+
+// cancels a stream and joins its thread; the caller holds the
+// streams_lock of the Database
+static void
+stream_stop(stream_state *state)
+{
+  enif_mutex_lock(state->lock);
+  state->cancelled = true;
+  enif_cond_signal(state->cond);
+  enif_mutex_unlock(state->lock);
+  if (state->tid)
+    enif_thread_join(state->tid, 0);
+  state->tid = 0;
+}
+
+// stops all streams of a Database before it is closed; their cursors
+// would otherwise keep it open
+static void
+stream_stop_db(db_wrapper *dwrapper)
+{
+  enif_mutex_lock(dwrapper->streams_lock);
+  for (stream_state *s = dwrapper->streams; s; s = s->next_stream)
+    stream_stop(s);
+  dwrapper->streams = 0;
+  enif_mutex_unlock(dwrapper->streams_lock);
+}
+
+// stops the streams of all open Databases of an Environment
+static void
+stream_stop_env(env_wrapper *ewrapper)
+{
+  enif_rwlock_rlock(ewrapper->dbs_lock);
+  for (db_wrapper *d = ewrapper->attached_dbs; d; d = d->next_attached)
+    stream_stop_db(d);
+  enif_rwlock_runlock(ewrapper->dbs_lock);
+}
+
+//
+// Bloom filter
+//
+// A Database opened with {bloom_filter_fpr, Rate} has a blocked Bloom
+// filter: all bits of a key are set in a single 512 bit block, therefore a
+// lookup touches only one cache line. The filter is sized for
+// {bloom_filter_keys, N} keys (default: 1000000). Every insert of this
+// binding adds its key before upscaledb is called; erases do not remove
+// keys. db_find and db_find_many skip upscaledb for keys which are
+// definitely missing.
+//
+// When the Database is closed, the filter is saved to the file
+// "<Environment>.bloom.<Database name>", which is loaded (and removed) when
+// the Database is opened again. Without this file, a native thread scans
+// the keys of the Database; the filter is not used till the scan is
+// complete. Every open through this binding removes the file, therefore a
+// filter which missed inserts is never loaded.
+//
+
+#define BLOOM_BLOCK_BITS      512
+#define BLOOM_BLOCK_WORDS     (BLOOM_BLOCK_BITS / 64)
+#define BLOOM_MAX_HASHES      16
+
+// version 2 hashes -0.0 like 0.0 (see bloom_for_each_bit)
+static const char g_bloom_magic[8] = {'U', 'P', 'S', 'B', 'L', 'M', '0', '2'};
+
+struct bloom_header {
+  char magic[8];
+  uint32_t hashes;
+  uint32_t reserved;
+  uint64_t blocks;
+};
+
+struct bloom_filter {
+  std::atomic<uint64_t> *words;
+  uint64_t blocks;
+  uint32_t hashes;
+  uint32_t key_type;
+  std::string path;             // the saved filter; empty for in-memory files
+  std::atomic<bool> ready;      // false while the keys are scanned
+  std::atomic<bool> cancelled;
+  bool has_thread;
+  ErlNifTid tid;
+  std::atomic<uint64_t> checks;
+  std::atomic<uint64_t> negatives;        // lookups which were skipped
+  std::atomic<uint64_t> false_positives;
+
+  bloom_filter(uint64_t b, uint32_t h, uint32_t kt)
+    : words(new std::atomic<uint64_t>[b * BLOOM_BLOCK_WORDS]()), blocks(b),
+      hashes(h), key_type(kt), ready(false), cancelled(false), has_thread(false),
+      checks(0), negatives(0), false_positives(0) {
+  }
+
+  ~bloom_filter() {
+    delete [] words;
+  }
+};
+
+// FNV-1a, followed by the finalizer of MurmurHash3
+static uint64_t
+bloom_hash(const void *data, uint32_t size)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  uint64_t h = 14695981039346656037ull;
+  for (uint32_t i = 0; i < size; i++) {
+    h ^= p[i];
+    h *= 1099511628211ull;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return (h);
+}
+
+// calls |fn| for each bit of a key; stops if |fn| returns false. The real
+// keys -0.0 and 0.0 are equal in the btree but not in their bytes, therefore
+// both are hashed as 0.0.
+template<typename Fn>
+static bool
+bloom_for_each_bit(const bloom_filter *bloom, const void *data, uint32_t size,
+                Fn fn)
+{
+  float f;
+  double d;
+  if (bloom->key_type == UPS_TYPE_REAL32 && size == sizeof(f)) {
+    memcpy(&f, data, sizeof(f));
+    if (f == 0) {
+      f = 0;
+      data = &f;
+    }
+  }
+  else if (bloom->key_type == UPS_TYPE_REAL64 && size == sizeof(d)) {
+    memcpy(&d, data, sizeof(d));
+    if (d == 0) {
+      d = 0;
+      data = &d;
+    }
+  }
+  uint64_t h = bloom_hash(data, size);
+  std::atomic<uint64_t> *block = bloom->words
+          + ((h >> 32) % bloom->blocks) * BLOOM_BLOCK_WORDS;
+  // double hashing within the block
+  uint64_t g = h * 0x9e3779b97f4a7c15ull;
+  uint32_t h1 = (uint32_t)g;
+  uint32_t h2 = (uint32_t)(g >> 32) | 1;
+  for (uint32_t i = 0; i < bloom->hashes; i++) {
+    uint32_t bit = (h1 + i * h2) % BLOOM_BLOCK_BITS;
+    if (!fn(block[bit / 64], 1ull << (bit % 64)))
+      return (false);
+  }
+  return (true);
+}
+
+static void
+bloom_add(db_wrapper *dwrapper, const void *data, uint32_t size)
+{
+  if (!dwrapper->bloom)
+    return;
+  bloom_for_each_bit(dwrapper->bloom, data, size,
+                  [](std::atomic<uint64_t> &word, uint64_t mask) {
+                    word.fetch_or(mask, std::memory_order_relaxed);
+                    return (true);
+                  });
+}
+
+// returns true if |key| is definitely not stored in the Database
+static bool
+bloom_excludes(db_wrapper *dwrapper, const ups_key_t *key)
+{
+  bloom_filter *bloom = dwrapper->bloom;
+  if (!bloom || !bloom->ready)
+    return (false);
+
+  bloom->checks++;
+  bool found = bloom_for_each_bit(bloom, key->data, key->size,
+                  [](std::atomic<uint64_t> &word, uint64_t mask) {
+                    return ((word.load(std::memory_order_relaxed) & mask)
+                            != 0);
+                  });
+  if (!found)
+    bloom->negatives++;
+  return (!found);
+}
+
+// counts a lookup which passed the filter but did not find its key
+static void
+bloom_false_positive(db_wrapper *dwrapper, ups_status_t st)
+{
+  if (st == UPS_KEY_NOT_FOUND && dwrapper->bloom && dwrapper->bloom->ready)
+    dwrapper->bloom->false_positives++;
+}
+
+// returns the file name of the saved filter of Database |name|; empty for
+// in-memory Environments
+static std::string
+bloom_path(env_wrapper *ewrapper, uint16_t name)
+{
+  ups_parameter_t params[] = {
+    {UPS_PARAM_FILENAME, 0},
+    {0, 0}
+  };
+  char suffix[32];
+
+  if ((ewrapper->flags & UPS_IN_MEMORY)
+      || ups_env_get_parameters(ewrapper->env, &params[0]) != 0
+      || !params[0].value)
+    return (std::string());
+  snprintf(suffix, sizeof(suffix), ".bloom.%u", (unsigned)name);
+  return (std::string((const char *)params[0].value) + suffix);
+}
+
+// removes the saved filter of a Database which is erased or renamed
+static void
+bloom_remove(env_wrapper *ewrapper, uint16_t name)
+{
+  std::string path = bloom_path(ewrapper, name);
+  if (!path.empty())
+    (void)remove(path.c_str());
+}
+
+static bool
+bloom_load(bloom_filter *bloom)
+{
+  bloom_header header;
+  uint64_t buffer[1024];
+  bool ok = false;
+
+  FILE *f = fopen(bloom->path.c_str(), "rb");
+  if (!f)
+    return (false);
+  if (fread(&header, sizeof(header), 1, f) == 1
+      && !memcmp(header.magic, g_bloom_magic, sizeof(g_bloom_magic))
+      && header.hashes == bloom->hashes
+      && header.blocks == bloom->blocks) {
+    uint64_t total = bloom->blocks * BLOOM_BLOCK_WORDS;
+    uint64_t i = 0;
+    while (i < total) {
+      size_t n = total - i < 1024 ? (size_t)(total - i) : 1024;
+      if (fread(buffer, sizeof(uint64_t), n, f) != n)
+        break;
+      for (size_t j = 0; j < n; j++)
+        bloom->words[i + j].fetch_or(buffer[j], std::memory_order_relaxed);
+      i += n;
+    }
+    ok = (i == total);
+  }
+  fclose(f);
+  return (ok);
+}
+
+static void
+bloom_save(db_wrapper *dwrapper)
+{
+  bloom_filter *bloom = dwrapper->bloom;
+  if (!bloom || !bloom->ready || bloom->path.empty())
+    return;
+
+  bloom_header header;
+  memcpy(header.magic, g_bloom_magic, sizeof(header.magic));
+  header.hashes = bloom->hashes;
+  header.reserved = 0;
+  header.blocks = bloom->blocks;
+
+  // write a temporary file; a crash must not leave a partial filter
+  std::string tmp = bloom->path + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (!f)
+    return;
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+  uint64_t total = bloom->blocks * BLOOM_BLOCK_WORDS;
+  uint64_t buffer[1024];
+  for (uint64_t i = 0; ok && i < total; ) {
+    size_t n = total - i < 1024 ? (size_t)(total - i) : 1024;
+    for (size_t j = 0; j < n; j++)
+      buffer[j] = bloom->words[i + j].load(std::memory_order_relaxed);
+    ok = fwrite(buffer, sizeof(uint64_t), n, f) == n;
+    i += n;
+  }
+  ok = (fclose(f) == 0) && ok;
+  if (!ok || rename(tmp.c_str(), bloom->path.c_str()) != 0)
+    remove(tmp.c_str());
+}
+
+// adds the keys of the Database to the filter
+static void *
+bloom_scan(void *arg)
+{
+  db_wrapper *dwrapper = (db_wrapper *)arg;
+  bloom_filter *bloom = dwrapper->bloom;
+  ups_cursor_t *cursor;
+  ups_key_t key = {0};
+
+  ups_status_t st = ups_cursor_create(&cursor, dwrapper->db, 0, 0);
+  if (st)
+    return (0); // the filter is not used
+  while (!bloom->cancelled
+          && (st = ups_cursor_move(cursor, &key, 0, UPS_CURSOR_NEXT)) == 0)
+    bloom_add(dwrapper, key.data, key.size);
+  (void)ups_cursor_close(cursor);
+
+  if (st == UPS_KEY_NOT_FOUND)
+    bloom->ready = true;
+  return (0);
+}
+
+// creates the filter of a Database; loads the saved filter or starts the
+// scan. Databases with record numbers or custom key types do not have a
+// filter. The saved filter is removed in any case.
+static void
+bloom_attach(db_wrapper *dwrapper, const nif_options *options, bool created)
+{
+  ups_parameter_t params[] = {
+    {UPS_PARAM_FLAGS, 0},
+    {0, 0}
+  };
+
+  std::string path = bloom_path(dwrapper->ewrapper, dwrapper->name);
+
+  if (options->bloom_filter_fpr > 0 && options->bloom_filter_fpr < 1
+      && dwrapper->key_type != UPS_TYPE_CUSTOM
+      && ups_db_get_parameters(dwrapper->db, &params[0]) == 0
+      && !(params[0].value & (UPS_RECORD_NUMBER32 | UPS_RECORD_NUMBER64))) {
+    double keys = options->bloom_filter_keys ? options->bloom_filter_keys : 1;
+    double bits = -keys * log(options->bloom_filter_fpr) / (M_LN2 * M_LN2);
+    uint64_t blocks = (uint64_t)ceil(bits / BLOOM_BLOCK_BITS);
+    double hashes = round(bits / keys * M_LN2);
+    bloom_filter *bloom = new bloom_filter(blocks ? blocks : 1,
+                    hashes < 1 ? 1
+                      : (hashes > BLOOM_MAX_HASHES ? BLOOM_MAX_HASHES
+                        : (uint32_t)hashes),
+                    dwrapper->key_type);
+    bloom->path = path;
+    dwrapper->bloom = bloom;
+
+    if (created || (!path.empty() && bloom_load(bloom)))
+      bloom->ready = true;
+    else if (enif_thread_create((char *)"ups_bloom_scan", &bloom->tid,
+                bloom_scan, dwrapper, 0) == 0)
+      bloom->has_thread = true;
+  }
+
+  if (!path.empty())
+    (void)remove(path.c_str());
+}
+
+// stops the scan; required before the Database is closed
+static void
+bloom_stop(db_wrapper *dwrapper)
+{
+  bloom_filter *bloom = dwrapper->bloom;
+  if (!bloom || !bloom->has_thread)
+    return;
+  bloom->cancelled = true;
+  enif_thread_join(bloom->tid, 0);
+  bloom->has_thread = false;
+}
+
+static void
+bloom_detach(db_wrapper *dwrapper)
+{
+  bloom_stop(dwrapper);
+  delete dwrapper->bloom;
+  dwrapper->bloom = 0;
+}
+
+// stops the scans of all Databases; required before the Environment is
+// closed
+static void
+bloom_stop_env(env_wrapper *ewrapper)
+{
+  enif_rwlock_rlock(ewrapper->dbs_lock);
+  for (db_wrapper *d = ewrapper->attached_dbs; d; d = d->next_attached)
+    bloom_stop(d);
+  enif_rwlock_runlock(ewrapper->dbs_lock);
+}
+
+static void
+bloom_save_env(env_wrapper *ewrapper)
+{
+  enif_rwlock_rlock(ewrapper->dbs_lock);
+  for (db_wrapper *d = ewrapper->attached_dbs; d; d = d->next_attached)
+    bloom_save(d);
+  enif_rwlock_runlock(ewrapper->dbs_lock);
+}
+
+//
+// Record compression
+//
+// Small records compress poorly one at a time. ups_nifs_db_train_codec
+// builds a dictionary from a sample of the records of a Database; from
+// then on the NIF layer compresses every record it writes with zlib (raw
+// deflate) and this preset dictionary, and decompresses the records it
+// returns. The dictionaries are stored in the Environment itself, in the
+// Database CODEC_CATALOG_DB with the key <<Name:16, Version:16>>, so
+// backups, compaction and dumps keep them. Retraining adds a new version;
+// records written with older versions remain readable. Version 0 is
+// reserved for the key codec (see key_codec_sync).
+//
+// An encoded record starts with the bytes 0xFF 0xDC, followed by the
+// version:16 of its dictionary (0 if the record is stored uncompressed)
+// and its uncompressed size:32, both big-endian. Records without this
+// header were written before the first training and are returned as they
+// are. The first training rewrites older records which happen to start
+// with a valid header as uncompressed records (see codec_escape); all
+// reads and writes of the Environment wait at the write gate till the
+// rewrite is finished and the codec is active.
+//
+
+#define CODEC_CATALOG_DB        0xEFFF
+#define CODEC_HEADER_SIZE       8
+#define CODEC_MAX_DICTIONARY    32768
+// the length of the substrings which are counted by the trainer, and of
+// the segments which are copied to the dictionary
+#define CODEC_KMER_SIZE         8
+#define CODEC_SEGMENT_SIZE      32
+
+// serializes ups_nifs_db_train_codec
+static std::mutex g_codec_training_mutex;
+
+struct record_codec {
+  ErlNifRWLock *lock;             // protects |dictionaries|
+  std::vector<std::string> dictionaries;  // version N is at index N - 1
+  std::mutex streams_mutex;
+  std::vector<z_stream *> deflaters;      // idle streams
+  std::vector<z_stream *> inflaters;
+};
+
+// opens (or creates) the catalog of the dictionaries; the handle is kept
+// until the Environment is closed
+static ups_status_t
+codec_catalog(env_wrapper *ewrapper, bool create, ups_db_t **db)
+{
+  ups_status_t st = 0;
+
+  enif_mutex_lock(ewrapper->lock);
+  if (!ewrapper->codec_catalog) {
+    st = ups_env_open_db(ewrapper->env, &ewrapper->codec_catalog,
+                    CODEC_CATALOG_DB, 0, 0);
+    if (st == UPS_DATABASE_NOT_FOUND && create)
+      st = ups_env_create_db(ewrapper->env, &ewrapper->codec_catalog,
+                      CODEC_CATALOG_DB, 0, 0);
+    if (st)
+      ewrapper->codec_catalog = 0;
+  }
+  *db = ewrapper->codec_catalog;
+  enif_mutex_unlock(ewrapper->lock);
+  return (st);
+}
+
+// closes the catalog before the Environment is closed
+static void
+codec_catalog_close(env_wrapper *ewrapper)
+{
+  enif_mutex_lock(ewrapper->lock);
+  if (ewrapper->codec_catalog)
+    (void)ups_db_close(ewrapper->codec_catalog, 0);
+  ewrapper->codec_catalog = 0;
+  enif_mutex_unlock(ewrapper->lock);
+}
+
+static void
+codec_catalog_key(uint16_t name, uint16_t version, unsigned char *buffer,
+                ups_key_t *key)
+{
+  buffer[0] = (unsigned char)(name >> 8);
+  buffer[1] = (unsigned char)name;
+  buffer[2] = (unsigned char)(version >> 8);
+  buffer[3] = (unsigned char)version;
+  key->data = buffer;
+  key->size = 4;
+}
+
+// loads the dictionaries of a Database; returns 0 if there are none
+static record_codec *
+codec_load(env_wrapper *ewrapper, uint16_t name)
+{
+  ups_db_t *catalog;
+  unsigned char buffer[4];
+
+  if (name == CODEC_CATALOG_DB || codec_catalog(ewrapper, false, &catalog))
+    return (0);
+
+  record_codec *codec = 0;
+  while (true) {
+    ups_key_t key = {0};
+    ups_record_t rec = {0};
+    codec_catalog_key(name,
+                    (uint16_t)((codec ? codec->dictionaries.size() : 0) + 1),
+                    &buffer[0], &key);
+    if (ups_db_find(catalog, 0, &key, &rec, 0))
+      break;
+    if (!codec) {
+      codec = new record_codec;
+      codec->lock = enif_rwlock_create((char *)"ups_codec_lock");
+    }
+    codec->dictionaries.push_back(std::string((const char *)rec.data,
+                            rec.size));
+  }
+  return (codec);
+}
+
+static void
+codec_free(record_codec *codec)
+{
+  if (!codec)
+    return;
+  for (size_t i = 0; i < codec->deflaters.size(); i++) {
+    (void)deflateEnd(codec->deflaters[i]);
+    delete codec->deflaters[i];
+  }
+  for (size_t i = 0; i < codec->inflaters.size(); i++) {
+    (void)inflateEnd(codec->inflaters[i]);
+    delete codec->inflaters[i];
+  }
+  enif_rwlock_destroy(codec->lock);
+  delete codec;
+}
+
+// only binary records of variable size can be compressed
+static bool
+codec_is_supported(const db_wrapper *dwrapper)
+{
+  ups_parameter_t params[] = {
+    {UPS_PARAM_RECORD_SIZE, 0},
+    {0, 0}
+  };
+
+  return (dwrapper->name != CODEC_CATALOG_DB
+          && dwrapper->record_type == UPS_TYPE_BINARY
+          && ups_db_get_parameters(dwrapper->db, &params[0]) == 0
+          && params[0].value == UPS_RECORD_SIZE_UNLIMITED);
+}
+
+static void
+codec_attach(db_wrapper *dwrapper)
+{
+  if (codec_is_supported(dwrapper))
+    dwrapper->codec = codec_load(dwrapper->ewrapper, dwrapper->name);
+}
+
+static void
+codec_detach(db_wrapper *dwrapper)
+{
+  codec_free(dwrapper->codec);
+  dwrapper->codec = 0;
+}
+
+// removes the dictionaries of a Database which is erased or created
+static void
+codec_remove(env_wrapper *ewrapper, uint16_t name)
+{
+  ups_db_t *catalog;
+  unsigned char buffer[4];
+  ups_key_t key = {0};
+
+  if (name == CODEC_CATALOG_DB || codec_catalog(ewrapper, false, &catalog))
+    return;
+  // version 0 is the key codec (see key_codec_sync)
+  codec_catalog_key(name, 0, &buffer[0], &key);
+  (void)ups_db_erase(catalog, 0, &key, 0);
+  for (uint32_t version = 1; version <= 0xffff; version++) {
+    codec_catalog_key(name, (uint16_t)version, &buffer[0], &key);
+    if (ups_db_erase(catalog, 0, &key, 0))
+      break;
+  }
+}
+
+// moves the dictionaries of a renamed Database
+static ups_status_t
+codec_rename(env_wrapper *ewrapper, uint16_t oldname, uint16_t newname)
+{
+  ups_db_t *catalog;
+  unsigned char buffer[4];
+  ups_key_t key = {0};
+  ups_status_t st = 0;
+
+  if (codec_catalog(ewrapper, false, &catalog))
+    return (0);
+  codec_remove(ewrapper, newname);
+  for (uint32_t version = 0; version <= 0xffff && !st; version++) {
+    ups_record_t rec = {0};
+    codec_catalog_key(oldname, (uint16_t)version, &buffer[0], &key);
+    if (ups_db_find(catalog, 0, &key, &rec, 0)) {
+      // the key codec is optional
+      if (version == 0)
+        continue;
+      break;
+    }
+    std::string dictionary((const char *)rec.data, rec.size);
+    rec.data = (void *)dictionary.data();
+    codec_catalog_key(newname, (uint16_t)version, &buffer[0], &key);
+    st = ups_db_insert(catalog, 0, &key, &rec, UPS_OVERWRITE);
+  }
+  if (!st)
+    codec_remove(ewrapper, oldname);
+  return (st);
+}
+
+// The key codec of a Database is stored in the catalog as version 0 (with
+// the record "term") if its keys are Erlang terms. env_create_db stores
+// it; env_open_db applies it if the key_codec parameter is missing and
+// fails if the parameter is 'binary'.
+static ups_status_t
+key_codec_sync(env_wrapper *ewrapper, ups_db_t *db, bool create,
+                nif_options *options)
+{
+  ups_parameter_t params[] = {
+    {UPS_PARAM_KEY_TYPE, 0},
+    {UPS_PARAM_DATABASE_NAME, 0},
+    {0, 0}
+  };
+  ups_db_t *catalog;
+  unsigned char buffer[4];
+  ups_key_t key = {0};
+  ups_record_t rec = {0};
+
+  ups_status_t st = ups_db_get_parameters(db, &params[0]);
+  if (st)
+    return (st);
+  // numeric keys are not encoded
+  if (params[0].value != UPS_TYPE_BINARY
+      || params[1].value == CODEC_CATALOG_DB)
+    return (0);
+  codec_catalog_key((uint16_t)params[1].value, 0, &buffer[0], &key);
+
+  if (!create) {
+    if (codec_catalog(ewrapper, false, &catalog)
+        || ups_db_find(catalog, 0, &key, &rec, 0))
+      return (0);
+    if (options->key_codec_set && !options->term_keys)
+      return (UPS_INV_PARAMETER);
+    options->term_keys = true;
+    return (0);
+  }
+
+  if (!options->term_keys)
+    return (0);
+  if ((st = codec_catalog(ewrapper, true, &catalog)))
+    return (st);
+  rec.data = (void *)"term";
+  rec.size = 4;
+  return (ups_db_insert(catalog, 0, &key, &rec, UPS_OVERWRITE));
+}
+
+// returns an idle stream, or a new one
+static z_stream *
+codec_stream(record_codec *codec, bool deflater)
+{
+  {
+    std::lock_guard<std::mutex> lock(codec->streams_mutex);
+    std::vector<z_stream *> &idle = deflater
+            ? codec->deflaters
+            : codec->inflaters;
+    if (!idle.empty()) {
+      z_stream *z = idle.back();
+      idle.pop_back();
+      return (z);
+    }
+  }
+
+  z_stream *z = new z_stream;
+  memset(z, 0, sizeof(*z));
+  int rc = deflater
+      ? deflateInit2(z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+              Z_DEFAULT_STRATEGY)
+      : inflateInit2(z, -15);
+  if (rc != Z_OK) {
+    delete z;
+    return (0);
+  }
+  return (z);
+}
+
+static void
+codec_release_stream(record_codec *codec, z_stream *z, bool deflater)
+{
+  if ((deflater ? deflateReset(z) : inflateReset(z)) != Z_OK) {
+    (void)(deflater ? deflateEnd(z) : inflateEnd(z));
+    delete z;
+    return;
+  }
+  std::lock_guard<std::mutex> lock(codec->streams_mutex);
+  (deflater ? codec->deflaters : codec->inflaters).push_back(z);
+}
+
+static void
+codec_put_header(unsigned char *header, uint16_t version, uint32_t raw_size)
+{
+  header[0] = 0xFF;
+  header[1] = 0xDC;
+  header[2] = (unsigned char)(version >> 8);
+  header[3] = (unsigned char)version;
+  header[4] = (unsigned char)(raw_size >> 24);
+  header[5] = (unsigned char)(raw_size >> 16);
+  header[6] = (unsigned char)(raw_size >> 8);
+  header[7] = (unsigned char)raw_size;
+}
+
+// compresses a record which is about to be written; |rec| then points to
+// |buffer|. Records which do not shrink are stored with version 0.
+static void
+codec_encode(const db_wrapper *dwrapper, ups_record_t *rec,
+                std::vector<char> *buffer)
+{
+  record_codec *codec = dwrapper->codec;
+  if (!codec)
+    return;
+
+  uint16_t version = 0;
+  size_t packed = 0;
+  enif_rwlock_rlock(codec->lock);
+  z_stream *z = codec_stream(codec, true);
+  if (z) {
+    const std::string &dictionary = codec->dictionaries.back();
+    buffer->resize(CODEC_HEADER_SIZE + deflateBound(z, rec->size));
+    if (deflateSetDictionary(z, (const Bytef *)dictionary.data(),
+                    (uInt)dictionary.size()) == Z_OK) {
+      z->next_in = (Bytef *)rec->data;
+      z->avail_in = rec->size;
+      z->next_out = (Bytef *)buffer->data() + CODEC_HEADER_SIZE;
+      z->avail_out = (uInt)(buffer->size() - CODEC_HEADER_SIZE);
+      if (deflate(z, Z_FINISH) == Z_STREAM_END && z->total_out < rec->size) {
+        version = (uint16_t)codec->dictionaries.size();
+        packed = z->total_out;
+      }
+    }
+    codec_release_stream(codec, z, true);
+  }
+  enif_rwlock_runlock(codec->lock);
+
+  if (!version) {
+    buffer->resize(CODEC_HEADER_SIZE + rec->size);
+    if (rec->size)
+      memcpy(buffer->data() + CODEC_HEADER_SIZE, rec->data, rec->size);
+    packed = rec->size;
+  }
+
+  codec_put_header((unsigned char *)buffer->data(), version, rec->size);
+  rec->data = buffer->data();
+  rec->size = (uint32_t)(CODEC_HEADER_SIZE + packed);
+}
+
+// returns the uncompressed size of a record, or false if it does not
+// start with a valid header
+static bool
+codec_header(const void *data, uint32_t size, uint16_t *version,
+                uint32_t *raw_size)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  if (size < CODEC_HEADER_SIZE || p[0] != 0xFF || p[1] != 0xDC)
+    return (false);
+  *version = (uint16_t)((p[2] << 8) | p[3]);
+  *raw_size = ((uint32_t)p[4] << 24) | ((uint32_t)p[5] << 16)
+          | ((uint32_t)p[6] << 8) | p[7];
+  // deflate does not compress by more than 1:1032
+  if (*version == 0)
+    return (*raw_size == size - CODEC_HEADER_SIZE);
+  return (*raw_size / 1032 <= size);
+}
+
+// decompresses a record which was read; |*data| and |*size| then point to
+// |buffer| (or into the record). Fails with UPS_INTEGRITY_VIOLATED if the
+// record cannot be decompressed or its dictionary is unknown.
+static ups_status_t
+codec_decode(const db_wrapper *dwrapper, const void **data, uint32_t *size,
+                std::vector<char> *buffer)
+{
+  record_codec *codec = dwrapper->codec;
+  uint16_t version;
+  uint32_t raw_size;
+
+  if (!codec || !codec_header(*data, *size, &version, &raw_size))
+    return (0);
+  const char *packed = (const char *)*data + CODEC_HEADER_SIZE;
+  if (version == 0) {
+    *data = packed;
+    *size = raw_size;
+    return (0);
+  }
+
+  bool ok = false;
+  enif_rwlock_rlock(codec->lock);
+  z_stream *z = version <= codec->dictionaries.size()
+          ? codec_stream(codec, false)
+          : 0;
+  if (z) {
+    const std::string &dictionary = codec->dictionaries[version - 1];
+    buffer->resize(raw_size);
+    if (inflateSetDictionary(z, (const Bytef *)dictionary.data(),
+                    (uInt)dictionary.size()) == Z_OK) {
+      z->next_in = (Bytef *)packed;
+      z->avail_in = *size - CODEC_HEADER_SIZE;
+      z->next_out = (Bytef *)buffer->data();
+      z->avail_out = raw_size;
+      ok = inflate(z, Z_FINISH) == Z_STREAM_END && z->total_out == raw_size;
+    }
+    codec_release_stream(codec, z, false);
+  }
+  enif_rwlock_runlock(codec->lock);
+
+  if (!ok)
+    return (UPS_INTEGRITY_VIOLATED);
+  *data = buffer->data();
+  *size = raw_size;
+  return (0);
+}
+
+// creates the term of a record, which is decompressed first
+static ups_status_t
+make_record_term(ErlNifEnv *env, const db_wrapper *dwrapper,
+                const void *data, uint32_t size, ERL_NIF_TERM *term)
+{
+  std::vector<char> buffer;
+  ups_status_t st = codec_decode(dwrapper, &data, &size, &buffer);
+  if (st)
+    return (st);
+  *term = make_value_term(env, dwrapper, dwrapper->record_type, data, size);
+  return (0);
+}
+
+struct codec_segment {
+  uint64_t score;
+  uint32_t sample;
+  uint32_t offset;
+
+  bool operator<(const codec_segment &other) const {
+    return (score < other.score);
+  }
+};
+
+static uint64_t
+codec_kmer(const std::string &sample, size_t offset)
+{
+  uint64_t kmer;
+  memcpy(&kmer, sample.data() + offset, sizeof(kmer));
+  return (kmer);
+}
+
+// the number of other samples which share the substrings of a segment
+static uint64_t
+codec_segment_score(const std::vector<std::string> &samples,
+                const codec_segment &segment,
+                const std::unordered_map<uint64_t, uint32_t> &frequencies)
+{
+  const std::string &sample = samples[segment.sample];
+  size_t end = std::min(sample.size(),
+                  (size_t)segment.offset + CODEC_SEGMENT_SIZE);
+  uint64_t score = 0;
+  for (size_t i = segment.offset; i + CODEC_KMER_SIZE <= end; i++) {
+    std::unordered_map<uint64_t, uint32_t>::const_iterator it
+            = frequencies.find(codec_kmer(sample, i));
+    if (it != frequencies.end() && it->second > 1)
+      score += it->second - 1;
+  }
+  return (score);
+}
+
+// Builds a dictionary from the segments whose substrings occur in the
+// most samples (a simplified version of the "cover" algorithm of zstd).
+// Segments are chosen greedily; the substrings of a chosen segment no
+// longer count for the others. The best segments are placed at the end,
+// where deflate reaches them with the shortest distances.
+static std::string
+codec_build_dictionary(const std::vector<std::string> &samples,
+                size_t capacity)
+{
+  std::unordered_map<uint64_t, uint32_t> frequencies;
+  std::vector<uint64_t> kmers;
+
+  // in how many samples does each substring occur?
+  for (size_t s = 0; s < samples.size(); s++) {
+    kmers.clear();
+    for (size_t i = 0; i + CODEC_KMER_SIZE <= samples[s].size(); i++)
+      kmers.push_back(codec_kmer(samples[s], i));
+    std::sort(kmers.begin(), kmers.end());
+    kmers.erase(std::unique(kmers.begin(), kmers.end()), kmers.end());
+    for (size_t i = 0; i < kmers.size(); i++)
+      frequencies[kmers[i]]++;
+  }
+
+  std::priority_queue<codec_segment> candidates;
+  for (size_t s = 0; s < samples.size(); s++) {
+    for (size_t offset = 0; offset + CODEC_KMER_SIZE <= samples[s].size();
+            offset += CODEC_SEGMENT_SIZE / 2) {
+      codec_segment segment = {0, (uint32_t)s, (uint32_t)offset};
+      segment.score = codec_segment_score(samples, segment, frequencies);
+      if (segment.score)
+        candidates.push(segment);
+    }
+  }
+
+  std::vector<codec_segment> chosen;
+  size_t size = 0;
+  while (!candidates.empty() && size < capacity) {
+    codec_segment segment = candidates.top();
+    candidates.pop();
+    // the score is lazily updated
+    uint64_t score = codec_segment_score(samples, segment, frequencies);
+    if (!score)
+      continue;
+    if (!candidates.empty() && score < candidates.top().score) {
+      segment.score = score;
+      candidates.push(segment);
+      continue;
+    }
+
+    const std::string &sample = samples[segment.sample];
+    size_t end = std::min(sample.size(),
+                    (size_t)segment.offset + CODEC_SEGMENT_SIZE);
+    for (size_t i = segment.offset; i + CODEC_KMER_SIZE <= end; i++)
+      frequencies[codec_kmer(sample, i)] = 0;
+    chosen.push_back(segment);
+    size += end - segment.offset;
+  }
+
+  std::string dictionary;
+  for (size_t i = chosen.size(); i > 0; i--) {
+    const codec_segment &segment = chosen[i - 1];
+    const std::string &sample = samples[segment.sample];
+    size_t end = std::min(sample.size(),
+                    (size_t)segment.offset + CODEC_SEGMENT_SIZE);
+    dictionary.append(sample, segment.offset, end - segment.offset);
+  }
+  if (dictionary.size() > capacity)
+    dictionary.erase(0, dictionary.size() - capacity);
+  return (dictionary);
+}
+
+//
+// Read cache
+//
+// A Database opened with {read_cache_size, Bytes} keeps the records of
+// recent lookups (without a Transaction) as refcounted record_blobs; a hit
+// returns a resource binary which points to the cached record, without
+// calling upscaledb and without copying. The cache is split into shards
+// with their own lock; each shard evicts with the CLOCK algorithm.
+//
+// Every write of this binding invalidates the key after it was applied.
+// Each shard counts its invalidations; a lookup which missed only fills the
+// cache if no key of its shard was invalidated in the meantime, therefore a
+// record which was read before a concurrent write is never cached.
+//
+
+#define READ_CACHE_SHARDS     16
+
+// the estimated overhead of an entry (list node, hash table node)
+#define READ_CACHE_OVERHEAD   96
+
+struct cache_entry {
+  std::string key;
+  record_blob *blob;
+  bool referenced;
+};
+
+typedef std::list<cache_entry> cache_ring;
+
+struct cache_shard {
+  std::mutex mutex;
+  cache_ring ring;              // in CLOCK order
+  cache_ring::iterator hand;
+  std::unordered_map<std::string, cache_ring::iterator> index;
+  size_t size;                  // bytes
+  uint64_t generation;          // incremented by every invalidation
+
+  cache_shard()
+    : hand(ring.end()), size(0), generation(0) {
+  }
+};
+
+struct read_cache {
+  cache_shard shards[READ_CACHE_SHARDS];
+  size_t shard_capacity;
+  std::atomic<uint64_t> hits;
+  std::atomic<uint64_t> misses;
+  std::atomic<uint64_t> evictions;
+
+  read_cache(size_t capacity)
+    : shard_capacity(capacity / READ_CACHE_SHARDS), hits(0), misses(0),
+      evictions(0) {
+  }
+
+  cache_shard &shard(const std::string &key) {
+    size_t h = std::hash<std::string>()(key);
+    return (shards[(h ^ (h >> 16)) % READ_CACHE_SHARDS]);
+  }
+};
+
+static inline size_t
+cache_entry_size(const cache_entry &entry)
+{
+  return (entry.key.size() + entry.blob->size + READ_CACHE_OVERHEAD);
+}
+
+// removes an entry; the caller holds the shard's mutex
+static void
+cache_shard_remove(cache_shard &shard, cache_ring::iterator it)
+{
+  shard.size -= cache_entry_size(*it);
+  shard.index.erase(it->key);
+  enif_release_resource(it->blob);
+  if (it == shard.hand)
+    shard.hand = shard.ring.erase(it);
+  else
+    shard.ring.erase(it);
+}
+
+static void
+read_cache_attach(db_wrapper *dwrapper, const nif_options *options)
+{
+  if (options->read_cache_size)
+    dwrapper->cache = new read_cache(options->read_cache_size);
+}
+
+static void
+read_cache_clear(db_wrapper *dwrapper)
+{
+  if (!dwrapper->cache)
+    return;
+  for (int i = 0; i < READ_CACHE_SHARDS; i++) {
+    cache_shard &shard = dwrapper->cache->shards[i];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.generation++;
+    while (!shard.ring.empty())
+      cache_shard_remove(shard, shard.ring.begin());
+  }
+}
+
+static void
+read_cache_detach(db_wrapper *dwrapper)
+{
+  read_cache_clear(dwrapper);
+  delete dwrapper->cache;
+  dwrapper->cache = 0;
+}
+
+// returns the cached record of |key| (the caller releases it), or 0; on a
+// miss, |generation| receives the state of the shard for read_cache_fill()
+static record_blob *
+read_cache_lookup(db_wrapper *dwrapper, const ups_key_t *key,
+                uint64_t *generation)
+{
+  std::string k((const char *)key->data, key->size);
+  cache_shard &shard = dwrapper->cache->shard(k);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+
+  std::unordered_map<std::string, cache_ring::iterator>::iterator it
+          = shard.index.find(k);
+  if (it == shard.index.end()) {
+    dwrapper->cache->misses++;
+    *generation = shard.generation;
+    return (0);
+  }
+
+  dwrapper->cache->hits++;
+  it->second->referenced = true;
+  enif_keep_resource(it->second->blob);
+  return (it->second->blob);
+}
+
+// caches the record of a missed lookup
+static void
+read_cache_fill(db_wrapper *dwrapper, const ups_key_t *key,
+                record_blob *blob, uint64_t generation)
+{
+  read_cache *cache = dwrapper->cache;
+  cache_entry entry = {std::string((const char *)key->data, key->size),
+                       blob, false};
+  size_t size = cache_entry_size(entry);
+  if (size > cache->shard_capacity)
+    return;
+
+  cache_shard &shard = cache->shard(entry.key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  if (shard.generation != generation
+      || shard.index.find(entry.key) != shard.index.end())
+    return;
+
+  while (shard.size + size > cache->shard_capacity) {
+    if (shard.hand == shard.ring.end())
+      shard.hand = shard.ring.begin();
+    if (shard.hand->referenced) {
+      shard.hand->referenced = false;
+      ++shard.hand;
+      continue;
+    }
+    cache_shard_remove(shard, shard.hand);
+    cache->evictions++;
+  }
+
+  enif_keep_resource(blob);
+  cache_ring::iterator it = shard.ring.insert(shard.hand, entry);
+  shard.index[entry.key] = it;
+  shard.size += size;
+}
+
+// drops the cached record of |key|; called after every write
+static void
+read_cache_invalidate(db_wrapper *dwrapper, const void *data, uint32_t size)
+{
+  if (!dwrapper->cache)
+    return;
+
+  std::string k((const char *)data, size);
+  cache_shard &shard = dwrapper->cache->shard(k);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  shard.generation++;
+  std::unordered_map<std::string, cache_ring::iterator>::iterator it
+          = shard.index.find(k);
+  if (it != shard.index.end())
+    cache_shard_remove(shard, it->second);
+}
+
+// returns a cached record to the VM; numeric records are decoded if
+// the Database uses typed terms
+static ERL_NIF_TERM
+read_cache_term(ErlNifEnv *env, const db_wrapper *dwrapper, record_blob *blob)
+{
+  ERL_NIF_TERM term;
+
+  if (dwrapper->typed_terms && make_typed_term(env, dwrapper->record_type,
+                          &blob->data[0], blob->size, &term))
+    return (term);
+  return (enif_make_resource_binary(env, blob, &blob->data[0], blob->size));
+}
+
+// looks up a key in the cache, and fills the cache on a miss
+static ups_status_t
+read_cache_find(ErlNifEnv *env, db_wrapper *dwrapper, ups_key_t *key,
+                ERL_NIF_TERM *term)
+{
+  uint64_t generation;
+  record_blob *blob = read_cache_lookup(dwrapper, key, &generation);
+  if (blob) {
+    *term = read_cache_term(env, dwrapper, blob);
+    enif_release_resource(blob);
+    return (0);
+  }
+
+  ups_record_t rec = {0};
+  ups_status_t st = ups_db_find(dwrapper->db, 0, key, &rec, 0);
+  if (st)
+    return (st);
+
+  // the cache stores decompressed records
+  const void *data = rec.data;
+  uint32_t size = rec.size;
+  std::vector<char> decoded;
+  st = codec_decode(dwrapper, &data, &size, &decoded);
+  if (st)
+    return (st);
+
+  blob = (record_blob *)enif_alloc_resource(g_ups_blob_resource,
+                  sizeof(record_blob) + size);
+  if (!blob)
+    return (UPS_OUT_OF_MEMORY);
+  blob->size = size;
+  if (size)
+    memcpy(&blob->data[0], data, size);
+  metrics_output(size);
+
+  read_cache_fill(dwrapper, key, blob, generation);
+  *term = read_cache_term(env, dwrapper, blob);
+  enif_release_resource(blob);
+  return (0);
+}
+
+// returns the key at the cursor's current position (for invalidation
+// after the cursor modified the record)
+static std::string
+cursor_current_key(cursor_wrapper *cwrapper)
+{
+  ups_key_t key = {0};
+  if (!cwrapper->dwrapper->cache
+      || ups_cursor_move(cwrapper->cursor, &key, 0, 0) != 0)
+    return (std::string());
+  return (std::string((const char *)key.data, key.size));
+}
+
+// With group commit, the committer only flushes the commits of
+// ups_nifs_txn_commit (see group_commit_run). Writes which are committed
+// otherwise (temporary Transactions of single writes and of cursors,
+// batches, sub-transactions of erase_range, async jobs and write buffer
+// flushes) lost the UPS_ENABLE_FSYNC of the Environment, therefore they
+// are flushed right away.
+static ups_status_t
+env_sync(env_wrapper *ewrapper, ups_status_t st)
+{
+  if (!st && ewrapper->sync_writes)
+    st = ups_env_flush(ewrapper->env, 0);
+  return (st);
+}
+
+//
+// Asynchronous requests
+//
+// Each Environment can have a native worker thread which executes
+// requests of the ups:async_* functions. Requests are pushed onto a
+// lock-free multi-producer/single-consumer queue (an intrusive queue as
+// described by Dmitry Vyukov); the results are sent to the calling process
+// as {ups_async, Ref, Result}. The worker is started with the first request
+// and stopped when the Environment is closed.
+//
+
+enum {
+  ASYNC_INSERT,
+  ASYNC_FIND,
+  ASYNC_ERASE,
+  ASYNC_STOP
+};
+
+struct async_job {
+  std::atomic<async_job *> next;
+  int type;
+  ErlNifEnv *msg_env;   // owns the copied arguments and the reply
+  ErlNifPid pid;
+  ERL_NIF_TERM ref;
+  db_wrapper *dwrapper;
+  txn_wrapper *twrapper;
+  ErlNifBinary key;
+  ErlNifBinary record;
+  typed_value key_value;
+  typed_value record_value;
+  uint32_t flags;
+};
+
+struct async_queue {
+  std::atomic<async_job *> head;  // producers push here
+  async_job *tail;                // the consumer pops from here
+  async_job stub;
+
+  async_queue()
+    : head(&stub), tail(&stub) {
+    stub.next = 0;
+  }
+
+  void push(async_job *job) {
+    job->next = 0;
+    async_job *prev = head.exchange(job);
+    prev->next = job;
+  }
+
+  // returns 0 if the queue is empty, or if a producer is still in the
+  // middle of push()
+  async_job *pop() {
+    async_job *t = tail;
+    async_job *next = t->next;
+    if (t == &stub) {
+      if (!next)
+        return (0);
+      tail = next;
+      t = next;
+      next = next->next;
+    }
+    if (next) {
+      tail = next;
+      return (t);
+    }
+    if (t != head.load())
+      return (0);
+    push(&stub);
+    next = t->next;
+    if (next) {
+      tail = next;
+      return (t);
+    }
+    return (0);
+  }
+};
+
+struct async_worker {
+  async_queue queue;
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::atomic<bool> sleeping;
+  std::atomic<int> producers;
+  env_wrapper *ewrapper;
+  ErlNifTid tid;
+  bool detached;          // stopped by its own thread (see async_worker_stop)
+
+  async_worker(env_wrapper *ew)
+    : sleeping(false), producers(0), ewrapper(ew), tid(0), detached(false) {
+  }
+};
+
+// workers which were stopped by their own thread; another thread joins
+// them (see async_worker_stop)
+static std::mutex g_stopped_workers_mutex;
+static std::vector<ErlNifTid> g_stopped_workers;
+
+// joins the threads of workers which stopped themselves
+static void
+async_worker_reap()
+{
+  std::vector<ErlNifTid> tids;
+  {
+    std::lock_guard<std::mutex> lock(g_stopped_workers_mutex);
+    tids.swap(g_stopped_workers);
+  }
+  for (size_t i = 0; i < tids.size(); i++)
+    enif_thread_join(tids[i], 0);
+}
+
+static async_job *
+async_job_create(ErlNifEnv *env, int type, db_wrapper *dwrapper,
+                txn_wrapper *twrapper)
+{
+  async_job *job = new async_job();
+  job->type = type;
+  job->msg_env = enif_alloc_env();
+  job->dwrapper = dwrapper;
+  job->twrapper = twrapper;
+  job->flags = 0;
+  if (dwrapper)
+    enif_keep_resource(dwrapper);
+  if (twrapper)
+    enif_keep_resource(twrapper);
+  if (env) {
+    enif_self(env, &job->pid);
+    job->ref = enif_make_ref(job->msg_env);
+  }
+  return (job);
+}
+
+static void
+async_job_destroy(async_job *job)
+{
+  if (job->dwrapper)
+    enif_release_resource(job->dwrapper);
+  if (job->twrapper)
+    enif_release_resource(job->twrapper);
+  enif_free_env(job->msg_env);
+  delete job;
+}
+
+static void
+async_job_reply(async_job *job, ERL_NIF_TERM result)
+{
+  ERL_NIF_TERM msg = enif_make_tuple3(job->msg_env,
+                  enif_make_atom(job->msg_env, "ups_async"),
+                  job->ref, result);
+  (void)enif_send(0, &job->pid, job->msg_env, msg);
+}
+
+static ERL_NIF_TERM
+async_job_execute(async_job *job)
+{
+  ErlNifEnv *env = job->msg_env;
+  ups_txn_t *txn = job->twrapper ? job->twrapper->txn : 0;
+  ups_key_t key = {0};
+  ups_record_t rec = {0};
+  std::vector<char> encoded;
+  ups_status_t st;
+
+  if (job->dwrapper->is_closed || (job->twrapper && job->twrapper->is_closed))
+    return (enif_make_tuple2(env, g_atom_error,
+                status_to_atom(env, UPS_INV_PARAMETER)));
+
+  key.size = job->key.size;
+  key.data = job->key.size ? job->key.data : 0;
+
+  switch (job->type) {
+    case ASYNC_INSERT:
+      metrics_enter(OP_ASYNC_INSERT);
+      rec.size = job->record.size;
+      rec.data = job->record.size ? job->record.data : 0;
+      codec_encode(job->dwrapper, &rec, &encoded);
+      bloom_add(job->dwrapper, key.data, key.size);
+      st = ups_db_insert(job->dwrapper->db, txn, &key, &rec, job->flags);
+      if (!txn)
+        st = env_sync(job->dwrapper->ewrapper, st);
+      if (st)
+        return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+      read_cache_invalidate(job->dwrapper, key.data, key.size);
+      return (g_atom_ok);
+
+    case ASYNC_ERASE:
+      metrics_enter(OP_ASYNC_ERASE);
+      st = ups_db_erase(job->dwrapper->db, txn, &key, 0);
+      if (!txn)
+        st = env_sync(job->dwrapper->ewrapper, st);
+      if (st)
+        return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+      read_cache_invalidate(job->dwrapper, key.data, key.size);
+      return (g_atom_ok);
+
+    case ASYNC_FIND: {
+      metrics_enter(OP_ASYNC_FIND);
+      st = ups_db_find(job->dwrapper->db, txn, &key, &rec, job->flags);
+      if (st)
+        return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+      ERL_NIF_TERM record;
+      st = make_record_term(env, job->dwrapper, rec.data, rec.size, &record);
+      if (st)
+        return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+      if (!job->flags)
+        return (enif_make_tuple2(env, g_atom_ok, record));
+      ERL_NIF_TERM k = make_key_term(env, job->dwrapper, key.data,
+                      key.size);
+      return (enif_make_tuple3(env, g_atom_ok, k, record));
+    }
+
+    default:
+      return (g_atom_error);
+  }
+}
+
+static void *
+async_worker_run(void *arg)
+{
+  async_worker *worker = (async_worker *)arg;
+
+  while (true) {
+    async_job *job = worker->queue.pop();
+    if (!job) {
+      std::unique_lock<std::mutex> lock(worker->mutex);
+      worker->sleeping = true;
+      while (!(job = worker->queue.pop()))
+        worker->cond.wait(lock);
+      worker->sleeping = false;
+    }
+
+    if (job->type == ASYNC_STOP) {
+      async_job_destroy(job);
+      break;
+    }
+
+    // ups_nifs_db_close() cannot close the Database (and
+    // ups_nifs_txn_commit() not the Transaction) while the job runs
+    enif_rwlock_rlock(worker->ewrapper->write_gate);
+    enif_rwlock_rlock(job->dwrapper->close_lock);
+    if (job->twrapper)
+      enif_rwlock_rlock(job->twrapper->close_lock);
+    ERL_NIF_TERM result = async_job_execute(job);
+    if (job->twrapper)
+      enif_rwlock_runlock(job->twrapper->close_lock);
+    enif_rwlock_runlock(job->dwrapper->close_lock);
+    enif_rwlock_runlock(worker->ewrapper->write_gate);
+    async_job_reply(job, result);
+    async_job_destroy(job);
+
+    // the job released the last reference of the Environment
+    if (worker->detached) {
+      delete worker;
+      break;
+    }
+  }
+
+  return (0);
+}
+
+// enqueues a job for the worker of an Environment; starts the thread if
+// required. Fails if the Environment is closed.
+static bool
+async_worker_push(env_wrapper *ewrapper, async_job *job)
+{
+  async_worker *worker;
+
+  async_worker_reap();
+
+  enif_mutex_lock(ewrapper->lock);
+  worker = ewrapper->worker;
+  if (!worker && !ewrapper->worker_stopped) {
+    worker = new async_worker(ewrapper);
+    if (enif_thread_create((char *)"ups_async_worker", &worker->tid,
+                async_worker_run, worker, 0)) {
+      delete worker;
+      worker = 0;
+    }
+    ewrapper->worker = worker;
+  }
+  // async_worker_stop() waits till all producers are gone
+  if (worker)
+    worker->producers++;
+  enif_mutex_unlock(ewrapper->lock);
+
+  if (!worker)
+    return (false);
+
+  worker->queue.push(job);
+  bool sleeping = worker->sleeping;
+  worker->producers--;
+
+  if (sleeping) {
+    std::lock_guard<std::mutex> lock(worker->mutex);
+    worker->cond.notify_one();
+  }
+  return (true);
+}
+
+// stops the worker thread; pending jobs are executed before the thread
+// terminates
+static void
+async_worker_stop(env_wrapper *ewrapper)
+{
+  enif_mutex_lock(ewrapper->lock);
+  async_worker *worker = ewrapper->worker;
+  ewrapper->worker = 0;
+  ewrapper->worker_stopped = true;
+  enif_mutex_unlock(ewrapper->lock);
+
+  if (!worker)
+    return;
+
+  // wait till concurrent pushes are finished; a push only takes a few
+  // instructions
+  while (worker->producers > 0)
+    std::this_thread::yield();
+
+  // a job holds a Database, which holds the Environment; if the worker
+  // destroys the last job then the Environment is released on the worker
+  // thread. The thread cannot join itself; it deletes the worker and
+  // terminates after the job, and the next start or stop of a worker
+  // joins it. No jobs are pending, since each of them would still hold
+  // the Environment.
+  if (enif_equal_tids(worker->tid, enif_thread_self())) {
+    worker->detached = true;
+    std::lock_guard<std::mutex> lock(g_stopped_workers_mutex);
+    g_stopped_workers.push_back(worker->tid);
+    return;
+  }
+  async_worker_reap();
+
+  async_job *stop = async_job_create(0, ASYNC_STOP, 0, 0);
+  worker->queue.push(stop);
+  {
+    std::lock_guard<std::mutex> lock(worker->mutex);
+    worker->cond.notify_one();
+  }
+  enif_thread_join(worker->tid, 0);
+  delete worker;
+}
+
+//
+// Group commit
+//
+// If an Environment is opened with {group_commit_window, Usecs}, it is
+// opened without UPS_ENABLE_FSYNC. ups_nifs_txn_commit commits the
+// Transaction without flushing it and parks the caller, which then waits
+// for {ups_commit, Ref, Result}. A native thread collects the commits which
+// arrive within the window (or until group_commit_size commits are
+// pending), makes all of them durable with a single ups_env_flush and then
+// acknowledges every caller.
+//
+
+struct commit_waiter {
+  ErlNifPid pid;
+  ErlNifEnv *msg_env;   // owns the ref and the reply
+  ERL_NIF_TERM ref;
+};
+
+struct group_committer {
+  std::mutex mutex;
+  std::condition_variable cond;
+  std::vector<commit_waiter> pending;
+  std::chrono::steady_clock::time_point first;  // arrival of pending[0]
+  bool stop;
+  env_wrapper *ewrapper;
+  ErlNifTid tid;
+
+  group_committer(env_wrapper *ew)
+    : stop(false), ewrapper(ew), tid(0) {
+  }
+};
+
+static void *
+group_commit_run(void *arg)
+{
+  group_committer *committer = (group_committer *)arg;
+  env_wrapper *ewrapper = committer->ewrapper;
+  std::chrono::microseconds window(ewrapper->group_commit_window);
+  std::vector<commit_waiter> batch;
+
+  std::unique_lock<std::mutex> lock(committer->mutex);
+  while (true) {
+    while (committer->pending.empty() && !committer->stop)
+      committer->cond.wait(lock);
+    if (committer->pending.empty())
+      break; // stopped, and nothing is left to flush
+
+    // wait till the window is closed or the group is full
+    std::chrono::steady_clock::time_point deadline = committer->first
+                    + window;
+    while (!committer->stop
+            && committer->pending.size() < ewrapper->group_commit_size
+            && committer->cond.wait_until(lock, deadline)
+                    != std::cv_status::timeout)
+      ;
+
+    batch.swap(committer->pending);
+    lock.unlock();
+
+    // commits which arrive in the meantime form the next group
+    enif_rwlock_rlock(ewrapper->write_gate);
+    ups_status_t st = ups_env_flush(ewrapper->env, 0);
+    enif_rwlock_runlock(ewrapper->write_gate);
+    for (size_t i = 0; i < batch.size(); i++) {
+      ErlNifEnv *env = batch[i].msg_env;
+      ERL_NIF_TERM result = st
+              ? enif_make_tuple2(env, g_atom_error, status_to_atom(env, st))
+              : g_atom_ok;
+      ERL_NIF_TERM msg = enif_make_tuple3(env,
+                      enif_make_atom(env, "ups_commit"), batch[i].ref, result);
+      (void)enif_send(0, &batch[i].pid, env, msg);
+      enif_free_env(env);
+    }
+    batch.clear();
+
+    lock.lock();
+  }
+
+  return (0);
+}
+
+// starts the committer thread of an Environment if group commit is enabled
+static void
+group_commit_start(env_wrapper *ewrapper)
+{
+  ewrapper->committer = 0;
+  if (!ewrapper->group_commit_window)
+    return;
+
+  group_committer *committer = new group_committer(ewrapper);
+  if (enif_thread_create((char *)"ups_group_commit", &committer->tid,
+              group_commit_run, committer, 0)) {
+    delete committer;
+    return;
+  }
+  ewrapper->committer = committer;
+}
+
+// parks the calling process till its commit is flushed; returns the
+// reference of the reply, or false if the Environment has no committer
+static bool
+group_commit_push(ErlNifEnv *env, env_wrapper *ewrapper, ERL_NIF_TERM *ref)
+{
+  bool pushed = false;
+
+  enif_mutex_lock(ewrapper->lock);
+  group_committer *committer = ewrapper->committer;
+  if (committer) {
+    commit_waiter waiter;
+    enif_self(env, &waiter.pid);
+    waiter.msg_env = enif_alloc_env();
+    waiter.ref = enif_make_ref(waiter.msg_env);
+    *ref = enif_make_copy(env, waiter.ref);
+
+    std::lock_guard<std::mutex> lock(committer->mutex);
+    if (committer->pending.empty())
+      committer->first = std::chrono::steady_clock::now();
+    committer->pending.push_back(waiter);
+    if (committer->pending.size() == 1
+        || committer->pending.size() >= ewrapper->group_commit_size)
+      committer->cond.notify_one();
+    pushed = true;
+  }
+  enif_mutex_unlock(ewrapper->lock);
+  return (pushed);
+}
+
+// stops the committer thread; pending commits are flushed and acknowledged
+// before the thread terminates
+static void
+group_commit_stop(env_wrapper *ewrapper)
+{
+  enif_mutex_lock(ewrapper->lock);
+  group_committer *committer = ewrapper->committer;
+  ewrapper->committer = 0;
+  enif_mutex_unlock(ewrapper->lock);
+
+  if (!committer)
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(committer->mutex);
+    committer->stop = true;
+    committer->cond.notify_one();
+  }
+  enif_thread_join(committer->tid, 0);
+  delete committer;
+}
+
+// initializes a new Database handle and caches the parameters which are
+// required by the NIF layer
+static void
+db_wrapper_init(db_wrapper *dwrapper, ups_db_t *hdb, env_wrapper *ewrapper,
+                const nif_options *options)
+{
+  ups_parameter_t params[] = {
+    {UPS_PARAM_KEY_TYPE, 0},
+    {UPS_PARAM_RECORD_TYPE, 0},
+    {UPS_PARAM_DATABASE_NAME, 0},
+    {0, 0}
+  };
+
+  dwrapper->db = hdb;
+  dwrapper->is_closed = false;
+  dwrapper->ewrapper = ewrapper;
+  dwrapper->typed_terms = options->typed_terms;
+  dwrapper->zero_copy_threshold = options->zero_copy_threshold;
+  dwrapper->buffer = 0;
+  dwrapper->next_attached = 0;
+  dwrapper->cache = 0;
+  dwrapper->bloom = 0;
+  dwrapper->codec = 0;
+  dwrapper->close_lock = enif_rwlock_create((char *)"ups_db_close_lock");
+  dwrapper->streams_lock = enif_mutex_create((char *)"ups_db_streams_lock");
+  dwrapper->streams = 0;
+  enif_keep_resource(ewrapper);
+
+  if (ups_db_get_parameters(hdb, &params[0]) == 0) {
+    dwrapper->key_type = (uint32_t)params[0].value;
+    dwrapper->record_type = (uint32_t)params[1].value;
+    dwrapper->name = (uint16_t)params[2].value;
+  }
+  else {
+    dwrapper->key_type = UPS_TYPE_BINARY;
+    dwrapper->record_type = UPS_TYPE_BINARY;
+    dwrapper->name = 0;
+  }
+  // numeric keys are not encoded
+  dwrapper->term_keys = options->term_keys
+          && dwrapper->key_type == UPS_TYPE_BINARY;
+}
+
+// compares two keys like the btree of a Database with the given key type
+static int
+compare_keys(uint32_t key_type, const void *lhs, size_t lhs_size,
+                const void *rhs, size_t rhs_size)
+{
+#define COMPARE_NUMERIC(T)                                    \
+  if (lhs_size == sizeof(T) && rhs_size == sizeof(T)) {       \
+    T l, r;                                                   \
+    memcpy(&l, lhs, sizeof(T));                               \
+    memcpy(&r, rhs, sizeof(T));                               \
+    return (l < r ? -1 : (l > r ? 1 : 0));                    \
+  }                                                           \
+  break;
+
+  switch (key_type) {
+    case UPS_TYPE_UINT8:
+      COMPARE_NUMERIC(uint8_t)
+    case UPS_TYPE_UINT16:
+      COMPARE_NUMERIC(uint16_t)
+    case UPS_TYPE_UINT32:
+      COMPARE_NUMERIC(uint32_t)
+    case UPS_TYPE_UINT64:
+      COMPARE_NUMERIC(uint64_t)
+    case UPS_TYPE_REAL32:
+      COMPARE_NUMERIC(float)
+    case UPS_TYPE_REAL64:
+      COMPARE_NUMERIC(double)
+    case UPS_TYPE_CUSTOM:
+      return (0); // the order is unknown
+    default:
+      break;
+  }
+#undef COMPARE_NUMERIC
+
+  int cmp = memcmp(lhs, rhs, lhs_size < rhs_size ? lhs_size : rhs_size);
+  if (cmp)
+    return (cmp);
+  return (lhs_size < rhs_size ? -1 : (lhs_size > rhs_size ? 1 : 0));
+}
+
+//
+// Write-behind buffer
+//
+// A Database opened with {write_buffer_size, Bytes} absorbs inserts and
+// erases without a Transaction in a sorted in-memory table; lookups are
+// served from the table first. The table is flushed to upscaledb in key
+// order (in a single Transaction if the Environment has Transactions
+// enabled) when it grows beyond write_buffer_size bytes, when a write finds
+// that the oldest buffered write is older than write_buffer_age
+// milliseconds, on ups:db_flush_buffer/1 and when the Database or its
+// Environment is closed. Calls which access the btree directly (cursors,
+// queries, streams, batches, asynchronous and transactional requests) flush
+// the buffer first.
+//
+// Buffered writes are lost if the VM terminates before they are flushed.
+// With {write_buffer_durability, flush} each flush is followed by
+// ups_env_flush; a successful flush then makes all preceding writes durable.
+//
+
+#define BUFFER_CHUNK_SIZE   (64 * 1024)
+
+// keys and records are copied into large chunks which are released
+// together when the table is flushed
+struct buffer_arena {
+  std::vector<unsigned char *> chunks;
+  size_t used;          // bytes used in the last chunk
+  size_t total;         // bytes handed out
+
+  buffer_arena()
+    : used(BUFFER_CHUNK_SIZE), total(0) {
+  }
+
+  ~buffer_arena() {
+    reset();
+  }
+
+  unsigned char *alloc(size_t size) {
+    total += size;
+    if (size > BUFFER_CHUNK_SIZE / 4) {
+      // large allocations get their own chunk; the current chunk is
+      // still used for the next small allocation
+      unsigned char *p = (unsigned char *)enif_alloc(size);
+      if (p)
+        chunks.insert(chunks.end() - (chunks.empty() ? 0 : 1), p);
+      return (p);
+    }
+    if (used + size > BUFFER_CHUNK_SIZE) {
+      unsigned char *p = (unsigned char *)enif_alloc(BUFFER_CHUNK_SIZE);
+      if (!p)
+        return (0);
+      chunks.push_back(p);
+      used = 0;
+    }
+    unsigned char *p = chunks.back() + used;
+    used += size;
+    return (p);
+  }
+
+  void reset() {
+    for (size_t i = 0; i < chunks.size(); i++)
+      enif_free(chunks[i]);
+    chunks.clear();
+    used = BUFFER_CHUNK_SIZE;
+    total = 0;
+  }
+};
+
+struct buffer_key {
+  const unsigned char *data;
+  uint32_t size;
+};
+
+struct buffer_key_less {
+  uint32_t key_type;
+
+  buffer_key_less(uint32_t type)
+    : key_type(type) {
+  }
+
+  bool operator()(const buffer_key &lhs, const buffer_key &rhs) const {
+    return (compare_keys(key_type, lhs.data, lhs.size,
+                            rhs.data, rhs.size) < 0);
+  }
+};
+
+struct buffer_entry {
+  unsigned char *record;
+  uint32_t size;
+  uint32_t capacity;    // overwrites reuse the memory if they fit
+  bool erased;
+};
+
+typedef std::map<buffer_key, buffer_entry, buffer_key_less> buffer_table;
+
+struct write_buffer {
+  std::mutex mutex;
+  buffer_table table;
+  buffer_arena arena;
+  uint32_t max_size;
+  std::chrono::milliseconds max_age;  // 0: unlimited
+  bool durable;
+  std::chrono::steady_clock::time_point first;  // oldest buffered write
+
+  write_buffer(uint32_t key_type, const nif_options *options)
+    : table(buffer_key_less(key_type)), max_size(options->write_buffer_size),
+      max_age(options->write_buffer_age), durable(options->write_buffer_durable) {
+  }
+
+  // the arena plus the (estimated) overhead of the tree nodes
+  size_t size() const {
+    return (arena.total + table.size() * 64);
+  }
+};
+
+// creates the write buffer of a Database if it was requested; Databases
+// with custom key types, record numbers or duplicate keys are not buffered
+static void
+write_buffer_attach(db_wrapper *dwrapper, const nif_options *options)
+{
+  ups_parameter_t params[] = {
+    {UPS_PARAM_FLAGS, 0},
+    {0, 0}
+  };
+
+  if (!options->write_buffer_size || dwrapper->key_type == UPS_TYPE_CUSTOM)
+    return;
+  if (ups_db_get_parameters(dwrapper->db, &params[0]) != 0
+      || (params[0].value & (UPS_RECORD_NUMBER32 | UPS_RECORD_NUMBER64
+                              | UPS_ENABLE_DUPLICATE_KEYS)))
+    return;
+
+  dwrapper->buffer = new write_buffer(dwrapper->key_type, options);
+}
+
+// writes the table to the btree; the caller holds the buffer's mutex
+static ups_status_t
+write_buffer_flush_locked(db_wrapper *dwrapper)
+{
+  write_buffer *buffer = dwrapper->buffer;
+  env_wrapper *ewrapper = dwrapper->ewrapper;
+  ups_txn_t *txn = 0;
+  ups_status_t st = 0;
+
+  if (buffer->table.empty())
+    return (0);
+
+  if (ewrapper->flags & UPS_ENABLE_TRANSACTIONS) {
+    st = ups_txn_begin(&txn, ewrapper->env, 0, 0, 0);
+    if (st)
+      return (st);
+  }
+
+  buffer_table::iterator it;
+  for (it = buffer->table.begin(); it != buffer->table.end(); ++it) {
+    ups_key_t key = {0};
+    key.data = (void *)it->first.data;
+    key.size = it->first.size;
+    if (it->second.erased) {
+      st = ups_db_erase(dwrapper->db, txn, &key, 0);
+      if (st == UPS_KEY_NOT_FOUND)
+        st = 0;
+    }
+    else {
+      ups_record_t rec = {0};
+      rec.data = it->second.size ? it->second.record : 0;
+      rec.size = it->second.size;
+      st = ups_db_insert(dwrapper->db, txn, &key, &rec, UPS_OVERWRITE);
+    }
+    if (st)
+      break;
+  }
+
+  if (txn) {
+    if (!st)
+      st = ups_txn_commit(txn, 0);
+    if (st) {
+      (void)ups_txn_abort(txn, 0);
+      return (st);  // the table is unchanged
+    }
+  }
+  else if (st) {
+    // keep what was not yet written
+    buffer->table.erase(buffer->table.begin(), it);
+    return (st);
+  }
+
+  buffer->table.clear();
+  buffer->arena.reset();
+
+  if (buffer->durable)
+    st = ups_env_flush(ewrapper->env, 0);
+  else
+    st = env_sync(ewrapper, st);
+  return (st);
+}
+
+// the caller holds the close_lock of the Database
+static ups_status_t
+write_buffer_flush_pinned(db_wrapper *dwrapper)
+{
+  if (!dwrapper->buffer)
+    return (0);
+  std::lock_guard<std::mutex> lock(dwrapper->buffer->mutex);
+  return (write_buffer_flush_locked(dwrapper));
+}
+
+// ups_nifs_db_close() releases the buffer while it holds the close_lock
+static ups_status_t
+write_buffer_flush(db_wrapper *dwrapper)
+{
+  enif_rwlock_rlock(dwrapper->close_lock);
+  ups_status_t st = dwrapper->is_closed
+                      ? UPS_INV_PARAMETER
+                      : write_buffer_flush_pinned(dwrapper);
+  enif_rwlock_runlock(dwrapper->close_lock);
+  return (st);
+}
+
+// flushes the buffers of all Databases of an Environment
+static ups_status_t
+write_buffer_flush_env(env_wrapper *ewrapper)
+{
+  ups_status_t st = 0;
+
+  enif_rwlock_rlock(ewrapper->dbs_lock);
+  for (db_wrapper *d = ewrapper->attached_dbs; d && !st; d = d->next_attached)
+    st = write_buffer_flush(d);
+  enif_rwlock_runlock(ewrapper->dbs_lock);
+  return (st);
+}
+
+// releases the buffer of a Database; unflushed writes are discarded. The
+// caller holds the close_lock for writing.
+static void
+write_buffer_detach(db_wrapper *dwrapper)
+{
+  delete dwrapper->buffer;
+  dwrapper->buffer = 0;
+}
+
+// flushes the table if it exceeds the size or age limit; the caller holds
+// the buffer's mutex
+static ups_status_t
+write_buffer_check_limits(db_wrapper *dwrapper)
+{
+  write_buffer *buffer = dwrapper->buffer;
+
+  if (buffer->size() >= buffer->max_size
+      || (buffer->max_age.count()
+          && std::chrono::steady_clock::now() - buffer->first
+                  >= buffer->max_age))
+    return (write_buffer_flush_locked(dwrapper));
+  return (0);
+}
+
+// returns 0 if the key exists, either in the table or in the btree
+static ups_status_t
+write_buffer_lookup(db_wrapper *dwrapper, ups_key_t *key,
+                buffer_table::iterator *it)
+{
+  buffer_key bkey = {(const unsigned char *)key->data, key->size};
+  *it = dwrapper->buffer->table.find(bkey);
+  if (*it != dwrapper->buffer->table.end())
+    return ((*it)->second.erased ? UPS_KEY_NOT_FOUND : 0);
+
+  ups_record_t rec = {0};
+  return (ups_db_find(dwrapper->db, 0, key, &rec, 0));
+}
+
+// stores a record (or a tombstone, if |rec| is null) in the table
+static ups_status_t
+write_buffer_put(db_wrapper *dwrapper, buffer_table::iterator it,
+                ups_key_t *key, ups_record_t *rec)
+{
+  write_buffer *buffer = dwrapper->buffer;
+  uint32_t size = rec ? rec->size : 0;
+
+  // overwrites reuse the memory of the previous record if it fits
+  unsigned char *record = 0;
+  uint32_t capacity = size;
+  if (it != buffer->table.end() && size <= it->second.capacity) {
+    record = it->second.record;
+    capacity = it->second.capacity;
+  }
+  else if (size && !(record = buffer->arena.alloc(size)))
+    return (UPS_OUT_OF_MEMORY);
+
+  if (buffer->table.empty())
+    buffer->first = std::chrono::steady_clock::now();
+
+  if (it == buffer->table.end()) {
+    unsigned char *k = buffer->arena.alloc(key->size ? key->size : 1);
+    if (!k)
+      return (UPS_OUT_OF_MEMORY);
+    memcpy(k, key->data, key->size);
+    buffer_key bkey = {k, key->size};
+    it = buffer->table.insert(std::make_pair(bkey, buffer_entry())).first;
+  }
+
+  buffer_entry &entry = it->second;
+  if (size)
+    memcpy(record, rec->data, size);
+  entry.record = record;
+  entry.size = size;
+  entry.capacity = capacity;
+  entry.erased = (rec == 0);
+
+  return (write_buffer_check_limits(dwrapper));
+}
+
+// buffers an insert; |flags| can be 0 or UPS_OVERWRITE. The caller holds
+// the close_lock.
+static ups_status_t
+write_buffer_insert_pinned(db_wrapper *dwrapper, ups_key_t *key,
+                ups_record_t *rec, uint32_t flags)
+{
+  std::lock_guard<std::mutex> lock(dwrapper->buffer->mutex);
+  buffer_table::iterator it = dwrapper->buffer->table.end();
+
+  if (!(flags & UPS_OVERWRITE)) {
+    ups_status_t st = write_buffer_lookup(dwrapper, key, &it);
+    if (st == 0)
+      return (UPS_DUPLICATE_KEY);
+    if (st != UPS_KEY_NOT_FOUND)
+      return (st);
+  }
+  else {
+    buffer_key bkey = {(const unsigned char *)key->data, key->size};
+    it = dwrapper->buffer->table.find(bkey);
+  }
+  return (write_buffer_put(dwrapper, it, key, rec));
+}
+
+// buffers an erase; fails with UPS_KEY_NOT_FOUND like ups_db_erase. The
+// caller holds the close_lock.
+static ups_status_t
+write_buffer_erase_pinned(db_wrapper *dwrapper, ups_key_t *key)
+{
+  std::lock_guard<std::mutex> lock(dwrapper->buffer->mutex);
+  buffer_table::iterator it;
+
+  ups_status_t st = write_buffer_lookup(dwrapper, key, &it);
+  if (st)
+    return (st);
+  return (write_buffer_put(dwrapper, it, key, 0));
+}
+
+// buffers an insert (or an erase, if |rec| is null); fails if the
+// Database was closed in the meantime
+static ups_status_t
+write_buffer_write(db_wrapper *dwrapper, ups_key_t *key, ups_record_t *rec,
+                uint32_t flags)
+{
+  ups_status_t st;
+
+  enif_rwlock_rlock(dwrapper->close_lock);
+  if (dwrapper->is_closed)
+    st = UPS_INV_PARAMETER;
+  else if (rec)
+    st = write_buffer_insert_pinned(dwrapper, key, rec, flags);
+  else
+    st = write_buffer_erase_pinned(dwrapper, key);
+  enif_rwlock_runlock(dwrapper->close_lock);
+  return (st);
+}
+
+// looks up a key in the table; returns false if the key is not buffered.
+// The caller holds the close_lock.
+static bool
+write_buffer_find_pinned(ErlNifEnv *env, db_wrapper *dwrapper,
+                ups_key_t *key, ERL_NIF_TERM *result)
+{
+  std::lock_guard<std::mutex> lock(dwrapper->buffer->mutex);
+  buffer_key bkey = {(const unsigned char *)key->data, key->size};
+  buffer_table::iterator it = dwrapper->buffer->table.find(bkey);
+  if (it == dwrapper->buffer->table.end())
+    return (false);
+
+  ERL_NIF_TERM record;
+  ups_status_t st = it->second.erased
+          ? UPS_KEY_NOT_FOUND
+          : make_record_term(env, dwrapper, it->second.record,
+                  it->second.size, &record);
+  *result = st
+          ? enif_make_tuple2(env, g_atom_error, status_to_atom(env, st))
+          : enif_make_tuple2(env, g_atom_ok, record);
+  return (true);
+}
+
+// looks up a key in the table; returns false if the key is not buffered.
+// Fails if the Database was closed in the meantime.
+static bool
+write_buffer_find(ErlNifEnv *env, db_wrapper *dwrapper, ups_key_t *key,
+                ERL_NIF_TERM *result)
+{
+  bool found = true;
+
+  enif_rwlock_rlock(dwrapper->close_lock);
+  if (dwrapper->is_closed)
+    *result = enif_make_tuple2(env, g_atom_error,
+                    status_to_atom(env, UPS_INV_PARAMETER));
+  else
+    found = write_buffer_find_pinned(env, dwrapper, key, result);
+  enif_rwlock_runlock(dwrapper->close_lock);
+  return (found);
+}
+
+//
+// Online backup
+//
+// ups_nifs_env_backup starts a native thread which copies the file of an
+// Environment while it is in use. The first pass copies the file (with an
+// optional rate limit) while writes continue, and a second pass rewrites
+// the blocks which changed in the meantime. Then all calls which can
+// modify the file wait at the write gate of the Environment while the
+// Environment is flushed. On file systems with reflinks the file is then
+// cloned, the gate is released and a last pass copies the changes from
+// the clone. Otherwise the last pass compares the file itself while the
+// gate is closed; it reads the whole file, but only writes the blocks
+// which changed since the second pass. (upscaledb does not report which
+// pages it writes, therefore the changed blocks cannot be tracked.)
+// An incremental backup updates an existing copy and compares the blocks
+// in the first pass as well, therefore it only writes what changed since
+// the previous backup.
+//
+
+#define BACKUP_CHUNK_SIZE       (1024 * 1024)
+// the granularity of the comparison of incremental backups
+#define BACKUP_BLOCK_SIZE       4096
+#define BACKUP_PROGRESS_BYTES   (64 * 1024 * 1024)
+
+struct backup_job {
+  env_wrapper *ewrapper;
+  std::string source;
+  std::string target;
+  bool incremental;
+  uint64_t rate_limit;          // bytes per second; 0 if unlimited
+  ErlNifPid pid;
+  ErlNifEnv *env;               // owns the reference
+  ERL_NIF_TERM ref;
+  ErlNifTid tid;
+  std::atomic<bool> cancelled;
+  std::atomic<bool> done;
+  uint64_t total;               // the size of the file
+  uint64_t copied;              // bytes which were read in the first pass
+  uint64_t written;             // bytes which were written to the copy
+  std::vector<char> source_buffer;
+  std::vector<char> target_buffer;
+
+  backup_job()
+    : ewrapper(0), incremental(false), rate_limit(0), env(enif_alloc_env()),
+      cancelled(false), done(false), total(0), copied(0), written(0),
+      source_buffer(BACKUP_CHUNK_SIZE), target_buffer(BACKUP_CHUNK_SIZE) {
+  }
+
+  ~backup_job() {
+    enif_free_env(env);
+  }
+};
+
+static void
+backup_send(backup_job *job, ErlNifEnv *msg_env, ERL_NIF_TERM event)
+{
+  ERL_NIF_TERM msg = enif_make_tuple3(msg_env,
+                  enif_make_atom(msg_env, "ups_backup"),
+                  enif_make_copy(msg_env, job->ref), event);
+  (void)enif_send(0, &job->pid, msg_env, msg);
+  enif_clear_env(msg_env);
+}
+
+static bool
+backup_write(int fd, const char *data, size_t size, off_t offset)
+{
+  while (size > 0) {
+    ssize_t n = pwrite(fd, data, size, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return (false);
+    data += n;
+    size -= n;
+    offset += n;
+  }
+  return (true);
+}
+
+static ssize_t
+backup_read(int fd, char *data, size_t size, off_t offset)
+{
+  size_t total = 0;
+  while (total < size) {
+    ssize_t n = pread(fd, data + total, size - total, offset + total);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return (-1);
+    if (n == 0)
+      break;
+    total += n;
+  }
+  return ((ssize_t)total);
+}
+
+// copies a range in the kernel if possible
+static bool
+backup_copy(backup_job *job, int in, int out, off_t offset, size_t size)
+{
+#if defined(__linux__)
+  off_t in_offset = offset;
+  off_t out_offset = offset;
+  size_t left = size;
+  while (left > 0) {
+    ssize_t n = copy_file_range(in, &in_offset, out, &out_offset, left, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;  // not supported for these files; copy the rest
+    left -= n;
+  }
+  if (left == 0) {
+    job->written += size;
+    return (true);
+  }
+  offset += size - left;
+  size = left;
+#endif
+  ssize_t n = backup_read(in, job->source_buffer.data(), size, offset);
+  if (n < 0 || !backup_write(out, job->source_buffer.data(), n, offset))
+    return (false);
+  job->written += n;
+  return (true);
+}
+
+// rewrites the blocks of a range which differ from the source
+static bool
+backup_compare(backup_job *job, int in, int out, off_t offset, size_t size)
+{
+  char *source = job->source_buffer.data();
+  char *target = job->target_buffer.data();
+
+  ssize_t n = backup_read(in, source, size, offset);
+  ssize_t m = backup_read(out, target, size, offset);
+  if (n < 0 || m < 0)
+    return (false);
+
+  for (ssize_t i = 0; i < n; i += BACKUP_BLOCK_SIZE) {
+    size_t block = std::min((ssize_t)BACKUP_BLOCK_SIZE, n - i);
+    if (i + (ssize_t)block <= m && !memcmp(source + i, target + i, block))
+      continue;
+    if (!backup_write(out, source + i, block, offset + i))
+      return (false);
+    job->written += block;
+  }
+  return (true);
+}
+
+// copies or compares the whole file; returns false on I/O errors or if the
+// backup was cancelled
+static bool
+backup_pass(backup_job *job, ErlNifEnv *msg_env, int in, int out,
+                bool compare, bool throttle)
+{
+  struct stat st;
+  if (fstat(in, &st))
+    return (false);
+
+  uint64_t size = (uint64_t)st.st_size;
+  uint64_t next_progress = BACKUP_PROGRESS_BYTES;
+  std::chrono::steady_clock::time_point start
+          = std::chrono::steady_clock::now();
+
+  for (uint64_t offset = 0; offset < size; offset += BACKUP_CHUNK_SIZE) {
+    if (job->cancelled)
+      return (false);
+
+    size_t chunk = (size_t)std::min((uint64_t)BACKUP_CHUNK_SIZE,
+                    size - offset);
+    if (!(compare
+            ? backup_compare(job, in, out, (off_t)offset, chunk)
+            : backup_copy(job, in, out, (off_t)offset, chunk)))
+      return (false);
+
+    if (!throttle)
+      continue;
+    job->copied = offset + chunk;
+    if (job->copied >= next_progress) {
+      next_progress += BACKUP_PROGRESS_BYTES;
+      backup_send(job, msg_env, enif_make_tuple3(msg_env,
+                      enif_make_atom(msg_env, "progress"),
+                      enif_make_uint64(msg_env, job->copied),
+                      enif_make_uint64(msg_env, size)));
+    }
+    if (job->rate_limit) {
+      std::chrono::microseconds due(job->copied * 1000000 / job->rate_limit);
+      std::chrono::steady_clock::time_point now
+              = std::chrono::steady_clock::now();
+      if (start + due > now)
+        std::this_thread::sleep_for(start + due - now);
+    }
+  }
+
+  job->total = size;
+  return (ftruncate(out, (off_t)size) == 0);
+}
+
+// creates a copy-on-write clone of the file |in| if the file system
+// supports reflinks; returns its descriptor, or -1. The clone is unlinked
+// at once and removed when the descriptor is closed.
+static int
+backup_clone(backup_job *job, int in)
+{
+#if defined(__linux__) && defined(FICLONE)
+  std::string path = job->source + ".backup";
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0)
+    return (-1);
+  (void)unlink(path.c_str());
+  if (ioctl(fd, FICLONE, in) == 0)
+    return (fd);
+  close(fd);
+#endif
+  return (-1);
+}
+
+static void *
+backup_run(void *arg)
+{
+  backup_job *job = (backup_job *)arg;
+  env_wrapper *ewrapper = job->ewrapper;
+  ErlNifEnv *msg_env = enif_alloc_env();
+  ups_status_t st = 0;
+  bool ok = false;
+
+  // an incremental backup without a previous copy is a full backup
+  int out = -1;
+  bool compare = false;
+  if (job->incremental) {
+    out = open(job->target.c_str(), O_RDWR);
+    compare = (out >= 0);
+  }
+  if (out < 0)
+    out = open(job->target.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  int in = open(job->source.c_str(), O_RDONLY);
+
+  if (in >= 0 && out >= 0) {
+    // the first pass starts with a recent state
+    enif_rwlock_rlock(ewrapper->write_gate);
+    st = write_buffer_flush_env(ewrapper);
+    if (!st)
+      st = ups_env_flush(ewrapper->env, 0);
+    enif_rwlock_runlock(ewrapper->write_gate);
+
+    // the second pass catches up while writes continue, therefore the
+    // last pass writes less
+    if (!st && backup_pass(job, msg_env, in, out, compare, true)
+        && backup_pass(job, msg_env, in, out, true, false)) {
+      enif_rwlock_rwlock(ewrapper->write_gate);
+      st = write_buffer_flush_env(ewrapper);
+      if (!st)
+        st = ups_env_flush(ewrapper->env, 0);
+      int clone = st ? -1 : backup_clone(job, in);
+      if (clone >= 0) {
+        enif_rwlock_rwunlock(ewrapper->write_gate);
+        ok = backup_pass(job, msg_env, clone, out, true, false);
+        close(clone);
+      }
+      else {
+        ok = !st && backup_pass(job, msg_env, in, out, true, false);
+        enif_rwlock_rwunlock(ewrapper->write_gate);
+      }
+      ok = ok && fsync(out) == 0;
+    }
+  }
+  if (in >= 0)
+    close(in);
+  if (out >= 0)
+    close(out);
+
+  if (ok) {
+    ERL_NIF_TERM stats = enif_make_new_map(msg_env);
+    (void)enif_make_map_put(msg_env, stats,
+                    enif_make_atom(msg_env, "bytes"),
+                    enif_make_uint64(msg_env, job->total), &stats);
+    (void)enif_make_map_put(msg_env, stats,
+                    enif_make_atom(msg_env, "written"),
+                    enif_make_uint64(msg_env, job->written), &stats);
+    backup_send(job, msg_env, enif_make_tuple2(msg_env, g_atom_ok, stats));
+  }
+  else if (job->cancelled)
+    backup_send(job, msg_env, enif_make_tuple2(msg_env, g_atom_error,
+                          enif_make_atom(msg_env, "cancelled")));
+  else
+    backup_send(job, msg_env, enif_make_tuple2(msg_env, g_atom_error,
+                          status_to_atom(msg_env, st ? st : UPS_IO_ERROR)));
+
+  enif_free_env(msg_env);
+  job->done = true;
+  return (0);
+}
+
+// cancels a running backup and waits for its thread
+static void
+backup_stop(env_wrapper *ewrapper)
+{
+  enif_mutex_lock(ewrapper->lock);
+  backup_job *job = ewrapper->backup;
+  ewrapper->backup = 0;
+  enif_mutex_unlock(ewrapper->lock);
+
+  if (!job)
+    return;
+  job->cancelled = true;
+  enif_thread_join(job->tid, 0);
+  delete job;
+}
+
+//
+// Compaction
+//
+// ups_nifs_env_compact starts a native thread which copies all Databases
+// of a closed Environment into a new file. The pairs are inserted in key
+// order with UPS_HINT_APPEND, therefore the pages of the new file are
+// filled densely, and pages which were freed by erasing keys or Databases
+// are not copied. The source is opened read-only; upscaledb locks the file
+// exclusively, so the Environment must not be open (a live Environment can
+// be compacted from a copy made by ups_nifs_env_backup).
+//
+
+struct compact_state {
+  char source[MAX_STRING];
+  char target[MAX_STRING];
+  bool swap;              // replace the source by the compacted file
+  ErlNifPid pid;
+  ErlNifEnv *env;         // owns the reference
+  ERL_NIF_TERM ref;
+  std::atomic<bool> cancelled;
+  ErlNifTid tid;
+  uint32_t databases;
+  uint64_t keys;
+};
+
+// copies one Database with its parameters
+static ups_status_t
+compact_database(compact_state *state, ups_env_t *source, ups_env_t *target,
+                uint16_t name)
+{
+  ups_db_t *sdb;
+  ups_db_t *tdb;
+  ups_cursor_t *cursor;
+  ups_parameter_t params[] = {
+    {UPS_PARAM_FLAGS, 0},
+    {UPS_PARAM_KEY_TYPE, 0},
+    {UPS_PARAM_KEY_SIZE, 0},
+    {UPS_PARAM_RECORD_TYPE, 0},
+    {UPS_PARAM_RECORD_SIZE, 0},
+    {UPS_PARAM_KEY_COMPRESSION, 0},
+    {UPS_PARAM_RECORD_COMPRESSION, 0},
+    {0, 0}
+  };
+
+  ups_status_t st = ups_env_open_db(source, &sdb, name, 0, 0);
+  if (st)
+    return (st);
+  if ((st = ups_db_get_parameters(sdb, &params[0]))) {
+    (void)ups_db_close(sdb, 0);
+    return (st);
+  }
+
+  // the flags are not a parameter of ups_env_create_db; compression is
+  // only set if it is enabled
+  uint32_t flags = (uint32_t)params[0].value & (UPS_ENABLE_DUPLICATE_KEYS
+                  | UPS_RECORD_NUMBER32 | UPS_RECORD_NUMBER64);
+  ups_parameter_t create_params[8] = {{0, 0}};
+  int n = 0;
+  for (int i = 1; params[i].name; i++) {
+    if (params[i].value || (params[i].name != UPS_PARAM_KEY_COMPRESSION
+                && params[i].name != UPS_PARAM_RECORD_COMPRESSION))
+      create_params[n++] = params[i];
+  }
+
+  if ((st = ups_env_create_db(target, &tdb, name, flags, &create_params[0]))) {
+    (void)ups_db_close(sdb, 0);
+    return (st);
+  }
+
+  // duplicates are appended in their order; record numbers are kept
+  uint32_t insert_flags = UPS_HINT_APPEND;
+  if (flags & UPS_ENABLE_DUPLICATE_KEYS)
+    insert_flags |= UPS_DUPLICATE;
+  if (flags & (UPS_RECORD_NUMBER32 | UPS_RECORD_NUMBER64))
+    insert_flags |= UPS_OVERWRITE;
+
+  if (!(st = ups_cursor_create(&cursor, sdb, 0, 0))) {
+    ups_key_t key = {0};
+    ups_record_t rec = {0};
+    while (!(st = ups_cursor_move(cursor, &key, &rec, UPS_CURSOR_NEXT))) {
+      if (state->cancelled)
+        break;
+      if ((st = ups_db_insert(tdb, 0, &key, &rec, insert_flags)))
+        break;
+      state->keys++;
+    }
+    if (st == UPS_KEY_NOT_FOUND)
+      st = 0;
+    (void)ups_cursor_close(cursor);
+  }
+
+  (void)ups_db_close(tdb, 0);
+  (void)ups_db_close(sdb, 0);
+  state->databases++;
+  return (st);
+}
+
+// copies all Databases; the target is created with the page size and the
+// maximum number of Databases of the source
+static ups_status_t
+compact_environment(compact_state *state)
+{
+  ups_env_t *source;
+  ups_env_t *target;
+  ups_parameter_t params[] = {
+    {UPS_PARAM_PAGE_SIZE, 0},
+    {UPS_PARAM_MAX_DATABASES, 0},
+    {UPS_PARAM_FLAGS, 0},
+    {0, 0}
+  };
+  struct stat st_source;
+
+  if (stat(state->source, &st_source))
+    return (UPS_FILE_NOT_FOUND);
+
+  ups_status_t st = ups_env_open(&source, state->source, UPS_READ_ONLY, 0);
+  if (st)
+    return (st);
+  if ((st = ups_env_get_parameters(source, &params[0]))) {
+    (void)ups_env_close(source, 0);
+    return (st);
+  }
+
+  ups_parameter_t create_params[] = {
+    {UPS_PARAM_PAGE_SIZE, params[0].value},
+    {UPS_PARAM_MAX_DATABASES, params[1].value},
+    {0, 0}
+  };
+  st = ups_env_create(&target, state->target,
+                  (uint32_t)params[2].value & UPS_ENABLE_CRC32,
+                  st_source.st_mode & 0777, &create_params[0]);
+  if (st) {
+    (void)ups_env_close(source, 0);
+    return (st);
+  }
+
+  std::vector<uint16_t> names(params[1].value ? params[1].value : 1);
+  uint32_t count = (uint32_t)names.size();
+  st = ups_env_get_database_names(source, names.data(), &count);
+  for (uint32_t i = 0; i < count && !st && !state->cancelled; i++)
+    st = compact_database(state, source, target, names[i]);
+
+  ups_status_t st2 = ups_env_close(target, UPS_AUTO_CLEANUP);
+  (void)ups_env_close(source, UPS_AUTO_CLEANUP);
+  return (st ? st : st2);
+}
+
+static void *
+compact_run(void *arg)
+{
+  compact_state *state = (compact_state *)arg;
+  ErlNifEnv *msg_env = enif_alloc_env();
+  struct stat st_before;
+  struct stat st_after;
+  ERL_NIF_TERM event;
+
+  ups_status_t st = compact_environment(state);
+  if (!st && !state->cancelled) {
+    // the new file is durable before it replaces the source
+    int fd = open(state->target, O_RDONLY);
+    if (fd < 0 || fsync(fd))
+      st = UPS_IO_ERROR;
+    if (fd >= 0)
+      close(fd);
+  }
+  if (!st && !state->cancelled
+      && (stat(state->source, &st_before) || stat(state->target, &st_after)))
+    st = UPS_IO_ERROR;
+  if (!st && !state->cancelled && state->swap) {
+    if (rename(state->target, state->source))
+      st = UPS_IO_ERROR;
+    else {
+      // the source was closed cleanly; its journal files are empty and do
+      // not belong to the new file
+      std::string journal(state->source);
+      (void)remove((journal + ".jrn0").c_str());
+      (void)remove((journal + ".jrn1").c_str());
+    }
+  }
+
+  if (st || state->cancelled) {
+    (void)remove(state->target);
+    event = enif_make_tuple2(msg_env, g_atom_error, state->cancelled
+                    ? enif_make_atom(msg_env, "cancelled")
+                    : status_to_atom(msg_env, st));
+  }
+  else {
+    uint64_t before = (uint64_t)st_before.st_size;
+    uint64_t after = (uint64_t)st_after.st_size;
+    ERL_NIF_TERM stats = enif_make_new_map(msg_env);
+    (void)enif_make_map_put(msg_env, stats,
+                    enif_make_atom(msg_env, "bytes_before"),
+                    enif_make_uint64(msg_env, before), &stats);
+    (void)enif_make_map_put(msg_env, stats,
+                    enif_make_atom(msg_env, "bytes_after"),
+                    enif_make_uint64(msg_env, after), &stats);
+    (void)enif_make_map_put(msg_env, stats,
+                    enif_make_atom(msg_env, "bytes_saved"),
+                    enif_make_uint64(msg_env,
+                            before > after ? before - after : 0), &stats);
+    (void)enif_make_map_put(msg_env, stats,
+                    enif_make_atom(msg_env, "databases"),
+                    enif_make_uint(msg_env, state->databases), &stats);
+    (void)enif_make_map_put(msg_env, stats,
+                    enif_make_atom(msg_env, "keys"),
+                    enif_make_uint64(msg_env, state->keys), &stats);
+    event = enif_make_tuple2(msg_env, g_atom_ok, stats);
+  }
+
+  ERL_NIF_TERM msg = enif_make_tuple3(msg_env,
+                  enif_make_atom(msg_env, "ups_compact"),
+                  enif_make_copy(msg_env, state->ref), event);
+  (void)enif_send(0, &state->pid, msg_env, msg);
+  enif_free_env(msg_env);
+  return (0);
+}
+
+// argv[0] is the source path, argv[1] the target path, argv[2] true if
+// the target replaces the source, argv[3] the process which receives the
+// result and argv[4] the reference which tags it. Returns a handle; the
+// compaction is cancelled when the handle is garbage collected.
+ERL_NIF_TERM
+ups_nifs_env_compact(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  char source[MAX_STRING];
+  char target[MAX_STRING];
+  char swap[8];
+  ErlNifPid pid;
+
+  if (argc != 5)
+    return (enif_make_badarg(env));
+  if (enif_get_string(env, argv[0], &source[0], sizeof(source),
+              ERL_NIF_LATIN1) <= 0)
+    return (enif_make_badarg(env));
+  if (enif_get_string(env, argv[1], &target[0], sizeof(target),
+              ERL_NIF_LATIN1) <= 0)
+    return (enif_make_badarg(env));
+  if (!enif_get_atom(env, argv[2], &swap[0], sizeof(swap), ERL_NIF_LATIN1))
+    return (enif_make_badarg(env));
+  if (!enif_get_local_pid(env, argv[3], &pid))
+    return (enif_make_badarg(env));
+  if (!enif_is_ref(env, argv[4]))
+    return (enif_make_badarg(env));
+  if (!strcmp(source, target))
+    return (enif_make_tuple2(env, g_atom_error,
+                status_to_atom(env, UPS_INV_PARAMETER)));
+
+  compact_state *state = (compact_state *)enif_alloc_resource(
+                  g_ups_compact_resource, sizeof(*state));
+  strcpy(state->source, source);
+  strcpy(state->target, target);
+  state->swap = !strcmp(swap, "true");
+  state->pid = pid;
+  state->env = enif_alloc_env();
+  state->ref = enif_make_copy(state->env, argv[4]);
+  state->cancelled = false;
+  state->databases = 0;
+  state->keys = 0;
+
+  ERL_NIF_TERM result = enif_make_resource(env, state);
+  enif_release_resource(state);
+
+  if (enif_thread_create((char *)"ups_compact", &state->tid, compact_run,
+                state, 0)) {
+    state->tid = 0;
+    return (enif_make_tuple2(env, g_atom_error,
+                status_to_atom(env, UPS_OUT_OF_MEMORY)));
+  }
+
+  return (enif_make_tuple2(env, g_atom_ok, result));
+}
+
+// stops a compaction; the thread removes the target and sends
+// {error, cancelled}
+ERL_NIF_TERM
+ups_nifs_env_compact_cancel(ErlNifEnv *env, int argc,
+                const ERL_NIF_TERM argv[])
+{
+  compact_state *state;
+
+  if (argc != 1)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_compact_resource,
+                          (void **)&state))
+    return (enif_make_badarg(env));
+
+  state->cancelled = true;
+  return (g_atom_ok);
+}
+
+//
+// Dump and restore
+//
+// ups_nifs_env_dump writes all Databases of an Environment to a portable
+// file; ups_nifs_env_restore creates a new Environment from it. All
+// integers are big-endian. The file starts with a header
+//
+//   "UPSDUMP1" | codec:8 | block_size:32 | page_size:32 | max_databases:32
+//
+// (the codec is 0 for none, 1 for zlib and 2 for snappy), followed by
+// frames which start with a tag byte:
+//
+//   'D' name:16 flags:32 key_type:32 key_size:32 record_type:32
+//       record_size:32 key_compression:32 record_compression:32
+//       - a Database; all following blocks belong to it
+//   'B' raw_size:32 stored_size:32 count:32 crc32:32 data:stored_size
+//       - |count| pairs, each key_size:32 key record_size:32 record, in
+//       key order; the pairs are compressed as a whole with the codec and
+//       the crc32 is computed over the uncompressed pairs; raw_size is
+//       at most DUMP_MAX_BLOCK_SIZE
+//   'E' databases:32 pairs:64
+//       - the end of the file
+//
+// The blocks are compressed and decompressed by a pool of native threads
+// while the calling thread reads the Database or inserts the pairs; the
+// frames are always written and applied in their order. Restored pairs are
+// inserted with UPS_HINT_APPEND.
+//
+
+#define DUMP_MAGIC              "UPSDUMP1"
+#define DUMP_CODEC_NONE         0
+#define DUMP_CODEC_ZLIB         1
+#define DUMP_CODEC_SNAPPY       2
+#define DUMP_MAX_BLOCK_SIZE     (64 * 1024 * 1024)
+
+struct dump_block {
+  char tag;                     // 'D' or 'B'
+  std::vector<char> raw;        // the Database header or the pairs
+  std::vector<char> packed;     // the compressed pairs
+  uint32_t count;
+  uint32_t crc;
+  bool done;
+  bool failed;
+
+  dump_block(char t)
+    : tag(t), count(0), crc(0), done(t != 'B'), failed(false) {
+  }
+};
+
+// compresses (or decompresses) blocks; the frames which are in flight are
+// kept in their order in |pending| and handed to |consume| in this order
+struct block_pool {
+  int codec;
+  bool compress;
+  ups_status_t (*consume)(void *context, dump_block *block);
+  void *context;
+  std::mutex mutex;
+  std::condition_variable work_cond;
+  std::condition_variable done_cond;
+  std::list<dump_block *> queue;      // waiting for a thread
+  std::list<dump_block *> pending;    // in flight, in file order
+  size_t window;
+  bool stop;
+  std::vector<ErlNifTid> threads;
+};
+
+static void
+put_u16(std::vector<char> &out, uint16_t v)
+{
+  out.push_back((char)(v >> 8));
+  out.push_back((char)v);
+}
+
+static void
+put_u32(std::vector<char> &out, uint32_t v)
+{
+  put_u16(out, (uint16_t)(v >> 16));
+  put_u16(out, (uint16_t)v);
+}
+
+static void
+put_u64(std::vector<char> &out, uint64_t v)
+{
+  put_u32(out, (uint32_t)(v >> 32));
+  put_u32(out, (uint32_t)v);
+}
+
+static uint32_t
+get_u32(const char *p)
+{
+  const unsigned char *u = (const unsigned char *)p;
+  return (((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16)
+                  | ((uint32_t)u[2] << 8) | u[3]);
+}
+
+static uint16_t
+get_u16(const char *p)
+{
+  const unsigned char *u = (const unsigned char *)p;
+  return ((uint16_t)((u[0] << 8) | u[1]));
+}
+
+// compresses |raw| into |packed| or the other way round; the crc of a
+// decompressed block is verified
+static bool
+block_process(int codec, bool compress, dump_block *block)
+{
+  const char *in = compress ? block->raw.data() : block->packed.data();
+  size_t in_size = compress ? block->raw.size() : block->packed.size();
+  std::vector<char> &out = compress ? block->packed : block->raw;
+  size_t out_size = compress ? 0 : out.size();
+
+  switch (codec) {
+    case DUMP_CODEC_NONE:
+      if (!compress && in_size != out_size)
+        return (false);
+      out.assign(in, in + in_size);
+      break;
+    case DUMP_CODEC_ZLIB: {
+      uLongf size = compress ? compressBound(in_size) : out_size;
+      if (compress)
+        out.resize(size);
+      int rc = compress
+          ? compress2((Bytef *)out.data(), &size, (const Bytef *)in, in_size,
+                  Z_DEFAULT_COMPRESSION)
+          : uncompress((Bytef *)out.data(), &size, (const Bytef *)in,
+                  in_size);
+      if (rc != Z_OK || (!compress && size != out_size))
+        return (false);
+      out.resize(size);
+      break;
+    }
+    case DUMP_CODEC_SNAPPY: {
+      size_t size = compress ? snappy_max_compressed_length(in_size)
+                             : out_size;
+      if (compress)
+        out.resize(size);
+      else if (snappy_uncompressed_length(in, in_size, &size) != SNAPPY_OK
+                || size != out_size)
+        return (false);
+      snappy_status rc = compress
+          ? snappy_compress(in, in_size, out.data(), &size)
+          : snappy_uncompress(in, in_size, out.data(), &size);
+      if (rc != SNAPPY_OK)
+        return (false);
+      out.resize(size);
+      break;
+    }
+    default:
+      return (false);
+  }
+
+  uint32_t crc = (uint32_t)crc32(0, (const Bytef *)block->raw.data(),
+                  (uInt)block->raw.size());
+  if (compress)
+    block->crc = crc;
+  return (compress || crc == block->crc);
+}
+
+static void *
+block_pool_run(void *arg)
+{
+  block_pool *pool = (block_pool *)arg;
+  std::unique_lock<std::mutex> lock(pool->mutex);
+
+  while (true) {
+    while (pool->queue.empty() && !pool->stop)
+      pool->work_cond.wait(lock);
+    if (pool->queue.empty())
+      break;
+    dump_block *block = pool->queue.front();
+    pool->queue.pop_front();
+    lock.unlock();
+    bool ok = block_process(pool->codec, pool->compress, block);
+    lock.lock();
+    block->failed = !ok;
+    block->done = true;
+    pool->done_cond.notify_all();
+  }
+  return (0);
+}
+
+static void
+block_pool_start(block_pool *pool, int codec, bool compress,
+                uint32_t threads,
+                ups_status_t (*consume)(void *, dump_block *), void *context)
+{
+  pool->codec = codec;
+  pool->compress = compress;
+  pool->consume = consume;
+  pool->context = context;
+  pool->window = 2 * (threads ? threads : 1);
+  pool->stop = false;
+  for (uint32_t i = 0; i < threads; i++) {
+    ErlNifTid tid;
+    if (enif_thread_create((char *)"ups_block_pool", &tid, block_pool_run,
+                pool, 0))
+      break;  // the remaining threads are optional
+    pool->threads.push_back(tid);
+  }
+}
+
+// waits for the threads; blocks which are still in flight are discarded
+static void
+block_pool_stop(block_pool *pool)
+{
+  {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    pool->stop = true;
+    pool->queue.clear();
+    pool->work_cond.notify_all();
+  }
+  for (size_t i = 0; i < pool->threads.size(); i++)
+    enif_thread_join(pool->threads[i], 0);
+  pool->threads.clear();
+  for (std::list<dump_block *>::iterator it = pool->pending.begin();
+          it != pool->pending.end(); ++it)
+    delete *it;
+  pool->pending.clear();
+}
+
+// hands the oldest frame to |consume| once it is processed
+static ups_status_t
+block_pool_consume(block_pool *pool)
+{
+  dump_block *block;
+  {
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    block = pool->pending.front();
+    while (!block->done)
+      pool->done_cond.wait(lock);
+    pool->pending.pop_front();
+  }
+  ups_status_t st = block->failed
+          ? UPS_INTEGRITY_VIOLATED
+          : pool->consume(pool->context, block);
+  delete block;
+  return (st);
+}
+
+// appends a frame; consumes the oldest frames while too many are in
+// flight. Without threads the block is processed immediately.
+static ups_status_t
+block_pool_push(block_pool *pool, dump_block *block)
+{
+  if (!block->done && pool->threads.empty()) {
+    block->failed = !block_process(pool->codec, pool->compress, block);
+    block->done = true;
+  }
+  {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    pool->pending.push_back(block);
+    if (!block->done) {
+      pool->queue.push_back(block);
+      pool->work_cond.notify_one();
+    }
+  }
+  ups_status_t st = 0;
+  while (!st && pool->pending.size() > pool->window)
+    st = block_pool_consume(pool);
+  return (st);
+}
+
+static ups_status_t
+block_pool_drain(block_pool *pool)
+{
+  ups_status_t st = 0;
+  while (!st && !pool->pending.empty())
+    st = block_pool_consume(pool);
+  return (st);
+}
+
+static bool
+dump_write(FILE *f, const std::vector<char> &data)
+{
+  return (fwrite(data.data(), 1, data.size(), f) == data.size());
+}
+
+// writes a frame to the file
+static ups_status_t
+dump_write_frame(void *context, dump_block *block)
+{
+  FILE *f = (FILE *)context;
+  std::vector<char> header;
+  header.push_back(block->tag);
+  if (block->tag == 'B') {
+    put_u32(header, (uint32_t)block->raw.size());
+    put_u32(header, (uint32_t)block->packed.size());
+    put_u32(header, block->count);
+    put_u32(header, block->crc);
+    if (!dump_write(f, header) || !dump_write(f, block->packed))
+      return (UPS_IO_ERROR);
+  }
+  else if (!dump_write(f, header) || !dump_write(f, block->raw))
+    return (UPS_IO_ERROR);
+  return (0);
+}
+
+// dumps a Database which is open in |db|
+static ups_status_t
+dump_database(block_pool *pool, ups_db_t *db, uint16_t name,
+                uint32_t block_size, uint64_t *pairs)
+{
+  ups_cursor_t *cursor;
+  ups_parameter_t params[] = {
+    {UPS_PARAM_FLAGS, 0},
+    {UPS_PARAM_KEY_TYPE, 0},
+    {UPS_PARAM_KEY_SIZE, 0},
+    {UPS_PARAM_RECORD_TYPE, 0},
+    {UPS_PARAM_RECORD_SIZE, 0},
+    {UPS_PARAM_KEY_COMPRESSION, 0},
+    {UPS_PARAM_RECORD_COMPRESSION, 0},
+    {0, 0}
+  };
+  ups_status_t st = ups_db_get_parameters(db, &params[0]);
+  if (st)
+    return (st);
+
+  dump_block *header = new dump_block('D');
+  put_u16(header->raw, name);
+  for (int i = 0; params[i].name; i++)
+    put_u32(header->raw, (uint32_t)params[i].value);
+  if ((st = block_pool_push(pool, header)))
+    return (st);
+
+  if ((st = ups_cursor_create(&cursor, db, 0, 0)))
+    return (st);
+
+  dump_block *block = new dump_block('B');
+  ups_key_t key = {0};
+  ups_record_t rec = {0};
+  while (!(st = ups_cursor_move(cursor, &key, &rec, UPS_CURSOR_NEXT))) {
+    // restore rejects larger blocks; a pair which does not fit into the
+    // current block starts a new one
+    uint64_t pair_size = 8 + (uint64_t)key.size + rec.size;
+    if (pair_size > DUMP_MAX_BLOCK_SIZE) {
+      st = UPS_LIMITS_REACHED;
+      break;
+    }
+    if (block->count && block->raw.size() + pair_size > DUMP_MAX_BLOCK_SIZE) {
+      st = block_pool_push(pool, block);
+      block = new dump_block('B');
+      if (st)
+        break;
+    }
+    put_u32(block->raw, key.size);
+    block->raw.insert(block->raw.end(), (const char *)key.data,
+                    (const char *)key.data + key.size);
+    put_u32(block->raw, rec.size);
+    block->raw.insert(block->raw.end(), (const char *)rec.data,
+                    (const char *)rec.data + rec.size);
+    block->count++;
+    (*pairs)++;
+    if (block->raw.size() >= block_size) {
+      st = block_pool_push(pool, block);
+      block = new dump_block('B');
+      if (st)
+        break;
+    }
+  }
+  (void)ups_cursor_close(cursor);
+  if (st != UPS_KEY_NOT_FOUND) {
+    delete block;
+    return (st);
+  }
+  if (block->count)
+    return (block_pool_push(pool, block));
+  delete block;
+  return (0);
+}
+
+// dumps a Database; an open handle of the NIF layer is used, otherwise
+// the Database is opened
+static ups_status_t
+dump_database_by_name(env_wrapper *ewrapper, block_pool *pool, uint16_t name,
+                uint32_t block_size, uint64_t *pairs)
+{
+  db_wrapper *dwrapper = env_pin_db(ewrapper, name);
+  if (dwrapper) {
+    ups_status_t st = write_buffer_flush_pinned(dwrapper);
+    if (!st)
+      st = dump_database(pool, dwrapper->db, name, block_size, pairs);
+    db_unpin(dwrapper);
+    return (st);
+  }
+  // the catalog of the dictionaries may be open already
+  ups_db_t *catalog;
+  if (name == CODEC_CATALOG_DB && codec_catalog(ewrapper, false, &catalog) == 0)
+    return (dump_database(pool, catalog, name, block_size, pairs));
+
+  ups_db_t *db;
+  ups_status_t st = ups_env_open_db(ewrapper->env, &db, name, 0, 0);
+  if (st)
+    return (st);
+  st = dump_database(pool, db, name, block_size, pairs);
+  (void)ups_db_close(db, 0);
+  return (st);
+}
+
+static int
+get_codec(ErlNifEnv *env, ERL_NIF_TERM term, int *codec)
+{
+  char atom[16];
+
+  if (enif_get_atom(env, term, &atom[0], sizeof(atom), ERL_NIF_LATIN1) <= 0)
+    return (0);
+  if (!strcmp(atom, "none"))
+    *codec = DUMP_CODEC_NONE;
+  else if (!strcmp(atom, "zlib"))
+    *codec = DUMP_CODEC_ZLIB;
+  else if (!strcmp(atom, "snappy"))
+    *codec = DUMP_CODEC_SNAPPY;
+  else
+    return (0);
+  return (1);
+}
+
+static ERL_NIF_TERM
+make_dump_stats(ErlNifEnv *env, uint32_t databases, uint64_t pairs)
+{
+  ERL_NIF_TERM stats = enif_make_new_map(env);
+  (void)enif_make_map_put(env, stats, enif_make_atom(env, "databases"),
+                  enif_make_uint(env, databases), &stats);
+  (void)enif_make_map_put(env, stats, enif_make_atom(env, "pairs"),
+                  enif_make_uint64(env, pairs), &stats);
+  return (enif_make_tuple2(env, g_atom_ok, stats));
+}
+
+// argv[1] is the path of the dump, argv[2] the codec, argv[3] the block
+// size and argv[4] the number of compression threads
+ERL_NIF_TERM
+ups_nifs_env_dump(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  env_wrapper *ewrapper;
+  char path[MAX_STRING];
+  int codec;
+  uint32_t block_size;
+  uint32_t threads;
+  ups_parameter_t params[] = {
+    {UPS_PARAM_PAGE_SIZE, 0},
+    {UPS_PARAM_MAX_DATABASES, 0},
+    {0, 0}
+  };
+
+  if (argc != 5)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_env_resource, (void **)&ewrapper)
+          || ewrapper->is_closed)
+    return (enif_make_badarg(env));
+  if (enif_get_string(env, argv[1], &path[0], sizeof(path),
+              ERL_NIF_LATIN1) <= 0)
+    return (enif_make_badarg(env));
+  if (!get_codec(env, argv[2], &codec))
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[3], &block_size) || block_size == 0
+          || block_size > DUMP_MAX_BLOCK_SIZE)
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[4], &threads))
+    return (enif_make_badarg(env));
+
+  ups_status_t st = ups_env_get_parameters(ewrapper->env, &params[0]);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+
+  std::vector<uint16_t> names(params[1].value ? params[1].value : 1);
+  uint32_t count = (uint32_t)names.size();
+  if ((st = ups_env_get_database_names(ewrapper->env, names.data(), &count)))
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+
+  FILE *f = fopen(path, "wb");
+  if (!f)
+    return (enif_make_tuple2(env, g_atom_error,
+                status_to_atom(env, UPS_IO_ERROR)));
+
+  std::vector<char> header(DUMP_MAGIC, DUMP_MAGIC + 8);
+  header.push_back((char)codec);
+  put_u32(header, block_size);
+  put_u32(header, (uint32_t)params[0].value);
+  put_u32(header, (uint32_t)params[1].value);
+  if (!dump_write(f, header))
+    st = UPS_IO_ERROR;
+
+  block_pool pool;
+  block_pool_start(&pool, codec, true, threads, dump_write_frame, f);
+  uint64_t pairs = 0;
+
+  for (uint32_t i = 0; i < count && !st; i++)
+    st = dump_database_by_name(ewrapper, &pool, names[i], block_size,
+                    &pairs);
+  if (!st)
+    st = block_pool_drain(&pool);
+  block_pool_stop(&pool);
+
+  if (!st) {
+    std::vector<char> trailer(1, 'E');
+    put_u32(trailer, count);
+    put_u64(trailer, pairs);
+    if (!dump_write(f, trailer) || fflush(f) || fsync(fileno(f)))
+      st = UPS_IO_ERROR;
+  }
+  if (fclose(f) && !st)
+    st = UPS_IO_ERROR;
+  if (st) {
+    (void)remove(path);
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+  }
+  return (make_dump_stats(env, count, pairs));
+}
+
+// the state of a restore; |db| is the Database of the current frames
+struct restore_state {
+  ups_env_t *env;
+  ups_db_t *db;
+  uint32_t insert_flags;
+  uint32_t databases;
+  uint64_t pairs;
+};
+
+// creates the Database of a 'D' frame or inserts the pairs of a 'B' frame
+static ups_status_t
+restore_frame(void *context, dump_block *block)
+{
+  restore_state *state = (restore_state *)context;
+  ups_status_t st;
+  const char *p = block->raw.data();
+  const char *end = p + block->raw.size();
+
+  if (block->tag == 'D') {
+    if (state->db)
+      (void)ups_db_close(state->db, 0);
+    state->db = 0;
+
+    uint32_t flags = get_u32(p + 2) & (UPS_ENABLE_DUPLICATE_KEYS
+                    | UPS_RECORD_NUMBER32 | UPS_RECORD_NUMBER64);
+    const uint16_t names[] = {
+      UPS_PARAM_KEY_TYPE, UPS_PARAM_KEY_SIZE, UPS_PARAM_RECORD_TYPE,
+      UPS_PARAM_RECORD_SIZE, UPS_PARAM_KEY_COMPRESSION,
+      UPS_PARAM_RECORD_COMPRESSION
+    };
+    ups_parameter_t params[8] = {{0, 0}};
+    int n = 0;
+    for (int i = 0; i < 6; i++) {
+      uint32_t value = get_u32(p + 6 + 4 * i);
+      if (value || (names[i] != UPS_PARAM_KEY_COMPRESSION
+                  && names[i] != UPS_PARAM_RECORD_COMPRESSION)) {
+        params[n].name = names[i];
+        params[n++].value = value;
+      }
+    }
+    if ((st = ups_env_create_db(state->env, &state->db, get_u16(p), flags,
+                    &params[0])))
+      return (st);
+
+    // duplicates are appended in their order; record numbers are kept
+    state->insert_flags = UPS_HINT_APPEND;
+    if (flags & UPS_ENABLE_DUPLICATE_KEYS)
+      state->insert_flags |= UPS_DUPLICATE;
+    if (flags & (UPS_RECORD_NUMBER32 | UPS_RECORD_NUMBER64))
+      state->insert_flags |= UPS_OVERWRITE;
+    state->databases++;
+    return (0);
+  }
+
+  if (!state->db)
+    return (UPS_INV_FILE_HEADER);
+  for (uint32_t i = 0; i < block->count; i++) {
+    ups_key_t key = {0};
+    ups_record_t rec = {0};
+    if (end - p < 4 || (uint32_t)(end - p - 4) < get_u32(p)
+        || get_u32(p) > 0xFFFF)
+      return (UPS_INTEGRITY_VIOLATED);
+    key.size = (uint16_t)get_u32(p);
+    key.data = (void *)(p + 4);
+    p += 4 + get_u32(p);
+    if (end - p < 4 || (uint32_t)(end - p - 4) < get_u32(p))
+      return (UPS_INTEGRITY_VIOLATED);
+    rec.size = get_u32(p);
+    rec.data = (void *)(p + 4);
+    p += 4 + rec.size;
+    if ((st = ups_db_insert(state->db, 0, &key, &rec, state->insert_flags)))
+      return (st);
+    state->pairs++;
+  }
+  return (0);
+}
+
+static bool
+restore_read(FILE *f, char *data, size_t size)
+{
+  return (fread(data, 1, size, f) == size);
+}
+
+// reads the frames of the file and applies them; |trailer| receives the
+// 'E' frame
+static ups_status_t
+restore_frames(FILE *f, block_pool *pool, char *trailer)
+{
+  ups_status_t st = 0;
+  char tag;
+
+  while (!st) {
+    if (!restore_read(f, &tag, 1))
+      return (UPS_INV_FILE_HEADER);  // truncated
+    if (tag == 'E')
+      return (restore_read(f, trailer, 12) ? 0 : UPS_INV_FILE_HEADER);
+
+    dump_block *block = new dump_block(tag);
+    if (tag == 'D') {
+      block->raw.resize(2 + 7 * 4);
+      if (!restore_read(f, block->raw.data(), block->raw.size())) {
+        delete block;
+        return (UPS_INV_FILE_HEADER);
+      }
+    }
+    else if (tag == 'B') {
+      char header[16];
+      if (!restore_read(f, &header[0], sizeof(header))
+          || get_u32(&header[0]) > DUMP_MAX_BLOCK_SIZE
+          || get_u32(&header[4]) > 2 * DUMP_MAX_BLOCK_SIZE) {
+        delete block;
+        return (UPS_INV_FILE_HEADER);
+      }
+      block->raw.resize(get_u32(&header[0]));
+      block->packed.resize(get_u32(&header[4]));
+      block->count = get_u32(&header[8]);
+      block->crc = get_u32(&header[12]);
+      if (!restore_read(f, block->packed.data(), block->packed.size())) {
+        delete block;
+        return (UPS_INV_FILE_HEADER);
+      }
+    }
+    else {
+      delete block;
+      return (UPS_INV_FILE_HEADER);
+    }
+    st = block_pool_push(pool, block);
+  }
+  return (st);
+}
+
+// argv[0] is the path of the dump, argv[1] the path of the new Environment
+// and argv[2] the number of decompression threads
+ERL_NIF_TERM
+ups_nifs_env_restore(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  char path[MAX_STRING];
+  char target[MAX_STRING];
+  uint32_t threads;
+  char header[8 + 1 + 3 * 4];
+  char trailer[12];
+
+  if (argc != 3)
+    return (enif_make_badarg(env));
+  if (enif_get_string(env, argv[0], &path[0], sizeof(path),
+              ERL_NIF_LATIN1) <= 0)
+    return (enif_make_badarg(env));
+  if (enif_get_string(env, argv[1], &target[0], sizeof(target),
+              ERL_NIF_LATIN1) <= 0)
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[2], &threads))
+    return (enif_make_badarg(env));
+
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return (enif_make_tuple2(env, g_atom_error,
+                status_to_atom(env, UPS_FILE_NOT_FOUND)));
+  if (!restore_read(f, &header[0], sizeof(header))
+      || memcmp(header, DUMP_MAGIC, 8)
+      || (unsigned char)header[8] > DUMP_CODEC_SNAPPY) {
+    fclose(f);
+    return (enif_make_tuple2(env, g_atom_error,
+                status_to_atom(env, UPS_INV_FILE_HEADER)));
+  }
+
+  ups_parameter_t params[] = {
+    {UPS_PARAM_PAGE_SIZE, get_u32(&header[13])},
+    {UPS_PARAM_MAX_DATABASES, get_u32(&header[17])},
+    {0, 0}
+  };
+  restore_state state = {0, 0, 0, 0, 0};
+  ups_status_t st = ups_env_create(&state.env, target, 0, 0644, &params[0]);
+  if (st) {
+    fclose(f);
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+  }
+
+  block_pool pool;
+  block_pool_start(&pool, header[8], false, threads, restore_frame, &state);
+  st = restore_frames(f, &pool, &trailer[0]);
+  if (!st)
+    st = block_pool_drain(&pool);
+  block_pool_stop(&pool);
+  fclose(f);
+
+  // the trailer detects files which lost frames
+  if (!st && (get_u32(&trailer[0]) != state.databases
+                  || ((uint64_t)get_u32(&trailer[4]) << 32
+                          | get_u32(&trailer[8])) != state.pairs))
+    st = UPS_INTEGRITY_VIOLATED;
+
+  if (state.db)
+    (void)ups_db_close(state.db, 0);
+  ups_status_t st2 = ups_env_close(state.env, UPS_AUTO_CLEANUP);
+  if (st || st2) {
+    (void)remove(target);
+    return (enif_make_tuple2(env, g_atom_error,
+                status_to_atom(env, st ? st : st2)));
+  }
+  return (make_dump_stats(env, state.databases, state.pairs));
+}
+
+// Returns the record of the cursor's current position. Records with at
+// least |zero_copy_threshold| bytes are copied by upscaledb directly into a
+// refcounted record_blob, which is then handed to the VM as a resource
+// binary. Smaller records are copied into a regular binary (or decoded, if
+// they are numeric); so are compressed records.
+static ups_status_t
+cursor_record_term(ErlNifEnv *env, ups_cursor_t *cursor,
+                const db_wrapper *dwrapper, ERL_NIF_TERM *term)
+{
+  ups_record_t rec = {0};
+  uint32_t size;
+
+  ups_status_t st = ups_cursor_get_record_size(cursor, &size);
+  if (st)
+    return (st);
+
+  if (size < dwrapper->zero_copy_threshold || size <= sizeof(typed_value)
+      || dwrapper->codec) {
+    st = ups_cursor_move(cursor, 0, &rec, 0);
+    if (st)
+      return (st);
+    return (make_record_term(env, dwrapper, rec.data, rec.size, term));
+  }
+
+  record_blob *blob = (record_blob *)enif_alloc_resource(g_ups_blob_resource,
+                  sizeof(record_blob) + size);
+  if (!blob)
+    return (UPS_OUT_OF_MEMORY);
+  rec.data = &blob->data[0];
+  rec.size = size;
+  rec.flags = UPS_RECORD_USER_ALLOC;
+  st = ups_cursor_move(cursor, 0, &rec, 0);
+  if (st == 0) {
+    blob->size = rec.size;
+    *term = enif_make_resource_binary(env, blob, &blob->data[0], rec.size);
+    metrics_output(rec.size);
+  }
+  enif_release_resource(blob);
+  return (st);
+}
+
+// Same as ups_db_find, but returns the record as a record_blob (see above)
+static ups_status_t
+db_find_record_term(ErlNifEnv *env, db_wrapper *dwrapper, ups_txn_t *txn,
+                ups_key_t *key, ERL_NIF_TERM *term)
+{
+  ups_cursor_t *cursor;
+
+  ups_status_t st = ups_cursor_create(&cursor, dwrapper->db, txn, 0);
+  if (st)
+    return (st);
+  st = ups_cursor_find(cursor, key, 0, 0);
+  if (st == 0)
+    st = cursor_record_term(env, cursor, dwrapper, term);
+  (void)ups_cursor_close(cursor);
+  return (st);
+}
+
+// Packs many keys and records into a single binary; the terms are then
+// created as sub-binaries of this binary
+struct packed_binary {
+  struct item {
+    size_t offset;
+    size_t size;
+    bool is_term;       // a decoded number, stored in |term|
+    ERL_NIF_TERM term;
+  };
+
+  ErlNifBinary bin;
+  size_t used;
+  std::vector<item> items;
+  bool ok;
+
+  packed_binary(size_t capacity)
+    : used(0), ok(true) {
+    ok = enif_alloc_binary(capacity ? capacity : 1, &bin) != 0;
+    if (!ok)
+      bin.data = 0;
+  }
+
+  ~packed_binary() {
+    if (bin.data)
+      enif_release_binary(&bin);
+  }
+
+  // appends an item; returns false if memory is exhausted
+  bool append(const void *data, size_t size) {
+    if (!ok)
+      return (false);
+    if (used + size > bin.size) {
+      size_t capacity = bin.size * 2;
+      if (capacity < used + size)
+        capacity = used + size;
+      if (!enif_realloc_binary(&bin, capacity))
+        return (ok = false);
+    }
+    item it = {used, size, false, 0};
+    items.push_back(it);
+    if (size)
+      memcpy(bin.data + used, data, size);
+    used += size;
+    return (true);
+  }
+
+  // appends a key or record; numeric values are decoded if |decode| is
+  // true (see make_typed_term)
+  bool append_value(ErlNifEnv *env, bool decode, uint32_t type,
+                  const void *data, size_t size) {
+    item it = {0, 0, true, 0};
+    if (decode && make_typed_term(env, type, data, size, &it.term)) {
+      items.push_back(it);
+      return (ok);
+    }
+    return (append(data, size));
+  }
+
+  // appends a key; term keys are decoded (see make_key_term)
+  bool append_key(ErlNifEnv *env, const db_wrapper *dwrapper,
+                  const void *data, size_t size) {
+    item it = {0, 0, true, 0};
+    const unsigned char *p = (const unsigned char *)data;
+    if (dwrapper->term_keys
+        && term_key_decode(env, &p, p + size, &it.term, 0)
+        && p == (const unsigned char *)data + size) {
+      items.push_back(it);
+      return (ok);
+    }
+    return (append_value(env, dwrapper->typed_terms, dwrapper->key_type,
+                    data, size));
+  }
+
+  // creates the binary term and the sub-binaries of all items; the
+  // binary is owned by the term afterwards
+  void make_terms(ErlNifEnv *env, std::vector<ERL_NIF_TERM> &terms) {
+    (void)enif_realloc_binary(&bin, used);
+    metrics_output(used);
+    ERL_NIF_TERM whole = enif_make_binary(env, &bin);
+    bin.data = 0;
+    terms.resize(items.size());
+    for (size_t i = 0; i < items.size(); i++) {
+      if (items[i].is_term)
+        terms[i] = items[i].term;
+      else
+        terms[i] = enif_make_sub_binary(env, whole, items[i].offset,
+                        items[i].size);
+    }
+  }
+};
+
+ERL_NIF_TERM
+ups_nifs_strerror(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ups_status_t st;
+
+  if (argc != 1)
+    return (enif_make_badarg(env));
+  if (!enif_get_int(env, argv[0], &st))
+    return (enif_make_badarg(env));
+
+  return (enif_make_string(env, ups_strerror(st), ERL_NIF_LATIN1));
+}
+
+ERL_NIF_TERM
+ups_nifs_env_create(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ups_env_t *henv;
+  uint32_t flags = 0;
+  uint32_t mode = 0;
+  char filename[MAX_STRING];
+  ups_parameter_t params[MAX_PARAMETERS] = {{0, 0}};
+  char logdir_buf[MAX_STRING];
+  char aesdir_buf[MAX_STRING];
+  nif_options options;
+
+  if (argc != 4)
+    return (enif_make_badarg(env));
+  if (enif_get_string(env, argv[0], &filename[0], sizeof(filename),
+              ERL_NIF_LATIN1) <= 0)
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[1], &flags))
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[2], &mode))
+    return (enif_make_badarg(env));
+  if (!get_parameters(env, argv[3], &params[0],
+              &logdir_buf[0], &aesdir_buf[0], &options))
+    return (enif_make_badarg(env));
+
+  // group commits are flushed by the committer thread
+  bool sync_writes = options.group_commit_window
+          && (flags & UPS_ENABLE_FSYNC);
+  if (options.group_commit_window)
+    flags &= ~UPS_ENABLE_FSYNC;
+
+  ups_status_t st = ups_env_create(&henv, filename, flags, mode, &params[0]);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+
+  env_wrapper *ewrapper = (env_wrapper *)enif_alloc_resource_compat(env,
+                                g_ups_env_resource, sizeof(*ewrapper));
+  ewrapper->env = henv;
+  ewrapper->is_closed = false;
+  ewrapper->flags = flags;
+  ewrapper->dirty_policy = options.dirty_policy;
+  ewrapper->dirty_threshold = options.dirty_threshold;
+  ewrapper->lock = enif_mutex_create((char *)"ups_env_lock");
+  ewrapper->dbs_lock = enif_rwlock_create((char *)"ups_env_dbs_lock");
+  ewrapper->worker = 0;
+  ewrapper->worker_stopped = false;
+  ewrapper->group_commit_window = options.group_commit_window;
+  ewrapper->group_commit_size = options.group_commit_size;
+  ewrapper->sync_writes = sync_writes;
+  ewrapper->attached_dbs = 0;
+  ewrapper->write_gate = enif_rwlock_create((char *)"ups_env_write_gate");
+  ewrapper->backup = 0;
+  ewrapper->codec_catalog = 0;
+  group_commit_start(ewrapper);
+  ERL_NIF_TERM result = enif_make_resource(env, ewrapper);
+  enif_release_resource_compat(env, ewrapper);
+
+  return (enif_make_tuple2(env, g_atom_ok, result));
+}
+
+ERL_NIF_TERM
+ups_nifs_env_open(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ups_env_t *henv;
+  uint32_t flags;
+  char filename[MAX_STRING];
+  ups_parameter_t params[MAX_PARAMETERS] = {{0, 0}};
+  char logdir_buf[MAX_STRING];
+  char aesdir_buf[MAX_STRING];
+  nif_options options;
+
+  if (argc != 3)
+    return (enif_make_badarg(env));
+  if (enif_get_string(env, argv[0], &filename[0], sizeof(filename),
+              ERL_NIF_LATIN1) <= 0)
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[1], &flags))
+    return (enif_make_badarg(env));
+  if (!get_parameters(env, argv[2], &params[0],
+              &logdir_buf[0], &aesdir_buf[0], &options))
+    return (enif_make_badarg(env));
+
+  // group commits are flushed by the committer thread
+  bool sync_writes = options.group_commit_window
+          && (flags & UPS_ENABLE_FSYNC);
+  if (options.group_commit_window)
+    flags &= ~UPS_ENABLE_FSYNC;
+
+  ups_status_t st = ups_env_open(&henv, filename, flags, &params[0]);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+
+  env_wrapper *ewrapper = (env_wrapper *)enif_alloc_resource_compat(env,
+                                g_ups_env_resource, sizeof(*ewrapper));
+  ewrapper->env = henv;
+  ewrapper->is_closed = false;
+  ewrapper->flags = flags;
+  ewrapper->dirty_policy = options.dirty_policy;
+  ewrapper->dirty_threshold = options.dirty_threshold;
+  ewrapper->lock = enif_mutex_create((char *)"ups_env_lock");
+  ewrapper->dbs_lock = enif_rwlock_create((char *)"ups_env_dbs_lock");
+  ewrapper->worker = 0;
+  ewrapper->worker_stopped = false;
+  ewrapper->group_commit_window = options.group_commit_window;
+  ewrapper->group_commit_size = options.group_commit_size;
+  ewrapper->sync_writes = sync_writes;
+  ewrapper->attached_dbs = 0;
+  ewrapper->write_gate = enif_rwlock_create((char *)"ups_env_write_gate");
+  ewrapper->backup = 0;
+  ewrapper->codec_catalog = 0;
+  group_commit_start(ewrapper);
+  ERL_NIF_TERM result = enif_make_resource(env, ewrapper);
+  enif_release_resource_compat(env, ewrapper);
+
+  return (enif_make_tuple2(env, g_atom_ok, result));
+}
+
+ERL_NIF_TERM
+ups_nifs_env_create_db(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ups_db_t *hdb;
+  uint32_t dbname;
+  uint32_t flags;
+  ups_parameter_t params[MAX_PARAMETERS] = {{0, 0}};
+  char logdir_buf[MAX_STRING];
+  char aesdir_buf[MAX_STRING];
+  nif_options options;
+  env_wrapper *ewrapper;
+
+  if (argc != 4)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_env_resource, (void **)&ewrapper)
+          || ewrapper->is_closed)
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[1], &dbname))
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[2], &flags))
+    return (enif_make_badarg(env));
+  if (!get_parameters(env, argv[3], &params[0],
+              &logdir_buf[0], &aesdir_buf[0], &options))
+    return (enif_make_badarg(env));
+
+  ups_status_t st = ups_env_create_db(ewrapper->env, &hdb, dbname, flags,
+          &params[0]);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+
+  // the catalog can still describe an erased Database of the same name
+  codec_remove(ewrapper, (uint16_t)dbname);
+  st = key_codec_sync(ewrapper, hdb, true, &options);
+  if (st) {
+    (void)ups_db_close(hdb, 0);
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+  }
+
+  db_wrapper *dbwrapper = (db_wrapper *)enif_alloc_resource_compat(env,
+                                g_ups_db_resource, sizeof(*dbwrapper));
+  db_wrapper_init(dbwrapper, hdb, ewrapper, &options);
+  write_buffer_attach(dbwrapper, &options);
+  read_cache_attach(dbwrapper, &options);
+  bloom_attach(dbwrapper, &options, true);
+  env_attach_db(dbwrapper);
+  ERL_NIF_TERM result = enif_make_resource(env, dbwrapper);
+  enif_release_resource_compat(env, dbwrapper);
+
+  return (enif_make_tuple2(env, g_atom_ok, result));
+}
+
+ERL_NIF_TERM
+ups_nifs_env_open_db(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ups_db_t *hdb;
+  uint32_t dbname;
+  uint32_t flags;
+  ups_parameter_t params[MAX_PARAMETERS] = {{0, 0}};
+  char logdir_buf[MAX_STRING];
+  char aesdir_buf[MAX_STRING];
+  nif_options options;
+  env_wrapper *ewrapper;
+
+  if (argc != 4)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_env_resource, (void **)&ewrapper)
+          || ewrapper->is_closed)
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[1], &dbname))
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[2], &flags))
+    return (enif_make_badarg(env));
+  if (!get_parameters(env, argv[3], &params[0],
+              &logdir_buf[0], &aesdir_buf[0], &options))
+    return (enif_make_badarg(env));
+
+  ups_status_t st = ups_env_open_db(ewrapper->env, &hdb, dbname, flags,
+          &params[0]);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+
+  st = key_codec_sync(ewrapper, hdb, false, &options);
+  if (st) {
+    (void)ups_db_close(hdb, 0);
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+  }
+
+  db_wrapper *dbwrapper = (db_wrapper *)enif_alloc_resource_compat(env,
+                                g_ups_db_resource, sizeof(*dbwrapper));
+  db_wrapper_init(dbwrapper, hdb, ewrapper, &options);
+  write_buffer_attach(dbwrapper, &options);
+  read_cache_attach(dbwrapper, &options);
+  bloom_attach(dbwrapper, &options, false);
+  codec_attach(dbwrapper);
+  env_attach_db(dbwrapper);
+  ERL_NIF_TERM result = enif_make_resource(env, dbwrapper);
+  enif_release_resource_compat(env, dbwrapper);
+
+  return (enif_make_tuple2(env, g_atom_ok, result));
+}
+
+ERL_NIF_TERM
+ups_nifs_env_erase_db(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  uint32_t dbname;
+  env_wrapper *ewrapper;
+
+  if (argc != 2)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_env_resource, (void **)&ewrapper)
+          || ewrapper->is_closed)
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[1], &dbname))
+    return (enif_make_badarg(env));
+
+  ups_status_t st = ups_env_erase_db(ewrapper->env, dbname, 0);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+
+  bloom_remove(ewrapper, (uint16_t)dbname);
+  codec_remove(ewrapper, (uint16_t)dbname);
+  return (g_atom_ok);
+}
+
+// wraps an UQI result set in a resource
+static ERL_NIF_TERM
+make_result_term(ErlNifEnv *env, uqi_result_t *result)
+{
+  result_wrapper *rwrapper = (result_wrapper *)enif_alloc_resource_compat(env,
+                                g_ups_result_resource, sizeof(*rwrapper));
+  rwrapper->result = result;
+  rwrapper->is_closed = false;
+  rwrapper->is_pinned = false;
+  ERL_NIF_TERM term = enif_make_resource(env, rwrapper);
+  enif_release_resource_compat(env, rwrapper);
+  return (term);
+}
+
+// copies a query (a string or a binary) to |query|; queries are not
+// limited in length
+static bool
+get_query(ErlNifEnv *env, ERL_NIF_TERM term, std::string *query)
+{
+  ErlNifBinary bin;
+
+  if (!enif_inspect_iolist_as_binary(env, term, &bin) || bin.size == 0)
+    return (false);
+  query->assign((const char *)bin.data, bin.size);
+  return (true);
+}
+
+// returns the name of the Database in the "FROM DATABASE <name>" clause of
+// a query
+static bool
+get_query_dbname(const std::string &query, uint16_t *dbname)
+{
+  std::string lower(query);
+  for (size_t i = 0; i < lower.size(); i++)
+    lower[i] = (char)tolower((unsigned char)lower[i]);
+
+  for (size_t pos = lower.find("database"); pos != std::string::npos;
+          pos = lower.find("database", pos + 1)) {
+    if (pos == 0 || !isspace((unsigned char)lower[pos - 1]))
+      continue;
+    const char *p = lower.c_str() + pos + 8;
+    if (!isspace((unsigned char)*p))
+      continue;
+    char *end;
+    unsigned long name = strtoul(p, &end, 10);
+    if (end != p && name > 0 && name < 0xf000) {
+      *dbname = (uint16_t)name;
+      return (true);
+    }
+  }
+  return (false);
+}
+
+ERL_NIF_TERM
+ups_nifs_uqi_select_range(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  std::string query;
+  env_wrapper *ewrapper;
+  cursor_wrapper *cwrapper1;
+  cursor_wrapper *cwrapper2;
+  uqi_result_t *result;
+
+  if (argc != 4)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_env_resource, (void **)&ewrapper)
+          || ewrapper->is_closed)
+    return (enif_make_badarg(env));
+  if (!get_query(env, argv[1], &query))
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[2], g_ups_cursor_resource,
+                          (void **)&cwrapper1)
+          || cwrapper1->is_closed)
+    cwrapper1 = 0;
+  if (!enif_get_resource(env, argv[3], g_ups_cursor_resource,
+                          (void **)&cwrapper2)
+          || cwrapper2->is_closed)
+    cwrapper2 = 0;
+
+  // queries read the btree of any Database of the Environment
+  ups_status_t st = write_buffer_flush_env(ewrapper);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+
+  st = uqi_select_range(ewrapper->env, query.c_str(),
+                 cwrapper1 ? cwrapper1->cursor : 0,
+                 cwrapper2 ? cwrapper2->cursor : 0,
+                 &result);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+
+  return (enif_make_tuple2(env, g_atom_ok, make_result_term(env, result)));
+}
+
+ERL_NIF_TERM
+ups_nifs_uqi_prepare(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  env_wrapper *ewrapper;
+  std::string query;
+  uint16_t dbname;
+
+  if (argc != 2)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_env_resource, (void **)&ewrapper)
+          || ewrapper->is_closed)
+    return (enif_make_badarg(env));
+  if (!get_query(env, argv[1], &query))
+    return (enif_make_badarg(env));
+  if (!get_query_dbname(query, &dbname))
+    return (enif_make_tuple2(env, g_atom_error,
+                status_to_atom(env, UPS_INV_PARAMETER)));
+
+  statement_wrapper *swrapper = (statement_wrapper *)enif_alloc_resource_compat(
+                  env, g_ups_statement_resource, sizeof(*swrapper));
+  swrapper->ewrapper = ewrapper;
+  swrapper->query = new std::string(query);
+  swrapper->dbname = dbname;
+  enif_keep_resource(ewrapper);
+  ERL_NIF_TERM result = enif_make_resource(env, swrapper);
+  enif_release_resource_compat(env, swrapper);
+  return (enif_make_tuple2(env, g_atom_ok, result));
+}
+
+// a bound of a prepared query: either a Cursor of the caller or a
+// temporary Cursor which is positioned at the first key >= the bound
+struct query_bound {
+  ups_cursor_t *cursor;
+  bool is_temporary;
+  bool is_past_end;     // no key is >= the bound
+
+  query_bound()
+    : cursor(0), is_temporary(false), is_past_end(false) {
+  }
+
+  ~query_bound() {
+    if (is_temporary)
+      (void)ups_cursor_close(cursor);
+  }
+};
+
+// |dwrapper| is 0 if the Database of the query is not open
+static ups_status_t
+get_query_bound(ErlNifEnv *env, ERL_NIF_TERM term, db_wrapper *dwrapper,
+                query_bound *bound, bool *badarg)
+{
+  cursor_wrapper *cwrapper;
+  typed_value keyval;
+  ErlNifBinary binkey;
+  ups_key_t key = {0};
+
+  if (enif_is_identical(term, enif_make_atom(env, "undefined")))
+    return (0);
+  if (enif_get_resource(env, term, g_ups_cursor_resource, (void **)&cwrapper)) {
+    if (cwrapper->is_closed)
+      *badarg = true;
+    else
+      bound->cursor = cwrapper->cursor;
+    return (0);
+  }
+
+  if (!dwrapper)
+    return (UPS_DATABASE_NOT_FOUND);
+  if (!get_key_binary(env, term, dwrapper, &keyval, &binkey)) {
+    *badarg = true;
+    return (0);
+  }
+  key.size = binkey.size;
+  key.data = binkey.size ? binkey.data : 0;
+
+  ups_status_t st = ups_cursor_create(&bound->cursor, dwrapper->db, 0, 0);
+  if (st)
+    return (st);
+  bound->is_temporary = true;
+  st = ups_cursor_find(bound->cursor, &key, 0, UPS_FIND_GEQ_MATCH);
+  if (st == UPS_KEY_NOT_FOUND) {
+    bound->is_past_end = true;
+    return (0);
+  }
+  return (st);
+}
+
+ERL_NIF_TERM
+ups_nifs_uqi_execute(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  statement_wrapper *swrapper;
+  uqi_result_t *result;
+
+  if (argc != 3)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_statement_resource,
+                          (void **)&swrapper)
+          || swrapper->ewrapper->is_closed)
+    return (enif_make_badarg(env));
+
+  env_wrapper *ewrapper = swrapper->ewrapper;
+  ups_status_t st = write_buffer_flush_env(ewrapper);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+
+  // the Database cannot be closed while its temporary cursors exist; the
+  // dbs_lock is not held during the query
+  bool badarg = false;
+  db_wrapper *dwrapper = env_pin_db(ewrapper, swrapper->dbname);
+  {
+    query_bound begin;
+    query_bound end;
+
+    st = get_query_bound(env, argv[1], dwrapper, &begin, &badarg);
+    if (!st && !badarg)
+      st = get_query_bound(env, argv[2], dwrapper, &end, &badarg);
+    if (!st && !badarg) {
+      // the range ends with the last key
+      if (end.is_past_end) {
+        (void)ups_cursor_close(end.cursor);
+        end.cursor = 0;
+        end.is_temporary = false;
+      }
+      // the range is empty; both cursors point to the last key
+      if (begin.is_past_end
+          && ups_cursor_move(begin.cursor, 0, 0, UPS_CURSOR_LAST) == 0) {
+        if (end.is_temporary)
+          (void)ups_cursor_close(end.cursor);
+        end.is_temporary = false;
+        end.cursor = begin.cursor;
+      }
+      st = uqi_select_range(ewrapper->env, swrapper->query->c_str(),
+                      begin.cursor, end.cursor, &result);
+    }
+    // the destructors close the temporary cursors
+  }
+  if (dwrapper)
+    db_unpin(dwrapper);
+
+  if (badarg)
+    return (enif_make_badarg(env));
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+  return (enif_make_tuple2(env, g_atom_ok, make_result_term(env, result)));
+}
+
+ERL_NIF_TERM
+ups_nifs_uqi_result_get_row_count(ErlNifEnv *env, int argc,
+                const ERL_NIF_TERM argv[])
+{
+  result_wrapper *rwrapper;
+
+  if (argc != 1)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_result_resource,
+                          (void **)&rwrapper)
+          || rwrapper->is_closed)
+    return (enif_make_badarg(env));
+
+  uint32_t rc = uqi_result_get_row_count(rwrapper->result);
+  return (enif_make_tuple2(env, g_atom_ok, enif_make_int(env, (int)rc)));
+}
+
+ERL_NIF_TERM
+ups_nifs_uqi_result_get_key_type(ErlNifEnv *env, int argc,
+                const ERL_NIF_TERM argv[])
+{
+  result_wrapper *rwrapper;
+
+  if (argc != 1)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_result_resource,
+                          (void **)&rwrapper)
+          || rwrapper->is_closed)
+    return (enif_make_badarg(env));
+
+  uint32_t rc = uqi_result_get_key_type(rwrapper->result);
+  return (enif_make_tuple2(env, g_atom_ok, enif_make_int(env, (int)rc)));
+}
+
+ERL_NIF_TERM
+ups_nifs_uqi_result_get_record_type(ErlNifEnv *env, int argc,
+                const ERL_NIF_TERM argv[])
+{
+  result_wrapper *rwrapper;
+
+  if (argc != 1)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_result_resource,
+                          (void **)&rwrapper)
+          || rwrapper->is_closed)
+    return (enif_make_badarg(env));
+
+  uint32_t rc = uqi_result_get_record_type(rwrapper->result);
+  return (enif_make_tuple2(env, g_atom_ok, enif_make_int(env, (int)rc)));
+}
+
+ERL_NIF_TERM
+ups_nifs_uqi_result_get_key(ErlNifEnv *env, int argc,
+                const ERL_NIF_TERM argv[])
+{
+  int row;
+  uint32_t zero_copy = 0;
+  result_wrapper *rwrapper;
+
+  if (argc != 2 && argc != 3)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_result_resource,
+                          (void **)&rwrapper)
+          || rwrapper->is_closed)
+    return (enif_make_badarg(env));
+  if (!enif_get_int(env, argv[1], &row))
+    return (enif_make_badarg(env));
+  // argv[2] (optional) is a flag which enables zero-copy
+  if (argc == 3 && !enif_get_uint(env, argv[2], &zero_copy))
+    return (enif_make_badarg(env));
+
+  ups_key_t key = {0};
+  uqi_result_get_key(rwrapper->result, row, &key);
+
+  // return a binary pointing into the result; the result is kept alive
+  // till all these binaries were garbage collected
+  if (zero_copy) {
+    rwrapper->is_pinned = true;
+    return (enif_make_tuple2(env, g_atom_ok,
+                enif_make_resource_binary(env, rwrapper, key.data, key.size)));
+  }
+
+  ErlNifBinary bin;
+  if (!enif_alloc_binary(key.size, &bin))
+    return (enif_make_tuple2(env, g_atom_error,
+                status_to_atom(env, UPS_OUT_OF_MEMORY)));
+  memcpy(bin.data, key.data, key.size);
+  bin.size = key.size;
+  metrics_output(key.size);
+
+  return (enif_make_tuple2(env, g_atom_ok, enif_make_binary(env, &bin)));
+}
+
+ERL_NIF_TERM
+ups_nifs_uqi_result_get_record(ErlNifEnv *env, int argc,
+                const ERL_NIF_TERM argv[])
+{
+  int row;
+  uint32_t zero_copy = 0;
+  result_wrapper *rwrapper;
+
+  if (argc != 2 && argc != 3)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_result_resource,
+                          (void **)&rwrapper)
+          || rwrapper->is_closed)
+    return (enif_make_badarg(env));
+  if (!enif_get_int(env, argv[1], &row))
+    return (enif_make_badarg(env));
+  // argv[2] (optional) is a flag which enables zero-copy
+  if (argc == 3 && !enif_get_uint(env, argv[2], &zero_copy))
+    return (enif_make_badarg(env));
+
+  ups_record_t record = {0};
+  uqi_result_get_record(rwrapper->result, row, &record);
+
+  // return a binary pointing into the result; the result is kept alive
+  // till all these binaries were garbage collected
+  if (zero_copy) {
+    rwrapper->is_pinned = true;
+    return (enif_make_tuple2(env, g_atom_ok,
+                enif_make_resource_binary(env, rwrapper, record.data, record.size)));
+  }
+
+  ErlNifBinary bin;
+  if (!enif_alloc_binary(record.size, &bin))
+    return (enif_make_tuple2(env, g_atom_error,
+                status_to_atom(env, UPS_OUT_OF_MEMORY)));
+  memcpy(bin.data, record.data, record.size);
+  bin.size = record.size;
+  metrics_output(record.size);
+
+  return (enif_make_tuple2(env, g_atom_ok, enif_make_binary(env, &bin)));
+}
+
+// Returns |count| rows starting at |offset| as a list of {Key, Record}.
+// Numeric keys and records are decoded to integers and floats; all binary
+// keys and records are packed into a single binary.
+ERL_NIF_TERM
+ups_nifs_uqi_result_slice(ErlNifEnv *env, int argc,
+                const ERL_NIF_TERM argv[])
+{
+  uint32_t offset;
+  uint32_t count;
+  result_wrapper *rwrapper;
+
+  if (argc != 3)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_result_resource,
+                          (void **)&rwrapper)
+          || rwrapper->is_closed)
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[1], &offset))
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[2], &count))
+    return (enif_make_badarg(env));
+
+  uint32_t row_count = uqi_result_get_row_count(rwrapper->result);
+  if (offset >= row_count)
+    return (enif_make_tuple2(env, g_atom_ok, enif_make_list(env, 0)));
+  if (count > row_count - offset)
+    count = row_count - offset;
+
+  uint32_t key_type = uqi_result_get_key_type(rwrapper->result);
+  uint32_t record_type = uqi_result_get_record_type(rwrapper->result);
+
+  packed_binary packed(64 * 1024);
+
+  for (uint32_t i = 0; i < count; i++) {
+    ups_key_t key = {0};
+    ups_record_t record = {0};
+    uqi_result_get_key(rwrapper->result, offset + i, &key);
+    uqi_result_get_record(rwrapper->result, offset + i, &record);
+
+    if (!packed.append_value(env, true, key_type, key.data, key.size)
+        || !packed.append_value(env, true, record_type,
+                record.data, record.size))
+      return (enif_make_tuple2(env, g_atom_error,
+                  status_to_atom(env, UPS_OUT_OF_MEMORY)));
+  }
+
+  std::vector<ERL_NIF_TERM> terms;
+  packed.make_terms(env, terms);
+  std::vector<ERL_NIF_TERM> rows(count);
+  for (uint32_t i = 0; i < count; i++)
+    rows[i] = enif_make_tuple2(env, terms[2 * i], terms[2 * i + 1]);
+
+  return (enif_make_tuple2(env, g_atom_ok,
+              enif_make_list_from_array(env, rows.data(), count)));
+}
+
+ERL_NIF_TERM
+ups_nifs_uqi_result_close(ErlNifEnv *env, int argc,
+                const ERL_NIF_TERM argv[])
+{
+  result_wrapper *rwrapper;
+
+  if (argc != 1)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_result_resource,
+                          (void **)&rwrapper)
+          || rwrapper->is_closed)
+    return (enif_make_badarg(env));
+
+  // pinned results are released when the resource is garbage collected
+  if (!rwrapper->is_pinned)
+    uqi_result_close(rwrapper->result);
+  rwrapper->is_closed = true;
+
+  return (g_atom_ok);
+}
+
+ERL_NIF_TERM
+ups_nifs_env_rename_db(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  uint32_t oldname;
+  uint32_t newname;
+  env_wrapper *ewrapper;
+
+  if (argc != 3)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_env_resource, (void **)&ewrapper)
+          || ewrapper->is_closed)
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[1], &oldname))
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[2], &newname))
+    return (enif_make_badarg(env));
+
+  ups_status_t st = ups_env_rename_db(ewrapper->env, oldname, newname, 0);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+
+  // the filter is rebuilt when the Database is opened again
+  bloom_remove(ewrapper, (uint16_t)oldname);
+  bloom_remove(ewrapper, (uint16_t)newname);
+  st = codec_rename(ewrapper, (uint16_t)oldname, (uint16_t)newname);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+  return (g_atom_ok);
+}
+
+ERL_NIF_TERM
+ups_nifs_db_insert(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ups_key_t key = {0};
+  ups_record_t rec = {0};
+  uint32_t flags;
+  ErlNifBinary binkey;
+  ErlNifBinary binrec;
+  typed_value keyval;
+  typed_value recval;
+  db_wrapper *dwrapper;
+  txn_wrapper *twrapper;
+
+  if (argc != 5)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
+          || dwrapper->is_closed)
+    return (enif_make_badarg(env));
+  // arg[1] is the Transaction!
+  if (!enif_get_resource(env, argv[1], g_ups_txn_resource, (void **)&twrapper))
+    twrapper = 0;
+  if (twrapper != 0 && twrapper->is_closed)
+    return (enif_make_badarg(env));
+  if (!get_key_binary(env, argv[2], dwrapper, &keyval, &binkey))
+    return (enif_make_badarg(env));
+  if (!get_typed_binary(env, argv[3], dwrapper->record_type, &recval,
+                &binrec))
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[4], &flags))
+    return (enif_make_badarg(env));
+
+  key.size = binkey.size;
+  key.data = binkey.size ? binkey.data : 0;
+  rec.size = binrec.size;
+  rec.data = binrec.size ? binrec.data : 0;
+  std::vector<char> encoded;
+  codec_encode(dwrapper, &rec, &encoded);
+
+  // the key is added before it is visible to other lookups
+  bloom_add(dwrapper, key.data, key.size);
+
+  ups_status_t st;
+  if (dwrapper->buffer && !twrapper && !(flags & ~UPS_OVERWRITE))
+    st = write_buffer_write(dwrapper, &key, &rec, flags);
+  else if (!(st = write_buffer_flush(dwrapper))) {
+    st = ups_db_insert(dwrapper->db, twrapper ? twrapper->txn : 0,
+                    &key, &rec, flags);
+    if (!twrapper)
+      st = env_sync(dwrapper->ewrapper, st);
+  }
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+
+  read_cache_invalidate(dwrapper, key.data, key.size);
+
+  return (g_atom_ok);
+}
+
+template<nif_op Op, nif_function_t Fn>
+static ERL_NIF_TERM
+gated_call(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]);
+
+// Inserts a {Key, Record} item of db_insert_many. Returns false if the
+// item is malformed or cannot be inserted; |failure| then receives
+// {Key, Reason} (or {Item, badarg} if the item is not a pair).
+static bool
+insert_many_item(ErlNifEnv *env, db_wrapper *dwrapper, txn_wrapper *twrapper,
+                ERL_NIF_TERM item, uint32_t flags, ERL_NIF_TERM *failure)
+{
+  int arity;
+  const ERL_NIF_TERM *array;
+  ErlNifBinary binkey;
+  ErlNifBinary binrec;
+  typed_value keyval;
+  typed_value recval;
+
+  if (!enif_get_tuple(env, item, &arity, &array) || arity != 2) {
+    *failure = enif_make_tuple2(env, item, enif_make_atom(env, "badarg"));
+    return (false);
+  }
+  if (!get_key_binary(env, array[0], dwrapper, &keyval, &binkey)
+      || !get_typed_binary(env, array[1], dwrapper->record_type, &recval,
+                &binrec)) {
+    *failure = enif_make_tuple2(env, array[0], enif_make_atom(env, "badarg"));
+    return (false);
+  }
+
+  ups_key_t key = {0};
+  key.size = binkey.size;
+  key.data = binkey.size ? binkey.data : 0;
+  ups_record_t rec = {0};
+  rec.size = binrec.size;
+  rec.data = binrec.size ? binrec.data : 0;
+  std::vector<char> encoded;
+  codec_encode(dwrapper, &rec, &encoded);
+
+  bloom_add(dwrapper, key.data, key.size);
+  ups_status_t st = ups_db_insert(dwrapper->db,
+                  twrapper ? twrapper->txn : 0, &key, &rec, flags);
+  if (st) {
+    *failure = enif_make_tuple2(env, array[0], status_to_atom(env, st));
+    return (false);
+  }
+  read_cache_invalidate(dwrapper, key.data, key.size);
+  return (true);
+}
+
+// Inserts a list of {Key, Record} tuples. Items which cannot be inserted
+// are collected and returned; they do not abort the batch. When the
+// timeslice is exhausted the function reschedules itself with the
+// remaining items; argv[4] and argv[5] then carry the number of inserted
+// items and the (reversed) list of failures.
+static ERL_NIF_TERM
+db_insert_many_impl(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  uint32_t flags;
+  db_wrapper *dwrapper;
+  txn_wrapper *twrapper;
+  unsigned long inserted = 0;
+  ERL_NIF_TERM failures = enif_make_list(env, 0);
+  ERL_NIF_TERM list, cell;
+
+  metrics_enter(OP_DB_INSERT_MANY);
+  if (argc != 4 && argc != 6)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
+          || dwrapper->is_closed)
+    return (enif_make_badarg(env));
+  // arg[1] is the Transaction!
+  if (!enif_get_resource(env, argv[1], g_ups_txn_resource, (void **)&twrapper))
+    twrapper = 0;
+  if (twrapper != 0 && twrapper->is_closed)
+    return (enif_make_badarg(env));
+  if (!enif_is_list(env, argv[2]))
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[3], &flags))
+    return (enif_make_badarg(env));
+  if (argc == 6) {
+    if (!enif_get_ulong(env, argv[4], &inserted))
+      return (enif_make_badarg(env));
+    failures = argv[5];
+  }
+
+  // batches are applied to the btree directly; writes which were buffered
+  // while the function yielded are older than the rest of the batch
+  ups_status_t st = write_buffer_flush(dwrapper);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+
+  ErlNifTime start = enif_monotonic_time(ERL_NIF_USEC);
+  unsigned n = 0;
+
+  list = argv[2];
+  while (enif_get_list_cell(env, list, &cell, &list)) {
+    // earlier items may already be inserted, therefore malformed items
+    // are reported like failed inserts
+    ERL_NIF_TERM failure;
+    if (insert_many_item(env, dwrapper, twrapper, cell, flags, &failure))
+      inserted++;
+    else
+      failures = enif_make_list_cell(env, failure, failures);
+
+    if (++n % YIELD_INTERVAL == 0 && !enif_is_empty_list(env, list)
+        && consume_timeslice(env, &start)) {
+      ERL_NIF_TERM newargv[6] = {argv[0], argv[1], list, argv[3],
+                enif_make_ulong(env, inserted), failures};
+      return (enif_schedule_nif(env, "db_insert_many", 0,
+                      gated_call<OP_DB_INSERT_MANY, db_insert_many_impl>,
+                      6, newargv));
+    }
+  }
+
+  // all inserts of the batch are flushed together
+  if (!twrapper && (st = env_sync(dwrapper->ewrapper, 0)))
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+
+  (void)enif_make_reverse_list(env, failures, &failures);
+  return (enif_make_tuple3(env, g_atom_ok,
+              enif_make_ulong(env, inserted), failures));
+}
+
+ERL_NIF_TERM
+ups_nifs_db_insert_many(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  if (argc != 4)
+    return (enif_make_badarg(env));
+  return (db_insert_many_impl(env, argc, argv));
+}
+
+// Inserts a list of {Key, Record} tuples with UPS_HINT_APPEND; the keys
+// should be sorted and greater than all keys of the Database (see
+// ups_bulk). The items are inserted in a single Transaction if the
+// Environment has Transactions enabled; the first failure aborts the batch.
+ERL_NIF_TERM
+ups_nifs_db_bulk_insert(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  uint32_t flags;
+  db_wrapper *dwrapper;
+  ups_txn_t *txn = 0;
+  unsigned long inserted = 0;
+  std::vector<char> encoded;
+  ERL_NIF_TERM list, cell;
+
+  if (argc != 3)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
+          || dwrapper->is_closed)
+    return (enif_make_badarg(env));
+  if (!enif_is_list(env, argv[1]))
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[2], &flags) || (flags & ~UPS_OVERWRITE))
+    return (enif_make_badarg(env));
+
+  ups_status_t st = write_buffer_flush(dwrapper);
+  if (!st && (dwrapper->ewrapper->flags & UPS_ENABLE_TRANSACTIONS))
+    st = ups_txn_begin(&txn, dwrapper->ewrapper->env, 0, 0, 0);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+
+  list = argv[1];
+  while (!st && enif_get_list_cell(env, list, &cell, &list)) {
+    int arity;
+    const ERL_NIF_TERM *array;
+    ErlNifBinary binkey;
+    ErlNifBinary binrec;
+    typed_value keyval;
+    typed_value recval;
+
+    if (!enif_get_tuple(env, cell, &arity, &array) || arity != 2
+        || !get_key_binary(env, array[0], dwrapper, &keyval,
+                  &binkey)
+        || !get_typed_binary(env, array[1], dwrapper->record_type, &recval,
+                  &binrec)) {
+      if (txn)
+        (void)ups_txn_abort(txn, 0);
+      return (enif_make_badarg(env));
+    }
+
+    ups_key_t key = {0};
+    key.size = binkey.size;
+    key.data = binkey.size ? binkey.data : 0;
+    ups_record_t rec = {0};
+    rec.size = binrec.size;
+    rec.data = binrec.size ? binrec.data : 0;
+    codec_encode(dwrapper, &rec, &encoded);
+
+    bloom_add(dwrapper, key.data, key.size);
+    st = ups_db_insert(dwrapper->db, txn, &key, &rec,
+                    flags | UPS_HINT_APPEND);
+    if (!st)
+      inserted++;
+  }
+
+  if (txn) {
+    if (!st)
+      st = ups_txn_commit(txn, 0);
+    if (st)
+      (void)ups_txn_abort(txn, 0);
+  }
+  st = env_sync(dwrapper->ewrapper, st);
+  // cached records can be overwritten
+  read_cache_clear(dwrapper);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+
+  return (enif_make_tuple2(env, g_atom_ok, enif_make_ulong(env, inserted)));
+}
+
+ERL_NIF_TERM
+ups_nifs_db_erase(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ups_key_t key = {0};
+  ErlNifBinary binkey;
+  typed_value keyval;
+  db_wrapper *dwrapper;
+  txn_wrapper *twrapper;
+
+  if (argc != 3)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
+          || dwrapper->is_closed)
+    return (enif_make_badarg(env));
+  // arg[1] is the Transaction!
+  if (!enif_get_resource(env, argv[1], g_ups_txn_resource, (void **)&twrapper))
+    twrapper = 0;
+  if (twrapper != 0 && twrapper->is_closed)
+    return (enif_make_badarg(env));
+  if (!get_key_binary(env, argv[2], dwrapper, &keyval, &binkey))
+    return (enif_make_badarg(env));
+
+  key.data = binkey.data;
+  key.size = binkey.size;
+
+  ups_status_t st;
+  if (dwrapper->buffer && !twrapper)
+    st = write_buffer_write(dwrapper, &key, 0, 0);
+  else if (!(st = write_buffer_flush(dwrapper))) {
+    st = ups_db_erase(dwrapper->db, twrapper ? twrapper->txn : 0, &key, 0);
+    if (!twrapper)
+      st = env_sync(dwrapper->ewrapper, st);
+  }
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+
+  read_cache_invalidate(dwrapper, key.data, key.size);
+
+  return (g_atom_ok);
+}
+
+
+// Erases the keys of the range [argv[2], argv[3]) in chunks of argv[4]
+// keys; the bounds are encoded keys (binaries) or 'undefined'. The keys
+// of a chunk are collected with a cursor and then erased. If argv[5] is
+// 'true' and no Transaction is given then each chunk is erased in its own
+// Transaction. The function yields between chunks when its timeslice is
+// used up; argv[6] carries the number of erased keys.
+static ERL_NIF_TERM
+db_erase_range_impl(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  db_wrapper *dwrapper;
+  txn_wrapper *twrapper;
+  ErlNifBinary binstart;
+  ErlNifBinary binend;
+  uint32_t chunk_size;
+  unsigned long erased;
+
+  if (argc != 7)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
+          || dwrapper->is_closed)
+    return (enif_make_badarg(env));
+  // arg[1] is the Transaction!
+  if (!enif_get_resource(env, argv[1], g_ups_txn_resource, (void **)&twrapper))
+    twrapper = 0;
+  if (twrapper != 0 && twrapper->is_closed)
+    return (enif_make_badarg(env));
+  bool has_start = enif_inspect_binary(env, argv[2], &binstart) != 0;
+  bool has_end = enif_inspect_binary(env, argv[3], &binend) != 0;
+  if (!enif_get_uint(env, argv[4], &chunk_size) || chunk_size == 0)
+    return (enif_make_badarg(env));
+  if (!enif_get_ulong(env, argv[6], &erased))
+    return (enif_make_badarg(env));
+  bool sub_txn = !twrapper
+          && enif_is_identical(argv[5], enif_make_atom(env, "true"))
+          && (dwrapper->ewrapper->flags & UPS_ENABLE_TRANSACTIONS);
+
+  // keys can be buffered again while the function yields
+  ups_status_t st = write_buffer_flush(dwrapper);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+
+  ErlNifTime start = enif_monotonic_time(ERL_NIF_USEC);
+  std::vector<std::string> keys;
+  keys.reserve(chunk_size < 1024 ? chunk_size : 1024);
+
+  while (true) {
+    ups_txn_t *txn = twrapper ? twrapper->txn : 0;
+    if (sub_txn && (st = ups_txn_begin(&txn, dwrapper->ewrapper->env,
+                    0, 0, 0)))
+      break;
+
+    // collect the keys of the next chunk; erased keys are no longer
+    // found, therefore every chunk starts at the start of the range
+    ups_cursor_t *cursor;
+    keys.clear();
+    st = ups_cursor_create(&cursor, dwrapper->db, txn, 0);
+    if (!st) {
+      ups_key_t key = {0};
+      if (has_start) {
+        key.data = binstart.data;
+        key.size = binstart.size;
+        st = ups_cursor_find(cursor, &key, 0, UPS_FIND_GEQ_MATCH);
+      }
+      else
+        st = ups_cursor_move(cursor, &key, 0,
+                        UPS_CURSOR_FIRST | UPS_SKIP_DUPLICATES);
+      while (!st && keys.size() < chunk_size) {
+        if (has_end && compare_keys(dwrapper->key_type, key.data, key.size,
+                        binend.data, binend.size) >= 0)
+          break;
+        keys.push_back(std::string((const char *)key.data, key.size));
+        // ups_db_erase() erases all duplicates of a key
+        st = ups_cursor_move(cursor, &key, 0,
+                        UPS_CURSOR_NEXT | UPS_SKIP_DUPLICATES);
+      }
+      if (st == UPS_KEY_NOT_FOUND)
+        st = 0;
+      (void)ups_cursor_close(cursor);
+    }
+
+    for (size_t i = 0; !st && i < keys.size(); i++) {
+      ups_key_t key = {0};
+      key.data = (void *)keys[i].data();
+      key.size = (uint32_t)keys[i].size();
+      st = ups_db_erase(dwrapper->db, txn, &key, 0);
+      if (!st)
+        read_cache_invalidate(dwrapper, key.data, key.size);
+    }
+
+    if (sub_txn) {
+      if (!st)
+        st = ups_txn_commit(txn, 0);
+      else
+        (void)ups_txn_abort(txn, 0);
+    }
+    if (st)
+      break;
+    erased += keys.size();
+
+    if (keys.size() < chunk_size) {
+      if (!twrapper && (st = env_sync(dwrapper->ewrapper, 0)))
+        break;
+      return (enif_make_tuple2(env, g_atom_ok, enif_make_ulong(env, erased)));
+    }
+    if (consume_timeslice(env, &start)) {
+      ERL_NIF_TERM newargv[7] = {argv[0], argv[1], argv[2], argv[3],
+                argv[4], argv[5], enif_make_ulong(env, erased)};
+      return (enif_schedule_nif(env, "db_erase_range", 0,
+                      gated_call<OP_DB_ERASE_RANGE, db_erase_range_impl>,
+                      7, newargv));
+    }
+  }
+
+  // an aborted sub-transaction erased nothing
+  read_cache_clear(dwrapper);
+  return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+}
+
+// copies the encoded key |term| to a binary, or returns 'undefined'
+static bool
+erase_range_bound(ErlNifEnv *env, ERL_NIF_TERM term, db_wrapper *dwrapper,
+                ERL_NIF_TERM *bound)
+{
+  ErlNifBinary bin;
+  typed_value value;
+
+  if (enif_is_identical(term, enif_make_atom(env, "undefined"))) {
+    *bound = term;
+    return (true);
+  }
+  if (!get_key_binary(env, term, dwrapper, &value, &bin))
+    return (false);
+  unsigned char *data = enif_make_new_binary(env, bin.size, bound);
+  if (bin.size)
+    memcpy(data, bin.data, bin.size);
+  return (true);
+}
+
+// Erases the keys of the half-open range [StartKey, EndKey); either bound
+// can be 'undefined'. Returns {ok, Count}.
+ERL_NIF_TERM
+ups_nifs_db_erase_range(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  db_wrapper *dwrapper;
+  ERL_NIF_TERM newargv[7];
+
+  if (argc != 6)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
+          || dwrapper->is_closed)
+    return (enif_make_badarg(env));
+  // the end of the range cannot be detected without the key order
+  if (dwrapper->key_type == UPS_TYPE_CUSTOM)
+    return (enif_make_tuple2(env, g_atom_error,
+                status_to_atom(env, UPS_INV_PARAMETER)));
+  if (!erase_range_bound(env, argv[2], dwrapper, &newargv[2])
+        || !erase_range_bound(env, argv[3], dwrapper, &newargv[3]))
+    return (enif_make_badarg(env));
+
+  newargv[0] = argv[0];
+  newargv[1] = argv[1];
+  newargv[4] = argv[4];
+  newargv[5] = argv[5];
+  newargv[6] = enif_make_ulong(env, 0);
+  return (db_erase_range_impl(env, 7, newargv));
+}
+
+ERL_NIF_TERM
+ups_nifs_db_find(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ups_key_t key = {0};
+  ups_record_t rec = {0};
+  ErlNifBinary binkey;
+  typed_value keyval;
+  db_wrapper *dwrapper;
+  txn_wrapper *twrapper;
+
+  if (argc != 3)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
+          || dwrapper->is_closed)
+    return (enif_make_badarg(env));
+  // argv[1] is the Transaction!
+  if (!enif_get_resource(env, argv[1], g_ups_txn_resource, (void **)&twrapper))
+    twrapper = 0;
+  if (twrapper != 0 && twrapper->is_closed)
+    return (enif_make_badarg(env));
+  if (!get_key_binary(env, argv[2], dwrapper, &keyval, &binkey))
+    return (enif_make_badarg(env));
+
+  key.data = binkey.data;
+  key.size = binkey.size;
+
+  if (dwrapper->buffer) {
+    ERL_NIF_TERM result;
+    if (!twrapper && write_buffer_find(env, dwrapper, &key, &result))
+      return (result);
+    // Transactions do not see buffered writes
+    ups_status_t st = twrapper ? write_buffer_flush(dwrapper) : 0;
+    if (st)
+      return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+  }
+
+  if (bloom_excludes(dwrapper, &key))
+    return (enif_make_tuple2(env, g_atom_error,
+                    status_to_atom(env, UPS_KEY_NOT_FOUND)));
+
+  if (dwrapper->cache && !twrapper) {
+    ERL_NIF_TERM record;
+    ups_status_t st = read_cache_find(env, dwrapper, &key, &record);
+    if (st) {
+      bloom_false_positive(dwrapper, st);
+      return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+    }
+    return (enif_make_tuple2(env, g_atom_ok, record));
+  }
+
+  if (dwrapper->zero_copy_threshold) {
+    ERL_NIF_TERM record;
+    ups_status_t st = db_find_record_term(env, dwrapper,
+                    twrapper ? twrapper->txn : 0, &key, &record);
+    if (st) {
+      bloom_false_positive(dwrapper, st);
+      return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+    }
+    return (enif_make_tuple2(env, g_atom_ok, record));
+  }
+
+  ups_status_t st = ups_db_find(dwrapper->db, twrapper ? twrapper->txn : 0,
+                                &key, &rec, 0);
+  if (st) {
+    bloom_false_positive(dwrapper, st);
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+  }
+
+  ERL_NIF_TERM record;
+  st = make_record_term(env, dwrapper, rec.data, rec.size, &record);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+  return (enif_make_tuple2(env, g_atom_ok, record));
+}
+
+// sorts the keys of a find_many_state in btree order
+struct find_many_less {
+  uint32_t key_type;
+
+  find_many_less(uint32_t kt)
+    : key_type(kt) {
+  }
+
+  bool operator()(const find_many_item &lhs, const find_many_item &rhs) const {
+    return (compare_keys(key_type, lhs.key_data(), lhs.key.size,
+                            rhs.key_data(), rhs.key.size) < 0);
+  }
+};
+
+// Looks up a list of keys. The keys are sorted according to the key type
+// of the Database, therefore consecutive lookups will hit the same or
+// neighbouring btree pages. The results are returned in the original order.
+// The function yields when its timeslice is used up; argv[3] then holds the
+// find_many_state resource. The keys are prepared before the first yield,
+// therefore long lists start on a dirty scheduler (see dirty_job_flags) and
+// are then moved to a normal scheduler for the lookups.
+static ERL_NIF_TERM
+db_find_many_impl(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  db_wrapper *dwrapper;
+  txn_wrapper *twrapper;
+  find_many_state *state;
+  ERL_NIF_TERM state_term;
+
+  if (argc == 3)
+    metrics_enter(OP_DB_FIND_MANY);
+  if (argc != 3 && argc != 4)
     return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_env_resource, (void **)&ewrapper)
-          || ewrapper->is_closed)
+  if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
+          || dwrapper->is_closed)
     return (enif_make_badarg(env));
-  if (!enif_get_uint(env, argv[1], &dbname))
+  // argv[1] is the Transaction!
+  if (!enif_get_resource(env, argv[1], g_ups_txn_resource, (void **)&twrapper))
+    twrapper = 0;
+  if (twrapper != 0 && twrapper->is_closed)
     return (enif_make_badarg(env));
-  if (!enif_get_uint(env, argv[2], &flags))
+
+  if (argc == 3) {
+    unsigned length;
+    if (!enif_get_list_length(env, argv[2], &length))
+      return (enif_make_badarg(env));
+
+    state = (find_many_state *)enif_alloc_resource(g_ups_find_many_resource,
+                    sizeof(*state));
+    state->items = new std::vector<find_many_item>(length);
+    state->position = 0;
+    state_term = enif_make_resource(env, state);
+    enif_release_resource(state);
+
+    ERL_NIF_TERM list = argv[2], cell;
+    for (unsigned i = 0; enif_get_list_cell(env, list, &cell, &list); i++) {
+      find_many_item &item = (*state->items)[i];
+      item.owns_key = false;
+      item.record.data = 0;
+      // the encoded term keys must survive when the function yields
+      std::string encoded;
+      if (dwrapper->term_keys) {
+        if (!term_key_encode(env, cell, &encoded, 0)
+            || !enif_alloc_binary(encoded.size(), &item.key))
+          return (enif_make_badarg(env));
+        memcpy(item.key.data, encoded.data(), encoded.size());
+        item.owns_key = true;
+      }
+      else if (!get_typed_binary(env, cell, dwrapper->key_type, &item.value,
+                    &item.key))
+        return (enif_make_badarg(env));
+      item.is_typed = item.key.data == (unsigned char *)&item.value;
+      item.index = i;
+      item.status = UPS_KEY_NOT_FOUND;
+    }
+
+    std::stable_sort(state->items->begin(), state->items->end(),
+                    find_many_less(dwrapper->key_type));
+
+    // a dirty scheduler never yields (see consume_timeslice), therefore
+    // the lookups continue on a normal scheduler unless all calls of the
+    // Environment are dirty
+    if (enif_thread_type() != ERL_NIF_THR_NORMAL_SCHEDULER
+        && dwrapper->ewrapper->dirty_policy != DIRTY_POLICY_ALWAYS) {
+      ERL_NIF_TERM newargv[4] = {argv[0], argv[1], argv[2], state_term};
+      return (enif_schedule_nif(env, "db_find_many", 0,
+                      db_find_many_impl, 4, newargv));
+    }
+  }
+  else {
+    if (!enif_get_resource(env, argv[3], g_ups_find_many_resource,
+                            (void **)&state))
+      return (enif_make_badarg(env));
+    state_term = argv[3];
+  }
+
+  std::vector<find_many_item> &items = *state->items;
+  ErlNifTime start = enif_monotonic_time(ERL_NIF_USEC);
+
+  while (state->position < items.size()) {
+    find_many_item &item = items[state->position++];
+
+    ups_key_t key = {0};
+    key.size = item.key.size;
+    key.data = item.key.size ? (void *)item.key_data() : 0;
+    ups_record_t rec = {0};
+
+    if (bloom_excludes(dwrapper, &key))
+      item.status = UPS_KEY_NOT_FOUND;
+    else {
+      item.status = ups_db_find(dwrapper->db, twrapper ? twrapper->txn : 0,
+                      &key, &rec, 0);
+      bloom_false_positive(dwrapper, item.status);
+    }
+    if (item.status == 0) {
+      const void *data = rec.data;
+      uint32_t size = rec.size;
+      std::vector<char> decoded;
+      item.status = codec_decode(dwrapper, &data, &size, &decoded);
+      if (item.status == 0 && !enif_alloc_binary(size, &item.record))
+        item.status = UPS_OUT_OF_MEMORY;
+      else if (item.status == 0) {
+        memcpy(item.record.data, data, size);
+        metrics_output(size);
+      }
+    }
+
+    if (state->position % YIELD_INTERVAL == 0
+        && state->position < items.size()
+        && consume_timeslice(env, &start)) {
+      ERL_NIF_TERM newargv[4] = {argv[0], argv[1], argv[2], state_term};
+      return (enif_schedule_nif(env, "db_find_many", 0,
+                      db_find_many_impl, 4, newargv));
+    }
+  }
+
+  // now build the results in the caller's order
+  std::vector<ERL_NIF_TERM> results(items.size());
+  for (size_t i = 0; i < items.size(); i++) {
+    find_many_item &item = items[i];
+    if (item.status == 0) {
+      ERL_NIF_TERM record;
+      if (dwrapper->typed_terms && make_typed_term(env, dwrapper->record_type,
+                  item.record.data, item.record.size, &record))
+        enif_release_binary(&item.record);
+      else
+        record = enif_make_binary(env, &item.record);
+      results[item.index] = enif_make_tuple2(env, g_atom_ok, record);
+      item.record.data = 0; // now owned by the term
+    }
+    else if (item.status == UPS_KEY_NOT_FOUND)
+      results[item.index] = g_atom_not_found;
+    else
+      results[item.index] = enif_make_tuple2(env, g_atom_error,
+                      status_to_atom(env, item.status));
+  }
+
+  return (enif_make_tuple2(env, g_atom_ok,
+              enif_make_list_from_array(env, results.data(),
+                      (unsigned)results.size())));
+}
+
+ERL_NIF_TERM
+ups_nifs_db_find_many(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  db_wrapper *dwrapper;
+
+  if (argc != 3)
     return (enif_make_badarg(env));
-  if (!get_parameters(env, argv[3], &params[0],
-              &logdir_buf[0], &aesdir_buf[0]))
+  // batches are applied to the btree directly
+  if (enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
+          && !dwrapper->is_closed) {
+    ups_status_t st = write_buffer_flush(dwrapper);
+    if (st)
+      return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+  }
+  return (db_find_many_impl(env, argc, argv));
+}
+
+ERL_NIF_TERM
+ups_nifs_db_find_flags(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  ups_key_t key = {0};
+  ups_record_t rec = {0};
+  uint32_t flags = 0;
+  ErlNifBinary binkey;
+  typed_value keyval;
+  db_wrapper *dwrapper;
+  txn_wrapper *twrapper;
+
+  if (argc != 4)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
+          || dwrapper->is_closed)
+    return (enif_make_badarg(env));
+  // argv[1] is the Transaction!
+  if (!enif_get_resource(env, argv[1], g_ups_txn_resource, (void **)&twrapper))
+    twrapper = 0;
+  if (twrapper != 0 && twrapper->is_closed)
+    return (enif_make_badarg(env));
+  if (!get_key_binary(env, argv[2], dwrapper, &keyval, &binkey))
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[3], &flags))
     return (enif_make_badarg(env));
 
-  ups_status_t st = ups_env_create_db(ewrapper->env, &hdb, dbname, flags,
-          &params[0]);
+  key.data = binkey.data;
+  key.size = binkey.size;
+
+  // approximate matches are looked up in the btree
+  ups_status_t st = write_buffer_flush(dwrapper);
+  if (!st)
+    st = ups_db_find(dwrapper->db, twrapper ? twrapper->txn : 0,
+                    &key, &rec, flags);
+  ERL_NIF_TERM record;
+  if (!st)
+    st = make_record_term(env, dwrapper, rec.data, rec.size, &record);
   if (st)
     return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
-  db_wrapper *dbwrapper = (db_wrapper *)enif_alloc_resource_compat(env,
-                                g_ups_db_resource, sizeof(*dbwrapper));
-  dbwrapper->db = hdb;
-  dbwrapper->is_closed = false;
-  ERL_NIF_TERM result = enif_make_resource(env, dbwrapper);
-  enif_release_resource_compat(env, dbwrapper);
-
-  return (enif_make_tuple2(env, g_atom_ok, result));
+  // with approximate matching, the key of the match is returned as well
+  return (enif_make_tuple3(env, g_atom_ok,
+              flags
+                ? make_key_term(env, dwrapper, key.data, key.size)
+                : argv[2],
+              record));
 }
 
 ERL_NIF_TERM
-ups_nifs_env_open_db(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ups_nifs_txn_begin(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  ups_db_t *hdb;
-  uint32_t dbname;
-  uint32_t flags;
-  ups_parameter_t params[MAX_PARAMETERS] = {{0, 0}};
-  char logdir_buf[MAX_STRING];
-  char aesdir_buf[MAX_STRING];
   env_wrapper *ewrapper;
+  uint32_t flags;
 
-  if (argc != 4)
+  if (argc != 2)
     return (enif_make_badarg(env));
   if (!enif_get_resource(env, argv[0], g_ups_env_resource, (void **)&ewrapper)
           || ewrapper->is_closed)
     return (enif_make_badarg(env));
-  if (!enif_get_uint(env, argv[1], &dbname))
-    return (enif_make_badarg(env));
-  if (!enif_get_uint(env, argv[2], &flags))
-    return (enif_make_badarg(env));
-  if (!get_parameters(env, argv[3], &params[0],
-              &logdir_buf[0], &aesdir_buf[0]))
+  if (!enif_get_uint(env, argv[1], &flags))
     return (enif_make_badarg(env));
 
-  ups_status_t st = ups_env_open_db(ewrapper->env, &hdb, dbname, flags,
-          &params[0]);
+  ups_txn_t *txn;
+  ups_status_t st = ups_txn_begin(&txn, ewrapper->env, 0, 0, flags);
   if (st)
     return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
-  db_wrapper *dbwrapper = (db_wrapper *)enif_alloc_resource_compat(env,
-                                g_ups_db_resource, sizeof(*dbwrapper));
-  dbwrapper->db = hdb;
-  dbwrapper->is_closed = false;
-  ERL_NIF_TERM result = enif_make_resource(env, dbwrapper);
-  enif_release_resource_compat(env, dbwrapper);
+  txn_wrapper *twrapper = (txn_wrapper *)enif_alloc_resource_compat(env,
+                                g_ups_txn_resource, sizeof(*twrapper));
+  twrapper->txn = txn;
+  twrapper->is_closed = false;
+  twrapper->ewrapper = ewrapper;
+  twrapper->close_lock = enif_rwlock_create((char *)"ups_txn_close_lock");
+  enif_keep_resource(ewrapper);
+  ERL_NIF_TERM result = enif_make_resource(env, twrapper);
+  enif_release_resource_compat(env, twrapper);
 
   return (enif_make_tuple2(env, g_atom_ok, result));
 }
 
 ERL_NIF_TERM
-ups_nifs_env_erase_db(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ups_nifs_txn_abort(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  uint32_t dbname;
-  env_wrapper *ewrapper;
+  txn_wrapper *twrapper;
 
-  if (argc != 2)
+  if (argc != 1)
     return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_env_resource, (void **)&ewrapper)
-          || ewrapper->is_closed)
+  if (!enif_get_resource(env, argv[0], g_ups_txn_resource, (void **)&twrapper)
+          || twrapper->is_closed)
     return (enif_make_badarg(env));
-  if (!enif_get_uint(env, argv[1], &dbname))
+
+  // waits for a running async job; queued jobs then see is_closed
+  enif_rwlock_rwlock(twrapper->close_lock);
+  ups_status_t st = twrapper->is_closed
+                      ? UPS_INV_PARAMETER
+                      : ups_txn_abort(twrapper->txn, 0);
+  if (!st)
+    twrapper->is_closed = true;
+  enif_rwlock_rwunlock(twrapper->close_lock);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+  return (g_atom_ok);
+}
+
+ERL_NIF_TERM
+ups_nifs_txn_commit(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  txn_wrapper *twrapper;
+
+  if (argc != 1)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_txn_resource, (void **)&twrapper)
+          || twrapper->is_closed)
     return (enif_make_badarg(env));
 
-  ups_status_t st = ups_env_erase_db(ewrapper->env, dbname, 0);
+  // waits for a running async job; queued jobs then see is_closed
+  enif_rwlock_rwlock(twrapper->close_lock);
+  ups_status_t st = twrapper->is_closed
+                      ? UPS_INV_PARAMETER
+                      : ups_txn_commit(twrapper->txn, 0);
+  if (!st)
+    twrapper->is_closed = true;
+  enif_rwlock_rwunlock(twrapper->close_lock);
   if (st)
     return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
+  // the commit is not yet durable; the caller waits for the committer.
+  // Without a committer the Environment is being closed, which flushes
+  // all committed Transactions.
+  ERL_NIF_TERM ref;
+  if (group_commit_push(env, twrapper->ewrapper, &ref))
+    return (enif_make_tuple2(env, enif_make_atom(env, "group_commit"), ref));
   return (g_atom_ok);
 }
 
 ERL_NIF_TERM
-ups_nifs_uqi_select_range(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ups_nifs_db_close(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  char query[1024];
-  env_wrapper *ewrapper;
-  cursor_wrapper *cwrapper1;
-  cursor_wrapper *cwrapper2;
-  uqi_result_t *result;
+  db_wrapper *dwrapper;
 
-  if (argc != 4)
+  if (argc != 1)
     return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_env_resource, (void **)&ewrapper)
-          || ewrapper->is_closed)
+  if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
+          || dwrapper->is_closed)
     return (enif_make_badarg(env));
-  if (enif_get_string(env, argv[1], query, sizeof(query), ERL_NIF_LATIN1) <= 0)
+
+  // an interrupted scan leaves the filter unused
+  bloom_stop(dwrapper);
+  stream_stop_db(dwrapper);
+  env_detach_db(dwrapper);
+  // waits for a running async job or buffered write; queued jobs and
+  // later writes then see is_closed
+  enif_rwlock_rwlock(dwrapper->close_lock);
+  ups_status_t st = write_buffer_flush_pinned(dwrapper);
+  if (!st)
+    st = ups_db_close(dwrapper->db, 0);
+  if (!st) {
+    dwrapper->is_closed = true;
+    write_buffer_detach(dwrapper);
+  }
+  enif_rwlock_rwunlock(dwrapper->close_lock);
+  if (st) {
+    env_attach_db(dwrapper);
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+  }
+
+  bloom_save(dwrapper);
+  read_cache_detach(dwrapper);
+  bloom_detach(dwrapper);
+  codec_detach(dwrapper);
+  return (g_atom_ok);
+}
+
+ERL_NIF_TERM
+ups_nifs_db_flush_buffer(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  db_wrapper *dwrapper;
+
+  if (argc != 1)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
+          || dwrapper->is_closed)
     return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[2], g_ups_cursor_resource,
-                          (void **)&cwrapper1)
-          || cwrapper1->is_closed)
-    cwrapper1 = 0;
-  if (!enif_get_resource(env, argv[3], g_ups_cursor_resource,
-                          (void **)&cwrapper2)
-          || cwrapper2->is_closed)
-    cwrapper2 = 0;
 
-  ups_status_t st = uqi_select_range(ewrapper->env, query,
-                 cwrapper1 ? cwrapper1->cursor : 0,
-                 cwrapper2 ? cwrapper2->cursor : 0,
-                 &result);
+  ups_status_t st = write_buffer_flush(dwrapper);
   if (st)
     return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
-  result_wrapper *rwrapper = (result_wrapper *)enif_alloc_resource_compat(env,
-                                g_ups_result_resource, sizeof(*rwrapper));
-  rwrapper->result = result;
-  rwrapper->is_closed = false;
-  ERL_NIF_TERM retval = enif_make_resource(env, rwrapper);
-  enif_release_resource_compat(env, rwrapper);
-  return (enif_make_tuple2(env, g_atom_ok, retval));
+  return (g_atom_ok);
 }
 
 ERL_NIF_TERM
-ups_nifs_uqi_result_get_row_count(ErlNifEnv *env, int argc,
-                const ERL_NIF_TERM argv[])
+ups_nifs_db_cache_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  db_wrapper *dwrapper;
+  uint64_t counters[5] = {0, 0, 0, 0, 0};
+  static const char *names[5] = {
+    "hits", "misses", "evictions", "entries", "bytes"
+  };
+
+  if (argc != 1)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
+          || dwrapper->is_closed)
+    return (enif_make_badarg(env));
+
+  read_cache *cache = dwrapper->cache;
+  if (cache) {
+    counters[0] = cache->hits;
+    counters[1] = cache->misses;
+    counters[2] = cache->evictions;
+    for (int i = 0; i < READ_CACHE_SHARDS; i++) {
+      std::lock_guard<std::mutex> lock(cache->shards[i].mutex);
+      counters[3] += cache->shards[i].index.size();
+      counters[4] += cache->shards[i].size;
+    }
+  }
+
+  ERL_NIF_TERM map = enif_make_new_map(env);
+  for (int i = 0; i < 5; i++)
+    (void)enif_make_map_put(env, map, enif_make_atom(env, names[i]),
+                    enif_make_uint64(env, counters[i]), &map);
+  return (enif_make_tuple2(env, g_atom_ok, map));
+}
+
+ERL_NIF_TERM
+ups_nifs_db_bloom_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  db_wrapper *dwrapper;
+  uint64_t counters[5] = {0, 0, 0, 0, 0};
+  static const char *names[5] = {
+    "checks", "negatives", "false_positives", "bits", "hashes"
+  };
+
+  if (argc != 1)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
+          || dwrapper->is_closed)
+    return (enif_make_badarg(env));
+
+  bloom_filter *bloom = dwrapper->bloom;
+  if (bloom) {
+    counters[0] = bloom->checks;
+    counters[1] = bloom->negatives;
+    counters[2] = bloom->false_positives;
+    counters[3] = bloom->blocks * BLOOM_BLOCK_BITS;
+    counters[4] = bloom->hashes;
+  }
+
+  ERL_NIF_TERM map = enif_make_new_map(env);
+  for (int i = 0; i < 5; i++)
+    (void)enif_make_map_put(env, map, enif_make_atom(env, names[i]),
+                    enif_make_uint64(env, counters[i]), &map);
+  (void)enif_make_map_put(env, map, enif_make_atom(env, "ready"),
+                  enif_make_atom(env, bloom && bloom->ready
+                          ? "true" : "false"), &map);
+  return (enif_make_tuple2(env, g_atom_ok, map));
+}
+
+// Rewrites the records which start with a valid header as uncompressed
+// records, before a Database is trained for the first time; otherwise
+// they would be decoded once the Database has a dictionary. The caller
+// holds the close_lock.
+static ups_status_t
+codec_escape(db_wrapper *dwrapper)
+{
+  ups_cursor_t *cursor;
+  ups_key_t key = {0};
+  ups_record_t rec = {0};
+  std::vector<char> buffer;
+  uint16_t version;
+  uint32_t raw_size;
+
+  ups_status_t st = write_buffer_flush_pinned(dwrapper);
+  if (st)
+    return (st);
+  st = ups_cursor_create(&cursor, dwrapper->db, 0, 0);
+  if (st)
+    return (st);
+  while ((st = ups_cursor_move(cursor, &key, &rec, UPS_CURSOR_NEXT)) == 0) {
+    if (!codec_header(rec.data, rec.size, &version, &raw_size))
+      continue;
+    std::string cached((const char *)key.data, key.size);
+    buffer.resize(CODEC_HEADER_SIZE + rec.size);
+    codec_put_header((unsigned char *)buffer.data(), 0, rec.size);
+    memcpy(buffer.data() + CODEC_HEADER_SIZE, rec.data, rec.size);
+    ups_record_t escaped = {0};
+    escaped.data = buffer.data();
+    escaped.size = (uint32_t)buffer.size();
+    if ((st = ups_cursor_overwrite(cursor, &escaped, 0)))
+      break;
+    read_cache_invalidate(dwrapper, cached.data(), (uint32_t)cached.size());
+  }
+  (void)ups_cursor_close(cursor);
+  return (st == UPS_KEY_NOT_FOUND ? 0 : st);
+}
+
+// reservoir sampling of the (decompressed) records of a Database; the
+// caller holds the close_lock
+static ups_status_t
+codec_sample(db_wrapper *dwrapper, uint32_t sample_size,
+                std::vector<std::string> *samples)
+{
+  std::vector<char> decoded;
+  ups_cursor_t *cursor;
+  ups_key_t key = {0};
+  ups_record_t rec = {0};
+  uint64_t seen = 0;
+  uint64_t random = (uint64_t)enif_monotonic_time(ERL_NIF_NSEC) | 1;
+
+  ups_status_t st = write_buffer_flush_pinned(dwrapper);
+  if (st)
+    return (st);
+  st = ups_cursor_create(&cursor, dwrapper->db, 0, 0);
+  if (st)
+    return (st);
+  while ((st = ups_cursor_move(cursor, &key, &rec, UPS_CURSOR_NEXT)) == 0) {
+    random ^= random << 13;
+    random ^= random >> 7;
+    random ^= random << 17;
+    uint64_t slot = seen < sample_size ? seen : random % (seen + 1);
+    seen++;
+    if (slot >= sample_size)
+      continue;
+
+    const void *data = rec.data;
+    uint32_t size = rec.size;
+    if ((st = codec_decode(dwrapper, &data, &size, &decoded)))
+      break;
+    // very large records do not improve the dictionary
+    std::string sample((const char *)data,
+                    std::min(size, (uint32_t)CODEC_MAX_DICTIONARY));
+    if (slot < samples->size())
+      (*samples)[slot].swap(sample);
+    else
+      samples->push_back(sample);
+  }
+  (void)ups_cursor_close(cursor);
+  return (st == UPS_KEY_NOT_FOUND ? 0 : st);
+}
+
+// stores a new dictionary and activates it. The first training rewrites
+// the records which look like encoded records (see codec_escape); the
+// writers of the Environment wait at the write gate till the codec is
+// active, therefore no such record is written in the meantime.
+static ups_status_t
+codec_activate(db_wrapper *dwrapper, const std::string &dictionary,
+                uint16_t *version)
 {
-  result_wrapper *rwrapper;
+  env_wrapper *ewrapper = dwrapper->ewrapper;
+  ups_db_t *catalog;
 
-  if (argc != 1)
-    return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_result_resource,
-                          (void **)&rwrapper)
-          || rwrapper->is_closed)
-    return (enif_make_badarg(env));
+  // the dictionary is stored before it is used
+  ups_status_t st = codec_catalog(ewrapper, true, &catalog);
+  if (st)
+    return (st);
+
+  // concurrent trainings are serialized
+  std::lock_guard<std::mutex> training(g_codec_training_mutex);
+  record_codec *codec = dwrapper->codec;
+  if (codec)
+    enif_rwlock_rlock(ewrapper->write_gate);
+  else
+    enif_rwlock_rwlock(ewrapper->write_gate);
+  enif_rwlock_rlock(dwrapper->close_lock);
+
+  *version = (uint16_t)(codec ? codec->dictionaries.size() + 1 : 1);
+  unsigned char buffer[4];
+  ups_key_t key = {0};
+  ups_record_t rec = {0};
+  codec_catalog_key(dwrapper->name, *version, &buffer[0], &key);
+  rec.data = (void *)dictionary.data();
+  rec.size = (uint32_t)dictionary.size();
+  if (dwrapper->is_closed)
+    st = UPS_INV_PARAMETER;
+  else if (!*version)
+    st = UPS_LIMITS_REACHED;
+  else
+    st = ups_db_insert(catalog, 0, &key, &rec, UPS_OVERWRITE);
+  if (st) {
+    enif_rwlock_runlock(dwrapper->close_lock);
+    if (codec)
+      enif_rwlock_runlock(ewrapper->write_gate);
+    else
+      enif_rwlock_rwunlock(ewrapper->write_gate);
+    return (st);
+  }
 
-  uint32_t rc = uqi_result_get_row_count(rwrapper->result);
-  return (enif_make_tuple2(env, g_atom_ok, enif_make_int(env, (int)rc)));
+  // the dictionary is already stored, therefore the codec is activated
+  // even if not all records could be escaped
+  if (!codec)
+    st = codec_escape(dwrapper);
+
+  enif_mutex_lock(ewrapper->lock);
+  if (codec) {
+    enif_rwlock_rwlock(codec->lock);
+    codec->dictionaries.push_back(dictionary);
+    enif_rwlock_rwunlock(codec->lock);
+    enif_mutex_unlock(ewrapper->lock);
+    enif_rwlock_runlock(dwrapper->close_lock);
+    enif_rwlock_runlock(ewrapper->write_gate);
+  }
+  else {
+    codec = new record_codec;
+    codec->lock = enif_rwlock_create((char *)"ups_codec_lock");
+    codec->dictionaries.push_back(dictionary);
+    dwrapper->codec = codec;
+    enif_mutex_unlock(ewrapper->lock);
+    enif_rwlock_runlock(dwrapper->close_lock);
+    enif_rwlock_rwunlock(ewrapper->write_gate);
+  }
+  return (st);
 }
 
+// argv[1] is the number of records which are sampled, argv[2] the maximum
+// size of the dictionary. Returns {ok, #{version, dictionary_size,
+// samples}}.
 ERL_NIF_TERM
-ups_nifs_uqi_result_get_key_type(ErlNifEnv *env, int argc,
-                const ERL_NIF_TERM argv[])
+ups_nifs_db_train_codec(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  result_wrapper *rwrapper;
+  db_wrapper *dwrapper;
+  uint32_t sample_size;
+  uint32_t capacity;
 
-  if (argc != 1)
+  if (argc != 3)
     return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_result_resource,
-                          (void **)&rwrapper)
-          || rwrapper->is_closed)
+  if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
+          || dwrapper->is_closed)
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[1], &sample_size) || sample_size == 0)
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[2], &capacity) || capacity == 0
+          || capacity > CODEC_MAX_DICTIONARY)
     return (enif_make_badarg(env));
 
-  uint32_t rc = uqi_result_get_key_type(rwrapper->result);
-  return (enif_make_tuple2(env, g_atom_ok, enif_make_int(env, (int)rc)));
+  if (!codec_is_supported(dwrapper))
+    return (enif_make_tuple2(env, g_atom_error,
+                status_to_atom(env, UPS_INV_PARAMETER)));
+
+  // the records are sampled like any other read
+  std::vector<std::string> samples;
+  enif_rwlock_rlock(dwrapper->ewrapper->write_gate);
+  enif_rwlock_rlock(dwrapper->close_lock);
+  ups_status_t st = dwrapper->is_closed
+          ? UPS_INV_PARAMETER
+          : codec_sample(dwrapper, sample_size, &samples);
+  enif_rwlock_runlock(dwrapper->close_lock);
+  enif_rwlock_runlock(dwrapper->ewrapper->write_gate);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+  if (samples.empty())
+    return (enif_make_tuple2(env, g_atom_error,
+                status_to_atom(env, UPS_KEY_NOT_FOUND)));
+
+  std::string dictionary = codec_build_dictionary(samples, capacity);
+  // fills the rest (or all, if nothing repeats) with the last samples
+  for (size_t i = samples.size(); i > 0 && dictionary.size() < capacity; i--)
+    dictionary.insert(0, samples[i - 1], 0,
+                    std::min(samples[i - 1].size(),
+                        capacity - dictionary.size()));
+
+  uint16_t version;
+  st = codec_activate(dwrapper, dictionary, &version);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+
+  ERL_NIF_TERM map = enif_make_new_map(env);
+  (void)enif_make_map_put(env, map, enif_make_atom(env, "version"),
+                  enif_make_uint(env, version), &map);
+  (void)enif_make_map_put(env, map, enif_make_atom(env, "dictionary_size"),
+                  enif_make_uint64(env, dictionary.size()), &map);
+  (void)enif_make_map_put(env, map, enif_make_atom(env, "samples"),
+                  enif_make_uint64(env, samples.size()), &map);
+  return (enif_make_tuple2(env, g_atom_ok, map));
 }
 
 ERL_NIF_TERM
-ups_nifs_uqi_result_get_record_type(ErlNifEnv *env, int argc,
-                const ERL_NIF_TERM argv[])
+ups_nifs_env_close(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  result_wrapper *rwrapper;
+  env_wrapper *ewrapper;
 
   if (argc != 1)
     return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_result_resource,
-                          (void **)&rwrapper)
-          || rwrapper->is_closed)
+  if (!enif_get_resource(env, argv[0], g_ups_env_resource, (void **)&ewrapper)
+          || ewrapper->is_closed)
     return (enif_make_badarg(env));
 
-  uint32_t rc = uqi_result_get_record_type(rwrapper->result);
-  return (enif_make_tuple2(env, g_atom_ok, enif_make_int(env, (int)rc)));
+  backup_stop(ewrapper);
+
+  ups_status_t st = write_buffer_flush_env(ewrapper);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+
+  async_worker_stop(ewrapper);
+  group_commit_stop(ewrapper);
+  bloom_stop_env(ewrapper);
+  stream_stop_env(ewrapper);
+  codec_catalog_close(ewrapper);
+
+  st = ups_env_close(ewrapper->env, 0);
+  if (st) {
+    enif_mutex_lock(ewrapper->lock);
+    ewrapper->worker_stopped = false;
+    enif_mutex_unlock(ewrapper->lock);
+    group_commit_start(ewrapper);
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+  }
+
+  ewrapper->is_closed = true;
+  bloom_save_env(ewrapper);
+  return (g_atom_ok);
 }
 
+// argv[1] is the target path, argv[2] true for an incremental backup,
+// argv[3] the rate limit in bytes per second (0 if unlimited), argv[4] the
+// process which receives the messages and argv[5] the reference which tags
+// them
 ERL_NIF_TERM
-ups_nifs_uqi_result_get_key(ErlNifEnv *env, int argc,
-                const ERL_NIF_TERM argv[])
+ups_nifs_env_backup(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  int row;
-  result_wrapper *rwrapper;
-
-  if (argc != 2)
+  env_wrapper *ewrapper;
+  char target[MAX_STRING];
+  char incremental[8];
+  ErlNifUInt64 rate_limit;
+  ErlNifPid pid;
+  ups_parameter_t params[] = {
+    {UPS_PARAM_FILENAME, 0},
+    {0, 0}
+  };
+
+  if (argc != 6)
     return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_result_resource,
-                          (void **)&rwrapper)
-          || rwrapper->is_closed)
+  if (!enif_get_resource(env, argv[0], g_ups_env_resource, (void **)&ewrapper)
+          || ewrapper->is_closed)
     return (enif_make_badarg(env));
-  if (!enif_get_int(env, argv[1], &row))
+  if (enif_get_string(env, argv[1], &target[0], sizeof(target),
+              ERL_NIF_LATIN1) <= 0)
+    return (enif_make_badarg(env));
+  if (!enif_get_atom(env, argv[2], &incremental[0], sizeof(incremental),
+              ERL_NIF_LATIN1))
+    return (enif_make_badarg(env));
+  if (!enif_get_uint64(env, argv[3], &rate_limit))
+    return (enif_make_badarg(env));
+  if (!enif_get_local_pid(env, argv[4], &pid))
+    return (enif_make_badarg(env));
+  if (!enif_is_ref(env, argv[5]))
     return (enif_make_badarg(env));
 
-  ups_key_t key = {0};
-  uqi_result_get_key(rwrapper->result, row, &key);
+  // in-memory Environments do not have a file
+  if ((ewrapper->flags & UPS_IN_MEMORY)
+      || ups_env_get_parameters(ewrapper->env, &params[0]) != 0
+      || !params[0].value)
+    return (enif_make_tuple2(env, g_atom_error,
+                status_to_atom(env, UPS_INV_PARAMETER)));
 
-  ErlNifBinary bin;
-  if (!enif_alloc_binary(key.size, &bin))
+  enif_mutex_lock(ewrapper->lock);
+  backup_job *previous = ewrapper->backup;
+  if (previous && !previous->done) {
+    enif_mutex_unlock(ewrapper->lock);
     return (enif_make_tuple2(env, g_atom_error,
-                status_to_atom(env, UPS_OUT_OF_MEMORY)));
-  memcpy(bin.data, key.data, key.size);
-  bin.size = key.size;
+                status_to_atom(env, UPS_WOULD_BLOCK)));
+  }
 
-  return (enif_make_tuple2(env, g_atom_ok, enif_make_binary(env, &bin)));
+  backup_job *job = new backup_job;
+  job->ewrapper = ewrapper;
+  job->source = (const char *)params[0].value;
+  job->target = target;
+  job->incremental = !strcmp(incremental, "true");
+  job->rate_limit = rate_limit;
+  job->pid = pid;
+  job->ref = enif_make_copy(job->env, argv[5]);
+  ewrapper->backup = job;
+  enif_mutex_unlock(ewrapper->lock);
+
+  // the thread of the previous backup has finished
+  if (previous) {
+    enif_thread_join(previous->tid, 0);
+    delete previous;
+  }
+
+  if (enif_thread_create((char *)"ups_backup", &job->tid, backup_run, job,
+                          0)) {
+    enif_mutex_lock(ewrapper->lock);
+    ewrapper->backup = 0;
+    enif_mutex_unlock(ewrapper->lock);
+    delete job;
+    return (enif_make_tuple2(env, g_atom_error,
+                status_to_atom(env, UPS_INTERNAL_ERROR)));
+  }
+  return (g_atom_ok);
 }
 
 ERL_NIF_TERM
-ups_nifs_uqi_result_get_record(ErlNifEnv *env, int argc,
-                const ERL_NIF_TERM argv[])
+ups_nifs_cursor_create(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  int row;
-  result_wrapper *rwrapper;
+  db_wrapper *dwrapper;
+  txn_wrapper *twrapper;
 
   if (argc != 2)
     return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_result_resource,
-                          (void **)&rwrapper)
-          || rwrapper->is_closed)
+  if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
+          || dwrapper->is_closed)
     return (enif_make_badarg(env));
-  if (!enif_get_int(env, argv[1], &row))
+  if (!enif_get_resource(env, argv[1], g_ups_txn_resource, (void **)&twrapper))
+    twrapper = 0;
+  if (twrapper && twrapper->is_closed)
     return (enif_make_badarg(env));
 
-  ups_record_t record = {0};
-  uqi_result_get_record(rwrapper->result, row, &record);
+  // cursors read the btree
+  ups_status_t st = write_buffer_flush(dwrapper);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
-  ErlNifBinary bin;
-  if (!enif_alloc_binary(record.size, &bin))
-    return (enif_make_tuple2(env, g_atom_error,
-                status_to_atom(env, UPS_OUT_OF_MEMORY)));
-  memcpy(bin.data, record.data, record.size);
-  bin.size = record.size;
+  ups_cursor_t *cursor;
+  st = ups_cursor_create(&cursor, dwrapper->db,
+                  twrapper ? twrapper ->txn : 0, 0);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
-  return (enif_make_tuple2(env, g_atom_ok, enif_make_binary(env, &bin)));
+  cursor_wrapper *cwrapper = (cursor_wrapper *)enif_alloc_resource_compat(env,
+                                g_ups_cursor_resource, sizeof(*cwrapper));
+  cwrapper->cursor = cursor;
+  cwrapper->is_closed = false;
+  cwrapper->in_txn = twrapper != 0;
+  cwrapper->dwrapper = dwrapper;
+  enif_keep_resource(dwrapper);
+  ERL_NIF_TERM result = enif_make_resource(env, cwrapper);
+  enif_release_resource_compat(env, cwrapper);
+
+  return (enif_make_tuple2(env, g_atom_ok, result));
 }
 
 ERL_NIF_TERM
-ups_nifs_uqi_result_close(ErlNifEnv *env, int argc,
-                const ERL_NIF_TERM argv[])
+ups_nifs_cursor_clone(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  result_wrapper *rwrapper;
+  cursor_wrapper *cwrapper;
 
   if (argc != 1)
     return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_result_resource,
-                          (void **)&rwrapper)
-          || rwrapper->is_closed)
+  if (!enif_get_resource(env, argv[0], g_ups_cursor_resource,
+              (void **)&cwrapper)
+          || cwrapper->is_closed)
     return (enif_make_badarg(env));
 
-  uqi_result_close(rwrapper->result);
-  rwrapper->is_closed = true;
+  ups_cursor_t *clone;
+  ups_status_t st = ups_cursor_clone(cwrapper->cursor, &clone);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
-  return (g_atom_ok);
+  cursor_wrapper *c2wrapper = (cursor_wrapper *)enif_alloc_resource_compat(env,
+                                g_ups_cursor_resource, sizeof(*c2wrapper));
+  c2wrapper->cursor = clone;
+  c2wrapper->is_closed = false;
+  c2wrapper->in_txn = cwrapper->in_txn;
+  c2wrapper->dwrapper = cwrapper->dwrapper;
+  enif_keep_resource(c2wrapper->dwrapper);
+  ERL_NIF_TERM result = enif_make_resource(env, c2wrapper);
+  enif_release_resource_compat(env, c2wrapper);
+
+  return (enif_make_tuple2(env, g_atom_ok, result));
 }
 
 ERL_NIF_TERM
-ups_nifs_env_rename_db(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ups_nifs_cursor_move(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  uint32_t oldname;
-  uint32_t newname;
-  env_wrapper *ewrapper;
+  cursor_wrapper *cwrapper;
+  uint32_t flags;
 
-  if (argc != 3)
-    return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_env_resource, (void **)&ewrapper)
-          || ewrapper->is_closed)
+  if (argc != 2)
     return (enif_make_badarg(env));
-  if (!enif_get_uint(env, argv[1], &oldname))
+  if (!enif_get_resource(env, argv[0], g_ups_cursor_resource,
+              (void **)&cwrapper)
+          || cwrapper->is_closed)
     return (enif_make_badarg(env));
-  if (!enif_get_uint(env, argv[2], &newname))
+  if (!enif_get_uint(env, argv[1], &flags))
     return (enif_make_badarg(env));
 
-  ups_status_t st = ups_env_rename_db(ewrapper->env, oldname, newname, 0);
+  // the cursor reads the btree
+  ups_status_t st = write_buffer_flush(cwrapper->dwrapper);
   if (st)
     return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
-  return (g_atom_ok);
+  ups_key_t key = {0};
+  ups_record_t rec = {0};
+
+  if (cwrapper->dwrapper->zero_copy_threshold) {
+    st = ups_cursor_move(cwrapper->cursor, &key, 0, flags);
+    if (st)
+      return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+    ERL_NIF_TERM k = make_key_term(env, cwrapper->dwrapper, key.data,
+                    key.size);
+    ERL_NIF_TERM record;
+    st = cursor_record_term(env, cwrapper->cursor, cwrapper->dwrapper,
+                    &record);
+    if (st)
+      return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+    return (enif_make_tuple3(env, g_atom_ok, k, record));
+  }
+
+  db_wrapper *dwrapper = cwrapper->dwrapper;
+  ERL_NIF_TERM record;
+  st = ups_cursor_move(cwrapper->cursor, &key, &rec, flags);
+  if (!st)
+    st = make_record_term(env, dwrapper, rec.data, rec.size, &record);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+
+  return (enif_make_tuple3(env, g_atom_ok,
+              make_key_term(env, dwrapper, key.data, key.size), record));
 }
 
+// set in argv[4] of ups_nifs_cursor_fold if argv[2] is a tuple prefix of
+// term keys
+#define FOLD_PREFIX   0x10000
+
+// Returns up to |ChunkSize| key/record pairs of a range; the keys and
+// records are packed into a single binary. argv[1] is the start key,
+// 'undefined' (start at the first/last key) or 'continue' (continue from
+// the current position), argv[2] the (exclusive) end key or 'undefined',
+// argv[4] is either UPS_CURSOR_NEXT or UPS_CURSOR_PREVIOUS. With
+// FOLD_PREFIX, the range are the keys which start with the prefix argv[2]
+// and argv[1] is 'undefined' or 'continue'.
+// Returns {ok, Pairs, More}; stops early if the timeslice is used up.
 ERL_NIF_TERM
-ups_nifs_db_insert(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ups_nifs_cursor_fold(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  ups_key_t key = {0};
-  ups_record_t rec = {0};
-  uint32_t flags;
-  ErlNifBinary binkey;
-  ErlNifBinary binrec;
-  db_wrapper *dwrapper;
-  txn_wrapper *twrapper;
+  cursor_wrapper *cwrapper;
+  ErlNifBinary binstart;
+  ErlNifBinary binend;
+  typed_value startval;
+  typed_value endval;
+  bool has_start = false;
+  bool has_end = false;
+  bool is_continue = false;
+  uint32_t chunk_size;
+  uint32_t direction;
 
   if (argc != 5)
     return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
-          || dwrapper->is_closed)
-    return (enif_make_badarg(env));
-  // arg[1] is the Transaction!
-  if (!enif_get_resource(env, argv[1], g_ups_txn_resource, (void **)&twrapper))
-    twrapper = 0;
-  if (twrapper != 0 && twrapper->is_closed)
+  if (!enif_get_resource(env, argv[0], g_ups_cursor_resource,
+              (void **)&cwrapper)
+          || cwrapper->is_closed)
     return (enif_make_badarg(env));
-  if (!enif_inspect_binary(env, argv[2], &binkey))
+  db_wrapper *dwrapper = cwrapper->dwrapper;
+  if (!enif_get_uint(env, argv[3], &chunk_size) || chunk_size == 0)
     return (enif_make_badarg(env));
-  if (!enif_inspect_binary(env, argv[3], &binrec))
+  if (!enif_get_uint(env, argv[4], &direction))
     return (enif_make_badarg(env));
-  if (!enif_get_uint(env, argv[4], &flags))
+  bool is_prefix = (direction & FOLD_PREFIX) != 0;
+  direction &= ~FOLD_PREFIX;
+  if (direction != UPS_CURSOR_NEXT && direction != UPS_CURSOR_PREVIOUS)
     return (enif_make_badarg(env));
+  bool forward = direction == UPS_CURSOR_NEXT;
+
+  // 'undefined' and 'continue' are valid term keys; they are checked first
+  ERL_NIF_TERM undefined = enif_make_atom(env, "undefined");
+  if (enif_is_identical(argv[1], enif_make_atom(env, "continue")))
+    is_continue = true;
+  else if (!enif_is_identical(argv[1], undefined)) {
+    if (is_prefix || !get_key_binary(env, argv[1], dwrapper, &startval,
+                  &binstart))
+      return (enif_make_badarg(env));
+    has_start = true;
+  }
 
-  key.size = binkey.size;
-  key.data = binkey.size ? binkey.data : 0;
-  rec.size = binrec.size;
-  rec.data = binrec.size ? binrec.data : 0;
+  std::string low, high;
+  if (is_prefix) {
+    if (!dwrapper->term_keys)
+      return (enif_make_tuple2(env, g_atom_error,
+                  status_to_atom(env, UPS_INV_PARAMETER)));
+    if (!term_key_encode_prefix(env, argv[2], &low, &high))
+      return (enif_make_badarg(env));
+    const std::string &first = forward ? low : high;
+    const std::string &last = forward ? high : low;
+    binstart.data = (unsigned char *)first.data();
+    binstart.size = first.size();
+    binend.data = (unsigned char *)last.data();
+    binend.size = last.size();
+    has_start = !is_continue;
+    has_end = true;
+  }
+  else if (!enif_is_identical(argv[2], undefined)) {
+    if (!get_key_binary(env, argv[2], dwrapper, &endval, &binend))
+      return (enif_make_badarg(env));
+    has_end = true;
+  }
 
-  ups_status_t st = ups_db_insert(dwrapper->db, twrapper ? twrapper->txn : 0,
-                                &key, &rec, flags);
+  // the cursor reads the btree
+  ups_status_t st = write_buffer_flush(dwrapper);
   if (st)
     return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
-  return (g_atom_ok);
+  uint32_t key_type = dwrapper->key_type;
+  ups_key_t key = {0};
+  ups_record_t rec = {0};
+
+  if (is_continue)
+    st = ups_cursor_move(cwrapper->cursor, &key, &rec, direction);
+  else if (has_start) {
+    key.data = binstart.data;
+    key.size = binstart.size;
+    st = ups_cursor_find(cwrapper->cursor, &key, &rec,
+                    forward ? UPS_FIND_GEQ_MATCH : UPS_FIND_LEQ_MATCH);
+  }
+  else
+    st = ups_cursor_move(cwrapper->cursor, &key, &rec,
+                    forward ? UPS_CURSOR_FIRST : UPS_CURSOR_LAST);
+
+  packed_binary packed(chunk_size > 64 ? 64 * 1024 : 4 * 1024);
+  std::vector<char> decoded;       // decompressed records
+  ErlNifTime start = enif_monotonic_time(ERL_NIF_USEC);
+  bool more = true;
+  uint32_t count = 0;
+
+  while (true) {
+    if (st == UPS_KEY_NOT_FOUND) {
+      more = false;
+      break;
+    }
+    if (st)
+      return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+    if (has_end) {
+      int cmp = compare_keys(key_type, key.data, key.size,
+                      binend.data, binend.size);
+      if (forward ? cmp >= 0 : cmp <= 0) {
+        more = false;
+        break;
+      }
+    }
+
+    const void *data = rec.data;
+    uint32_t size = rec.size;
+    st = codec_decode(dwrapper, &data, &size, &decoded);
+    if (st)
+      return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+    if (!packed.append_key(env, dwrapper, key.data, key.size)
+        || !packed.append_value(env, dwrapper->typed_terms,
+                dwrapper->record_type, data, size))
+      return (enif_make_tuple2(env, g_atom_error,
+                  status_to_atom(env, UPS_OUT_OF_MEMORY)));
+
+    if (++count == chunk_size)
+      break;
+    if (count % YIELD_INTERVAL == 0 && consume_timeslice(env, &start))
+      break;
+
+    st = ups_cursor_move(cwrapper->cursor, &key, &rec, direction);
+  }
+
+  std::vector<ERL_NIF_TERM> terms;
+  packed.make_terms(env, terms);
+  std::vector<ERL_NIF_TERM> pairs(count);
+  for (uint32_t i = 0; i < count; i++)
+    pairs[i] = enif_make_tuple2(env, terms[2 * i], terms[2 * i + 1]);
+
+  return (enif_make_tuple3(env, g_atom_ok,
+              enif_make_list_from_array(env, pairs.data(), count),
+              enif_make_atom(env, more ? "true" : "false")));
 }
 
 ERL_NIF_TERM
-ups_nifs_db_erase(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ups_nifs_cursor_overwrite(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  ups_key_t key = {0};
-  ErlNifBinary binkey;
-  db_wrapper *dwrapper;
-  txn_wrapper *twrapper;
+  cursor_wrapper *cwrapper;
+  ErlNifBinary binrec;
+  typed_value recval;
 
-  if (argc != 3)
-    return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
-          || dwrapper->is_closed)
+  if (argc != 2)
     return (enif_make_badarg(env));
-  // arg[1] is the Transaction!
-  if (!enif_get_resource(env, argv[1], g_ups_txn_resource, (void **)&twrapper))
-    twrapper = 0;
-  if (twrapper != 0 && twrapper->is_closed)
+  if (!enif_get_resource(env, argv[0], g_ups_cursor_resource,
+              (void **)&cwrapper)
+          || cwrapper->is_closed)
     return (enif_make_badarg(env));
-  if (!enif_inspect_binary(env, argv[2], &binkey))
+  if (!get_typed_binary(env, argv[1], cwrapper->dwrapper->record_type,
+                &recval, &binrec))
     return (enif_make_badarg(env));
 
-  key.data = binkey.data;
-  key.size = binkey.size;
+  ups_record_t rec = {0};
+  rec.data = binrec.data;
+  rec.size = binrec.size;
+  std::vector<char> encoded;
+  codec_encode(cwrapper->dwrapper, &rec, &encoded);
+
+  // the cursor writes the btree
+  ups_status_t st = write_buffer_flush(cwrapper->dwrapper);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
-  ups_status_t st = ups_db_erase(dwrapper->db, twrapper ? twrapper->txn : 0,
-                        &key, 0);
+  std::string cached = cursor_current_key(cwrapper);
+  st = ups_cursor_overwrite(cwrapper->cursor, &rec, 0);
+  if (!cwrapper->in_txn)
+    st = env_sync(cwrapper->dwrapper->ewrapper, st);
   if (st)
     return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
+  read_cache_invalidate(cwrapper->dwrapper, cached.data(),
+                  (uint32_t)cached.size());
+
   return (g_atom_ok);
 }
 
 ERL_NIF_TERM
-ups_nifs_db_find(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ups_nifs_cursor_find(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  ups_key_t key = {0};
-  ups_record_t rec = {0};
+  cursor_wrapper *cwrapper;
   ErlNifBinary binkey;
-  ErlNifBinary binrec;
-  db_wrapper *dwrapper;
-  txn_wrapper *twrapper;
+  typed_value keyval;
 
-  if (argc != 3)
-    return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
-          || dwrapper->is_closed)
+  if (argc != 2)
     return (enif_make_badarg(env));
-  // argv[1] is the Transaction!
-  if (!enif_get_resource(env, argv[1], g_ups_txn_resource, (void **)&twrapper))
-    twrapper = 0;
-  if (twrapper != 0 && twrapper->is_closed)
+  if (!enif_get_resource(env, argv[0], g_ups_cursor_resource,
+              (void **)&cwrapper)
+          || cwrapper->is_closed)
     return (enif_make_badarg(env));
-  if (!enif_inspect_binary(env, argv[2], &binkey))
+  if (!get_key_binary(env, argv[1], cwrapper->dwrapper,
+                &keyval, &binkey))
     return (enif_make_badarg(env));
 
+  // the cursor reads the btree
+  ups_status_t st = write_buffer_flush(cwrapper->dwrapper);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+
+  ups_record_t rec = {0};
+  ups_key_t key = {0};
   key.data = binkey.data;
   key.size = binkey.size;
 
-  ups_status_t st = ups_db_find(dwrapper->db, twrapper ? twrapper->txn : 0,
-                                &key, &rec, 0);
+  if (cwrapper->dwrapper->zero_copy_threshold) {
+    ERL_NIF_TERM record;
+    st = ups_cursor_find(cwrapper->cursor, &key, 0, 0);
+    if (st == 0)
+      st = cursor_record_term(env, cwrapper->cursor, cwrapper->dwrapper,
+                      &record);
+    if (st)
+      return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+    return (enif_make_tuple2(env, g_atom_ok, record));
+  }
+
+  ERL_NIF_TERM record;
+  st = ups_cursor_find(cwrapper->cursor, &key, &rec, 0);
+  if (!st)
+    st = make_record_term(env, cwrapper->dwrapper, rec.data, rec.size,
+                    &record);
   if (st)
     return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
-  if (!enif_alloc_binary(rec.size, &binrec))
-    return (enif_make_tuple2(env, g_atom_error,
-                status_to_atom(env, UPS_OUT_OF_MEMORY)));
-
-  memcpy(binrec.data, rec.data, rec.size);
-  binrec.size = rec.size;
-
-  return (enif_make_tuple2(env, g_atom_ok, enif_make_binary(env, &binrec)));
+  return (enif_make_tuple2(env, g_atom_ok, record));
 }
 
 ERL_NIF_TERM
-ups_nifs_db_find_flags(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ups_nifs_cursor_insert(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  ups_key_t key = {0};
-  ups_record_t rec = {0};
-  uint32_t flags = 0;
+  cursor_wrapper *cwrapper;
   ErlNifBinary binkey;
   ErlNifBinary binrec;
-  db_wrapper *dwrapper;
-  txn_wrapper *twrapper;
+  typed_value keyval;
+  typed_value recval;
+  uint32_t flags;
 
   if (argc != 4)
     return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
-          || dwrapper->is_closed)
+  if (!enif_get_resource(env, argv[0], g_ups_cursor_resource,
+              (void **)&cwrapper)
+          || cwrapper->is_closed)
     return (enif_make_badarg(env));
-  // argv[1] is the Transaction!
-  if (!enif_get_resource(env, argv[1], g_ups_txn_resource, (void **)&twrapper))
-    twrapper = 0;
-  if (twrapper != 0 && twrapper->is_closed)
+  if (!get_key_binary(env, argv[1], cwrapper->dwrapper,
+                &keyval, &binkey))
     return (enif_make_badarg(env));
-  if (!enif_inspect_binary(env, argv[2], &binkey))
+  if (!get_typed_binary(env, argv[2], cwrapper->dwrapper->record_type,
+                &recval, &binrec))
     return (enif_make_badarg(env));
   if (!enif_get_uint(env, argv[3], &flags))
     return (enif_make_badarg(env));
 
+  ups_key_t key = {0};
   key.data = binkey.data;
   key.size = binkey.size;
+  ups_record_t rec = {0};
+  rec.data = binrec.data;
+  rec.size = binrec.size;
+  std::vector<char> encoded;
+  codec_encode(cwrapper->dwrapper, &rec, &encoded);
 
-  ups_status_t st = ups_db_find(dwrapper->db, twrapper ? twrapper->txn : 0,
-                                &key, &rec, flags);
+  // the cursor writes the btree
+  ups_status_t st = write_buffer_flush(cwrapper->dwrapper);
   if (st)
     return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
-  if (!enif_alloc_binary(rec.size, &binrec))
-    return (enif_make_tuple2(env, g_atom_error,
-                status_to_atom(env, UPS_OUT_OF_MEMORY)));
-  if (flags) {
-    if (!enif_alloc_binary(key.size, &binkey))
-      return (enif_make_tuple2(env, g_atom_error,
-                  status_to_atom(env, UPS_OUT_OF_MEMORY)));
-    memcpy(binkey.data, key.data, key.size);
-  }
+  bloom_add(cwrapper->dwrapper, key.data, key.size);
+  st = ups_cursor_insert(cwrapper->cursor, &key, &rec, flags);
+  if (!cwrapper->in_txn)
+    st = env_sync(cwrapper->dwrapper->ewrapper, st);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
-  memcpy(binrec.data, rec.data, rec.size);
-  binrec.size = rec.size;
+  read_cache_invalidate(cwrapper->dwrapper, key.data, key.size);
 
-  return (enif_make_tuple3(env, g_atom_ok,
-              enif_make_binary(env, &binkey),
-              enif_make_binary(env, &binrec)));
+  return (g_atom_ok);
 }
 
 ERL_NIF_TERM
-ups_nifs_txn_begin(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ups_nifs_cursor_erase(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  env_wrapper *ewrapper;
-  uint32_t flags;
+  cursor_wrapper *cwrapper;
 
-  if (argc != 2)
-    return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_env_resource, (void **)&ewrapper)
-          || ewrapper->is_closed)
+  if (argc != 1)
     return (enif_make_badarg(env));
-  if (!enif_get_uint(env, argv[1], &flags))
+  if (!enif_get_resource(env, argv[0], g_ups_cursor_resource,
+              (void **)&cwrapper)
+          || cwrapper->is_closed)
     return (enif_make_badarg(env));
 
-  ups_txn_t *txn;
-  ups_status_t st = ups_txn_begin(&txn, ewrapper->env, 0, 0, flags);
+  // the cursor writes the btree
+  ups_status_t st = write_buffer_flush(cwrapper->dwrapper);
   if (st)
     return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
-  txn_wrapper *twrapper = (txn_wrapper *)enif_alloc_resource_compat(env,
-                                g_ups_txn_resource, sizeof(*twrapper));
-  twrapper->txn = txn;
-  twrapper->is_closed = false;
-  ERL_NIF_TERM result = enif_make_resource(env, twrapper);
-  enif_release_resource_compat(env, twrapper);
+  std::string cached = cursor_current_key(cwrapper);
+  st = ups_cursor_erase(cwrapper->cursor, 0);
+  if (!cwrapper->in_txn)
+    st = env_sync(cwrapper->dwrapper->ewrapper, st);
+  if (st)
+    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
-  return (enif_make_tuple2(env, g_atom_ok, result));
+  read_cache_invalidate(cwrapper->dwrapper, cached.data(),
+                  (uint32_t)cached.size());
+
+  return (g_atom_ok);
 }
 
 ERL_NIF_TERM
-ups_nifs_txn_abort(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ups_nifs_cursor_get_duplicate_count(ErlNifEnv *env, int argc,
+        const ERL_NIF_TERM argv[])
 {
-  txn_wrapper *twrapper;
+  cursor_wrapper *cwrapper;
 
   if (argc != 1)
     return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_txn_resource, (void **)&twrapper)
-          || twrapper->is_closed)
+  if (!enif_get_resource(env, argv[0], g_ups_cursor_resource,
+              (void **)&cwrapper)
+          || cwrapper->is_closed)
     return (enif_make_badarg(env));
 
-  ups_status_t st = ups_txn_abort(twrapper->txn, 0);
+  uint32_t count;
+  ups_status_t st = ups_cursor_get_duplicate_count(cwrapper->cursor, &count, 0);
   if (st)
     return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
-  twrapper->is_closed = true;
-  return (g_atom_ok);
+  return (enif_make_tuple2(env, g_atom_ok, enif_make_int(env, (int)count)));
 }
 
 ERL_NIF_TERM
-ups_nifs_txn_commit(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ups_nifs_cursor_get_record_size(ErlNifEnv *env, int argc,
+        const ERL_NIF_TERM argv[])
 {
-  txn_wrapper *twrapper;
+  cursor_wrapper *cwrapper;
 
   if (argc != 1)
     return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_txn_resource, (void **)&twrapper)
-          || twrapper->is_closed)
+  if (!enif_get_resource(env, argv[0], g_ups_cursor_resource,
+              (void **)&cwrapper)
+          || cwrapper->is_closed)
     return (enif_make_badarg(env));
 
-  ups_status_t st = ups_txn_commit(twrapper->txn, 0);
+  uint32_t size;
+  ups_status_t st = ups_cursor_get_record_size(cwrapper->cursor, &size);
   if (st)
     return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
-  twrapper->is_closed = true;
-  return (g_atom_ok);
+  // compressed records store their original size in the header
+  ups_record_t rec = {0};
+  uint16_t version;
+  uint32_t raw_size;
+  if (cwrapper->dwrapper->codec
+      && ups_cursor_move(cwrapper->cursor, 0, &rec, 0) == 0
+      && codec_header(rec.data, rec.size, &version, &raw_size))
+    size = raw_size;
+
+  return (enif_make_tuple2(env, g_atom_ok, enif_make_int64(env, (int)size)));
 }
 
 ERL_NIF_TERM
-ups_nifs_db_close(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ups_nifs_cursor_close(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  db_wrapper *dwrapper;
+  cursor_wrapper *cwrapper;
 
   if (argc != 1)
     return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
-          || dwrapper->is_closed)
+  if (!enif_get_resource(env, argv[0], g_ups_cursor_resource,
+              (void **)&cwrapper)
+          || cwrapper->is_closed)
     return (enif_make_badarg(env));
 
-  ups_status_t st = ups_db_close(dwrapper->db, 0);
+  ups_status_t st = ups_cursor_close(cwrapper->cursor);
   if (st)
     return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
-  dwrapper->is_closed = true;
+  cwrapper->is_closed = true;
   return (g_atom_ok);
 }
 
 ERL_NIF_TERM
-ups_nifs_env_close(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ups_nifs_async_insert(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  env_wrapper *ewrapper;
+  uint32_t flags;
+  db_wrapper *dwrapper;
+  txn_wrapper *twrapper;
 
-  if (argc != 1)
+  if (argc != 5)
     return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_env_resource, (void **)&ewrapper)
-          || ewrapper->is_closed)
+  if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
+          || dwrapper->is_closed)
+    return (enif_make_badarg(env));
+  // arg[1] is the Transaction!
+  if (!enif_get_resource(env, argv[1], g_ups_txn_resource, (void **)&twrapper))
+    twrapper = 0;
+  if (twrapper != 0 && twrapper->is_closed)
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[4], &flags))
     return (enif_make_badarg(env));
 
-  ups_status_t st = ups_env_close(ewrapper->env, 0);
+  // the worker accesses the btree directly
+  ups_status_t st = write_buffer_flush(dwrapper);
   if (st)
     return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
-  ewrapper->is_closed = true;
-  return (g_atom_ok);
+  async_job *job = async_job_create(env, ASYNC_INSERT, dwrapper, twrapper);
+  if (!get_key_binary(job->msg_env, enif_make_copy(job->msg_env, argv[2]),
+                dwrapper, &job->key_value, &job->key)
+      || !get_typed_binary(job->msg_env, enif_make_copy(job->msg_env, argv[3]),
+                dwrapper->record_type, &job->record_value, &job->record)) {
+    async_job_destroy(job);
+    return (enif_make_badarg(env));
+  }
+  job->flags = flags;
+
+  ERL_NIF_TERM ref = enif_make_copy(env, job->ref);
+  if (!async_worker_push(dwrapper->ewrapper, job)) {
+    async_job_destroy(job);
+    return (enif_make_badarg(env));
+  }
+  return (enif_make_tuple2(env, g_atom_ok, ref));
 }
 
 ERL_NIF_TERM
-ups_nifs_cursor_create(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ups_nifs_async_find(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
+  uint32_t flags;
   db_wrapper *dwrapper;
   txn_wrapper *twrapper;
 
-  if (argc != 2)
+  if (argc != 4)
     return (enif_make_badarg(env));
   if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
           || dwrapper->is_closed)
     return (enif_make_badarg(env));
+  // arg[1] is the Transaction!
   if (!enif_get_resource(env, argv[1], g_ups_txn_resource, (void **)&twrapper))
     twrapper = 0;
-  if (twrapper && twrapper->is_closed)
+  if (twrapper != 0 && twrapper->is_closed)
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[3], &flags))
     return (enif_make_badarg(env));
 
-  ups_cursor_t *cursor;
-  ups_status_t st = ups_cursor_create(&cursor, dwrapper->db,
-                                    twrapper ? twrapper ->txn : 0, 0);
+  // the worker accesses the btree directly
+  ups_status_t st = write_buffer_flush(dwrapper);
   if (st)
     return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
-  cursor_wrapper *cwrapper = (cursor_wrapper *)enif_alloc_resource_compat(env,
-                                g_ups_cursor_resource, sizeof(*cwrapper));
-  cwrapper->cursor = cursor;
-  cwrapper->is_closed = false;
-  ERL_NIF_TERM result = enif_make_resource(env, cwrapper);
-  enif_release_resource_compat(env, cwrapper);
+  async_job *job = async_job_create(env, ASYNC_FIND, dwrapper, twrapper);
+  if (!get_key_binary(job->msg_env, enif_make_copy(job->msg_env, argv[2]),
+                dwrapper, &job->key_value, &job->key)) {
+    async_job_destroy(job);
+    return (enif_make_badarg(env));
+  }
+  job->flags = flags;
 
-  return (enif_make_tuple2(env, g_atom_ok, result));
+  ERL_NIF_TERM ref = enif_make_copy(env, job->ref);
+  if (!async_worker_push(dwrapper->ewrapper, job)) {
+    async_job_destroy(job);
+    return (enif_make_badarg(env));
+  }
+  return (enif_make_tuple2(env, g_atom_ok, ref));
 }
 
 ERL_NIF_TERM
-ups_nifs_cursor_clone(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ups_nifs_async_erase(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  cursor_wrapper *cwrapper;
+  db_wrapper *dwrapper;
+  txn_wrapper *twrapper;
 
-  if (argc != 1)
+  if (argc != 3)
     return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_cursor_resource,
-              (void **)&cwrapper)
-          || cwrapper->is_closed)
+  if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
+          || dwrapper->is_closed)
     return (enif_make_badarg(env));
-
-  ups_cursor_t *clone;
-  ups_status_t st = ups_cursor_clone(cwrapper->cursor, &clone);
+  // arg[1] is the Transaction!
+  if (!enif_get_resource(env, argv[1], g_ups_txn_resource, (void **)&twrapper))
+    twrapper = 0;
+  if (twrapper != 0 && twrapper->is_closed)
+    return (enif_make_badarg(env));
+  // the worker accesses the btree directly
+  ups_status_t st = write_buffer_flush(dwrapper);
   if (st)
     return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
-  cursor_wrapper *c2wrapper = (cursor_wrapper *)enif_alloc_resource_compat(env,
-                                g_ups_cursor_resource, sizeof(*c2wrapper));
-  c2wrapper->cursor = clone;
-  c2wrapper->is_closed = false;
-  ERL_NIF_TERM result = enif_make_resource(env, c2wrapper);
-  enif_release_resource_compat(env, c2wrapper);
+  async_job *job = async_job_create(env, ASYNC_ERASE, dwrapper, twrapper);
+  if (!get_key_binary(job->msg_env, enif_make_copy(job->msg_env, argv[2]),
+                dwrapper, &job->key_value, &job->key)) {
+    async_job_destroy(job);
+    return (enif_make_badarg(env));
+  }
 
-  return (enif_make_tuple2(env, g_atom_ok, result));
+  ERL_NIF_TERM ref = enif_make_copy(env, job->ref);
+  if (!async_worker_push(dwrapper->ewrapper, job)) {
+    async_job_destroy(job);
+    return (enif_make_badarg(env));
+  }
+  return (enif_make_tuple2(env, g_atom_ok, ref));
+}
+
+//
+// Streaming range scans
+//
+// ups_nifs_stream_range starts a producer thread which walks a range with
+// its own cursor and sends the pairs in batches to a process. The producer
+// only runs ahead by the number of batches that the consumer granted
+// (ups_nifs_stream_ack), therefore memory consumption is bounded regardless
+// of the size of the range.
+//
+
+static void
+stream_send(stream_state *state, ErlNifEnv *msg_env, ERL_NIF_TERM event)
+{
+  ERL_NIF_TERM msg = enif_make_tuple3(msg_env,
+                  enif_make_atom(msg_env, "ups_stream"),
+                  enif_make_copy(msg_env, state->ref), event);
+  (void)enif_send(0, &state->pid, msg_env, msg);
+  enif_clear_env(msg_env);
+}
+
+// the caller holds the close_lock of the Database and of the Transaction
+static bool
+stream_is_closed(stream_state *state)
+{
+  return (state->dwrapper->is_closed || state->dwrapper->ewrapper->is_closed
+          || (state->twrapper && state->twrapper->is_closed));
+}
+
+// the first training of a codec and a backup hold the write gate; the
+// producer waits for it, but without blocking db_close and env_close
+// which hold the read side while they cancel the stream. Returns false
+// if the stream was cancelled in the meantime.
+static bool
+stream_lock(stream_state *state)
+{
+  while (enif_rwlock_tryrlock(state->dwrapper->ewrapper->write_gate)) {
+    enif_mutex_lock(state->lock);
+    bool cancelled = state->cancelled;
+    enif_mutex_unlock(state->lock);
+    if (cancelled)
+      return (false);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  enif_rwlock_rlock(state->dwrapper->close_lock);
+  if (state->twrapper)
+    enif_rwlock_rlock(state->twrapper->close_lock);
+  return (true);
+}
+
+static void
+stream_unlock(stream_state *state)
+{
+  if (state->twrapper)
+    enif_rwlock_runlock(state->twrapper->close_lock);
+  enif_rwlock_runlock(state->dwrapper->close_lock);
+  enif_rwlock_runlock(state->dwrapper->ewrapper->write_gate);
+}
+
+// the handles are only used while a batch is read; in between, the
+// Database and the Transaction can be closed
+static void *
+stream_run(void *arg)
+{
+  stream_state *state = (stream_state *)arg;
+  ErlNifEnv *msg_env = enif_alloc_env();
+  uint32_t key_type = state->dwrapper->key_type;
+  ups_cursor_t *cursor = 0;
+  ups_key_t key = {0};
+  ups_record_t rec = {0};
+  ups_status_t st = 0;
+
+  metrics_enter(OP_STREAM_RANGE);
+  while (st == 0) {
+    // wait for credit
+    enif_mutex_lock(state->lock);
+    while (state->credit == 0 && !state->cancelled)
+      enif_cond_wait(state->cond, state->lock);
+    bool cancelled = state->cancelled;
+    if (!cancelled)
+      state->credit--;
+    enif_mutex_unlock(state->lock);
+    if (cancelled)
+      break;
+
+    if (!stream_lock(state))
+      break;
+    if (stream_is_closed(state)) {
+      stream_unlock(state);
+      st = UPS_INV_PARAMETER;
+      break;
+    }
+
+    if (!cursor) {
+      st = ups_cursor_create(&cursor, state->dwrapper->db,
+                      state->twrapper ? state->twrapper->txn : 0, 0);
+      if (st == 0) {
+        if (state->has_start) {
+          key.data = state->start.data;
+          key.size = state->start.size;
+          st = ups_cursor_find(cursor, &key, &rec, UPS_FIND_GEQ_MATCH);
+        }
+        else
+          st = ups_cursor_move(cursor, &key, &rec, UPS_CURSOR_FIRST);
+      }
+    }
+
+    packed_binary packed(64 * 1024);
+    std::vector<char> decoded;
+    uint32_t count = 0;
+    while (st == 0 && count < state->batch_size) {
+      if (state->has_end && compare_keys(key_type, key.data, key.size,
+                              state->end.data, state->end.size) >= 0) {
+        st = UPS_KEY_NOT_FOUND;
+        break;
+      }
+      const void *data = rec.data;
+      uint32_t size = rec.size;
+      if ((st = codec_decode(state->dwrapper, &data, &size, &decoded)))
+        break;
+      if (!packed.append_key(msg_env, state->dwrapper, key.data, key.size)
+          || !packed.append_value(msg_env, state->dwrapper->typed_terms,
+                  state->dwrapper->record_type, data, size)) {
+        st = UPS_OUT_OF_MEMORY;
+        break;
+      }
+      count++;
+      st = ups_cursor_move(cursor, &key, &rec, UPS_CURSOR_NEXT);
+    }
+
+    // the terms are built before the lock is released; the key and the
+    // record point into the Database
+    if (count > 0 && st != UPS_OUT_OF_MEMORY) {
+      std::vector<ERL_NIF_TERM> terms;
+      packed.make_terms(msg_env, terms);
+      std::vector<ERL_NIF_TERM> pairs(count);
+      for (uint32_t i = 0; i < count; i++)
+        pairs[i] = enif_make_tuple2(msg_env, terms[2 * i], terms[2 * i + 1]);
+      stream_unlock(state);
+      stream_send(state, msg_env, enif_make_tuple2(msg_env,
+                      enif_make_atom(msg_env, "data"),
+                      enif_make_list_from_array(msg_env, pairs.data(), count)));
+    }
+    else
+      stream_unlock(state);
+  }
+
+  // Databases and Transactions with an open cursor cannot be closed
+  // (closing a cursor does not modify the file, the write gate is not
+  // needed)
+  if (cursor) {
+    enif_rwlock_rlock(state->dwrapper->close_lock);
+    if (state->twrapper)
+      enif_rwlock_rlock(state->twrapper->close_lock);
+    (void)ups_cursor_close(cursor);
+    if (state->twrapper)
+      enif_rwlock_runlock(state->twrapper->close_lock);
+    enif_rwlock_runlock(state->dwrapper->close_lock);
+  }
+
+  if (st == UPS_KEY_NOT_FOUND)
+    stream_send(state, msg_env, enif_make_atom(msg_env, "done"));
+  else if (st)
+    stream_send(state, msg_env, enif_make_tuple2(msg_env, g_atom_error,
+                          status_to_atom(msg_env, st)));
+
+  enif_free_env(msg_env);
+  return (0);
 }
 
+// argv[2] is {StartKey | undefined, EndKey | undefined}, argv[3] the
+// consumer, argv[4] the batch size, argv[5] the initial credit and argv[6]
+// the reference which tags all messages
 ERL_NIF_TERM
-ups_nifs_cursor_move(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ups_nifs_stream_range(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  cursor_wrapper *cwrapper;
-  uint32_t flags;
+  db_wrapper *dwrapper;
+  txn_wrapper *twrapper;
+  ErlNifPid pid;
+  uint32_t batch_size;
+  uint32_t credit;
+  int arity;
+  const ERL_NIF_TERM *range;
 
-  if (argc != 2)
+  if (argc != 7)
+    return (enif_make_badarg(env));
+  if (!enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper)
+          || dwrapper->is_closed)
     return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_cursor_resource,
-              (void **)&cwrapper)
-          || cwrapper->is_closed)
+  // argv[1] is the Transaction!
+  if (!enif_get_resource(env, argv[1], g_ups_txn_resource, (void **)&twrapper))
+    twrapper = 0;
+  if (twrapper != 0 && twrapper->is_closed)
     return (enif_make_badarg(env));
-  if (!enif_get_uint(env, argv[1], &flags))
+  if (!enif_is_ref(env, argv[6]))
+    return (enif_make_badarg(env));
+  if (!enif_get_tuple(env, argv[2], &arity, &range) || arity != 2)
+    return (enif_make_badarg(env));
+  if (!enif_get_local_pid(env, argv[3], &pid))
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[4], &batch_size) || batch_size == 0)
+    return (enif_make_badarg(env));
+  if (!enif_get_uint(env, argv[5], &credit))
     return (enif_make_badarg(env));
 
-  ups_key_t key = {0};
-  ups_record_t rec = {0};
-  ups_status_t st = ups_cursor_move(cwrapper->cursor, &key, &rec, flags);
+  ERL_NIF_TERM undefined = enif_make_atom(env, "undefined");
+  ErlNifBinary bin;
+  typed_value value;
+  if (!enif_is_identical(range[0], undefined)
+        && !get_key_binary(env, range[0], dwrapper, &value, &bin))
+    return (enif_make_badarg(env));
+  if (!enif_is_identical(range[1], undefined)
+        && !get_key_binary(env, range[1], dwrapper, &value, &bin))
+    return (enif_make_badarg(env));
+
+  ups_status_t st = write_buffer_flush(dwrapper);
   if (st)
     return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
-  ErlNifBinary binkey;
-  if (!enif_alloc_binary(key.size, &binkey))
-    return (enif_make_tuple2(env, g_atom_error,
-                status_to_atom(env, UPS_OUT_OF_MEMORY)));
-  memcpy(binkey.data, key.data, key.size);
-  binkey.size = key.size;
-
-  ErlNifBinary binrec;
-  if (!enif_alloc_binary(rec.size, &binrec))
+  stream_state *state = (stream_state *)enif_alloc_resource(
+                  g_ups_stream_resource, sizeof(*state));
+  state->dwrapper = dwrapper;
+  enif_keep_resource(dwrapper);
+  state->twrapper = twrapper;
+  if (twrapper)
+    enif_keep_resource(twrapper);
+  state->pid = pid;
+  state->env = enif_alloc_env();
+  state->ref = enif_make_copy(state->env, argv[6]);
+  // 'undefined' is a valid term key; it is not a bound
+  state->has_start = !enif_is_identical(range[0], undefined)
+          && get_key_binary(state->env,
+                  enif_make_copy(state->env, range[0]), dwrapper,
+                  &state->start_value, &state->start);
+  state->has_end = !enif_is_identical(range[1], undefined)
+          && get_key_binary(state->env,
+                  enif_make_copy(state->env, range[1]), dwrapper,
+                  &state->end_value, &state->end);
+  state->batch_size = batch_size;
+  state->lock = enif_mutex_create((char *)"ups_stream_lock");
+  state->cond = enif_cond_create((char *)"ups_stream_cond");
+  state->credit = credit;
+  state->cancelled = false;
+  state->next_stream = 0;
+
+  ERL_NIF_TERM result = enif_make_resource(env, state);
+  enif_release_resource(state);
+
+  enif_mutex_lock(dwrapper->streams_lock);
+  if (enif_thread_create((char *)"ups_stream", &state->tid, stream_run,
+                state, 0)) {
+    enif_mutex_unlock(dwrapper->streams_lock);
+    state->tid = 0;
     return (enif_make_tuple2(env, g_atom_error,
                 status_to_atom(env, UPS_OUT_OF_MEMORY)));
-  memcpy(binrec.data, rec.data, rec.size);
-  binrec.size = rec.size;
+  }
+  // db_close and env_close stop the stream
+  state->next_stream = dwrapper->streams;
+  dwrapper->streams = state;
+  enif_mutex_unlock(dwrapper->streams_lock);
 
-  return (enif_make_tuple3(env, g_atom_ok,
-              enif_make_binary(env, &binkey),
-              enif_make_binary(env, &binrec)));
+  return (enif_make_tuple2(env, g_atom_ok, result));
 }
 
+// grants additional credit to a stream
 ERL_NIF_TERM
-ups_nifs_cursor_overwrite(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ups_nifs_stream_ack(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  cursor_wrapper *cwrapper;
-  ErlNifBinary binrec;
+  stream_state *state;
+  uint32_t credit;
 
   if (argc != 2)
     return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_cursor_resource,
-              (void **)&cwrapper)
-          || cwrapper->is_closed)
+  if (!enif_get_resource(env, argv[0], g_ups_stream_resource, (void **)&state))
     return (enif_make_badarg(env));
-  if (!enif_inspect_binary(env, argv[1], &binrec))
+  if (!enif_get_uint(env, argv[1], &credit))
     return (enif_make_badarg(env));
 
-  ups_record_t rec = {0};
-  rec.data = binrec.data;
-  rec.size = binrec.size;
-
-  ups_status_t st = ups_cursor_overwrite(cwrapper->cursor, &rec, 0);
-  if (st)
-    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
-
+  enif_mutex_lock(state->lock);
+  state->credit += credit;
+  enif_cond_signal(state->cond);
+  enif_mutex_unlock(state->lock);
   return (g_atom_ok);
 }
 
 ERL_NIF_TERM
-ups_nifs_cursor_find(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ups_nifs_stream_cancel(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  cursor_wrapper *cwrapper;
-  ErlNifBinary binkey;
+  stream_state *state;
 
-  if (argc != 2)
-    return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_cursor_resource,
-              (void **)&cwrapper)
-          || cwrapper->is_closed)
+  if (argc != 1)
     return (enif_make_badarg(env));
-  if (!enif_inspect_binary(env, argv[1], &binkey))
+  if (!enif_get_resource(env, argv[0], g_ups_stream_resource, (void **)&state))
     return (enif_make_badarg(env));
 
-  ups_record_t rec = {0};
-  ups_key_t key = {0};
-  key.data = binkey.data;
-  key.size = binkey.size;
+  enif_mutex_lock(state->lock);
+  state->cancelled = true;
+  enif_cond_signal(state->cond);
+  enif_mutex_unlock(state->lock);
+  return (g_atom_ok);
+}
 
-  ups_status_t st = ups_cursor_find(cwrapper->cursor, &key, &rec, 0);
-  if (st)
-    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+//
+// Reading the metrics
+//
 
-  ErlNifBinary binrec;
-  if (!enif_alloc_binary(rec.size, &binrec))
-    return (enif_make_tuple2(env, g_atom_error,
-                status_to_atom(env, UPS_OUT_OF_MEMORY)));
-  memcpy(binrec.data, rec.data, rec.size);
-  binrec.size = rec.size;
+// adds |value| to the counter |key| of |map|
+static void
+metrics_map_add(ErlNifEnv *env, ERL_NIF_TERM *map, ERL_NIF_TERM key,
+                uint64_t value)
+{
+  ERL_NIF_TERM term;
+  ErlNifUInt64 current;
+
+  if (enif_get_map_value(env, *map, key, &term)
+        && enif_get_uint64(env, term, &current))
+    value += current;
+  (void)enif_make_map_put(env, *map, key, enif_make_uint64(env, value), map);
+}
 
-  return (enif_make_tuple2(env, g_atom_ok, enif_make_binary(env, &binrec)));
+// sums a per-operation counter of all slots; only operations with a
+// non-zero counter are returned
+static ERL_NIF_TERM
+metrics_op_map(ErlNifEnv *env, int metric)
+{
+  ERL_NIF_TERM map = enif_make_new_map(env);
+  for (int op = 0; op < OP_MAX; op++) {
+    uint64_t sum = 0;
+    for (int i = 0; i < METRICS_SLOTS; i++)
+      sum += g_metrics[i].ops[metric][op].load(std::memory_order_relaxed);
+    if (sum)
+      metrics_map_add(env, &map, enif_make_atom(env, g_op_names[op]), sum);
+  }
+  return (map);
 }
 
+// Returns the metrics of the Environment and the (global) counters of the
+// NIF layer as #{engine => #{...}, nif => #{...}}
 ERL_NIF_TERM
-ups_nifs_cursor_insert(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ups_nifs_env_metrics(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  cursor_wrapper *cwrapper;
-  ErlNifBinary binkey;
-  ErlNifBinary binrec;
-  uint32_t flags;
+  env_wrapper *ewrapper;
+  ups_env_metrics_t metrics;
 
-  if (argc != 4)
-    return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_cursor_resource,
-              (void **)&cwrapper)
-          || cwrapper->is_closed)
-    return (enif_make_badarg(env));
-  if (!enif_inspect_binary(env, argv[1], &binkey))
-    return (enif_make_badarg(env));
-  if (!enif_inspect_binary(env, argv[2], &binrec))
+  if (argc != 1)
     return (enif_make_badarg(env));
-  if (!enif_get_uint(env, argv[3], &flags))
+  if (!enif_get_resource(env, argv[0], g_ups_env_resource, (void **)&ewrapper)
+          || ewrapper->is_closed)
     return (enif_make_badarg(env));
 
-  ups_key_t key = {0};
-  key.data = binkey.data;
-  key.size = binkey.size;
-  ups_record_t rec = {0};
-  rec.data = binrec.data;
-  rec.size = binrec.size;
-
-  ups_status_t st = ups_cursor_insert(cwrapper->cursor, &key, &rec, flags);
+  memset(&metrics, 0, sizeof(metrics));
+  metrics.version = 1;
+  ups_status_t st = ups_env_get_metrics(ewrapper->env, &metrics);
   if (st)
     return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
 
-  return (g_atom_ok);
+  ERL_NIF_TERM engine = enif_make_new_map(env);
+#define ENGINE_METRIC(name)                                             \
+  metrics_map_add(env, &engine, enif_make_atom(env, #name), metrics.name);
+  ENGINE_METRIC(mem_total_allocations)
+  ENGINE_METRIC(mem_current_allocations)
+  ENGINE_METRIC(mem_current_usage)
+  ENGINE_METRIC(mem_peak_usage)
+  ENGINE_METRIC(mem_heap_size)
+  ENGINE_METRIC(page_count_fetched)
+  ENGINE_METRIC(page_count_flushed)
+  ENGINE_METRIC(page_count_type_index)
+  ENGINE_METRIC(page_count_type_blob)
+  ENGINE_METRIC(page_count_type_page_manager)
+  ENGINE_METRIC(freelist_hits)
+  ENGINE_METRIC(freelist_misses)
+  ENGINE_METRIC(cache_hits)
+  ENGINE_METRIC(cache_misses)
+  ENGINE_METRIC(blob_total_allocated)
+  ENGINE_METRIC(blob_total_read)
+  ENGINE_METRIC(btree_smo_split)
+  ENGINE_METRIC(btree_smo_merge)
+  ENGINE_METRIC(extended_keys)
+  ENGINE_METRIC(extended_duptables)
+  ENGINE_METRIC(journal_bytes_flushed)
+#undef ENGINE_METRIC
+
+  ERL_NIF_TERM errors = enif_make_new_map(env);
+  for (int status = 1; status < METRICS_STATUS_MAX; status++) {
+    uint64_t sum = 0;
+    for (int i = 0; i < METRICS_SLOTS; i++)
+      sum += g_metrics[i].errors[status].load(std::memory_order_relaxed);
+    if (sum)
+      metrics_map_add(env, &errors, status_name(env, -status), sum);
+  }
+
+  ERL_NIF_TERM nif = enif_make_new_map(env);
+  (void)enif_make_map_put(env, nif, enif_make_atom(env, "errors"),
+                  errors, &nif);
+  for (int metric = 0; metric < METRIC_MAX; metric++)
+    (void)enif_make_map_put(env, nif,
+                  enif_make_atom(env, g_metric_names[metric]),
+                  metrics_op_map(env, metric), &nif);
+
+  ERL_NIF_TERM result = enif_make_new_map(env);
+  (void)enif_make_map_put(env, result, enif_make_atom(env, "engine"),
+                  engine, &result);
+  (void)enif_make_map_put(env, result, enif_make_atom(env, "nif"),
+                  nif, &result);
+  return (enif_make_tuple2(env, g_atom_ok, result));
 }
 
+//
+// Reading the traces
+//
+
+// sets the trace threshold in microseconds; 0 disables the recorder
 ERL_NIF_TERM
-ups_nifs_cursor_erase(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ups_nifs_trace_threshold(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  cursor_wrapper *cwrapper;
+  ErlNifUInt64 usec;
 
   if (argc != 1)
     return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_cursor_resource,
-              (void **)&cwrapper)
-          || cwrapper->is_closed)
+  if (!enif_get_uint64(env, argv[0], &usec))
     return (enif_make_badarg(env));
 
-  ups_status_t st = ups_cursor_erase(cwrapper->cursor, 0);
-  if (st)
-    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
-
+  g_trace_threshold.store((ErlNifTime)usec * 1000, std::memory_order_relaxed);
   return (g_atom_ok);
 }
 
+// returns the entries of all rings, oldest first
 ERL_NIF_TERM
-ups_nifs_cursor_get_duplicate_count(ErlNifEnv *env, int argc,
-        const ERL_NIF_TERM argv[])
+ups_nifs_trace_dump(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  cursor_wrapper *cwrapper;
+  std::vector<trace_entry *> entries;
 
-  if (argc != 1)
-    return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_cursor_resource,
-              (void **)&cwrapper)
-          || cwrapper->is_closed)
+  if (argc != 0)
     return (enif_make_badarg(env));
 
-  uint32_t count;
-  ups_status_t st = ups_cursor_get_duplicate_count(cwrapper->cursor, &count, 0);
-  if (st)
-    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
+  for (int i = 0; i < METRICS_SLOTS; i++) {
+    for (int j = 0; j < TRACE_RING_SIZE; j++) {
+      trace_entry &e = g_trace_rings[i].entries[j];
+      uint64_t seq = e.seq.load(std::memory_order_acquire);
+      if (!seq)
+        continue;
+      trace_entry *copy = new trace_entry();
+      copy->start = e.start;
+      copy->duration = e.duration;
+      copy->op = e.op;
+      copy->status = e.status;
+      copy->db_name = e.db_name;
+      copy->key_size = e.key_size;
+      copy->record_size = e.record_size;
+      memcpy(copy->key, e.key, sizeof(copy->key));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      // skip the entry if it was overwritten in the meantime
+      if (e.seq.load(std::memory_order_relaxed) != seq)
+        delete copy;
+      else
+        entries.push_back(copy);
+    }
+  }
 
-  return (enif_make_tuple2(env, g_atom_ok, enif_make_int(env, (int)count)));
+  std::sort(entries.begin(), entries.end(), trace_entry_older);
+
+  std::vector<ERL_NIF_TERM> terms(entries.size());
+  for (size_t i = 0; i < entries.size(); i++) {
+    terms[i] = trace_entry_term(env, *entries[i]);
+    delete entries[i];
+  }
+  return (enif_make_list_from_array(env, terms.data(),
+                          (unsigned)terms.size()));
 }
 
 ERL_NIF_TERM
-ups_nifs_cursor_get_record_size(ErlNifEnv *env, int argc,
-        const ERL_NIF_TERM argv[])
+ups_nifs_trace_subscribe(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  cursor_wrapper *cwrapper;
+  ErlNifPid pid;
 
   if (argc != 1)
     return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_cursor_resource,
-              (void **)&cwrapper)
-          || cwrapper->is_closed)
+  if (!enif_get_local_pid(env, argv[0], &pid))
     return (enif_make_badarg(env));
 
-  uint32_t size;
-  ups_status_t st = ups_cursor_get_record_size(cwrapper->cursor, &size);
-  if (st)
-    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
-
-  return (enif_make_tuple2(env, g_atom_ok, enif_make_int64(env, (int)size)));
+  std::lock_guard<std::mutex> guard(g_trace_subscribers_mutex);
+  for (size_t i = 0; i < g_trace_subscribers.size(); i++) {
+    if (enif_is_identical(enif_make_pid(env, &g_trace_subscribers[i]),
+                argv[0]))
+      return (g_atom_ok);
+  }
+  g_trace_subscribers.push_back(pid);
+  g_trace_subscriber_count.store((int)g_trace_subscribers.size(),
+                  std::memory_order_relaxed);
+  return (g_atom_ok);
 }
 
 ERL_NIF_TERM
-ups_nifs_cursor_close(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+ups_nifs_trace_unsubscribe(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
 {
-  cursor_wrapper *cwrapper;
+  ErlNifPid pid;
 
   if (argc != 1)
     return (enif_make_badarg(env));
-  if (!enif_get_resource(env, argv[0], g_ups_cursor_resource,
-              (void **)&cwrapper)
-          || cwrapper->is_closed)
+  if (!enif_get_local_pid(env, argv[0], &pid))
     return (enif_make_badarg(env));
 
-  ups_status_t st = ups_cursor_close(cwrapper->cursor);
-  if (st)
-    return (enif_make_tuple2(env, g_atom_error, status_to_atom(env, st)));
-
-  cwrapper->is_closed = true;
+  std::lock_guard<std::mutex> guard(g_trace_subscribers_mutex);
+  for (size_t i = 0; i < g_trace_subscribers.size(); i++) {
+    if (enif_is_identical(enif_make_pid(env, &g_trace_subscribers[i]),
+                argv[0])) {
+      g_trace_subscribers.erase(g_trace_subscribers.begin() + i);
+      break;
+    }
+  }
+  g_trace_subscriber_count.store((int)g_trace_subscribers.size(),
+                  std::memory_order_relaxed);
   return (g_atom_ok);
 }
 
+//
+// Dispatching to dirty schedulers
+//
+// Every NIF is registered through nif_dispatch<>(), which decides per call
+// whether the function can run on a normal scheduler or has to be
+// rescheduled on a dirty one. Functions are either never dirty (cheap
+// accessors), always dirty (opening/closing files, running queries) or dirty
+// only above a threshold (commits of fsync-enabled Environments, large
+// records). The policy of an Environment can be overridden with the
+// "dirty_policy" and "dirty_threshold" parameters.
+//
+
+// returns the Environment which is (directly or indirectly) referenced by
+// the first argument of |op|, or 0
+static env_wrapper *
+op_env(nif_op op, ErlNifEnv *env, const ERL_NIF_TERM argv[])
+{
+  env_wrapper *ewrapper;
+  db_wrapper *dwrapper;
+  txn_wrapper *twrapper;
+  cursor_wrapper *cwrapper;
+  statement_wrapper *swrapper;
+
+  if (enif_get_resource(env, argv[0], g_ups_env_resource, (void **)&ewrapper))
+    return (ewrapper);
+  if (enif_get_resource(env, argv[0], g_ups_db_resource, (void **)&dwrapper))
+    return (dwrapper->ewrapper);
+  if (enif_get_resource(env, argv[0], g_ups_txn_resource, (void **)&twrapper))
+    return (twrapper->ewrapper);
+  if (enif_get_resource(env, argv[0], g_ups_cursor_resource,
+                          (void **)&cwrapper))
+    return (cwrapper->dwrapper->ewrapper);
+  if (enif_get_resource(env, argv[0], g_ups_statement_resource,
+                          (void **)&swrapper))
+    return (swrapper->ewrapper);
+  return (0);
+}
+
+// scans the parameters of ups_env_create/ups_env_open for a "dirty_policy"
+static int
+parameters_dirty_policy(ErlNifEnv *env, ERL_NIF_TERM term)
+{
+  int policy = DIRTY_POLICY_AUTO;
+  ERL_NIF_TERM cell;
+
+  while (enif_get_list_cell(env, term, &cell, &term)) {
+    int arity;
+    const ERL_NIF_TERM *array;
+    if (enif_get_tuple(env, cell, &arity, &array) && arity == 2
+        && enif_is_identical(array[0], enif_make_atom(env, "dirty_policy")))
+      (void)get_dirty_policy(env, array[1], &policy);
+  }
+  return (policy);
+}
+
+// returns true if a call to uqi_result_slice decodes at least
+// DIRTY_SLICE_THRESHOLD rows
+static bool
+slice_exceeds_threshold(ErlNifEnv *env, const ERL_NIF_TERM argv[])
+{
+  result_wrapper *rwrapper;
+  uint32_t offset;
+  uint32_t count;
+
+  if (!enif_get_resource(env, argv[0], g_ups_result_resource,
+                          (void **)&rwrapper)
+          || rwrapper->is_closed
+          || !enif_get_uint(env, argv[1], &offset)
+          || !enif_get_uint(env, argv[2], &count))
+    return (false); // the function will fail with badarg
+
+  uint32_t row_count = uqi_result_get_row_count(rwrapper->result);
+  if (offset >= row_count)
+    return (false);
+  if (count > row_count - offset)
+    count = row_count - offset;
+  return (count >= DIRTY_SLICE_THRESHOLD);
+}
+
+// returns true if the list |term| has at least |threshold| elements
+static bool
+list_exceeds_threshold(ErlNifEnv *env, ERL_NIF_TERM term, unsigned threshold)
+{
+  unsigned length;
+  return (enif_get_list_length(env, term, &length) && length >= threshold);
+}
+
+// returns true if the binary |term| has at least |threshold| bytes
+static bool
+exceeds_threshold(ErlNifEnv *env, ERL_NIF_TERM term, uint32_t threshold)
+{
+  ErlNifBinary bin;
+  return (enif_inspect_binary(env, term, &bin) && bin.size >= threshold);
+}
+
+// returns the ERL_NIF_DIRTY_JOB_* flags for a call, or 0 if the call can
+// run on a normal scheduler
+static int
+dirty_job_flags(nif_op op, ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  env_wrapper *ewrapper;
+
+  switch (op) {
+    // never dirty
+    case OP_STRERROR:
+    case OP_UQI_RESULT_GET_ROW_COUNT:
+    case OP_UQI_RESULT_GET_KEY_TYPE:
+    case OP_UQI_RESULT_GET_RECORD_TYPE:
+    case OP_UQI_RESULT_GET_KEY:
+    case OP_UQI_RESULT_GET_RECORD:
+    case OP_UQI_RESULT_CLOSE:
+    case OP_ASYNC_INSERT:
+    case OP_ASYNC_FIND:
+    case OP_ASYNC_ERASE:
+    case OP_STREAM_RANGE:
+    case OP_STREAM_ACK:
+    case OP_STREAM_CANCEL:
+    case OP_ENV_METRICS:
+    case OP_TRACE_THRESHOLD:
+    case OP_TRACE_DUMP:
+    case OP_TRACE_SUBSCRIBE:
+    case OP_TRACE_UNSUBSCRIBE:
+    case OP_DB_CACHE_STATS:
+    case OP_DB_BLOOM_STATS:
+    case OP_UQI_PREPARE:
+    case OP_ENV_BACKUP:
+    case OP_ENV_COMPACT:
+    case OP_ENV_COMPACT_CANCEL:
+      return (0);
+
+    // creating and opening files; the Environment does not yet exist,
+    // therefore the policy is taken from the parameters
+    case OP_ENV_CREATE:
+    case OP_ENV_OPEN:
+      if (parameters_dirty_policy(env, argv[argc - 1]) == DIRTY_POLICY_NEVER)
+        return (0);
+      return (ERL_NIF_DIRTY_JOB_IO_BOUND);
+
+    // a restore reads a whole file into a new Environment
+    case OP_ENV_RESTORE:
+      return (ERL_NIF_DIRTY_JOB_IO_BOUND);
+
+    // result sets are not attached to an Environment; large slices
+    // are always decoded on a dirty scheduler
+    case OP_UQI_RESULT_SLICE:
+      return (slice_exceeds_threshold(env, argv)
+                ? ERL_NIF_DIRTY_JOB_CPU_BOUND
+                : 0);
+
+    default:
+      break;
+  }
+
+  ewrapper = op_env(op, env, argv);
+  if (!ewrapper || ewrapper->is_closed)
+    return (0); // the function will fail with badarg
+
+  switch (ewrapper->dirty_policy) {
+    case DIRTY_POLICY_NEVER:
+      return (0);
+    case DIRTY_POLICY_ALWAYS:
+      return (op == OP_UQI_SELECT_RANGE || op == OP_UQI_EXECUTE
+                ? ERL_NIF_DIRTY_JOB_CPU_BOUND
+                : ERL_NIF_DIRTY_JOB_IO_BOUND);
+    default:
+      break;
+  }
+
+  switch (op) {
+    // always dirty: flushing and closing files
+    case OP_ENV_CLOSE:
+    case OP_DB_CLOSE:
+    case OP_DB_FLUSH_BUFFER:
+    case OP_DB_BULK_INSERT:
+    case OP_ENV_ERASE_DB:
+    case OP_ENV_DUMP:
+    case OP_DB_TRAIN_CODEC:
+      return (ERL_NIF_DIRTY_JOB_IO_BOUND);
+
+    // a saved Bloom filter is loaded
+    case OP_ENV_OPEN_DB:
+      return (ERL_NIF_DIRTY_JOB_IO_BOUND);
+
+    // queries can scan a full database
+    case OP_UQI_SELECT_RANGE:
+    case OP_UQI_EXECUTE:
+      return (ERL_NIF_DIRTY_JOB_CPU_BOUND);
+
+    // all keys are encoded and sorted on a dirty scheduler; the lookups
+    // are then rescheduled on a normal scheduler (see db_find_many_impl)
+    case OP_DB_FIND_MANY:
+      return (argc == 3 && list_exceeds_threshold(env, argv[2],
+                                DIRTY_FIND_MANY_THRESHOLD)
+                ? ERL_NIF_DIRTY_JOB_CPU_BOUND
+                : 0);
+
+    // a commit is flushed to disk if fsync is enabled
+    case OP_TXN_COMMIT:
+      return ((ewrapper->flags & UPS_ENABLE_FSYNC)
+                ? ERL_NIF_DIRTY_JOB_IO_BOUND
+                : 0);
+
+    // large records are written to separate blob pages
+    case OP_DB_INSERT:
+      return (exceeds_threshold(env, argv[3], ewrapper->dirty_threshold)
+                ? ERL_NIF_DIRTY_JOB_IO_BOUND
+                : 0);
+    case OP_CURSOR_INSERT:
+      return (exceeds_threshold(env, argv[2], ewrapper->dirty_threshold)
+                ? ERL_NIF_DIRTY_JOB_IO_BOUND
+                : 0);
+    case OP_CURSOR_OVERWRITE:
+      return (exceeds_threshold(env, argv[1], ewrapper->dirty_threshold)
+                ? ERL_NIF_DIRTY_JOB_IO_BOUND
+                : 0);
+
+    default:
+      return (0);
+  }
+}
+
+// returns true if a call can modify the file of its Environment; these
+// calls wait at the write gate while a backup freezes the file. Reads
+// are gated if they flush the write buffer first.
+static bool
+is_gated(nif_op op)
+{
+  switch (op) {
+    case OP_ENV_CREATE_DB:
+    case OP_ENV_RENAME_DB:
+    case OP_ENV_ERASE_DB:
+    case OP_DB_INSERT:
+    case OP_DB_ERASE:
+    case OP_DB_CLOSE:
+    case OP_TXN_ABORT:
+    case OP_TXN_COMMIT:
+    case OP_CURSOR_OVERWRITE:
+    case OP_CURSOR_INSERT:
+    case OP_CURSOR_ERASE:
+    case OP_DB_INSERT_MANY:
+    case OP_DB_FLUSH_BUFFER:
+    case OP_DB_BULK_INSERT:
+    case OP_DB_ERASE_RANGE:
+    // these flush the write buffer
+    case OP_DB_FIND:
+    case OP_DB_FIND_FLAGS:
+    case OP_DB_FIND_MANY:
+    case OP_CURSOR_CREATE:
+    case OP_CURSOR_MOVE:
+    case OP_CURSOR_FOLD:
+    case OP_CURSOR_FIND:
+    case OP_STREAM_RANGE:
+    case OP_ASYNC_INSERT:
+    case OP_ASYNC_FIND:
+    case OP_ASYNC_ERASE:
+    case OP_UQI_SELECT_RANGE:
+    case OP_UQI_EXECUTE:
+    case OP_ENV_DUMP:
+      return (true);
+    default:
+      return (false);
+  }
+}
+
+// runs a NIF which can modify the file under the read side of the write
+// gate. If a backup holds the gate then a call on a normal scheduler is
+// moved to a dirty scheduler instead of blocking it.
+template<nif_op Op, nif_function_t Fn>
+static ERL_NIF_TERM
+gated_call(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  env_wrapper *ewrapper = is_gated(Op) ? op_env(Op, env, argv) : 0;
+  if (!ewrapper)
+    return (trace_call<Op, Fn>(env, argc, argv));
+
+  if (enif_rwlock_tryrlock(ewrapper->write_gate)) {
+    if (g_dirty_supported
+          && enif_thread_type() == ERL_NIF_THR_NORMAL_SCHEDULER)
+      return (enif_schedule_nif(env, g_op_names[Op],
+                      ERL_NIF_DIRTY_JOB_IO_BOUND, gated_call<Op, Fn>,
+                      argc, argv));
+    enif_rwlock_rlock(ewrapper->write_gate);
+  }
+  ERL_NIF_TERM result = trace_call<Op, Fn>(env, argc, argv);
+  enif_rwlock_runlock(ewrapper->write_gate);
+  return (result);
+}
+
+// runs a rescheduled function on the dirty scheduler
+template<nif_op Op, nif_function_t Fn>
+static ERL_NIF_TERM
+nif_dirty(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  metrics_enter(Op);
+  return (gated_call<Op, Fn>(env, argc, argv));
+}
+
+template<nif_op Op, nif_function_t Fn>
+static ERL_NIF_TERM
+nif_dispatch(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[])
+{
+  metrics_call(Op);
+  if (g_dirty_supported
+        && enif_thread_type() == ERL_NIF_THR_NORMAL_SCHEDULER) {
+    int flags = dirty_job_flags(Op, env, argc, argv);
+    if (flags)
+      return (enif_schedule_nif(env, g_op_names[Op], flags,
+                      nif_dirty<Op, Fn>, argc, argv));
+  }
+  return (gated_call<Op, Fn>(env, argc, argv));
+}
+
 static void
 env_resource_cleanup(ErlNifEnv *env, void *arg)
 {
   env_wrapper *ewrapper = (env_wrapper *)arg;
-  if (!ewrapper->is_closed)
+  backup_stop(ewrapper);
+  async_worker_stop(ewrapper);
+  group_commit_stop(ewrapper);
+  if (!ewrapper->is_closed) {
+    codec_catalog_close(ewrapper);
     (void)ups_env_close(ewrapper->env, 0);
+  }
   ewrapper->is_closed = true;
+  enif_mutex_destroy(ewrapper->lock);
+  enif_rwlock_destroy(ewrapper->dbs_lock);
+  enif_rwlock_destroy(ewrapper->write_gate);
 }
 
 static void
 db_resource_cleanup(ErlNifEnv *env, void *arg)
 {
   db_wrapper *dwrapper = (db_wrapper *)arg;
+  env_detach_db(dwrapper);
+  bloom_stop(dwrapper);
+  // a backup can freeze the file
+  enif_rwlock_rlock(dwrapper->ewrapper->write_gate);
+  // waits till a dump or query which pinned the handle is finished
+  enif_rwlock_rwlock(dwrapper->close_lock);
+  if (!dwrapper->is_closed && !dwrapper->ewrapper->is_closed) {
+    (void)write_buffer_flush_pinned(dwrapper);
+    bloom_save(dwrapper);
+  }
+  write_buffer_detach(dwrapper);
   if (!dwrapper->is_closed)
     (void)ups_db_close(dwrapper->db, 0);
   dwrapper->is_closed = true;
+  enif_rwlock_rwunlock(dwrapper->close_lock);
+  enif_rwlock_runlock(dwrapper->ewrapper->write_gate);
+  enif_rwlock_destroy(dwrapper->close_lock);
+  enif_mutex_destroy(dwrapper->streams_lock);
+  read_cache_detach(dwrapper);
+  bloom_detach(dwrapper);
+  codec_detach(dwrapper);
+  enif_release_resource(dwrapper->ewrapper);
 }
 
 static void
@@ -1245,6 +8743,8 @@ txn_resource_cleanup(ErlNifEnv *env, void *arg)
   if (!twrapper->is_closed)
     (void)ups_txn_abort(twrapper->txn, 0);
   twrapper->is_closed = true;
+  enif_rwlock_destroy(twrapper->close_lock);
+  enif_release_resource(twrapper->ewrapper);
 }
 
 static void
@@ -1254,17 +8754,76 @@ cursor_resource_cleanup(ErlNifEnv *env, void *arg)
   if (!cwrapper->is_closed)
     (void)ups_cursor_close(cwrapper->cursor);
   cwrapper->is_closed = true;
+  enif_release_resource(cwrapper->dwrapper);
 }
 
 static void
 result_resource_cleanup(ErlNifEnv *env, void *arg)
 {
   result_wrapper *rwrapper = (result_wrapper *)arg;
-  if (!rwrapper->is_closed)
+  if (!rwrapper->is_closed || rwrapper->is_pinned)
     (void)uqi_result_close(rwrapper->result);
   rwrapper->is_closed = true;
 }
 
+static void
+statement_resource_cleanup(ErlNifEnv *env, void *arg)
+{
+  statement_wrapper *swrapper = (statement_wrapper *)arg;
+  delete swrapper->query;
+  enif_release_resource(swrapper->ewrapper);
+}
+
+static void
+find_many_resource_cleanup(ErlNifEnv *env, void *arg)
+{
+  find_many_state *state = (find_many_state *)arg;
+  for (size_t i = 0; i < state->items->size(); i++) {
+    if ((*state->items)[i].record.data)
+      enif_release_binary(&(*state->items)[i].record);
+    if ((*state->items)[i].owns_key)
+      enif_release_binary(&(*state->items)[i].key);
+  }
+  delete state->items;
+}
+
+static void
+stream_resource_cleanup(ErlNifEnv *env, void *arg)
+{
+  stream_state *state = (stream_state *)arg;
+  db_wrapper *dwrapper = state->dwrapper;
+
+  // the consumer dropped the stream; stop the producer unless db_close
+  // did already
+  enif_mutex_lock(dwrapper->streams_lock);
+  for (stream_state **p = &dwrapper->streams; *p; p = &(*p)->next_stream)
+    if (*p == state) {
+      *p = state->next_stream;
+      break;
+    }
+  stream_stop(state);
+  enif_mutex_unlock(dwrapper->streams_lock);
+
+  enif_cond_destroy(state->cond);
+  enif_mutex_destroy(state->lock);
+  enif_free_env(state->env);
+  if (state->twrapper)
+    enif_release_resource(state->twrapper);
+  enif_release_resource(state->dwrapper);
+}
+
+static void
+compact_resource_cleanup(ErlNifEnv *env, void *arg)
+{
+  compact_state *state = (compact_state *)arg;
+
+  // the caller dropped the handle; stop the compaction
+  state->cancelled = true;
+  if (state->tid)
+    enif_thread_join(state->tid, 0);
+  enif_free_env(state->env);
+}
+
 static int
 on_load(ErlNifEnv *env, void **priv_data, ERL_NIF_TERM load_info)
 {
@@ -1272,6 +8831,11 @@ on_load(ErlNifEnv *env, void **priv_data, ERL_NIF_TERM load_info)
   g_atom_error = enif_make_atom(env, "error");
   g_atom_key_not_found = enif_make_atom(env, "key_not_found");
   g_atom_duplicate_key = enif_make_atom(env, "duplicate_key");
+  g_atom_not_found = enif_make_atom(env, "not_found");
+
+  ErlNifSysInfo info;
+  enif_system_info(&info, sizeof(info));
+  g_dirty_supported = info.dirty_scheduler_support != 0;
 
   g_ups_env_resource = enif_open_resource_type(env, NULL, "ups_env_resource",
                             &env_resource_cleanup,
@@ -1293,6 +8857,30 @@ on_load(ErlNifEnv *env, void **priv_data, ERL_NIF_TERM load_info)
                             &result_resource_cleanup,
                             (ErlNifResourceFlags)(ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER),
                             0);
+  g_ups_blob_resource = enif_open_resource_type(env, NULL,
+                            "ups_blob_resource", 0,
+                            (ErlNifResourceFlags)(ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER),
+                            0);
+  g_ups_stream_resource = enif_open_resource_type(env, NULL,
+                            "ups_stream_resource",
+                            &stream_resource_cleanup,
+                            (ErlNifResourceFlags)(ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER),
+                            0);
+  g_ups_find_many_resource = enif_open_resource_type(env, NULL,
+                            "ups_find_many_resource",
+                            &find_many_resource_cleanup,
+                            (ErlNifResourceFlags)(ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER),
+                            0);
+  g_ups_statement_resource = enif_open_resource_type(env, NULL,
+                            "ups_statement_resource",
+                            &statement_resource_cleanup,
+                            (ErlNifResourceFlags)(ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER),
+                            0);
+  g_ups_compact_resource = enif_open_resource_type(env, NULL,
+                            "ups_compact_resource",
+                            &compact_resource_cleanup,
+                            (ErlNifResourceFlags)(ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER),
+                            0);
   return (0);
 }
 
@@ -1300,39 +8888,128 @@ extern "C" {
 
 static ErlNifFunc ups_nif_funcs[] =
 {
-  {"strerror", 1, ups_nifs_strerror},
-  {"env_create", 4, ups_nifs_env_create},
-  {"env_open", 3, ups_nifs_env_open},
-  {"env_create_db", 4, ups_nifs_env_create_db},
-  {"env_open_db", 4, ups_nifs_env_open_db},
-  {"env_rename_db", 3, ups_nifs_env_rename_db},
-  {"env_erase_db", 2, ups_nifs_env_erase_db},
-  {"db_insert", 5, ups_nifs_db_insert},
-  {"db_erase", 3, ups_nifs_db_erase},
-  {"db_find", 3, ups_nifs_db_find},
-  {"db_find_flags", 4, ups_nifs_db_find_flags},
-  {"db_close", 1, ups_nifs_db_close},
-  {"txn_begin", 2, ups_nifs_txn_begin},
-  {"txn_abort", 1, ups_nifs_txn_abort},
-  {"txn_commit", 1, ups_nifs_txn_commit},
-  {"env_close", 1, ups_nifs_env_close},
-  {"cursor_create", 2, ups_nifs_cursor_create},
-  {"cursor_clone", 1, ups_nifs_cursor_clone},
-  {"cursor_move", 2, ups_nifs_cursor_move},
-  {"cursor_overwrite", 2, ups_nifs_cursor_overwrite},
-  {"cursor_find", 2, ups_nifs_cursor_find},
-  {"cursor_insert", 4, ups_nifs_cursor_insert},
-  {"cursor_erase", 1, ups_nifs_cursor_erase},
-  {"cursor_get_duplicate_count", 1, ups_nifs_cursor_get_duplicate_count},
-  {"cursor_get_record_size", 1, ups_nifs_cursor_get_record_size},
-  {"cursor_close", 1, ups_nifs_cursor_close},
-  {"uqi_select_range", 4, ups_nifs_uqi_select_range},
-  {"uqi_result_get_row_count", 1, ups_nifs_uqi_result_get_row_count},
-  {"uqi_result_get_key_type", 1, ups_nifs_uqi_result_get_key_type},
-  {"uqi_result_get_record_type", 1, ups_nifs_uqi_result_get_record_type},
-  {"uqi_result_get_key", 2, ups_nifs_uqi_result_get_key},
-  {"uqi_result_get_record", 2, ups_nifs_uqi_result_get_record},
-  {"uqi_result_close", 1, ups_nifs_uqi_result_close},
+  {"strerror", 1,
+      nif_dispatch<OP_STRERROR, ups_nifs_strerror>},
+  {"env_create", 4,
+      nif_dispatch<OP_ENV_CREATE, ups_nifs_env_create>},
+  {"env_open", 3,
+      nif_dispatch<OP_ENV_OPEN, ups_nifs_env_open>},
+  {"env_create_db", 4,
+      nif_dispatch<OP_ENV_CREATE_DB, ups_nifs_env_create_db>},
+  {"env_open_db", 4,
+      nif_dispatch<OP_ENV_OPEN_DB, ups_nifs_env_open_db>},
+  {"env_rename_db", 3,
+      nif_dispatch<OP_ENV_RENAME_DB, ups_nifs_env_rename_db>},
+  {"env_erase_db", 2,
+      nif_dispatch<OP_ENV_ERASE_DB, ups_nifs_env_erase_db>},
+  {"db_insert", 5,
+      nif_dispatch<OP_DB_INSERT, ups_nifs_db_insert>},
+  {"db_erase", 3,
+      nif_dispatch<OP_DB_ERASE, ups_nifs_db_erase>},
+  {"db_find", 3,
+      nif_dispatch<OP_DB_FIND, ups_nifs_db_find>},
+  {"db_find_flags", 4,
+      nif_dispatch<OP_DB_FIND_FLAGS, ups_nifs_db_find_flags>},
+  {"db_close", 1,
+      nif_dispatch<OP_DB_CLOSE, ups_nifs_db_close>},
+  {"txn_begin", 2,
+      nif_dispatch<OP_TXN_BEGIN, ups_nifs_txn_begin>},
+  {"txn_abort", 1,
+      nif_dispatch<OP_TXN_ABORT, ups_nifs_txn_abort>},
+  {"txn_commit", 1,
+      nif_dispatch<OP_TXN_COMMIT, ups_nifs_txn_commit>},
+  {"env_close", 1,
+      nif_dispatch<OP_ENV_CLOSE, ups_nifs_env_close>},
+  {"cursor_create", 2,
+      nif_dispatch<OP_CURSOR_CREATE, ups_nifs_cursor_create>},
+  {"cursor_clone", 1,
+      nif_dispatch<OP_CURSOR_CLONE, ups_nifs_cursor_clone>},
+  {"cursor_move", 2,
+      nif_dispatch<OP_CURSOR_MOVE, ups_nifs_cursor_move>},
+  {"cursor_overwrite", 2,
+      nif_dispatch<OP_CURSOR_OVERWRITE, ups_nifs_cursor_overwrite>},
+  {"cursor_find", 2,
+      nif_dispatch<OP_CURSOR_FIND, ups_nifs_cursor_find>},
+  {"cursor_insert", 4,
+      nif_dispatch<OP_CURSOR_INSERT, ups_nifs_cursor_insert>},
+  {"cursor_erase", 1,
+      nif_dispatch<OP_CURSOR_ERASE, ups_nifs_cursor_erase>},
+  {"cursor_get_duplicate_count", 1,
+      nif_dispatch<OP_CURSOR_GET_DUPLICATE_COUNT, ups_nifs_cursor_get_duplicate_count>},
+  {"cursor_get_record_size", 1,
+      nif_dispatch<OP_CURSOR_GET_RECORD_SIZE, ups_nifs_cursor_get_record_size>},
+  {"cursor_close", 1,
+      nif_dispatch<OP_CURSOR_CLOSE, ups_nifs_cursor_close>},
+  {"uqi_select_range", 4,
+      nif_dispatch<OP_UQI_SELECT_RANGE, ups_nifs_uqi_select_range>},
+  {"uqi_result_get_row_count", 1,
+      nif_dispatch<OP_UQI_RESULT_GET_ROW_COUNT, ups_nifs_uqi_result_get_row_count>},
+  {"uqi_result_get_key_type", 1,
+      nif_dispatch<OP_UQI_RESULT_GET_KEY_TYPE, ups_nifs_uqi_result_get_key_type>},
+  {"uqi_result_get_record_type", 1,
+      nif_dispatch<OP_UQI_RESULT_GET_RECORD_TYPE, ups_nifs_uqi_result_get_record_type>},
+  {"uqi_result_get_key", 2,
+      nif_dispatch<OP_UQI_RESULT_GET_KEY, ups_nifs_uqi_result_get_key>},
+  {"uqi_result_get_key", 3,
+      nif_dispatch<OP_UQI_RESULT_GET_KEY, ups_nifs_uqi_result_get_key>},
+  {"uqi_result_get_record", 2,
+      nif_dispatch<OP_UQI_RESULT_GET_RECORD, ups_nifs_uqi_result_get_record>},
+  {"uqi_result_get_record", 3,
+      nif_dispatch<OP_UQI_RESULT_GET_RECORD, ups_nifs_uqi_result_get_record>},
+  {"uqi_result_close", 1,
+      nif_dispatch<OP_UQI_RESULT_CLOSE, ups_nifs_uqi_result_close>},
+  {"uqi_result_slice", 3,
+      nif_dispatch<OP_UQI_RESULT_SLICE, ups_nifs_uqi_result_slice>},
+  {"env_metrics", 1,
+      nif_dispatch<OP_ENV_METRICS, ups_nifs_env_metrics>},
+  {"trace_threshold", 1,
+      nif_dispatch<OP_TRACE_THRESHOLD, ups_nifs_trace_threshold>},
+  {"trace_dump", 0,
+      nif_dispatch<OP_TRACE_DUMP, ups_nifs_trace_dump>},
+  {"trace_subscribe", 1,
+      nif_dispatch<OP_TRACE_SUBSCRIBE, ups_nifs_trace_subscribe>},
+  {"trace_unsubscribe", 1,
+      nif_dispatch<OP_TRACE_UNSUBSCRIBE, ups_nifs_trace_unsubscribe>},
+  {"async_insert", 5,
+      nif_dispatch<OP_ASYNC_INSERT, ups_nifs_async_insert>},
+  {"async_find", 4,
+      nif_dispatch<OP_ASYNC_FIND, ups_nifs_async_find>},
+  {"async_erase", 3,
+      nif_dispatch<OP_ASYNC_ERASE, ups_nifs_async_erase>},
+  {"db_insert_many", 4,
+      nif_dispatch<OP_DB_INSERT_MANY, ups_nifs_db_insert_many>},
+  {"db_find_many", 3,
+      nif_dispatch<OP_DB_FIND_MANY, ups_nifs_db_find_many>},
+  {"cursor_fold", 5,
+      nif_dispatch<OP_CURSOR_FOLD, ups_nifs_cursor_fold>},
+  {"stream_range", 7,
+      nif_dispatch<OP_STREAM_RANGE, ups_nifs_stream_range>},
+  {"stream_ack", 2,
+      nif_dispatch<OP_STREAM_ACK, ups_nifs_stream_ack>},
+  {"stream_cancel", 1,
+      nif_dispatch<OP_STREAM_CANCEL, ups_nifs_stream_cancel>},
+  {"db_flush_buffer", 1,
+      nif_dispatch<OP_DB_FLUSH_BUFFER, ups_nifs_db_flush_buffer>},
+  {"db_cache_stats", 1,
+      nif_dispatch<OP_DB_CACHE_STATS, ups_nifs_db_cache_stats>},
+  {"db_bloom_stats", 1,
+      nif_dispatch<OP_DB_BLOOM_STATS, ups_nifs_db_bloom_stats>},
+  {"uqi_prepare", 2,
+      nif_dispatch<OP_UQI_PREPARE, ups_nifs_uqi_prepare>},
+  {"uqi_execute", 3,
+      nif_dispatch<OP_UQI_EXECUTE, ups_nifs_uqi_execute>},
+  {"db_bulk_insert", 3,
+      nif_dispatch<OP_DB_BULK_INSERT, ups_nifs_db_bulk_insert>},
+  {"env_backup", 6, nif_dispatch<OP_ENV_BACKUP, ups_nifs_env_backup>},
+  {"env_compact", 5, nif_dispatch<OP_ENV_COMPACT, ups_nifs_env_compact>},
+  {"env_compact_cancel", 1,
+      nif_dispatch<OP_ENV_COMPACT_CANCEL, ups_nifs_env_compact_cancel>},
+  {"env_dump", 5, nif_dispatch<OP_ENV_DUMP, ups_nifs_env_dump>},
+  {"env_restore", 3, nif_dispatch<OP_ENV_RESTORE, ups_nifs_env_restore>},
+  {"db_train_codec", 3,
+      nif_dispatch<OP_DB_TRAIN_CODEC, ups_nifs_db_train_codec>},
+  {"db_erase_range", 6,
+      nif_dispatch<OP_DB_ERASE_RANGE, ups_nifs_db_erase_range>},
 };
 
 ERL_NIF_INIT(ups_nifs, ups_nif_funcs, on_load, NULL, NULL, NULL);
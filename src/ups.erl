@@ -36,16 +36,35 @@
    env_open_db/2, env_open_db/3, env_open_db/4,
    env_rename_db/3,
    env_erase_db/2,
+   env_backup/3,
+   env_compact/2, env_compact/3,
+   dump/3,
+   restore/3,
+   env_metrics/1,
+   trace_threshold/1,
+   trace_dump/0,
+   trace_subscribe/1,
+   trace_unsubscribe/1,
    db_insert/3, db_insert/4, db_insert/5,
+   db_insert_many/2, db_insert_many/3, db_insert_many/4,
    db_erase/2, db_erase/3,
+   erase_range/5,
    db_find/2, db_find/3, db_find/4,
+   db_find_many/2, db_find_many/3,
    db_close/1,
+   db_flush_buffer/1,
+   db_cache_stats/1,
+   db_bloom_stats/1,
+   db_train_codec/2,
+   bulk_load/2, bulk_load/3,
    txn_begin/1, txn_begin/2,
    txn_abort/1,
    txn_commit/1,
    cursor_create/1, cursor_create/2,
    cursor_clone/1, 
    cursor_move/2, 
+   cursor_fold/1, cursor_fold/5,
+   prefix_scan/4,
    cursor_overwrite/2, 
    cursor_find/2,
    cursor_insert/3, cursor_insert/4,
@@ -58,9 +77,20 @@
    uqi_result_get_row_count/1,
    uqi_result_get_key_type/1,
    uqi_result_get_record_type/1,
-   uqi_result_get_key/2,
-   uqi_result_get_record/2,
-   uqi_result_close/1
+   uqi_result_get_key/2, uqi_result_get_key/3,
+   uqi_result_get_record/2, uqi_result_get_record/3,
+   uqi_result_to_list/1,
+   uqi_result_slice/3,
+   uqi_result_close/1,
+   uqi_prepare/2,
+   uqi_execute/3,
+   async_insert/4, async_insert/5,
+   async_find/3, async_find/4,
+   async_erase/3,
+   async_await/1, async_await/2,
+   stream_range/5,
+   stream_ack/2,
+   stream_cancel/1
    ]).
 
 
@@ -102,6 +132,20 @@ env_create(Filename, Flags, Mode) ->
 %% @doc Creates a new Environment. Expects a filename, flags, file access
 %% mode (chmod) and a list of additional parameters for the new
 %% Environment. See @type env_create_flags.
+%% Besides the native parameters, `{dirty_policy, auto | always | never}'
+%% and `{dirty_threshold, Bytes}' control whether calls on this Environment
+%% are executed on dirty schedulers. With `auto' (the default), opening and
+%% closing files, queries, commits of fsync-enabled Environments and inserts
+%% of records with at least `dirty_threshold' bytes (default: 64 kb) are
+%% rescheduled.
+%% `{group_commit_window, Usecs}' enables group commit: txn_commit/1 waits
+%% till its commit is flushed to disk together with all other commits which
+%% arrive within the window, or until `{group_commit_size, N}' (default: 64)
+%% commits are pending. The Environment is then opened without
+%% `enable_fsync'; each group is made durable with a single flush. If
+%% `enable_fsync' was requested, all other writes outside of a Transaction
+%% (including batches, cursors, asynchronous requests and flushes of the
+%% write buffer) are flushed when they return, as before.
 %% This wraps the native ups_env_create function.
 -spec env_create(string(), [env_create_flag()], integer(),
        [{atom(), integer() | atom()}]) ->
@@ -128,6 +172,8 @@ env_open(Filename, Flags) ->
 
 %% @doc Opens an existing Environment. Expects a filename, flags and
 %% additional parameters. See @type env_open_flags.
+%% Supports the `dirty_policy', `dirty_threshold', `group_commit_window' and
+%% `group_commit_size' parameters (see env_create/4).
 %% This wraps the native ups_env_open function.
 -spec env_open(string(), [env_open_flag()],
        [{atom(), integer() | atom()}]) ->
@@ -158,10 +204,55 @@ env_create_db(Env, Dbname, Flags) ->
 %% @doc Creates a new Database in an Environment. Expects a handle for the
 %% Environment, the name, flags and a list of additional parameters of
 %% the new Database.
+%% Besides the native parameters, `{zero_copy_threshold, Bytes}' enables
+%% zero-copy lookups: db_find, cursor_find and cursor_move return records
+%% with at least `Bytes' bytes as binaries which point to memory that
+%% upscaledb wrote the record to, without copying them again.
+%% Keys and records of Databases with a numeric `key_type' or `record_type'
+%% can always be passed as integers or floats; `{typed_terms, true}'
+%% returns them as integers and floats as well (instead of binaries).
+%% `{write_buffer_size, Bytes}' enables a write-behind buffer: db_insert/5
+%% and db_erase/3 without a Transaction are collected in a sorted in-memory
+%% table, which db_find/3 reads first. The table is written to the Database
+%% (in key order, and in a single Transaction if the Environment has
+%% Transactions enabled) when it holds `Bytes' bytes, when a write finds
+%% the oldest buffered write older than `{write_buffer_age, Milliseconds}',
+%% with db_flush_buffer/1 and when the Database or the Environment is
+%% closed. Cursors, queries, streams, batches, asynchronous and
+%% transactional calls flush the buffer before they access the Database.
+%% Buffered writes are lost if the VM terminates before they are written.
+%% With `{write_buffer_durability, flush}' (default: `none') every flush of
+%% the buffer also flushes the Environment to disk.
+%% Databases with record numbers, duplicate keys or a custom key type are
+%% never buffered.
+%% `{read_cache_size, Bytes}' caches the records of db_find/3 lookups
+%% without a Transaction; a cached record is returned without calling
+%% upscaledb and without copying it. The cache is invalidated by every
+%% write of this module (see db_cache_stats/1).
+%% `{bloom_filter_fpr, Rate}' (a float between 0 and 1) maintains a Bloom
+%% filter of the keys with this false positive rate, sized for
+%% `{bloom_filter_keys, N}' keys (default: 1000000). db_find/3 and
+%% db_find_many/3 return `{error, key_not_found}' without calling upscaledb
+%% if the filter does not contain a key. Erased keys stay in the filter.
+%% When the Database is closed the filter is saved next to the
+%% Environment file and loaded when the Database is opened again; without
+%% a saved filter, the keys are scanned in the background and the filter
+%% is used when the scan is complete (see db_bloom_stats/1). Databases with
+%% record numbers or a custom key type have no filter.
+%% `{key_codec, term}' stores the keys of a Database with binary keys as
+%% Erlang terms: integers (64 bit), floats, atoms, binaries, tuples and
+%% lists of these can be used as keys, and are returned as terms. They are
+%% encoded so that they sort in Erlang's term order, except that tuples of
+%% different sizes are compared element by element (a prefix sorts first);
+%% see prefix_scan/4. The codec is stored in the Environment (in the
+%% reserved Database 16#EFFF) and used whenever the Database is opened;
+%% opening it with `{key_codec, binary}' fails with
+%% `{error, inv_parameter}'. The atoms `undefined' and `continue' can
+%% not be used as bounds of cursor_fold/5 and stream_range/5.
 %% See @type env_create_db_flag.
 %% This wraps the native ups_env_create_db function.
 -spec env_create_db(env(), integer(), [env_create_db_flag()],
-       [{atom(), integer() | atom()}]) ->
+       [{atom(), integer() | float() | atom()}]) ->
   {ok, db()} | {error, atom()}.
 env_create_db(Env, Dbname, Flags, Parameters) ->
   env_create_db_impl(Env, Dbname, Flags, Parameters).
@@ -187,11 +278,13 @@ env_open_db(Env, Dbname, Flags) ->
 
 %% @doc Opens an existing Database in an Environment. Expects a handle for the
 %% Environment, the name, flags and a list of additional parameters of
-%% the Database.
+%% the Database. Supports the `zero_copy_threshold', `typed_terms',
+%% `write_buffer_*', `read_cache_size', `bloom_filter_*' and `key_codec'
+%% parameters (see env_create_db/4).
 %% See @type env_open_db_flag.
 %% This wraps the native ups_env_open_db function.
 -spec env_open_db(env(), integer(), [env_open_db_flag()],
-       [{atom(), integer() | atom()}]) ->
+       [{atom(), integer() | float() | atom()}]) ->
   {ok, db()} | {error, atom()}.
 env_open_db(Env, Dbname, Flags, Parameters) ->
   env_open_db_impl(Env, Dbname, Flags, Parameters).
@@ -216,6 +309,54 @@ env_rename_db(Env, Oldname, Newname) ->
 env_erase_db(Env, Dbname) ->
   ups_nifs:env_erase_db(Env, Dbname).
 
+%% @doc Returns the metrics of an Environment. `engine' holds the metrics
+%% of upscaledb (page cache hits and misses, pages fetched and flushed,
+%% blob and freelist statistics etc). `nif' holds the counters of the
+%% NIF layer, which are shared by all Environments: `calls', `bytes_in',
+%% `bytes_out' and `allocs' are maps from operation to counter, `errors'
+%% maps status atoms to the number of times they were returned.
+%% This wraps the native ups_env_get_metrics function.
+-spec env_metrics(env()) ->
+  {ok, #{engine := #{atom() => non_neg_integer()},
+         nif := #{atom() => #{atom() => non_neg_integer()}}}}
+  | {error, atom()}.
+env_metrics(Env) ->
+  ups_nifs:env_metrics(Env).
+
+%% @doc Enables the flight recorder: every call which takes at least
+%% `Microseconds' is recorded (see trace_dump/0) and sent to the
+%% subscribers (see trace_subscribe/1). 0 disables the recorder (the
+%% default). For functions which yield or run on a dirty scheduler, only
+%% the time spent in a single scheduler slot is measured.
+-spec trace_threshold(non_neg_integer()) ->
+  ok.
+trace_threshold(Microseconds) ->
+  ups_nifs:trace_threshold(Microseconds).
+
+%% @doc Returns the most recent slow calls, oldest first. Each entry is a map
+%% with the operation (`op'), the name of the Database (`db'), the first
+%% bytes of the key (`key') and its full size (`key_size'), the size of the
+%% record (`record_size'), the last status (`status'), the duration
+%% (`duration_ns') and the start time in nanoseconds (`timestamp', see
+%% erlang:system_time/1).
+-spec trace_dump() ->
+  [trace_entry()].
+trace_dump() ->
+  ups_nifs:trace_dump().
+
+%% @doc Sends every slow call to `Pid' as `{ups_trace, Entry}' (see
+%% trace_dump/0).
+-spec trace_subscribe(pid()) ->
+  ok.
+trace_subscribe(Pid) ->
+  ups_nifs:trace_subscribe(Pid).
+
+%% @doc Stops sending slow calls to `Pid'.
+-spec trace_unsubscribe(pid()) ->
+  ok.
+trace_unsubscribe(Pid) ->
+  ups_nifs:trace_unsubscribe(Pid).
+
 
 
 %% @doc Closes a Database handle.
@@ -225,6 +366,93 @@ env_erase_db(Env, Dbname) ->
 db_close(Db) ->
   ups_nifs:db_close(Db).
 
+%% @doc Writes the buffered inserts and erases of a Database to disk (see
+%% env_create_db/4). Returns `ok' if the Database has no write buffer.
+-spec db_flush_buffer(db()) ->
+  ok | {error, atom()}.
+db_flush_buffer(Db) ->
+  ups_nifs:db_flush_buffer(Db).
+
+%% @doc Returns the counters of the read cache of a Database (see
+%% env_create_db/4): `hits', `misses', `evictions', the number of cached
+%% records (`entries') and their estimated memory usage (`bytes'). All
+%% counters are 0 if the Database has no read cache.
+-spec db_cache_stats(db()) ->
+  {ok, #{atom() => non_neg_integer()}}.
+db_cache_stats(Db) ->
+  ups_nifs:db_cache_stats(Db).
+
+%% @doc Returns the counters of the Bloom filter of a Database (see
+%% env_create_db/4): the number of lookups which were checked (`checks'),
+%% which were answered by the filter (`negatives') and which passed the
+%% filter but did not find their key (`false_positives'), the size of the
+%% filter (`bits', `hashes') and whether the filter is used (`ready').
+-spec db_bloom_stats(db()) ->
+  {ok, #{atom() => non_neg_integer() | boolean()}}.
+db_bloom_stats(Db) ->
+  ups_nifs:db_bloom_stats(Db).
+
+%% @doc Trains a compression dictionary from a sample of the records of a
+%% Database. From then on, records written through this module are
+%% compressed with zlib and the dictionary, and decompressed when they are
+%% read; records written before remain readable. The first training
+%% rewrites the older records which start with the bytes of an encoded
+%% record (16#FF, 16#DC, version:16, size:32) so that they are not
+%% decoded; all reads and writes of the Environment wait till this rewrite
+%% is finished. Each training
+%% adds a new version of the dictionary, therefore it can be repeated while
+%% the Database is in use. The dictionaries are stored in the Environment
+%% (in the reserved Database 16#EFFF). Only binary records of variable size
+%% are compressed, and UQI queries see the compressed records. Reading a
+%% record which cannot be decompressed fails with
+%% `{error, integrity_violated}'. Options (defaults in brackets):
+%% <ul>
+%% <li>`{sample_size, N}' [1000]: the number of records which are sampled</li>
+%% <li>`{dictionary_size, Bytes}' [16384]: at most 32768</li>
+%% </ul>
+-spec db_train_codec(db(), [{sample_size, pos_integer()}
+                            | {dictionary_size, pos_integer()}]) ->
+  {ok, #{version := pos_integer(), dictionary_size := non_neg_integer(),
+         samples := non_neg_integer()}}
+  | {error, atom()}.
+db_train_codec(Db, Options) ->
+  ups_nifs:db_train_codec(Db,
+                          proplists:get_value(sample_size, Options, 1000),
+                          proplists:get_value(dictionary_size, Options,
+                                              16384)).
+
+%% @doc Loads Key/Value pairs into a Database. See bulk_load/3.
+-spec bulk_load(db(), {generator, fun()} | {file, string()}) ->
+  {ok, non_neg_integer()} | {error, term()}.
+bulk_load(Db, Source) ->
+  ups_bulk:load(Db, Source, []).
+
+%% @doc Loads Key/Value pairs into a Database, in key order and with the
+%% `UPS_HINT_APPEND' hint; this is much faster than db_insert/3 if the keys
+%% are greater than the keys which are already stored. `Source' is
+%% <ul>
+%% <li>`{generator, Fun}': `Fun()' returns `{ok, Pairs, NextFun}' with
+%%   the next sorted list of pairs, `eof' or `{error, Reason}'</li>
+%% <li>`{file, Path}': an unsorted file of pairs (see
+%%   ups_bulk:encode_pairs/1), which is sorted with at most
+%%   `{memory, Bytes}' bytes of memory (default: 64 MB); the temporary
+%%   files are written to `{tmp_dir, Dir}' (default: the directory of
+%%   the file)</li>
+%% </ul>
+%% The pairs are inserted in batches of `{batch_size, N}' pairs (default:
+%% 10000); each batch is a single Transaction if the Environment has
+%% Transactions enabled. `{overwrite, true}' overwrites existing keys,
+%% otherwise they fail with `{error, duplicate_key}'. `{progress, Fun}' is
+%% called with the number of inserted pairs after each batch.
+%% Returns the number of inserted pairs.
+-spec bulk_load(db(), {generator, fun()} | {file, string()},
+                [{batch_size, pos_integer()} | {memory, pos_integer()}
+                 | {tmp_dir, string()} | {overwrite, boolean()}
+                 | {progress, fun((non_neg_integer()) -> any())}]) ->
+  {ok, non_neg_integer()} | {error, term()}.
+bulk_load(Db, Source, Options) ->
+  ups_bulk:load(Db, Source, Options).
+
 
 
 %% @doc Closes an Environment handle.
@@ -232,18 +460,109 @@ db_close(Db) ->
 env_close(Env) ->
   ups_nifs:env_close(Env).
 
+%% @doc Copies the file of an Environment to `Target' while the Environment
+%% remains in use. The copy runs in a native thread and reports to the
+%% calling process:
+%% <ul>
+%% <li>`{ups_backup, Ref, {progress, BytesRead, Total}}' every 64 MB</li>
+%% <li>`{ups_backup, Ref, {ok, #{bytes := Bytes, written := Written}}}'
+%%   when the backup is complete</li>
+%% <li>`{ups_backup, Ref, {error, Reason}}'</li>
+%% </ul>
+%% After the first pass a second pass copies what changed in the
+%% meantime. Then calls which modify the file wait while the Environment
+%% is flushed and, on file systems which support reflinks (e.g. Btrfs or
+%% XFS), cloned; the rest of the backup copies from the clone. On other
+%% file systems they wait while the backup compares the whole file with
+%% the copy and rewrites the blocks which changed.
+%% With `{incremental, true}' an existing copy is updated and only changed
+%% blocks are written. `{rate_limit, BytesPerSecond}' throttles the first
+%% pass (default: 0, unlimited). Only one backup per Environment can run
+%% at a time; closing the Environment cancels it. The journal files are not copied.
+-spec env_backup(env(), string(),
+                 [{incremental, boolean()} | {rate_limit, non_neg_integer()}]) ->
+  {ok, reference()} | {error, atom()}.
+env_backup(Env, Target, Options) ->
+  Incremental = proplists:get_value(incremental, Options, false),
+  RateLimit = proplists:get_value(rate_limit, Options, 0),
+  Ref = make_ref(),
+  case ups_nifs:env_backup(Env, Target, Incremental, RateLimit, self(),
+                           Ref) of
+    ok ->
+      {ok, Ref};
+    Error ->
+      Error
+  end.
+
+%% @doc Compacts the Environment in `Path' and replaces the file by the
+%% compacted copy. See env_compact/3.
+-spec env_compact(string(), [{timeout, timeout()}]) ->
+  {ok, map()} | {error, atom()}.
+env_compact(Path, Options) ->
+  env_compact_impl(Path, Path ++ ".compact", true, Options).
+
+%% @doc Copies all Databases of the Environment in `Source' into a new
+%% Environment in `Target', with the same page size and Database
+%% parameters. The keys are inserted in order and the pages are filled
+%% densely; the space of erased keys and Databases is not copied. The
+%% copy runs in a native thread; the calling process waits for the result
+%% (a map with `bytes_before', `bytes_after', `bytes_saved', `databases'
+%% and `keys'). After `{timeout, Ms}' (default: infinity) the compaction
+%% is cancelled.
+%%
+%% The source is opened read-only and must not be open. To compact a live
+%% Environment, compact a copy made by env_backup/3.
+-spec env_compact(string(), string(), [{timeout, timeout()}]) ->
+  {ok, map()} | {error, atom()}.
+env_compact(Source, Target, Options) ->
+  env_compact_impl(Source, Target, false, Options).
+
+%% @doc Writes all Databases of an Environment to a dump file, which can be
+%% loaded with restore/3 on another host. The file stores the parameters
+%% of each Database and its pairs in key order, in blocks which are
+%% compressed independently by a pool of native threads; the format is
+%% described in c_src/ups_nifs.cc. Options (defaults in brackets):
+%% <ul>
+%% <li>`{codec, none | zlib | snappy}' [snappy]</li>
+%% <li>`{block_size, Bytes}' [1 MB]: the uncompressed size of a block</li>
+%% <li>`{threads, N}' [the number of schedulers]</li>
+%% </ul>
+%% Databases which are not open are opened and closed again. Writes which
+%% run concurrently may or may not be included. Blocks are limited to 64 MB;
+%% a larger pair fails the dump with `{error, limits_reached}'.
+-spec dump(env(), string(), [{codec, none | zlib | snappy}
+                             | {block_size, pos_integer()}
+                             | {threads, non_neg_integer()}]) ->
+  {ok, #{databases := non_neg_integer(), pairs := non_neg_integer()}}
+  | {error, atom()}.
+dump(Env, Path, Options) ->
+  ups_nifs:env_dump(Env, Path,
+                    proplists:get_value(codec, Options, snappy),
+                    proplists:get_value(block_size, Options, 1024 * 1024),
+                    dump_threads(Options)).
+
+%% @doc Creates a new Environment in `Target' from a file written by
+%% dump/3. The blocks are decompressed by `{threads, N}' native threads
+%% [the number of schedulers] and the pairs are appended in key order. The
+%% Environment is removed if the file is truncated or corrupt.
+-spec restore(string(), string(), [{threads, non_neg_integer()}]) ->
+  {ok, #{databases := non_neg_integer(), pairs := non_neg_integer()}}
+  | {error, atom()}.
+restore(Path, Target, Options) ->
+  ups_nifs:env_restore(Path, Target, dump_threads(Options)).
+
 
 
 %% @doc Inserts a new Key/Value pair into the Database.
 %% This wraps the native ups_db_insert function.
--spec db_insert(db(), binary(), binary()) ->
+-spec db_insert(db(), key(), value()) ->
   ok | {error, atom()}.
 db_insert(Db, Key, Value) ->
   db_insert_impl(Db, undefined, Key, Value, []).
 
 %% @doc Inserts a new Key/Value pair into the Database in a Transaction.
 %% This wraps the native ups_db_insert function.
--spec db_insert(db(), txn() | undefined, binary(), binary()) ->
+-spec db_insert(db(), txn() | undefined, key(), value()) ->
   ok | {error, atom()}.
 db_insert(Db, Txn, Key, Value) ->
   db_insert_impl(Db, Txn, Key, Value, []).
@@ -251,49 +570,124 @@ db_insert(Db, Txn, Key, Value) ->
 %% @doc Inserts a new Key/Value pair into the Database. Accepts additional
 %% flags for the operation.
 %% This wraps the native ups_db_insert function.
--spec db_insert(db(), txn() | undefined, binary(),
-                binary(), [db_insert_flag()]) ->
+-spec db_insert(db(), txn() | undefined, key(),
+                value(), [db_insert_flag()]) ->
   ok | {error, atom()}.
 db_insert(Db, Txn, Key, Value, Flags) ->
   db_insert_impl(Db, Txn, Key, Value, Flags).
 
+%% @doc Inserts a list of Key/Value pairs into the Database.
+%% See db_insert_many/4.
+-spec db_insert_many(db(), [{key(), value()}]) ->
+  {ok, non_neg_integer(), [{key(), atom()}]}.
+db_insert_many(Db, Pairs) ->
+  ups_nifs:db_insert_many(Db, undefined, Pairs, 0).
+
+%% @doc Inserts a list of Key/Value pairs into the Database in a Transaction.
+%% See db_insert_many/4.
+-spec db_insert_many(db(), txn() | undefined, [{key(), value()}]) ->
+  {ok, non_neg_integer(), [{key(), atom()}]}.
+db_insert_many(Db, Txn, Pairs) ->
+  ups_nifs:db_insert_many(Db, Txn, Pairs, 0).
+
+%% @doc Inserts a list of Key/Value pairs into the Database. Accepts
+%% additional flags, which are applied to each pair.
+%% The list is processed with a single NIF call which yields when its
+%% timeslice is used up. Pairs which cannot be inserted (i.e. because the
+%% key already exists) do not abort the batch; they are returned as
+%% `{Key, Reason}' together with the number of inserted pairs. So are
+%% malformed items, as `{Key, badarg}' (or `{Item, badarg}' if the item
+%% is not a pair), since the pairs before them may already be inserted.
+%% This wraps the native ups_db_insert function.
+-spec db_insert_many(db(), txn() | undefined, [{key(), value()}],
+                     [db_insert_flag()]) ->
+  {ok, non_neg_integer(), [{key(), atom()}]}.
+db_insert_many(Db, Txn, Pairs, Flags) ->
+  ups_nifs:db_insert_many(Db, Txn, Pairs, insert_db_flags(Flags, 0)).
+
 %% @doc Erases a Key/Value pair (including all duplicates) from the Database.
 %% This wraps the native ups_db_erase function.
--spec db_erase(db(), binary()) ->
+-spec db_erase(db(), key()) ->
   ok | {error, atom()}.
 db_erase(Db, Key) ->
   ups_nifs:db_erase(Db, undefined, Key).
 
 %% @doc Erases a Key/Value pair (including all duplicates) from the Database.
 %% This wraps the native ups_db_erase function.
--spec db_erase(db(), txn() | undefined, binary()) ->
+-spec db_erase(db(), txn() | undefined, key()) ->
   ok | {error, atom()}.
 db_erase(Db, Txn, Key) ->
   ups_nifs:db_erase(Db, Txn, Key).
 
+%% @doc Erases all keys (including their duplicates) of the half-open range
+%% [`StartKey', `EndKey'); either bound can be `undefined'. The range is
+%% erased by a single NIF call in chunks of keys, and the call yields
+%% between chunks when its timeslice is used up. Returns the number of
+%% erased keys. Options (defaults in brackets):
+%% <ul>
+%% <li>`{chunk_size, N}' [1000]: the number of keys which are erased at
+%%   a time</li>
+%% <li>`{sub_transactions, Bool}' [false]: if the Environment has
+%%   Transactions enabled and `Txn' is `undefined', then each chunk is
+%%   erased in its own Transaction. If an error occurs then the chunks
+%%   which were already committed remain erased.</li>
+%% </ul>
+-spec erase_range(db(), txn() | undefined, key() | undefined,
+                  key() | undefined,
+                  [{chunk_size, pos_integer()}
+                   | {sub_transactions, boolean()}]) ->
+  {ok, non_neg_integer()} | {error, atom()}.
+erase_range(Db, Txn, StartKey, EndKey, Options) ->
+  ups_nifs:db_erase_range(Db, Txn, StartKey, EndKey,
+                          proplists:get_value(chunk_size, Options, 1000),
+                          proplists:get_value(sub_transactions, Options,
+                                              false)).
+
 %% @doc Lookup of a Key; returns the associated value from the Database.
 %% This wraps the native ups_db_find function.
--spec db_find(db(), binary()) ->
-  {ok, binary()} | {error, atom()}.
+-spec db_find(db(), key()) ->
+  {ok, value()} | {error, atom()}.
 db_find(Db, Key) ->
   ups_nifs:db_find(Db, undefined, Key).
 
 %% @doc Lookup of a Key; returns the associated value from the Database.
 %% This wraps the native ups_db_find function.
--spec db_find(db(), txn() | undefined, binary()) ->
-  {ok, binary()} | {error, atom()}.
+-spec db_find(db(), txn() | undefined, key()) ->
+  {ok, value()} | {error, atom()}.
 db_find(Db, Txn, Key) ->
   ups_nifs:db_find(Db, Txn, Key).
 
 %% @doc Lookup of a Key; returns the associated value from the Database.
 %% This wraps the native ups_db_find function. It returns key AND record!
--spec db_find(db(), txn() | undefined, binary(), [db_find_flag()]) ->
-  {ok, binary(), binary()} | {error, atom()}.
+-spec db_find(db(), txn() | undefined, key(), [db_find_flag()]) ->
+  {ok, key(), value()} | {error, atom()}.
 db_find(Db, Txn, Key, Flags) ->
   ups_nifs:db_find_flags(Db, Txn, Key, find_db_flags(Flags, 0)).
 
 
 
+%% @doc Lookup of multiple Keys. See db_find_many/3.
+-spec db_find_many(db(), [key()]) ->
+  {ok, [{ok, value()} | not_found | {error, atom()}]}.
+db_find_many(Db, Keys) ->
+  ups_nifs:db_find_many(Db, undefined, Keys).
+
+%% @doc Lookup of multiple Keys with a single call. The keys are sorted
+%% according to the key type of the Database before they are looked up,
+%% therefore consecutive lookups hit the same or adjacent btree pages.
+%% The results are returned in the order of `Keys'; missing keys are
+%% reported as `not_found'. The call yields when its timeslice is used up;
+%% lists of 10000 keys or more are sorted on a dirty scheduler unless the
+%% dirty policy of the Environment is `never', and then looked up on a
+%% normal scheduler unless it is `always'. This wraps the native
+%% ups_db_find function.
+-spec db_find_many(db(), txn() | undefined, [key()]) ->
+  {ok, [{ok, value()} | not_found | {error, atom()}]}.
+db_find_many(Db, Txn, Keys) ->
+  ups_nifs:db_find_many(Db, Txn, Keys).
+
+
+
 %% @doc Begins a new Transaction.
 %% This wraps the native ups_txn_begin function.
 -spec txn_begin(env()) ->
@@ -315,12 +709,21 @@ txn_begin(Env, Flags) ->
 txn_abort(Txn) ->
   ups_nifs:txn_abort(Txn).
 
-%% @doc Commits a running Transaction.
+%% @doc Commits a running Transaction. If the Environment uses group commit,
+%% the calling process waits till the commit was flushed to disk.
 %% This wraps the native ups_txn_commit function.
 -spec txn_commit(txn()) ->
   ok | {error, atom()}.
 txn_commit(Txn) ->
-  ups_nifs:txn_commit(Txn).
+  case ups_nifs:txn_commit(Txn) of
+    {group_commit, Ref} ->
+      receive
+        {ups_commit, Ref, Result} ->
+          Result
+      end;
+    Result ->
+      Result
+  end.
 
 
 
@@ -349,28 +752,89 @@ cursor_clone(Cursor) ->
 %% Key and Record.
 %% This wraps the native ups_cursor_move function.
 -spec cursor_move(cursor(), [cursor_move_flag()]) ->
-  {ok, binary(), binary()} | {error, atom()}.
+  {ok, key(), value()} | {error, atom()}.
 cursor_move(Cursor, Flags) ->
   ups_nifs:cursor_move(Cursor, cursor_move_flags(Flags, 0)).
 
+%% @doc Scans a range of keys in chunks. Returns up to `ChunkSize'
+%% Key/Record pairs, starting at `StartKey' (or the first/last key if
+%% `StartKey' is `undefined') and ending before `EndKey' (or at the end of
+%% the Database if `EndKey' is `undefined'). `Continuation' is passed to
+%% cursor_fold/1 to retrieve the next chunk, or is `'$end_of_table'' if the
+%% range is exhausted.
+%% All keys and records of a chunk share a single binary; holding on to
+%% one of them keeps the whole chunk in memory. A chunk can be shorter than
+%% `ChunkSize' if the scheduler's timeslice was used up.
+-spec cursor_fold(cursor(), key() | undefined, key() | undefined,
+                  pos_integer(), cursor_fold_direction()) ->
+  {ok, [{key(), value()}], term()} | {error, atom()}.
+cursor_fold(Cursor, StartKey, EndKey, ChunkSize, Direction) ->
+  cursor_fold_impl(Cursor, StartKey, EndKey, ChunkSize, Direction).
+
+%% @doc Retrieves the next chunk of a range scan. See cursor_fold/5.
+-spec cursor_fold(term()) ->
+  {ok, [{key(), value()}], term()} | {error, atom()}.
+cursor_fold('$end_of_table') ->
+  {ok, [], '$end_of_table'};
+cursor_fold({cursor_fold, Cursor, EndKey, ChunkSize, Direction}) ->
+  cursor_fold_impl(Cursor, continue, EndKey, ChunkSize, Direction).
+
+%% @doc Returns the Key/Record pairs of a Database with term keys (see
+%% env_create_db/4) whose keys are tuples which start with the elements of
+%% `Prefix', in key order; `{TenantId}' selects all keys
+%% `{TenantId, ...}', including `{TenantId}' itself. The prefix is
+%% turned into a single key range, therefore the scan does not read the
+%% pages of other prefixes. Options (defaults in brackets):
+%% <ul>
+%% <li>`{direction, forward | backward}' [forward]</li>
+%% <li>`{limit, N}' [infinity]: the maximum number of pairs</li>
+%% <li>`{chunk_size, N}' [1000]: the number of pairs which are read by a
+%%   single NIF call</li>
+%% </ul>
+-spec prefix_scan(db(), txn() | undefined, tuple(),
+                  [{direction, cursor_fold_direction()}
+                   | {limit, non_neg_integer() | infinity}
+                   | {chunk_size, pos_integer()}]) ->
+  {ok, [{key(), value()}]} | {error, atom()}.
+prefix_scan(Db, Txn, Prefix, Options) ->
+  Direction = proplists:get_value(direction, Options, forward),
+  ChunkSize = proplists:get_value(chunk_size, Options, 1000),
+  case proplists:get_value(limit, Options, infinity) of
+    0 ->
+      {ok, []};
+    Limit ->
+      case cursor_create(Db, Txn) of
+        {ok, Cursor} ->
+          try
+            prefix_scan_impl(Cursor, undefined, Prefix, ChunkSize,
+                             fold_direction(Direction) bor 16#10000, Limit,
+                             [])
+          after
+            cursor_close(Cursor)
+          end;
+        Error ->
+          Error
+      end
+  end.
+
 %% @doc Overwrites the Record of the Cursor.
 %% This wraps the native ups_cursor_overwrite function.
--spec cursor_overwrite(cursor(), binary()) ->
+-spec cursor_overwrite(cursor(), value()) ->
   ok | {error, atom()}.
 cursor_overwrite(Cursor, Record) ->
   ups_nifs:cursor_overwrite(Cursor, Record).
 
 %% @doc Performs a lookup and points the Cursor to the found key. Returns
 %% the Record. This wraps the native ups_cursor_find function.
--spec cursor_find(cursor(), binary()) ->
-  {ok, binary()} | {error, atom()}.
+-spec cursor_find(cursor(), key()) ->
+  {ok, value()} | {error, atom()}.
 cursor_find(Cursor, Key) ->
   ups_nifs:cursor_find(Cursor, Key).
 
 %% @doc Inserts a Key/Record pair into the Database and points the Cursor
 %% to the inserted Key.
 %% This wraps the native ups_cursor_insert function.
--spec cursor_insert(cursor(), binary(), binary()) ->
+-spec cursor_insert(cursor(), key(), value()) ->
   ok | {error, atom()}.
 cursor_insert(Cursor, Key, Record) ->
   ups_nifs:cursor_insert(Cursor, Key, Record, 0).
@@ -378,7 +842,7 @@ cursor_insert(Cursor, Key, Record) ->
 %% @doc Inserts a Key/Record pair into the Database and points the Cursor
 %% to the inserted Key. Supports additional flags.
 %% This wraps the native ups_cursor_insert function.
--spec cursor_insert(cursor(), binary(), binary(), [cursor_insert_flag()]) ->
+-spec cursor_insert(cursor(), key(), value(), [cursor_insert_flag()]) ->
   ok | {error, atom()}.
 cursor_insert(Cursor, Key, Record, Flags) ->
   ups_nifs:cursor_insert(Cursor, Key, Record, cursor_insert_flags(Flags, 0)).
@@ -413,21 +877,21 @@ cursor_close(Cursor) ->
 
 %% @doc Performs a range select over a database.
 %% This wraps the native uqi_select_range function.
--spec uqi_select_range(env(), string()) ->
+-spec uqi_select_range(env(), string() | binary()) ->
   {ok, result()} | {error, atom()}.
 uqi_select_range(Env, Query) ->
   ups_nifs:uqi_select_range(Env, Query, undefined, undefined).
 
 %% @doc Performs a range select over a database.
 %% This wraps the native uqi_select_range function.
--spec uqi_select_range(env(), string(), cursor()) ->
+-spec uqi_select_range(env(), string() | binary(), cursor()) ->
   {ok, result()} | {error, atom()}.
 uqi_select_range(Env, Query, Cursor) ->
   ups_nifs:uqi_select_range(Env, Query, Cursor, undefined).
 
 %% @doc Performs a range select over a database.
 %% This wraps the native uqi_select_range function.
--spec uqi_select_range(env(), string(), cursor(), cursor()) ->
+-spec uqi_select_range(env(), string() | binary(), cursor(), cursor()) ->
   {ok, result()} | {error, atom()}.
 uqi_select_range(Env, Query, Cursor1, Cursor2) ->
   ups_nifs:uqi_select_range(Env, Query, Cursor1, Cursor2).
@@ -460,6 +924,14 @@ uqi_result_get_record_type(Result) ->
 uqi_result_get_key(Result, Row) ->
   ups_nifs:uqi_result_get_key(Result, Row).
 
+%% @doc Returns a key of an UQI result set. Supports the `zero_copy' option
+%% (see uqi_result_get_record/3).
+%% This wraps the native uqi_result_get_key function.
+-spec uqi_result_get_key(result(), integer(), [zero_copy]) ->
+  {ok, binary()} | {error, atom()}.
+uqi_result_get_key(Result, Row, Options) ->
+  ups_nifs:uqi_result_get_key(Result, Row, zero_copy_flag(Options)).
+
 %% @doc Returns a record of an UQI result set.
 %% This wraps the native uqi_result_get_record function.
 -spec uqi_result_get_record(result(), integer()) ->
@@ -467,6 +939,33 @@ uqi_result_get_key(Result, Row) ->
 uqi_result_get_record(Result, Row) ->
   ups_nifs:uqi_result_get_record(Result, Row).
 
+%% @doc Returns a record of an UQI result set. With the `zero_copy' option,
+%% the returned binary points into the result set, which then stays in
+%% memory (even after uqi_result_close/1) till the binary is garbage
+%% collected.
+%% This wraps the native uqi_result_get_record function.
+-spec uqi_result_get_record(result(), integer(), [zero_copy]) ->
+  {ok, binary()} | {error, atom()}.
+uqi_result_get_record(Result, Row, Options) ->
+  ups_nifs:uqi_result_get_record(Result, Row, zero_copy_flag(Options)).
+
+%% @doc Returns all rows of an UQI result set as a list of `{Key, Record}'.
+%% See uqi_result_slice/3.
+-spec uqi_result_to_list(result()) ->
+  {ok, [{uqi_value(), uqi_value()}]} | {error, atom()}.
+uqi_result_to_list(Result) ->
+  ups_nifs:uqi_result_slice(Result, 0, 16#ffffffff).
+
+%% @doc Returns up to `Count' rows of an UQI result set, starting at row
+%% `Offset', as a list of `{Key, Record}'. Keys and records of a numeric type
+%% (see uqi_result_get_key_type/1 and uqi_result_get_record_type/1) are
+%% decoded to integers or floats; all other keys and records are returned
+%% as binaries.
+-spec uqi_result_slice(result(), non_neg_integer(), non_neg_integer()) ->
+  {ok, [{uqi_value(), uqi_value()}]} | {error, atom()}.
+uqi_result_slice(Result, Offset, Count) ->
+  ups_nifs:uqi_result_slice(Result, Offset, Count).
+
 %% @doc Closes an UQI result set.
 %% This wraps the native uqi_result_close function.
 -spec uqi_result_close(result()) ->
@@ -474,8 +973,143 @@ uqi_result_get_record(Result, Row) ->
 uqi_result_close(Result) ->
   ups_nifs:uqi_result_close(Result).
 
+%% @doc Prepares an UQI query for uqi_execute/3. `Query' (a string or a
+%% binary of any length) is stored with the Environment and must contain a
+%% `FROM DATABASE' clause.
+-spec uqi_prepare(env(), string() | binary()) ->
+  {ok, statement()} | {error, atom()}.
+uqi_prepare(Env, Query) ->
+  ups_nifs:uqi_prepare(Env, Query).
+
+%% @doc Runs a prepared query on a range of keys. `Start' and `End' are
+%% `undefined' (the first or last key), a Cursor (see uqi_select_range/4)
+%% or a key: the range starts at the first key greater than or equal to
+%% `Start' and ends before the first key greater than or equal to `End'.
+%% Keys require that the Database of the query is open.
+-spec uqi_execute(statement(), cursor() | key() | undefined,
+                  cursor() | key() | undefined) ->
+  {ok, result()} | {error, atom()}.
+uqi_execute(Statement, Start, End) ->
+  ups_nifs:uqi_execute(Statement, Start, End).
+
+%% @doc Asynchronously inserts a Key/Value pair. The request is executed
+%% by the worker thread of the Environment; the result (see db_insert/5) is
+%% sent to the calling process as `{ups_async, Ref, Result}'.
+-spec async_insert(db(), txn() | undefined, key(), value()) ->
+  {ok, reference()} | {error, atom()}.
+async_insert(Db, Txn, Key, Value) ->
+  ups_nifs:async_insert(Db, Txn, Key, Value, 0).
+
+%% @doc Asynchronously inserts a Key/Value pair. Accepts additional flags
+%% for the operation. See async_insert/4.
+-spec async_insert(db(), txn() | undefined, key(), value(),
+                   [db_insert_flag()]) ->
+  {ok, reference()} | {error, atom()}.
+async_insert(Db, Txn, Key, Value, Flags) ->
+  ups_nifs:async_insert(Db, Txn, Key, Value, insert_db_flags(Flags, 0)).
+
+%% @doc Asynchronous lookup of a Key. The result (see db_find/3) is sent
+%% to the calling process as `{ups_async, Ref, Result}'.
+-spec async_find(db(), txn() | undefined, key()) ->
+  {ok, reference()} | {error, atom()}.
+async_find(Db, Txn, Key) ->
+  ups_nifs:async_find(Db, Txn, Key, 0).
+
+%% @doc Asynchronous lookup of a Key with approximate matching. The result
+%% (see db_find/4) is sent to the calling process as
+%% `{ups_async, Ref, Result}'.
+-spec async_find(db(), txn() | undefined, key(), [db_find_flag()]) ->
+  {ok, reference()} | {error, atom()}.
+async_find(Db, Txn, Key, Flags) ->
+  ups_nifs:async_find(Db, Txn, Key, find_db_flags(Flags, 0)).
+
+%% @doc Asynchronously erases a Key. The result (see db_erase/3) is sent
+%% to the calling process as `{ups_async, Ref, Result}'.
+-spec async_erase(db(), txn() | undefined, key()) ->
+  {ok, reference()} | {error, atom()}.
+async_erase(Db, Txn, Key) ->
+  ups_nifs:async_erase(Db, Txn, Key).
+
+%% @doc Waits for the result of an asynchronous request.
+-spec async_await(reference()) ->
+  term().
+async_await(Ref) ->
+  async_await(Ref, infinity).
+
+%% @doc Waits for the result of an asynchronous request; returns
+%% `{error, timeout}' if there is no result after `Timeout' milliseconds.
+-spec async_await(reference(), timeout()) ->
+  term().
+async_await(Ref, Timeout) ->
+  receive
+    {ups_async, Ref, Result} ->
+      Result
+  after Timeout ->
+    {error, timeout}
+  end.
+
+%% @doc Streams a range of a Database to a process. `Range' is
+%% `{StartKey, EndKey}' (the EndKey is exclusive; either key can be
+%% `undefined'). A native thread walks the range and sends batches of
+%% Key/Value pairs to `Pid' as `{ups_stream, Ref, {data, Pairs}}', followed
+%% by `{ups_stream, Ref, done}' or `{ups_stream, Ref, {error, Reason}}'.
+%%
+%% The producer only sends as many batches as the consumer granted; the
+%% initial credit is set with the `{credit, N}' option (default: 1), more is
+%% granted with stream_ack/2. `{batch_size, N}' sets the number of pairs per
+%% batch (default: 1000). The stream is cancelled when `Stream' is garbage
+%% collected and when the Database or the Environment is closed.
+-spec stream_range(db(), txn() | undefined,
+                   {key() | undefined, key() | undefined}, pid(),
+                   [{batch_size, pos_integer()} | {credit, non_neg_integer()}]) ->
+  {ok, reference(), stream()} | {error, atom()}.
+stream_range(Db, Txn, Range, Pid, Options) ->
+  BatchSize = proplists:get_value(batch_size, Options, 1000),
+  Credit = proplists:get_value(credit, Options, 1),
+  Ref = make_ref(),
+  case ups_nifs:stream_range(Db, Txn, Range, Pid, BatchSize, Credit, Ref) of
+    {ok, Stream} ->
+      {ok, Ref, Stream};
+    Error ->
+      Error
+  end.
+
+%% @doc Grants a stream permission to send `Credit' more batches.
+-spec stream_ack(stream(), non_neg_integer()) ->
+  ok.
+stream_ack(Stream, Credit) ->
+  ups_nifs:stream_ack(Stream, Credit).
+
+%% @doc Stops a stream. No further batches are sent, but batches which are
+%% already in the mailbox of the consumer are not removed.
+-spec stream_cancel(stream()) ->
+  ok.
+stream_cancel(Stream) ->
+  ups_nifs:stream_cancel(Stream).
+
 %% Private functions
 
+dump_threads(Options) ->
+  proplists:get_value(threads, Options,
+                      erlang:system_info(schedulers_online)).
+
+env_compact_impl(Source, Target, Swap, Options) ->
+  Timeout = proplists:get_value(timeout, Options, infinity),
+  Ref = make_ref(),
+  case ups_nifs:env_compact(Source, Target, Swap, self(), Ref) of
+    {ok, Compaction} ->
+      receive
+        {ups_compact, Ref, Result} ->
+          Result
+      after Timeout ->
+        % the thread removes the target before it replies
+        ok = ups_nifs:env_compact_cancel(Compaction),
+        receive {ups_compact, Ref, _} -> {error, timeout} end
+      end;
+    Error ->
+      Error
+  end.
+
 env_create_impl(Filename, Flags, Mode, Parameters) ->
   ups_nifs:env_create(Filename, env_create_flags(Flags, 0), Mode, Parameters).
 
@@ -491,6 +1125,50 @@ env_open_db_impl(Env, Dbname, Flags, Parameters) ->
 db_insert_impl(Db, Txn, Key, Value, Flags) ->
   ups_nifs:db_insert(Db, Txn, Key, Value, insert_db_flags(Flags, 0)).
 
+cursor_fold_impl(Cursor, StartKey, EndKey, ChunkSize, Direction) ->
+  Flag = fold_direction(Direction),
+  case ups_nifs:cursor_fold(Cursor, StartKey, EndKey, ChunkSize, Flag) of
+    {ok, Pairs, true} ->
+      {ok, Pairs, {cursor_fold, Cursor, EndKey, ChunkSize, Direction}};
+    {ok, Pairs, false} ->
+      {ok, Pairs, '$end_of_table'};
+    Error ->
+      Error
+  end.
+
+fold_direction(forward) -> 16#0004;
+fold_direction(backward) -> 16#0008.
+
+% the flags carry the FOLD_PREFIX bit (see ups_nifs_cursor_fold)
+prefix_scan_impl(Cursor, Start, Prefix, ChunkSize, Flags, Limit, Acc) ->
+  Size = case Limit of
+    infinity -> ChunkSize;
+    _ -> min(ChunkSize, Limit)
+  end,
+  case ups_nifs:cursor_fold(Cursor, Start, Prefix, Size, Flags) of
+    {ok, Pairs, More} ->
+      Acc2 = lists:reverse(Pairs, Acc),
+      Remaining = case Limit of
+        infinity -> infinity;
+        _ -> Limit - length(Pairs)
+      end,
+      case More andalso Remaining =/= 0 of
+        true ->
+          prefix_scan_impl(Cursor, continue, Prefix, ChunkSize, Flags,
+                           Remaining, Acc2);
+        false ->
+          {ok, lists:reverse(Acc2)}
+      end;
+    Error ->
+      Error
+  end.
+
+zero_copy_flag(Options) ->
+  case lists:member(zero_copy, Options) of
+    true -> 1;
+    false -> 0
+  end.
+
 env_create_flags([], Acc) ->
   Acc;
 env_create_flags([Flag | Tail], Acc) ->
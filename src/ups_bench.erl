@@ -0,0 +1,275 @@
+%% @author Christoph Rupp <chris@crupp.de>
+%% @copyright 2017 Christoph Rupp
+%%
+%% @doc Load generator for upscaledb-erlang. Runs a mix of reads and writes
+%% from a number of concurrent processes through the public API and reports
+%% the throughput and the latency percentiles.
+%%
+%% Supported options (defaults in brackets):
+%% <ul>
+%% <li>`{file, string()}' ["ups_bench.db"]</li>
+%% <li>`{key_distribution, sequential | uniform | zipfian}' [uniform]</li>
+%% <li>`{zipf_theta, float()}' [0.99]</li>
+%% <li>`{key_count, integer()}' [100000]: size of the key space; all keys
+%%   are inserted before the measurement starts</li>
+%% <li>`{key_size, integer()}' [16]</li>
+%% <li>`{value_size, integer()}' [100]</li>
+%% <li>`{read_ratio, float()}' [0.5]</li>
+%% <li>`{concurrency, integer()}' [4]</li>
+%% <li>`{ops, integer()}' [100000]: total number of operations</li>
+%% <li>`{transactional, boolean()}' [false]: each operation runs in its
+%%   own Transaction</li>
+%% <li>`{fsync, boolean()}' [false]</li>
+%% </ul>
+%%
+%% micro/1 measures the NIF calls of the hot paths one at a time, from a
+%% single process.
+%%
+%%
+%% Copyright (C) 2005-2017 Christoph Rupp (chris@crupp.de).
+%%
+%% Licensed under the Apache License, Version 2.0 (the "License");
+%% you may not use this file except in compliance with the License.
+%% You may obtain a copy of the License at
+%%
+%%     http://www.apache.org/licenses/LICENSE-2.0
+%%
+%% Unless required by applicable law or agreed to in writing, software
+%% distributed under the License is distributed on an "AS IS" BASIS,
+%% WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+%% See the License for the specific language governing permissions and
+%% limitations under the License.
+
+-module(ups_bench).
+-author("Christoph Rupp <chris@crupp.de>").
+
+-export([main/1, run/1, micro/1]).
+
+-record(config, {file, distribution, theta, key_count, key_size, value_size,
+                 read_ratio, concurrency, ops, transactional, fsync}).
+
+%% @doc Runs the benchmark and prints the result as a JSON object.
+-spec main([{atom(), term()}]) -> ok.
+main(Options) ->
+  Result = run(Options),
+  io:format("~s~n", [to_json(Result)]).
+
+%% @doc Runs the benchmark and returns the result. Latencies are in
+%% nanoseconds.
+-spec run([{atom(), term()}]) -> map().
+run(Options) ->
+  Config = config(Options),
+  EnvFlags = [enable_transactions || Config#config.transactional]
+                ++ [enable_fsync || Config#config.fsync],
+  file:delete(Config#config.file),
+  {ok, Env} = ups:env_create(Config#config.file, EnvFlags),
+  {ok, Db} = ups:env_create_db(Env, 1),
+  preload(Db, Config),
+  Generator = generator(Config),
+  Parent = self(),
+  Start = erlang:monotonic_time(nanosecond),
+  Pids = [spawn_link(fun() ->
+                       rand:seed(exsplus, {I, I * 7, I * 13}),
+                       Parent ! {self(), worker(Env, Db, Config, Generator,
+                                                I - 1, worker_ops(Config, I),
+                                                [], 0)}
+                     end) || I <- lists:seq(1, Config#config.concurrency)],
+  Results = [receive {Pid, R} -> R end || Pid <- Pids],
+  Elapsed = max(erlang:monotonic_time(nanosecond) - Start, 1),
+  ok = ups:db_close(Db),
+  ok = ups:env_close(Env),
+  file:delete(Config#config.file),
+  Latencies = lists:sort(lists:append([L || {L, _} <- Results])),
+  Ops = length(Latencies),
+  #{key_distribution => Config#config.distribution,
+    concurrency => Config#config.concurrency,
+    read_ratio => Config#config.read_ratio,
+    transactional => Config#config.transactional,
+    fsync => Config#config.fsync,
+    ops => Ops,
+    errors => lists:sum([E || {_, E} <- Results]),
+    elapsed_ns => Elapsed,
+    ops_per_sec => Ops * 1000000000 div Elapsed,
+    p50_ns => percentile(Latencies, Ops, 0.50),
+    p99_ns => percentile(Latencies, Ops, 0.99),
+    p999_ns => percentile(Latencies, Ops, 0.999)}.
+
+%% @doc Measures single NIF calls of the hot paths through the public API:
+%% db_insert, db_find (with the record copied into a new binary and with
+%% zero-copy lookups), cursor_fold (per chunk of 100 pairs) and db_erase.
+%% Prints one JSON object per benchmark. Supported options (defaults in
+%% brackets):
+%% <ul>
+%% <li>`{file, string()}' ["ups_bench.db"]</li>
+%% <li>`{count, integer()}' [100000]: the number of keys</li>
+%% <li>`{value_size, integer()}' [64]</li>
+%% </ul>
+-spec micro([{atom(), term()}]) -> ok.
+micro(Options) ->
+  File = proplists:get_value(file, Options, "ups_bench.db"),
+  Count = max(proplists:get_value(count, Options, 100000), 1),
+  Value = binary:copy(<<"x">>, proplists:get_value(value_size, Options, 64)),
+  Keys = [<<I:32/big-unsigned>> || I <- lists:seq(0, Count - 1)],
+  % the lookups visit the keys in a scattered order
+  Lookups = [<<(I * 2654435761 rem Count):32/big-unsigned>>
+             || I <- lists:seq(0, Count - 1)],
+  file:delete(File),
+  {ok, Env} = ups:env_create(File),
+  {ok, Db} = ups:env_create_db(Env, 1),
+  {ok, ZeroCopy} = ups:env_create_db(Env, 2, [],
+                                     [{zero_copy_threshold, 1}]),
+  print(micro_calls(db_insert, Keys,
+                    fun(K) -> ok = ups:db_insert(Db, undefined, K, Value, [])
+                    end)),
+  lists:foreach(fun(K) ->
+                  ok = ups:db_insert(ZeroCopy, undefined, K, Value, [])
+                end, Keys),
+  print(micro_calls(db_find, Lookups,
+                    fun(K) -> {ok, _} = ups:db_find(Db, K) end)),
+  print(micro_calls(db_find_zero_copy, Lookups,
+                    fun(K) -> {ok, _} = ups:db_find(ZeroCopy, K) end)),
+  {ok, Cursor} = ups:cursor_create(Db),
+  print(micro_fold(ups:cursor_fold(Cursor, undefined, undefined, 100,
+                                   forward), [])),
+  ok = ups:cursor_close(Cursor),
+  print(micro_calls(db_erase, Keys, fun(K) -> ok = ups:db_erase(Db, K) end)),
+  ok = ups:db_close(ZeroCopy),
+  ok = ups:db_close(Db),
+  ok = ups:env_close(Env),
+  file:delete(File),
+  ok.
+
+micro_calls(Name, Keys, Fun) ->
+  {Name, [begin
+            T0 = erlang:monotonic_time(nanosecond),
+            Fun(K),
+            erlang:monotonic_time(nanosecond) - T0
+          end || K <- Keys]}.
+
+% the first chunk is already read by cursor_fold/5
+micro_fold({ok, [], '$end_of_table'}, Latencies) ->
+  {cursor_fold, Latencies};
+micro_fold({ok, _Pairs, Continuation}, Latencies) ->
+  T0 = erlang:monotonic_time(nanosecond),
+  Next = ups:cursor_fold(Continuation),
+  micro_fold(Next, [erlang:monotonic_time(nanosecond) - T0 | Latencies]).
+
+print({Name, Latencies}) ->
+  Sorted = lists:sort(Latencies),
+  Ops = length(Sorted),
+  Elapsed = max(lists:sum(Sorted), 1),
+  io:format("~s~n", [to_json(#{benchmark => Name,
+                               ops => Ops,
+                               ops_per_sec => Ops * 1000000000 div Elapsed,
+                               p50_ns => percentile(Sorted, Ops, 0.50),
+                               p99_ns => percentile(Sorted, Ops, 0.99),
+                               p999_ns => percentile(Sorted, Ops, 0.999)})]).
+
+
+
+config(Options) ->
+  Get = fun(Key, Default) -> proplists:get_value(Key, Options, Default) end,
+  #config{file = Get(file, "ups_bench.db"),
+          distribution = Get(key_distribution, uniform),
+          theta = Get(zipf_theta, 0.99),
+          key_count = max(Get(key_count, 100000), 1),
+          key_size = max(Get(key_size, 16), 8),
+          value_size = Get(value_size, 100),
+          read_ratio = Get(read_ratio, 0.5),
+          concurrency = max(Get(concurrency, 4), 1),
+          ops = Get(ops, 100000),
+          transactional = Get(transactional, false),
+          fsync = Get(fsync, false)}.
+
+worker_ops(#config{ops = Ops, concurrency = C}, I) when I =< Ops rem C ->
+  Ops div C + 1;
+worker_ops(#config{ops = Ops, concurrency = C}, _I) ->
+  Ops div C.
+
+preload(Db, Config) ->
+  Value = value(Config),
+  lists:foreach(fun(I) ->
+                  ok = ups:db_insert(Db, undefined, key(I, Config), Value,
+                                     [overwrite])
+                end, lists:seq(0, Config#config.key_count - 1)).
+
+% |Seq| is the position of the worker in the sequence of all operations;
+% the workers of a sequential run therefore interleave
+worker(_Env, _Db, _Config, _Generator, _Seq, 0, Latencies, Errors) ->
+  {Latencies, Errors};
+worker(Env, Db, Config, Generator, Seq, Remaining, Latencies, Errors) ->
+  Key = key(Generator(Seq), Config),
+  IsRead = rand:uniform() < Config#config.read_ratio,
+  T0 = erlang:monotonic_time(nanosecond),
+  Result = operation(Env, Db, Config, IsRead, Key),
+  Latency = erlang:monotonic_time(nanosecond) - T0,
+  worker(Env, Db, Config, Generator, Seq + Config#config.concurrency,
+         Remaining - 1, [Latency | Latencies], Errors + is_error(Result)).
+
+operation(Env, Db, #config{transactional = true} = Config, IsRead, Key) ->
+  {ok, Txn} = ups:txn_begin(Env),
+  case execute(Txn, Db, Config, IsRead, Key) of
+    {error, _} = Error ->
+      ups:txn_abort(Txn),
+      Error;
+    _ ->
+      ups:txn_commit(Txn)
+  end;
+operation(_Env, Db, Config, IsRead, Key) ->
+  execute(undefined, Db, Config, IsRead, Key).
+
+execute(Txn, Db, _Config, true, Key) ->
+  ups:db_find(Db, Txn, Key);
+execute(Txn, Db, Config, false, Key) ->
+  ups:db_insert(Db, Txn, Key, value(Config), [overwrite]).
+
+is_error({error, _}) -> 1;
+is_error(_) -> 0.
+
+key(I, #config{key_size = Size}) ->
+  Padding = (Size - 8) * 8,
+  <<I:64/big-unsigned, 0:Padding>>.
+
+value(#config{value_size = Size}) ->
+  binary:copy(<<"x">>, Size).
+
+generator(#config{distribution = sequential, key_count = N}) ->
+  fun(Seq) -> Seq rem N end;
+generator(#config{distribution = uniform, key_count = N}) ->
+  fun(_) -> rand:uniform(N) - 1 end;
+generator(#config{distribution = zipfian, key_count = N, theta = Theta}) ->
+  % the zipfian generator of YCSB (Gray et al., "Quickly Generating
+  % Billion-Record Synthetic Databases")
+  ZetaN = zeta(N, Theta),
+  Zeta2 = zeta(2, Theta),
+  Alpha = 1 / (1 - Theta),
+  Eta = (1 - math:pow(2 / N, 1 - Theta)) / (1 - Zeta2 / ZetaN),
+  Half = 1 + math:pow(0.5, Theta),
+  fun(_) ->
+    U = rand:uniform(),
+    Uz = U * ZetaN,
+    if
+      Uz < 1.0 -> 0;
+      Uz < Half -> min(1, N - 1);
+      true -> min(trunc(N * math:pow(Eta * U - Eta + 1, Alpha)), N - 1)
+    end
+  end.
+
+zeta(N, Theta) ->
+  lists:foldl(fun(I, Acc) -> Acc + 1 / math:pow(I, Theta) end,
+              0.0, lists:seq(1, N)).
+
+percentile(_Sorted, 0, _P) ->
+  0;
+percentile(Sorted, Length, P) ->
+  lists:nth(trunc(P * (Length - 1)) + 1, Sorted).
+
+to_json(Map) ->
+  Pairs = [io_lib:format("\"~s\": ~s", [K, json_value(V)])
+           || {K, V} <- lists:sort(maps:to_list(Map))],
+  ["{", lists:join(", ", Pairs), "}"].
+
+json_value(V) when is_integer(V) -> integer_to_list(V);
+json_value(V) when is_float(V) -> float_to_list(V, [{decimals, 3}]);
+json_value(V) when is_boolean(V) -> atom_to_list(V);
+json_value(V) when is_atom(V) -> ["\"", atom_to_list(V), "\""].
@@ -0,0 +1,276 @@
+%% @author Christoph Rupp <chris@crupp.de>
+%% @copyright 2017 Christoph Rupp
+%%
+%% @doc Bulk loader for upscaledb-erlang (see ups:bulk_load/3). The pairs
+%% are inserted in key order with the `UPS_HINT_APPEND' hint, which appends
+%% to the last leaf page instead of descending the B-tree, and splits full
+%% pages at the end, therefore the pages are filled densely. Each batch is
+%% inserted with a single NIF call and, if the Environment has Transactions
+%% enabled, in a single Transaction.
+%%
+%% Unsorted files are sorted externally: runs of at most `{memory, Bytes}'
+%% bytes are sorted in memory and written to temporary files, which are
+%% then merged. Keys are sorted in the Erlang term order, which is the
+%% order of upscaledb for binary keys.
+%%
+%%
+%% Copyright (C) 2005-2017 Christoph Rupp (chris@crupp.de).
+%%
+%% Licensed under the Apache License, Version 2.0 (the "License");
+%% you may not use this file except in compliance with the License.
+%% You may obtain a copy of the License at
+%%
+%%     http://www.apache.org/licenses/LICENSE-2.0
+%%
+%% Unless required by applicable law or agreed to in writing, software
+%% distributed under the License is distributed on an "AS IS" BASIS,
+%% WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+%% See the License for the specific language governing permissions and
+%% limitations under the License.
+
+-module(ups_bulk).
+-author("Christoph Rupp <chris@crupp.de>").
+
+-export([load/3, encode_pairs/1]).
+
+-define(DEFAULT_BATCH_SIZE, 10000).
+-define(DEFAULT_MEMORY, 64 * 1024 * 1024).
+% the estimated memory usage of a pair, in addition to the key and record
+-define(PAIR_OVERHEAD, 64).
+-define(UPS_OVERWRITE, 16#0001).
+
+-record(loader, {db, batch_size, flags, progress}).
+
+
+
+%% @doc Loads pairs into a Database. See ups:bulk_load/3.
+-spec load(term(), {generator, fun()} | {file, string()}, [term()]) ->
+  {ok, non_neg_integer()} | {error, term()}.
+load(Db, {generator, Fun}, Options) ->
+  run(loader(Db, Options), Fun, 0);
+load(Db, {file, Path}, Options) ->
+  Memory = proplists:get_value(memory, Options, ?DEFAULT_MEMORY),
+  TmpDir = proplists:get_value(tmp_dir, Options, filename:dirname(Path)),
+  case file:open(Path, [read, binary, raw, {read_ahead, 65536}]) of
+    {ok, Fd} ->
+      Sorted = try
+                 sort_runs(Fd, Memory, run_prefix(TmpDir, Path), 0, [])
+               after
+                 file:close(Fd)
+               end,
+      case Sorted of
+        {ok, {memory, Pairs}} ->
+          run(loader(Db, Options), list_generator(Pairs), 0);
+        {ok, Files} ->
+          try open_runs(Files, []) of
+            {ok, Heads} ->
+              try
+                run(loader(Db, Options), merge_generator(Heads), 0)
+              after
+                [file:close(F) || {_, _, F} <- Heads]
+              end;
+            Error ->
+              Error
+          after
+            [file:delete(F) || F <- Files]
+          end;
+        Error ->
+          Error
+      end;
+    Error ->
+      Error
+  end.
+
+%% @doc Encodes Key/Value pairs in the file format of ups:bulk_load/3: each
+%% pair is `<<KeySize:32, Key/binary, RecordSize:32, Record/binary>>'.
+-spec encode_pairs([{binary(), binary()}]) ->
+  iodata().
+encode_pairs(Pairs) ->
+  [<<(byte_size(K)):32, K/binary, (byte_size(V)):32, V/binary>>
+   || {K, V} <- Pairs].
+
+
+
+%% Private functions
+
+loader(Db, Options) ->
+  Flags = case proplists:get_value(overwrite, Options, false) of
+    true -> ?UPS_OVERWRITE;
+    false -> 0
+  end,
+  #loader{db = Db,
+          batch_size = proplists:get_value(batch_size, Options,
+                                           ?DEFAULT_BATCH_SIZE),
+          flags = Flags,
+          progress = proplists:get_value(progress, Options,
+                                         fun(_) -> ok end)}.
+
+% inserts the batches of a generator
+run(Loader, Generator, Count) ->
+  case Generator() of
+    eof ->
+      {ok, Count};
+    {ok, Pairs, Next} ->
+      case insert(Loader, Pairs, Count) of
+        {ok, Count2} -> run(Loader, Next, Count2);
+        Error -> Error
+      end;
+    {error, _} = Error ->
+      Error
+  end.
+
+insert(_Loader, [], Count) ->
+  {ok, Count};
+insert(#loader{batch_size = BatchSize} = Loader, Pairs, Count)
+    when length(Pairs) > BatchSize ->
+  {Batch, Rest} = lists:split(BatchSize, Pairs),
+  case insert(Loader, Batch, Count) of
+    {ok, Count2} -> insert(Loader, Rest, Count2);
+    Error -> Error
+  end;
+insert(#loader{db = Db, flags = Flags, progress = Progress}, Pairs, Count) ->
+  case ups_nifs:db_bulk_insert(Db, Pairs, Flags) of
+    {ok, N} ->
+      Progress(Count + N),
+      {ok, Count + N};
+    Error ->
+      Error
+  end.
+
+list_generator(Pairs) ->
+  fun() -> {ok, Pairs, fun() -> eof end} end.
+
+run_prefix(TmpDir, Path) ->
+  filename:join(TmpDir, filename:basename(Path) ++ ".run.").
+
+% reads the file in runs of |Memory| bytes; a single run is kept in memory,
+% otherwise all runs are written to temporary files
+sort_runs(Fd, Memory, Prefix, Index, Files) ->
+  case read_run(Fd, Memory, 0, []) of
+    {ok, Pairs, eof} when Files =:= [] ->
+      {ok, {memory, lists:keysort(1, Pairs)}};
+    {ok, Pairs, Status} ->
+      File = Prefix ++ integer_to_list(Index),
+      Files2 = [File | Files],
+      case write_run(File, lists:keysort(1, Pairs)) of
+        ok when Status =:= eof ->
+          {ok, lists:reverse(Files2)};
+        ok ->
+          sort_runs(Fd, Memory, Prefix, Index + 1, Files2);
+        Error ->
+          [file:delete(F) || F <- Files2],
+          Error
+      end;
+    Error ->
+      [file:delete(F) || F <- Files],
+      Error
+  end.
+
+read_run(_Fd, Memory, Bytes, Acc) when Bytes >= Memory ->
+  {ok, Acc, more};
+read_run(Fd, Memory, Bytes, Acc) ->
+  case read_pair(Fd) of
+    {ok, {K, V} = Pair} ->
+      read_run(Fd, Memory,
+               Bytes + byte_size(K) + byte_size(V) + ?PAIR_OVERHEAD,
+               [Pair | Acc]);
+    eof ->
+      {ok, Acc, eof};
+    Error ->
+      Error
+  end.
+
+read_pair(Fd) ->
+  case file:read(Fd, 4) of
+    {ok, <<KeySize:32>>} ->
+      case file:read(Fd, KeySize + 4) of
+        {ok, <<Key:KeySize/binary, RecordSize:32>>} ->
+          case read_exactly(Fd, RecordSize) of
+            {ok, Record} -> {ok, {Key, Record}};
+            Error -> Error
+          end;
+        _ ->
+          {error, truncated_file}
+      end;
+    eof ->
+      eof;
+    {ok, _} ->
+      {error, truncated_file};
+    Error ->
+      Error
+  end.
+
+read_exactly(_Fd, 0) ->
+  {ok, <<>>};
+read_exactly(Fd, Size) ->
+  case file:read(Fd, Size) of
+    {ok, Data} when byte_size(Data) =:= Size -> {ok, Data};
+    {ok, _} -> {error, truncated_file};
+    eof -> {error, truncated_file};
+    Error -> Error
+  end.
+
+write_run(File, Pairs) ->
+  case file:open(File, [write, binary, raw, {delayed_write, 65536, 1000}]) of
+    {ok, Fd} ->
+      Result = file:write(Fd, encode_pairs(Pairs)),
+      case file:close(Fd) of
+        ok -> Result;
+        Error -> Error
+      end;
+    Error ->
+      Error
+  end.
+
+% merges the sorted runs; a head is {Key, Value, Fd}. The caller closes
+% the files.
+merge_generator(Heads) ->
+  fun() -> merge(lists:sort(Heads), ?DEFAULT_BATCH_SIZE) end.
+
+% opens the runs and reads their first pairs; a head is {Key, Value, Fd}
+open_runs([], Heads) ->
+  {ok, Heads};
+open_runs([File | Files], Heads) ->
+  case file:open(File, [read, binary, raw, {read_ahead, 65536}]) of
+    {ok, Fd} ->
+      case next_head(Fd) of
+        {error, _} = Error ->
+          [file:close(F) || F <- [Fd | [F2 || {_, _, F2} <- Heads]]],
+          Error;
+        empty ->
+          file:close(Fd),
+          open_runs(Files, Heads);
+        Head ->
+          open_runs(Files, [Head | Heads])
+      end;
+    Error ->
+      [file:close(F) || {_, _, F} <- Heads],
+      Error
+  end.
+
+next_head(Fd) ->
+  case read_pair(Fd) of
+    {ok, {K, V}} -> {K, V, Fd};
+    eof -> empty;
+    Error -> Error
+  end.
+
+merge(Heads, BatchSize) ->
+  merge(Heads, BatchSize, []).
+
+merge([], _BatchSize, []) ->
+  eof;
+merge([], _BatchSize, Acc) ->
+  {ok, lists:reverse(Acc), fun() -> eof end};
+merge(Heads, 0, Acc) ->
+  {ok, lists:reverse(Acc), fun() -> merge(Heads, ?DEFAULT_BATCH_SIZE) end};
+merge([{K, V, Fd} | Heads], BatchSize, Acc) ->
+  case next_head(Fd) of
+    empty ->
+      file:close(Fd),
+      merge(Heads, BatchSize - 1, [{K, V} | Acc]);
+    {error, _} = Error ->
+      Error;
+    Head ->
+      merge(lists:merge([Head], Heads), BatchSize - 1, [{K, V} | Acc])
+  end.
@@ -27,10 +27,15 @@
      env_rename_db/3,
      env_erase_db/2,
      db_insert/5,
+     db_insert_many/4,
      db_erase/3,
      db_find/3,
      db_find_flags/4,
+     db_find_many/3,
      db_close/1,
+     db_flush_buffer/1,
+     db_cache_stats/1,
+     db_bloom_stats/1,
      txn_begin/2,
      txn_abort/1,
      txn_commit/1,
@@ -38,6 +43,7 @@
      cursor_create/2,
      cursor_clone/1, 
      cursor_move/2, 
+     cursor_fold/5,
      cursor_overwrite/2, 
      cursor_find/2,
      cursor_insert/4,
@@ -50,8 +56,32 @@
      uqi_result_get_key_type/1,
      uqi_result_get_record_type/1,
      uqi_result_get_key/2,
+     uqi_result_get_key/3,
      uqi_result_get_record/2,
-     uqi_result_close/1
+     uqi_result_get_record/3,
+     uqi_result_slice/3,
+     env_metrics/1,
+     trace_threshold/1,
+     trace_dump/0,
+     trace_subscribe/1,
+     trace_unsubscribe/1,
+     uqi_result_close/1,
+     uqi_prepare/2,
+     uqi_execute/3,
+     db_bulk_insert/3,
+     env_backup/6,
+     env_compact/5,
+     env_compact_cancel/1,
+     env_dump/5,
+     env_restore/3,
+     db_train_codec/3,
+     db_erase_range/6,
+     async_insert/5,
+     async_find/4,
+     async_erase/3,
+     stream_range/7,
+     stream_ack/2,
+     stream_cancel/1
     ]).
 
 -define(MISSING_NIF, missing_nif).
@@ -93,6 +123,9 @@ env_erase_db(_Env, _Dbname) ->
 db_insert(_Db, _Txn, _Key, _Value, _Flags) ->
   erlang:nif_error(?MISSING_NIF).
 
+db_insert_many(_Db, _Txn, _Pairs, _Flags) ->
+  erlang:nif_error(?MISSING_NIF).
+
 db_erase(_Db, _Txn, _Key) ->
   erlang:nif_error(?MISSING_NIF).
 
@@ -102,9 +135,21 @@ db_find(_Db, _Txn, _Key) ->
 db_find_flags(_Db, _Txn, _Key, _Flags) ->
   erlang:nif_error(?MISSING_NIF).
 
+db_find_many(_Db, _Txn, _Keys) ->
+  erlang:nif_error(?MISSING_NIF).
+
 db_close(_Db) ->
   erlang:nif_error(?MISSING_NIF).
 
+db_flush_buffer(_Db) ->
+  erlang:nif_error(?MISSING_NIF).
+
+db_cache_stats(_Db) ->
+  erlang:nif_error(?MISSING_NIF).
+
+db_bloom_stats(_Db) ->
+  erlang:nif_error(?MISSING_NIF).
+
 txn_begin(_Env, _Flags) ->
   erlang:nif_error(?MISSING_NIF).
 
@@ -126,6 +171,9 @@ cursor_clone(_Cursor) ->
 cursor_move(_Cursor, _Flags) ->
   erlang:nif_error(?MISSING_NIF).
 
+cursor_fold(_Cursor, _StartKey, _EndKey, _ChunkSize, _Direction) ->
+  erlang:nif_error(?MISSING_NIF).
+
 cursor_overwrite(_Cursor, _Record) ->
   erlang:nif_error(?MISSING_NIF).
 
@@ -162,9 +210,81 @@ uqi_result_get_record_type(_Result) ->
 uqi_result_get_key(_Result, _Row) ->
   erlang:nif_error(?MISSING_NIF).
 
+uqi_result_get_key(_Result, _Row, _ZeroCopy) ->
+  erlang:nif_error(?MISSING_NIF).
+
 uqi_result_get_record(_Result, _Row) ->
   erlang:nif_error(?MISSING_NIF).
 
+uqi_result_get_record(_Result, _Row, _ZeroCopy) ->
+  erlang:nif_error(?MISSING_NIF).
+
+uqi_result_slice(_Result, _Offset, _Count) ->
+  erlang:nif_error(?MISSING_NIF).
+
 uqi_result_close(_Result) ->
   erlang:nif_error(?MISSING_NIF).
 
+uqi_prepare(_Env, _Query) ->
+  erlang:nif_error(?MISSING_NIF).
+
+uqi_execute(_Statement, _Start, _End) ->
+  erlang:nif_error(?MISSING_NIF).
+
+db_bulk_insert(_Db, _Pairs, _Flags) ->
+  erlang:nif_error(?MISSING_NIF).
+
+env_backup(_Env, _Target, _Incremental, _RateLimit, _Pid, _Ref) ->
+  erlang:nif_error(?MISSING_NIF).
+
+env_compact(_Source, _Target, _Swap, _Pid, _Ref) ->
+  erlang:nif_error(?MISSING_NIF).
+
+env_compact_cancel(_Compaction) ->
+  erlang:nif_error(?MISSING_NIF).
+
+env_dump(_Env, _Path, _Codec, _BlockSize, _Threads) ->
+  erlang:nif_error(?MISSING_NIF).
+
+env_restore(_Path, _Target, _Threads) ->
+  erlang:nif_error(?MISSING_NIF).
+
+db_train_codec(_Db, _SampleSize, _DictionarySize) ->
+  erlang:nif_error(?MISSING_NIF).
+
+db_erase_range(_Db, _Txn, _StartKey, _EndKey, _ChunkSize, _SubTxn) ->
+  erlang:nif_error(?MISSING_NIF).
+
+env_metrics(_Env) ->
+  erlang:nif_error(?MISSING_NIF).
+
+trace_threshold(_Microseconds) ->
+  erlang:nif_error(?MISSING_NIF).
+
+trace_dump() ->
+  erlang:nif_error(?MISSING_NIF).
+
+trace_subscribe(_Pid) ->
+  erlang:nif_error(?MISSING_NIF).
+
+trace_unsubscribe(_Pid) ->
+  erlang:nif_error(?MISSING_NIF).
+
+
+async_insert(_Db, _Txn, _Key, _Value, _Flags) ->
+  erlang:nif_error(?MISSING_NIF).
+
+async_find(_Db, _Txn, _Key, _Flags) ->
+  erlang:nif_error(?MISSING_NIF).
+
+async_erase(_Db, _Txn, _Key) ->
+  erlang:nif_error(?MISSING_NIF).
+
+stream_range(_Db, _Txn, _Range, _Pid, _BatchSize, _Credit, _Ref) ->
+  erlang:nif_error(?MISSING_NIF).
+
+stream_ack(_Stream, _Credit) ->
+  erlang:nif_error(?MISSING_NIF).
+
+stream_cancel(_Stream) ->
+  erlang:nif_error(?MISSING_NIF).
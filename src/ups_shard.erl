@@ -0,0 +1,439 @@
+%% @author Christoph Rupp <chris@crupp.de>
+%% @copyright 2017 Christoph Rupp
+%%
+%% @doc A logical Database which is partitioned over several Environment
+%% files. upscaledb serializes all operations of an Environment; spreading
+%% the keys over N Environments allows N writers to run in parallel.
+%%
+%% The shards are the files `Path.1' to `Path.N'; `Path' itself stores the
+%% number of shards and the partitioning scheme. Keys are either assigned
+%% by a hash (`{partition, hash}', the default) or by key ranges
+%% (`{partition, {range, SplitKeys}}' with N-1 ascending split keys; shard
+%% I holds the keys from split key I-1 up to, but excluding, split key I).
+%%
+%% Point operations are routed to their shard and executed by the worker
+%% thread of the shard's Environment (see ups:async_insert/5); batches
+%% therefore use all shards in parallel. Range scans and queries are sent
+%% to all shards, and their results are merged in key order. The order is
+%% the Erlang term order, which matches the order of upscaledb for binary
+%% keys; Databases with numeric keys require `{typed_terms, true}'.
+%%
+%%
+%% Copyright (C) 2005-2017 Christoph Rupp (chris@crupp.de).
+%%
+%% Licensed under the Apache License, Version 2.0 (the "License");
+%% you may not use this file except in compliance with the License.
+%% You may obtain a copy of the License at
+%%
+%%     http://www.apache.org/licenses/LICENSE-2.0
+%%
+%% Unless required by applicable law or agreed to in writing, software
+%% distributed under the License is distributed on an "AS IS" BASIS,
+%% WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+%% See the License for the specific language governing permissions and
+%% limitations under the License.
+
+-module(ups_shard).
+-author("Christoph Rupp <chris@crupp.de>").
+
+-include("include/ups.hrl").
+
+-export([create/3, open/2, close/1,
+   shard_count/1,
+   insert/3, insert/4,
+   insert_many/2, insert_many/3,
+   erase/2,
+   find/2,
+   find_many/2,
+   fold/5,
+   uqi_select/2
+   ]).
+
+-export_type([shards/0]).
+
+-record(shards, {envs :: tuple(), dbs :: tuple(), partition}).
+
+-opaque shards() :: #shards{}.
+-type partition() :: hash | {range, [key()]}.
+-type option() ::
+   {partition, partition()}
+   | {env_flags, [env_create_flag() | env_open_flag()]}
+   | {env_parameters, [{atom(), term()}]}
+   | {db_flags, [env_create_db_flag() | env_open_db_flag()]}
+   | {db_parameters, [{atom(), term()}]}
+   | {mode, integer()}.
+
+-define(MANIFEST_VERSION, 1).
+% all shards store the keys in Database 1
+-define(DBNAME, 1).
+-define(FOLD_CHUNK_SIZE, 1000).
+
+
+
+%% @doc Creates a sharded Database with `Count' shards. Supports the
+%% `partition' option and the flags and parameters of the Environments
+%% (`env_flags', `env_parameters', `mode'; see ups:env_create/4) and of the
+%% Databases (`db_flags', `db_parameters'; see ups:env_create_db/4).
+%% Either all shards are created, or none.
+-spec create(string(), pos_integer(), [option()]) ->
+  {ok, shards()} | {error, term()}.
+create(Path, Count, Options) when is_integer(Count), Count > 0 ->
+  Partition = proplists:get_value(partition, Options, hash),
+  case check_partition(Partition, Count) of
+    ok ->
+      Create = fun(I) ->
+          File = shard_file(Path, I),
+          case ups:env_create(File, option(env_flags, Options),
+                              option(mode, Options, 8#644),
+                              option(env_parameters, Options)) of
+            {ok, Env} ->
+              case ups:env_create_db(Env, ?DBNAME, option(db_flags, Options),
+                                     option(db_parameters, Options)) of
+                {ok, Db} ->
+                  {ok, {Env, Db}};
+                Error ->
+                  ups:env_close(Env),
+                  Error
+              end;
+            Error ->
+              Error
+          end
+        end,
+      Manifest = term_to_binary({ups_shard, ?MANIFEST_VERSION, Count,
+                                 Partition}),
+      case for_all_shards(Count, Create) of
+        {ok, Shards} ->
+          case file:write_file(Path, Manifest) of
+            ok ->
+              {ok, make_shards(Shards, Partition)};
+            Error ->
+              close_shards(Shards),
+              delete_files(Path, Count),
+              Error
+          end;
+        Error ->
+          delete_files(Path, Count),
+          Error
+      end;
+    Error ->
+      Error
+  end.
+
+%% @doc Opens a sharded Database. Supports the flags and parameters of the
+%% Environments (`env_flags', `env_parameters'; see ups:env_open/3) and of
+%% the Databases (`db_flags', `db_parameters'; see ups:env_open_db/4).
+%% Either all shards are opened, or none.
+-spec open(string(), [option()]) ->
+  {ok, shards()} | {error, term()}.
+open(Path, Options) ->
+  case file:read_file(Path) of
+    {ok, Manifest} ->
+      case catch binary_to_term(Manifest) of
+        {ups_shard, ?MANIFEST_VERSION, Count, Partition} ->
+          Open = fun(I) ->
+              case ups:env_open(shard_file(Path, I),
+                                option(env_flags, Options),
+                                option(env_parameters, Options)) of
+                {ok, Env} ->
+                  case ups:env_open_db(Env, ?DBNAME,
+                                       option(db_flags, Options),
+                                       option(db_parameters, Options)) of
+                    {ok, Db} ->
+                      {ok, {Env, Db}};
+                    Error ->
+                      ups:env_close(Env),
+                      Error
+                  end;
+                Error ->
+                  Error
+              end
+            end,
+          case for_all_shards(Count, Open) of
+            {ok, Shards} ->
+              {ok, make_shards(Shards, Partition)};
+            Error ->
+              Error
+          end;
+        _ ->
+          {error, invalid_file_header}
+      end;
+    Error ->
+      Error
+  end.
+
+%% @doc Closes all shards. Returns the first error, but tries to close
+%% every shard.
+-spec close(shards()) ->
+  ok | {error, atom()}.
+close(#shards{envs = Envs, dbs = Dbs}) ->
+  close_shards(lists:zip(tuple_to_list(Envs), tuple_to_list(Dbs))).
+
+%% @doc Returns the number of shards.
+-spec shard_count(shards()) ->
+  pos_integer().
+shard_count(#shards{dbs = Dbs}) ->
+  tuple_size(Dbs).
+
+%% @doc Inserts a Key/Value pair. See ups:db_insert/3.
+-spec insert(shards(), key(), value()) ->
+  ok | {error, atom()}.
+insert(Shards, Key, Value) ->
+  insert(Shards, Key, Value, []).
+
+%% @doc Inserts a Key/Value pair. See ups:db_insert/5.
+-spec insert(shards(), key(), value(), [db_insert_flag()]) ->
+  ok | {error, atom()}.
+insert(Shards, Key, Value, Flags) ->
+  await(ups:async_insert(shard_db(Shards, Key), undefined, Key, Value,
+                         Flags)).
+
+%% @doc Inserts a list of Key/Value pairs; all shards work in parallel.
+%% Returns the number of inserted pairs and the keys which failed. See
+%% ups:db_insert_many/4.
+-spec insert_many(shards(), [{key(), value()}]) ->
+  {ok, non_neg_integer(), [{key(), atom()}]}.
+insert_many(Shards, Pairs) ->
+  insert_many(Shards, Pairs, []).
+
+%% @doc Inserts a list of Key/Value pairs with additional flags. See
+%% insert_many/2.
+-spec insert_many(shards(), [{key(), value()}], [db_insert_flag()]) ->
+  {ok, non_neg_integer(), [{key(), atom()}]}.
+insert_many(Shards, Pairs, Flags) ->
+  Results = await_all([{K, ups:async_insert(shard_db(Shards, K), undefined,
+                                            K, V, Flags)}
+                       || {K, V} <- Pairs]),
+  Failures = [{K, Reason} || {K, {error, Reason}} <- Results],
+  {ok, length(Results) - length(Failures), Failures}.
+
+%% @doc Erases a Key. See ups:db_erase/2.
+-spec erase(shards(), key()) ->
+  ok | {error, atom()}.
+erase(Shards, Key) ->
+  await(ups:async_erase(shard_db(Shards, Key), undefined, Key)).
+
+%% @doc Looks up a Key. See ups:db_find/2.
+-spec find(shards(), key()) ->
+  {ok, value()} | {error, atom()}.
+find(Shards, Key) ->
+  await(ups:async_find(shard_db(Shards, Key), undefined, Key)).
+
+%% @doc Looks up a list of Keys; all shards work in parallel. The results
+%% are in the order of the Keys. See ups:db_find_many/2.
+-spec find_many(shards(), [key()]) ->
+  {ok, [{ok, value()} | {error, atom()}]}.
+find_many(Shards, Keys) ->
+  Results = await_all([{K, ups:async_find(shard_db(Shards, K), undefined,
+                                          K)}
+                       || K <- Keys]),
+  {ok, [Result || {_, Result} <- Results]}.
+
+%% @doc Calls `Fun(Key, Value, Acc)' for all keys from `StartKey' up to,
+%% but excluding, `EndKey' in ascending order (either key can be
+%% `undefined'). Only the shards which can hold keys of the range are
+%% scanned.
+-spec fold(shards(), key() | undefined, key() | undefined,
+           fun((key(), value(), Acc) -> Acc), Acc) ->
+  {ok, Acc} | {error, atom()}.
+fold(Shards, StartKey, EndKey, Fun, Acc) ->
+  Dbs = range_dbs(Shards, StartKey, EndKey),
+  case open_cursors(Dbs, StartKey, EndKey, []) of
+    {ok, Heads, Cursors} ->
+      Result = merge(lists:sort(Heads), Fun, Acc),
+      [ups:cursor_close(C) || C <- Cursors],
+      Result;
+    Error ->
+      Error
+  end.
+
+%% @doc Runs an UQI query on all shards in parallel (see
+%% ups:uqi_select_range/2) and returns the rows of all shards as a list of
+%% `{Key, Record}', merged in key order. The query must refer to Database
+%% 1. Aggregating queries (i.e. `COUNT' or `SUM') return one row per shard,
+%% which the caller has to combine.
+-spec uqi_select(shards(), string()) ->
+  {ok, [{uqi_value(), uqi_value()}]} | {error, atom()}.
+uqi_select(#shards{envs = Envs}, Query) ->
+  Select = fun(Env) ->
+      case ups:uqi_select_range(Env, Query) of
+        {ok, Result} ->
+          Rows = ups:uqi_result_to_list(Result),
+          ups:uqi_result_close(Result),
+          Rows;
+        Error ->
+          Error
+      end
+    end,
+  Results = pmap(Select, tuple_to_list(Envs)),
+  case [E || {error, _} = E <- Results] of
+    [] ->
+      {ok, lists:merge([lists:sort(Rows) || {ok, Rows} <- Results])};
+    [Error | _] ->
+      Error
+  end.
+
+
+
+%% Private functions
+
+option(Key, Options) ->
+  option(Key, Options, []).
+
+option(Key, Options, Default) ->
+  proplists:get_value(Key, Options, Default).
+
+shard_file(Path, I) ->
+  Path ++ "." ++ integer_to_list(I).
+
+delete_files(Path, Count) ->
+  [file:delete(shard_file(Path, I)) || I <- lists:seq(1, Count)],
+  file:delete(Path),
+  ok.
+
+check_partition(hash, _Count) ->
+  ok;
+check_partition({range, Splits}, Count) when is_list(Splits),
+                                             length(Splits) =:= Count - 1 ->
+  case lists:usort(Splits) =:= Splits of
+    true -> ok;
+    false -> {error, inv_parameter}
+  end;
+check_partition(_, _) ->
+  {error, inv_parameter}.
+
+make_shards(Shards, hash) ->
+  #shards{envs = list_to_tuple([E || {E, _} <- Shards]),
+          dbs = list_to_tuple([D || {_, D} <- Shards]),
+          partition = hash};
+make_shards(Shards, {range, Splits}) ->
+  #shards{envs = list_to_tuple([E || {E, _} <- Shards]),
+          dbs = list_to_tuple([D || {_, D} <- Shards]),
+          partition = {range, list_to_tuple(Splits)}}.
+
+% calls |Fun| for the shards 1 to |Count|; closes all shards if one fails
+for_all_shards(Count, Fun) ->
+  for_all_shards(1, Count, Fun, []).
+
+for_all_shards(I, Count, _Fun, Acc) when I > Count ->
+  {ok, lists:reverse(Acc)};
+for_all_shards(I, Count, Fun, Acc) ->
+  case Fun(I) of
+    {ok, Shard} ->
+      for_all_shards(I + 1, Count, Fun, [Shard | Acc]);
+    Error ->
+      close_shards(lists:reverse(Acc)),
+      Error
+  end.
+
+close_shards(Shards) ->
+  Results = [close_shard(Env, Db) || {Env, Db} <- Shards],
+  case [E || {error, _} = E <- Results] of
+    [] -> ok;
+    [Error | _] -> Error
+  end.
+
+close_shard(Env, Db) ->
+  case ups:db_close(Db) of
+    ok -> ups:env_close(Env);
+    Error -> ups:env_close(Env), Error
+  end.
+
+% returns the index of the shard which stores |Key|
+shard_index(#shards{dbs = Dbs, partition = hash}, Key) ->
+  erlang:phash2(Key, tuple_size(Dbs)) + 1;
+shard_index(#shards{partition = {range, Splits}}, Key) ->
+  range_index(Splits, Key, 1, tuple_size(Splits) + 1).
+
+% binary search for the first split key which is greater than |Key|
+range_index(_Splits, _Key, Low, High) when Low >= High ->
+  Low;
+range_index(Splits, Key, Low, High) ->
+  Mid = (Low + High) div 2,
+  case Key < element(Mid, Splits) of
+    true -> range_index(Splits, Key, Low, Mid);
+    false -> range_index(Splits, Key, Mid + 1, High)
+  end.
+
+shard_db(#shards{dbs = Dbs} = Shards, Key) ->
+  element(shard_index(Shards, Key), Dbs).
+
+% the Databases which can hold keys of the range [StartKey, EndKey)
+range_dbs(#shards{dbs = Dbs, partition = hash}, _StartKey, _EndKey) ->
+  tuple_to_list(Dbs);
+range_dbs(#shards{dbs = Dbs} = Shards, StartKey, EndKey) ->
+  First = case StartKey of
+    undefined -> 1;
+    _ -> shard_index(Shards, StartKey)
+  end,
+  Last = case EndKey of
+    undefined -> tuple_size(Dbs);
+    _ -> shard_index(Shards, EndKey)
+  end,
+  [element(I, Dbs) || I <- lists:seq(First, Last)].
+
+await({ok, Ref}) ->
+  ups:async_await(Ref);
+await(Error) ->
+  Error.
+
+% the requests are already queued; the results are collected in order
+await_all(Requests) ->
+  [{Key, await(Request)} || {Key, Request} <- Requests].
+
+pmap(Fun, List) ->
+  Parent = self(),
+  Pids = [spawn_link(fun() -> Parent ! {self(), Fun(X)} end) || X <- List],
+  [receive {Pid, Result} -> Result end || Pid <- Pids].
+
+% opens a cursor for each Database and fetches the first chunk; a head is
+% {Key, Value, RemainingPairs, Continuation}
+open_cursors([], _StartKey, _EndKey, Acc) ->
+  {Heads, Cursors} = lists:unzip(Acc),
+  {ok, [H || H <- Heads, H =/= empty], Cursors};
+open_cursors([Db | Dbs], StartKey, EndKey, Acc) ->
+  Close = fun() -> [ups:cursor_close(C) || {_, C} <- Acc] end,
+  case ups:cursor_create(Db) of
+    {ok, Cursor} ->
+      case ups:cursor_fold(Cursor, StartKey, EndKey, ?FOLD_CHUNK_SIZE,
+                           forward) of
+        {ok, Pairs, Cont} ->
+          case head(Pairs, Cont) of
+            {error, _} = Error ->
+              ups:cursor_close(Cursor),
+              Close(),
+              Error;
+            Head ->
+              open_cursors(Dbs, StartKey, EndKey, [{Head, Cursor} | Acc])
+          end;
+        Error ->
+          ups:cursor_close(Cursor),
+          Close(),
+          Error
+      end;
+    Error ->
+      Close(),
+      Error
+  end.
+
+head([{K, V} | Rest], Cont) ->
+  {K, V, Rest, Cont};
+head([], '$end_of_table') ->
+  empty;
+head([], Cont) ->
+  case ups:cursor_fold(Cont) of
+    {ok, Pairs, Cont2} -> head(Pairs, Cont2);
+    Error -> Error
+  end.
+
+% |Heads| are sorted by key; the smallest key is always the first head
+merge([], _Fun, Acc) ->
+  {ok, Acc};
+merge([{K, V, Rest, Cont} | Heads], Fun, Acc) ->
+  case head(Rest, Cont) of
+    empty ->
+      merge(Heads, Fun, Fun(K, V, Acc));
+    {error, _} = Error ->
+      Error;
+    Head ->
+      merge(lists:merge([Head], Heads), Fun, Fun(K, V, Acc))
+  end.
@@ -27,7 +27,31 @@ run_test_() ->
     ?_test(env1()),
     ?_test(txn1()),
     ?_test(cursor1()),
-    ?_test(uqi1())
+    ?_test(uqi1()),
+    ?_test(dirty1()),
+    ?_test(async1()),
+    ?_test(batch1()),
+    ?_test(batch2()),
+    ?_test(zero_copy1()),
+    ?_test(cursor2()),
+    ?_test(stream1()),
+    ?_test(uqi2()),
+    ?_test(typed1()),
+    ?_test(metrics1()),
+    ?_test(trace1()),
+    ?_test(commit1()),
+    ?_test(buffer1()),
+    ?_test(cache1()),
+    ?_test(bloom1()),
+    ?_test(shard1()),
+    ?_test(uqi3()),
+    ?_test(bulk1()),
+    ?_test(backup1()),
+    ?_test(compact1()),
+    ?_test(dump1()),
+    ?_test(codec1()),
+    ?_test(termkey1()),
+    ?_test(erase_range1())
    ]}.
 
 %%
@@ -215,4 +239,763 @@ uqi1() ->
   ok = ups:env_close(Env1),
   true.
 
+%%
+%% This test runs blocking operations with different dirty scheduler
+%% policies.
+%%
+dirty1() ->
+  %% Every call of this Environment is executed on a dirty scheduler
+  {ok, Env1} = ups:env_create("test.db", [enable_transactions, enable_fsync],
+                              0, [{dirty_policy, always}]),
+  {ok, Db1} = ups:env_create_db(Env1, 1),
+  {ok, Txn1} = ups:txn_begin(Env1),
+  ok = ups:db_insert(Db1, Txn1, <<"foo1">>, <<"value1">>),
+  ok = ups:txn_commit(Txn1),
+  ?assertEqual({ok, <<"value1">>}, ups:db_find(Db1, <<"foo1">>)),
+  ok = ups:db_close(Db1),
+  ok = ups:env_close(Env1),
+
+  %% Reopen, but only reschedule records with at least 1 kb
+  {ok, Env2} = ups:env_open("test.db", [enable_transactions],
+                            [{dirty_policy, auto}, {dirty_threshold, 1024}]),
+  {ok, Db2} = ups:env_open_db(Env2, 1),
+  ok = ups:db_insert(Db2, <<"foo2">>, binary:copy(<<"x">>, 4096)),
+  ?assertEqual({ok, binary:copy(<<"x">>, 4096)}, ups:db_find(Db2, <<"foo2">>)),
+  ok = ups:db_close(Db2),
+  ok = ups:env_close(Env2),
+
+  %% Never use dirty schedulers
+  {ok, Env3} = ups:env_open("test.db", [], [{dirty_policy, never}]),
+  ok = ups:env_close(Env3),
+  true.
+
+%%
+%% This test pipelines asynchronous requests against the worker thread of
+%% an Environment.
+%%
+async1() ->
+  {ok, Env1} = ups:env_create("test.db"),
+  {ok, Db1} = ups:env_create_db(Env1, 1),
+  %% Send 100 inserts without waiting for the results
+  Refs = lists:map(fun(I) ->
+                     {ok, Ref} = ups:async_insert(Db1, undefined,
+                                                  <<I:32>>, <<"Record">>),
+                     Ref
+                   end, lists:seq(1, 100)),
+  %% The requests are executed in order
+  lists:foreach(fun(Ref) -> ok = ups:async_await(Ref) end, Refs),
+  {ok, Ref1} = ups:async_find(Db1, undefined, <<1:32>>),
+  ?assertEqual({ok, <<"Record">>}, ups:async_await(Ref1)),
+  {ok, Ref2} = ups:async_insert(Db1, undefined, <<1:32>>, <<"Other">>, []),
+  ?assertEqual({error, duplicate_key}, ups:async_await(Ref2)),
+  {ok, Ref3} = ups:async_erase(Db1, undefined, <<1:32>>),
+  ok = ups:async_await(Ref3),
+  {ok, Ref4} = ups:async_find(Db1, undefined, <<1:32>>),
+  ?assertEqual({error, key_not_found}, ups:async_await(Ref4)),
+  {ok, Ref5} = ups:async_find(Db1, undefined, <<1:32>>, [geq_match]),
+  ?assertEqual({ok, <<2:32>>, <<"Record">>}, ups:async_await(Ref5)),
+  ok = ups:db_close(Db1),
+  ok = ups:env_close(Env1),
+  true.
+
+%%
+%% This test inserts key/value pairs in batches.
+%%
+batch1() ->
+  {ok, Env1} = ups:env_create("test.db"),
+  {ok, Db1} = ups:env_create_db(Env1, 1),
+  %% Insert 100000 pairs with a single call
+  Pairs = [{<<I:32>>, <<"Record">>} || I <- lists:seq(1, 100000)],
+  ?assertEqual({ok, 100000, []}, ups:db_insert_many(Db1, Pairs)),
+  ?assertEqual({ok, <<"Record">>}, ups:db_find(Db1, <<50000:32>>)),
+  %% Existing keys are reported, but do not abort the batch
+  ?assertEqual({ok, 1, [{<<1:32>>, duplicate_key}, {<<3:32>>, duplicate_key}]},
+               ups:db_insert_many(Db1, [{<<1:32>>, <<"New">>},
+                                        {<<0:32>>, <<"New">>},
+                                        {<<3:32>>, <<"New">>}])),
+  %% ... unless they are overwritten
+  ?assertEqual({ok, 2, []},
+               ups:db_insert_many(Db1, undefined, [{<<1:32>>, <<"New">>},
+                                                   {<<3:32>>, <<"New">>}],
+                                  [overwrite])),
+  ?assertEqual({ok, <<"New">>}, ups:db_find(Db1, <<3:32>>)),
+  %% Malformed items are reported as well
+  ?assertEqual({ok, 1, [{foo, badarg}, {<<5:32>>, badarg}]},
+               ups:db_insert_many(Db1, [foo, {<<4:32>>, <<"New">>},
+                                        {<<5:32>>, self()}])),
+  ?assertEqual({ok, <<"New">>}, ups:db_find(Db1, <<4:32>>)),
+  ok = ups:db_close(Db1),
+  ok = ups:env_close(Env1),
+  true.
+
+%%
+%% This test looks up multiple keys with a single call.
+%%
+batch2() ->
+  {ok, Env1} = ups:env_create("test.db"),
+  %% The keys of this Database are sorted numerically
+  {ok, Db1} = ups:env_create_db(Env1, 1, [], [{key_type, ?UPS_TYPE_UINT32}]),
+  {ok, 1000, []} = ups:db_insert_many(Db1, [{<<I:32/native>>, <<I:32>>}
+                                            || I <- lists:seq(1, 1000)]),
+  %% Results are returned in the caller's order
+  ?assertEqual({ok, [{ok, <<900:32>>}, not_found, {ok, <<3:32>>}]},
+               ups:db_find_many(Db1, [<<900:32/native>>, <<2000:32/native>>,
+                                      <<3:32/native>>])),
+  Keys = [<<I:32/native>> || I <- lists:seq(1000, 1, -1)],
+  {ok, Results} = ups:db_find_many(Db1, undefined, Keys),
+  ?assertEqual([{ok, <<I:32>>} || I <- lists:seq(1000, 1, -1)], Results),
+  ok = ups:db_close(Db1),
+  ok = ups:env_close(Env1),
+  true.
+
+%%
+%% This test returns large records without copying them.
+%%
+zero_copy1() ->
+  {ok, Env1} = ups:env_create("test.db"),
+  %% Records with at least 1 kb are not copied
+  {ok, Db1} = ups:env_create_db(Env1, 1, [], [{zero_copy_threshold, 1024}]),
+  Large = binary:copy(<<"0123456789">>, 100000),
+  ok = ups:db_insert(Db1, <<"large">>, Large),
+  ok = ups:db_insert(Db1, <<"small">>, <<"value">>),
+  ?assertEqual({ok, Large}, ups:db_find(Db1, <<"large">>)),
+  ?assertEqual({ok, <<"value">>}, ups:db_find(Db1, <<"small">>)),
+  ?assertEqual({error, key_not_found}, ups:db_find(Db1, <<"missing">>)),
+  {ok, Cursor1} = ups:cursor_create(Db1),
+  ?assertEqual({ok, <<"large">>, Large}, ups:cursor_move(Cursor1, [first])),
+  ?assertEqual({ok, <<"small">>, <<"value">>},
+               ups:cursor_move(Cursor1, [next])),
+  ?assertEqual({ok, Large}, ups:cursor_find(Cursor1, <<"large">>)),
+  ok = ups:cursor_close(Cursor1),
+  ok = ups:db_close(Db1),
+  ok = ups:env_close(Env1),
+  true.
+
+%%
+%% This test scans ranges of keys in chunks.
+%%
+cursor2() ->
+  {ok, Env1} = ups:env_create("test.db"),
+  {ok, Db1} = ups:env_create_db(Env1, 1),
+  {ok, 1000, []} = ups:db_insert_many(Db1, [{<<I:32>>, <<"Record">>}
+                                            || I <- lists:seq(1, 1000)]),
+  {ok, Cursor1} = ups:cursor_create(Db1),
+  %% Scan [100, 350) in chunks of 100 pairs
+  {ok, Chunk1, Cont1} = ups:cursor_fold(Cursor1, <<100:32>>, <<350:32>>, 100,
+                                        forward),
+  ?assert(length(Chunk1) =< 100),
+  ?assertEqual([{<<I:32>>, <<"Record">>} || I <- lists:seq(100, 349)],
+               Chunk1 ++ fold_all(Cont1)),
+  %% Scan backwards from the last key
+  {ok, Chunk4, _} = ups:cursor_fold(Cursor1, undefined, undefined, 3,
+                                    backward),
+  ?assertEqual([{<<1000:32>>, <<"Record">>}, {<<999:32>>, <<"Record">>},
+                {<<998:32>>, <<"Record">>}], Chunk4),
+  ok = ups:cursor_close(Cursor1),
+  ok = ups:db_close(Db1),
+  ok = ups:env_close(Env1),
+  true.
+
+%%
+%% This test streams a range of keys with credit-based flow control.
+%%
+stream1() ->
+  {ok, Env1} = ups:env_create("test.db"),
+  {ok, Db1} = ups:env_create_db(Env1, 1),
+  {ok, 1000, []} = ups:db_insert_many(Db1, [{<<I:32>>, <<"Record">>}
+                                            || I <- lists:seq(1, 1000)]),
+  %% Stream [10, 500) in batches of 64 pairs
+  {ok, Ref, Stream} = ups:stream_range(Db1, undefined, {<<10:32>>, <<500:32>>},
+                                       self(), [{batch_size, 64}]),
+  ?assertEqual([{<<I:32>>, <<"Record">>} || I <- lists:seq(10, 499)],
+               stream_all(Ref, Stream)),
+  %% Closing the Database stops a stream which waits for credit
+  {ok, _, _} = ups:stream_range(Db1, undefined, {undefined, undefined},
+                                self(), [{credit, 0}]),
+  ok = ups:db_close(Db1),
+  ok = ups:env_close(Env1),
+  true.
+
+%%
+%% This test converts UQI results to lists and slices.
+%%
+uqi2() ->
+  {ok, Env1} = ups:env_create("test.db"),
+  {ok, Db1} = ups:env_create_db(Env1, 1, [], [{record_type, ?UPS_TYPE_UINT32}]),
+  lists:foreach(fun(I) ->
+                        V = 50 + I rem 30,
+                        ok = ups:db_insert(Db1, <<I:32>>, <<V:32/little>>)
+                end, lists:seq(1, 1000)),
+  %% Numeric records are decoded
+  {ok, Result1} = ups:uqi_select_range(Env1, "MAX($record) FROM DATABASE 1"),
+  ?assertMatch({ok, [{_, 79}]}, ups:uqi_result_to_list(Result1)),
+  ?assertMatch({ok, [{_, 79}]}, ups:uqi_result_slice(Result1, 0, 10)),
+  ?assertEqual({ok, []}, ups:uqi_result_slice(Result1, 1, 10)),
+  ok = ups:uqi_result_close(Result1),
+  ok = ups:db_close(Db1),
+  ok = ups:env_close(Env1),
+  true.
+
+%%
+%% This test passes numbers for numeric key and record types.
+%%
+typed1() ->
+  {ok, Env1} = ups:env_create("test.db"),
+  {ok, Db1} = ups:env_create_db(Env1, 1, [],
+                                [{key_type, ?UPS_TYPE_UINT64},
+                                 {record_type, ?UPS_TYPE_REAL64},
+                                 {typed_terms, true}]),
+  ok = ups:db_insert(Db1, 1, 0.5),
+  ok = ups:db_insert(Db1, <<2:64/little>>, 2),
+  {ok, 3, []} = ups:db_insert_many(Db1, [{I, I * 1.5} || I <- [3, 4, 5]]),
+  ?assertEqual({ok, 0.5}, ups:db_find(Db1, 1)),
+  ?assertEqual({ok, 2.0}, ups:db_find(Db1, <<2:64/little>>)),
+  ?assertEqual({ok, [{ok, 4.5}, not_found]}, ups:db_find_many(Db1, [3, 6])),
+  %% Out of range or wrong type
+  ?assertError(badarg, ups:db_insert(Db1, -1, 1.0)),
+  ?assertError(badarg, ups:db_insert(Db1, 1.5, 1.0)),
+  {ok, Cursor1} = ups:cursor_create(Db1),
+  ?assertEqual({ok, 1, 0.5}, ups:cursor_move(Cursor1, [first])),
+  {ok, Chunk1, _} = ups:cursor_fold(Cursor1, 2, 5, 10, forward),
+  ?assertEqual([{2, 2.0}, {3, 4.5}, {4, 6.0}], Chunk1),
+  ok = ups:cursor_close(Cursor1),
+  ok = ups:db_close(Db1),
+  ok = ups:env_close(Env1),
+  true.
+
+%%
+%% This test reads the engine and NIF counters of an Environment.
+%%
+metrics1() ->
+  {ok, Env1} = ups:env_create("test.db"),
+  {ok, Db1} = ups:env_create_db(Env1, 1),
+  ok = ups:db_insert(Db1, <<"Hello">>, <<"World">>),
+  {ok, <<"World">>} = ups:db_find(Db1, <<"Hello">>),
+  {error, key_not_found} = ups:db_find(Db1, <<"Missing">>),
+  {ok, #{engine := Engine, nif := Nif}} = ups:env_metrics(Env1),
+  ?assert(is_integer(maps:get(page_count_fetched, Engine))),
+  ?assert(maps:get(db_insert, maps:get(calls, Nif)) >= 1),
+  ?assert(maps:get(db_find, maps:get(bytes_out, Nif)) >= 5),
+  ?assert(maps:get(key_not_found, maps:get(errors, Nif)) >= 1),
+  ok = ups:db_close(Db1),
+  ok = ups:env_close(Env1),
+  true.
+
+%%
+%% This test records slow calls in the flight recorder.
+%%
+trace1() ->
+  {ok, Env1} = ups:env_create("test.db"),
+  {ok, Db1} = ups:env_create_db(Env1, 1),
+  %% Record every call which takes at least 1 microsecond; copying the
+  %% large record takes longer
+  ok = ups:trace_subscribe(self()),
+  ok = ups:trace_threshold(1),
+  ok = ups:db_insert(Db1, <<"Hello">>, binary:copy(<<0>>, 1024 * 1024)),
+  ok = ups:trace_threshold(0),
+  ok = ups:trace_unsubscribe(self()),
+  ?assert(lists:any(fun(#{op := Op, db := Db, key := Key}) ->
+                            {Op, Db, Key} =:= {db_insert, 1, <<"Hello">>}
+                    end, ups:trace_dump())),
+  receive
+    {ups_trace, #{op := db_insert, record_size := 1048576}} -> ok
+  after 1000 ->
+    erlang:error(timeout)
+  end,
+  ok = ups:db_close(Db1),
+  ok = ups:env_close(Env1),
+  true.
+
+%%
+%% This test commits Transactions of concurrent processes in groups.
+%%
+commit1() ->
+  {ok, Env1} = ups:env_create("test.db", [enable_transactions, enable_fsync],
+                              8#644, [{group_commit_window, 5000},
+                                      {group_commit_size, 8}]),
+  {ok, Db1} = ups:env_create_db(Env1, 1),
+  Self = self(),
+  %% Every process waits till its commit is durable
+  Pids = [spawn_link(fun() ->
+                       {ok, Txn} = ups:txn_begin(Env1),
+                       ok = ups:db_insert(Db1, Txn, <<I:32>>, <<"Record">>),
+                       Self ! {self(), ups:txn_commit(Txn)}
+                     end) || I <- lists:seq(1, 20)],
+  lists:foreach(fun(Pid) -> receive {Pid, Result} -> ok = Result end end,
+                Pids),
+  ok = ups:db_close(Db1),
+  ok = ups:env_close(Env1),
+  {ok, Env2} = ups:env_open("test.db", [enable_transactions]),
+  {ok, Db2} = ups:env_open_db(Env2, 1),
+  lists:foreach(fun(I) ->
+                  ?assertEqual({ok, <<"Record">>}, ups:db_find(Db2, <<I:32>>))
+                end, lists:seq(1, 20)),
+  ok = ups:db_close(Db2),
+  ok = ups:env_close(Env2),
+  true.
+
+%%
+%% This test buffers small writes in memory.
+%%
+buffer1() ->
+  {ok, Env1} = ups:env_create("test.db"),
+  {ok, Db1} = ups:env_create_db(Env1, 1, [], [{write_buffer_size, 1000000}]),
+  ok = ups:db_insert(Db1, <<"a">>, <<"1">>),
+  %% Hot keys are overwritten in the buffer
+  lists:foreach(fun(I) ->
+                  ok = ups:db_insert(Db1, undefined, <<"b">>, <<I:32>>,
+                                     [overwrite])
+                end, lists:seq(1, 100)),
+  ?assertEqual({ok, <<100:32>>}, ups:db_find(Db1, <<"b">>)),
+  ?assertEqual({error, duplicate_key}, ups:db_insert(Db1, <<"a">>, <<"2">>)),
+  ok = ups:db_erase(Db1, <<"a">>),
+  ?assertEqual({error, key_not_found}, ups:db_find(Db1, <<"a">>)),
+  ?assertEqual({error, key_not_found}, ups:db_erase(Db1, <<"a">>)),
+  ok = ups:db_insert(Db1, <<"c">>, <<"3">>),
+  %% Cursors see the buffered writes after they were flushed
+  {ok, Cursor} = ups:cursor_create(Db1),
+  ?assertEqual({ok, <<"b">>, <<100:32>>}, ups:cursor_move(Cursor, [first])),
+  ?assertEqual({ok, <<"c">>, <<"3">>}, ups:cursor_move(Cursor, [next])),
+  ok = ups:cursor_close(Cursor),
+  ok = ups:db_insert(Db1, <<"d">>, <<"4">>),
+  ok = ups:db_flush_buffer(Db1),
+  %% Closing the Database writes the buffer
+  ok = ups:db_insert(Db1, <<"e">>, <<"5">>),
+  ok = ups:db_close(Db1),
+  {ok, Db2} = ups:env_open_db(Env1, 1),
+  ?assertEqual({ok, <<"4">>}, ups:db_find(Db2, <<"d">>)),
+  ?assertEqual({ok, <<"5">>}, ups:db_find(Db2, <<"e">>)),
+  ok = ups:db_close(Db2),
+  ok = ups:env_close(Env1),
+  true.
+
+%%
+%% This test serves repeated lookups from the read cache.
+%%
+cache1() ->
+  {ok, Env1} = ups:env_create("test.db"),
+  {ok, Db1} = ups:env_create_db(Env1, 1, [], [{read_cache_size, 1000000}]),
+  ok = ups:db_insert(Db1, <<"key">>, <<"Record">>),
+  ?assertEqual({ok, <<"Record">>}, ups:db_find(Db1, <<"key">>)),
+  ?assertEqual({ok, <<"Record">>}, ups:db_find(Db1, <<"key">>)),
+  ?assertMatch({ok, #{hits := 1, misses := 1, entries := 1}},
+               ups:db_cache_stats(Db1)),
+  %% Writes invalidate the cache
+  ok = ups:db_insert(Db1, undefined, <<"key">>, <<"Other">>, [overwrite]),
+  ?assertEqual({ok, <<"Other">>}, ups:db_find(Db1, <<"key">>)),
+  {ok, Cursor} = ups:cursor_create(Db1),
+  {ok, <<"key">>, <<"Other">>} = ups:cursor_move(Cursor, [first]),
+  ok = ups:cursor_overwrite(Cursor, <<"Third">>),
+  ?assertEqual({ok, <<"Third">>}, ups:db_find(Db1, <<"key">>)),
+  ok = ups:cursor_erase(Cursor),
+  ok = ups:cursor_close(Cursor),
+  ?assertEqual({error, key_not_found}, ups:db_find(Db1, <<"key">>)),
+  ok = ups:db_close(Db1),
+  ok = ups:env_close(Env1),
+  true.
+
+%%
+%% This test skips lookups of missing keys with a Bloom filter.
+%%
+bloom1() ->
+  {ok, Env1} = ups:env_create("test.db"),
+  Params = [{bloom_filter_fpr, 0.01}, {bloom_filter_keys, 1000}],
+  {ok, Db1} = ups:env_create_db(Env1, 1, [], Params),
+  lists:foreach(fun(I) -> ok = ups:db_insert(Db1, <<I:32>>, <<"Record">>)
+                end, lists:seq(1, 100)),
+  ?assertEqual({ok, <<"Record">>}, ups:db_find(Db1, <<1:32>>)),
+  ?assertEqual({error, key_not_found}, ups:db_find(Db1, <<1000:32>>)),
+  {ok, Stats1} = ups:db_bloom_stats(Db1),
+  ?assertMatch(#{ready := true, checks := 2}, Stats1),
+  %% The filter is saved when the Database is closed
+  ok = ups:db_close(Db1),
+  ?assert(filelib:is_file("test.db.bloom.1")),
+  {ok, Db2} = ups:env_open_db(Env1, 1, [], Params),
+  ?assertNot(filelib:is_file("test.db.bloom.1")),
+  ?assertMatch({ok, #{ready := true}}, ups:db_bloom_stats(Db2)),
+  lists:foreach(fun(I) -> ?assertEqual({ok, <<"Record">>},
+                                       ups:db_find(Db2, <<I:32>>))
+                end, lists:seq(1, 100)),
+  ok = ups:db_close(Db2),
+  %% -0.0 and 0.0 are the same key
+  {ok, Db3} = ups:env_create_db(Env1, 2, [],
+                                [{key_type, ?UPS_TYPE_REAL64} | Params]),
+  ok = ups:db_insert(Db3, <<16#8000000000000000:64/native>>, <<"Zero">>),
+  ?assertEqual({ok, <<"Zero">>}, ups:db_find(Db3, <<0:64/native>>)),
+  ok = ups:db_close(Db3),
+  ok = ups:env_close(Env1),
+  file:delete("test.db.bloom.1"),
+  file:delete("test.db.bloom.2"),
+  true.
+
+%%
+%% This test distributes keys over the Environments of a shard set.
+%%
+shard1() ->
+  {ok, Shards1} = ups_shard:create("test.shard", 4, []),
+  ?assertEqual(4, ups_shard:shard_count(Shards1)),
+  Pairs = [{<<I:32>>, integer_to_binary(I)} || I <- lists:seq(1, 100)],
+  ?assertEqual({ok, 100, []}, ups_shard:insert_many(Shards1, Pairs)),
+  ok = ups_shard:erase(Shards1, <<1:32>>),
+  ok = ups_shard:close(Shards1),
+  {ok, Shards2} = ups_shard:open("test.shard", []),
+  ?assertEqual({ok, <<"2">>}, ups_shard:find(Shards2, <<2:32>>)),
+  ?assertEqual({ok, [{error, key_not_found}, {ok, <<"3">>}]},
+               ups_shard:find_many(Shards2, [<<1:32>>, <<3:32>>])),
+  %% Range scans are merged in key order
+  ?assertEqual({ok, lists:reverse(tl(Pairs))},
+               ups_shard:fold(Shards2, undefined, undefined,
+                              fun(K, V, Acc) -> [{K, V} | Acc] end, [])),
+  ok = ups_shard:close(Shards2),
+  %% Key ranges
+  {ok, Shards3} = ups_shard:create("test.shard", 2,
+                                   [{partition, {range, [<<50:32>>]}}]),
+  ok = ups_shard:insert(Shards3, <<10:32>>, <<"a">>),
+  ok = ups_shard:insert(Shards3, <<60:32>>, <<"b">>),
+  ?assertEqual({ok, [<<60:32>>]},
+               ups_shard:fold(Shards3, <<50:32>>, undefined,
+                              fun(K, _V, Acc) -> [K | Acc] end, [])),
+  ok = ups_shard:close(Shards3),
+  [file:delete(F) || F <- filelib:wildcard("test.shard*")],
+  true.
+
+%%
+%% This test runs a prepared UQI query over ranges of keys.
+%%
+uqi3() ->
+  {ok, Env1} = ups:env_create("test.db"),
+  {ok, Db1} = ups:env_create_db(Env1, 1, [], [{record_type, ?UPS_TYPE_UINT32}]),
+  lists:foreach(fun(I) ->
+                        ok = ups:db_insert(Db1, <<I:32>>, <<I:32/little>>)
+                end, lists:seq(1, 100)),
+  {error, inv_parameter} = ups:uqi_prepare(Env1, "MAX($record)"),
+  {ok, Query} = ups:uqi_prepare(Env1, <<"MAX($record) FROM DATABASE 1">>),
+  {ok, Result1} = ups:uqi_execute(Query, undefined, undefined),
+  ?assertMatch({ok, [{_, 100}]}, ups:uqi_result_to_list(Result1)),
+  ok = ups:uqi_result_close(Result1),
+  %% The end key is excluded
+  {ok, Result2} = ups:uqi_execute(Query, <<10:32>>, <<50:32>>),
+  ?assertMatch({ok, [{_, 49}]}, ups:uqi_result_to_list(Result2)),
+  ok = ups:uqi_result_close(Result2),
+  %% Queries are not limited in length
+  Long = lists:duplicate(2000, $\s) ++ "MAX($record) FROM DATABASE 1",
+  {ok, Result3} = ups:uqi_select_range(Env1, Long),
+  ?assertMatch({ok, [{_, 100}]}, ups:uqi_result_to_list(Result3)),
+  ok = ups:uqi_result_close(Result3),
+  ok = ups:db_close(Db1),
+  {error, database_not_found} = ups:uqi_execute(Query, <<10:32>>, undefined),
+  ok = ups:env_close(Env1),
+  true.
+
+%%
+%% This test builds a Database from a sorted stream of keys.
+%%
+bulk1() ->
+  {ok, Env1} = ups:env_create("test.db", [enable_transactions]),
+  {ok, Db1} = ups:env_create_db(Env1, 1),
+  %% A sorted generator
+  Batch = fun(From) -> [{<<I:32>>, <<"Record">>} || I <- lists:seq(From,
+                                                                From + 99)]
+          end,
+  Gen = fun(_F, From) when From > 300 -> eof;
+           (F, From) -> {ok, Batch(From), fun() -> F(F, From + 100) end}
+        end,
+  Self = self(),
+  ?assertEqual({ok, 300},
+               ups:bulk_load(Db1, {generator, fun() -> Gen(Gen, 1) end},
+                             [{batch_size, 64},
+                              {progress, fun(N) -> Self ! {progress, N} end}])),
+  receive {progress, 64} -> ok end,
+  %% An unsorted file, sorted in several runs
+  Pairs = [{<<I:32>>, <<"File">>} || I <- lists:seq(1000, 1999)],
+  Shuffled = [P || {_, P} <- lists:sort([{rand:uniform(), P} || P <- Pairs])],
+  ok = file:write_file("test.pairs", ups_bulk:encode_pairs(Shuffled)),
+  ?assertEqual({ok, 1000},
+               ups:bulk_load(Db1, {file, "test.pairs"}, [{memory, 4096}])),
+  ?assertEqual([], filelib:wildcard("test.pairs.run.*")),
+  lists:foreach(fun({K, V}) -> ?assertEqual({ok, V}, ups:db_find(Db1, K))
+                end, Pairs),
+  ?assertEqual({error, duplicate_key},
+               ups:bulk_load(Db1, {file, "test.pairs"}, [])),
+  ok = file:delete("test.pairs"),
+  ok = ups:db_close(Db1),
+  ok = ups:env_close(Env1),
+  true.
+
+%%
+%% This test copies a live Environment to a backup file.
+%%
+backup1() ->
+  file:delete("test.backup"),
+  {ok, Env1} = ups:env_create("test.db"),
+  {ok, Db1} = ups:env_create_db(Env1, 1),
+  lists:foreach(fun(I) -> ok = ups:db_insert(Db1, <<I:32>>, <<"Before">>)
+                end, lists:seq(1, 1000)),
+  {ok, Ref1} = ups:env_backup(Env1, "test.backup", []),
+  %% Writes continue while the backup runs
+  ok = ups:db_insert(Db1, <<2000:32>>, <<"During">>),
+  Stats = receive {ups_backup, Ref1, {ok, S}} -> S end,
+  ?assertEqual(maps:get(bytes, Stats), filelib:file_size("test.db")),
+  %% An incremental backup only writes the changed blocks
+  ok = ups:db_insert(Db1, <<3000:32>>, <<"After">>),
+  {ok, Ref2} = ups:env_backup(Env1, "test.backup", [{incremental, true},
+                                                    {rate_limit, 1 bsl 20}]),
+  Stats2 = receive {ups_backup, Ref2, {ok, S2}} -> S2 end,
+  ?assert(maps:get(written, Stats2) < maps:get(bytes, Stats2)),
+  ok = ups:db_close(Db1),
+  ok = ups:env_close(Env1),
+  {ok, Env2} = ups:env_open("test.backup"),
+  {ok, Db2} = ups:env_open_db(Env2, 1),
+  ?assertEqual({ok, <<"Before">>}, ups:db_find(Db2, <<1:32>>)),
+  ?assertEqual({ok, <<"After">>}, ups:db_find(Db2, <<3000:32>>)),
+  ok = ups:db_close(Db2),
+  ok = ups:env_close(Env2),
+  ok = file:delete("test.backup"),
+  %% In-memory Environments do not have a file
+  {ok, Env3} = ups:env_create("test.db", [in_memory]),
+  {error, inv_parameter} = ups:env_backup(Env3, "test.backup", []),
+  ok = ups:env_close(Env3),
+  true.
+
+%%
+%% This test rewrites an Environment into a compacted file.
+%%
+compact1() ->
+  {ok, Env1} = ups:env_create("test.db"),
+  {ok, Db1} = ups:env_create_db(Env1, 1),
+  {ok, Db2} = ups:env_create_db(Env1, 2, [enable_duplicate_keys]),
+  Record = binary:copy(<<"x">>, 200),
+  lists:foreach(fun(I) -> ok = ups:db_insert(Db1, <<I:32>>, Record)
+                end, lists:seq(1, 5000)),
+  lists:foreach(fun(I) -> ok = ups:db_erase(Db1, <<I:32>>)
+                end, lists:seq(1, 4900)),
+  ok = ups:db_insert(Db2, <<"a">>, <<"1">>),
+  ok = ups:db_insert(Db2, undefined, <<"a">>, <<"2">>, [duplicate]),
+  ok = ups:db_close(Db1),
+  ok = ups:db_close(Db2),
+  ok = ups:env_close(Env1),
+  {ok, Stats} = ups:env_compact("test.db", "test.compact", []),
+  ?assertMatch(#{databases := 2, keys := 102}, Stats),
+  ?assert(maps:get(bytes_after, Stats) < maps:get(bytes_before, Stats)),
+  %% The Environment must not be open
+  {ok, Env2} = ups:env_open("test.compact"),
+  ?assertMatch({error, _}, ups:env_compact("test.compact", "test.db2", [])),
+  {ok, Db3} = ups:env_open_db(Env2, 1),
+  ?assertEqual({ok, Record}, ups:db_find(Db3, <<5000:32>>)),
+  ?assertEqual({error, key_not_found}, ups:db_find(Db3, <<1:32>>)),
+  {ok, Db4} = ups:env_open_db(Env2, 2),
+  {ok, Cursor} = ups:cursor_create(Db4),
+  {ok, <<"a">>, <<"1">>} = ups:cursor_move(Cursor, [first]),
+  ?assertEqual({ok, 2}, ups:cursor_get_duplicate_count(Cursor)),
+  ok = ups:cursor_close(Cursor),
+  ok = ups:db_close(Db3),
+  ok = ups:db_close(Db4),
+  ok = ups:env_close(Env2),
+  %% In place
+  {ok, #{bytes_saved := Saved}} = ups:env_compact("test.db", []),
+  ?assert(Saved > 0),
+  ?assertEqual(filelib:file_size("test.compact"),
+               filelib:file_size("test.db")),
+  ok = file:delete("test.compact"),
+  true.
+
+%%
+%% This test dumps an Environment to a file and restores it.
+%%
+dump1() ->
+  {ok, Env1} = ups:env_create("test.db"),
+  {ok, Db1} = ups:env_create_db(Env1, 1),
+  {ok, Db2} = ups:env_create_db(Env1, 2, [], [{key_type, ?UPS_TYPE_UINT32}]),
+  Pairs = [{<<I:32>>, binary:copy(<<I:8>>, 100)} || I <- lists:seq(1, 2000)],
+  {ok, 2000, []} = ups:db_insert_many(Db1, Pairs),
+  ok = ups:db_insert(Db2, <<7:32/native>>, <<"seven">>),
+  ok = ups:db_close(Db2),
+  %% Small blocks, compressed by several threads
+  lists:foreach(
+    fun(Codec) ->
+        ?assertEqual({ok, #{databases => 2, pairs => 2001}},
+                     ups:dump(Env1, "test.dump", [{codec, Codec},
+                                                  {block_size, 4096},
+                                                  {threads, 3}])),
+        file:delete("test.restore"),
+        ?assertEqual({ok, #{databases => 2, pairs => 2001}},
+                     ups:restore("test.dump", "test.restore", [])),
+        {ok, Env2} = ups:env_open("test.restore"),
+        {ok, Db3} = ups:env_open_db(Env2, 1),
+        lists:foreach(fun({K, V}) -> ?assertEqual({ok, V}, ups:db_find(Db3, K))
+                      end, Pairs),
+        {ok, Db4} = ups:env_open_db(Env2, 2),
+        ?assertEqual({ok, <<"seven">>}, ups:db_find(Db4, <<7:32/native>>)),
+        ok = ups:db_close(Db3),
+        ok = ups:db_close(Db4),
+        ok = ups:env_close(Env2)
+    end, [none, zlib, snappy]),
+  %% A truncated file is rejected
+  {ok, Dump} = file:read_file("test.dump"),
+  ok = file:write_file("test.dump", binary:part(Dump, 0, byte_size(Dump) div 2)),
+  ?assertEqual({error, inv_file_header},
+               ups:restore("test.dump", "test.restore", [{threads, 0}])),
+  ?assertNot(filelib:is_file("test.restore")),
+  ok = ups:db_close(Db1),
+  ok = ups:env_close(Env1),
+  ok = file:delete("test.dump"),
+  true.
+
+%%
+%% This test compresses records with a trained dictionary.
+%%
+codec1() ->
+  {ok, Env1} = ups:env_create("test.db"),
+  {ok, Db1} = ups:env_create_db(Env1, 1),
+  Record = fun(I) ->
+             list_to_binary(io_lib:format("{\"id\": ~p, \"name\": \"user~p\", "
+                                          "\"active\": true}", [I, I]))
+           end,
+  lists:foreach(fun(I) -> ok = ups:db_insert(Db1, <<I:32>>, Record(I))
+                end, lists:seq(1, 500)),
+  %% A raw record which looks like an encoded record
+  Lookalike = <<16#FF, 16#DC, 0:16, 4:32, "abcd">>,
+  ok = ups:db_insert(Db1, undefined, <<1:32>>, Lookalike, [overwrite]),
+  {ok, #{version := 1, samples := 100}}
+      = ups:db_train_codec(Db1, [{sample_size, 100},
+                                 {dictionary_size, 1024}]),
+  %% Records written before and after the training
+  lists:foreach(fun(I) -> ok = ups:db_insert(Db1, <<I:32>>, Record(I))
+                end, lists:seq(501, 1000)),
+  ?assertEqual({ok, Lookalike}, ups:db_find(Db1, <<1:32>>)),
+  ?assertEqual({ok, Record(2)}, ups:db_find(Db1, <<2:32>>)),
+  ?assertEqual({ok, Record(1000)}, ups:db_find(Db1, <<1000:32>>)),
+  {ok, Cursor} = ups:cursor_create(Db1),
+  ?assertEqual({ok, Record(600)}, ups:cursor_find(Cursor, <<600:32>>)),
+  ?assertEqual({ok, byte_size(Record(600))},
+               ups:cursor_get_record_size(Cursor)),
+  ?assertEqual({ok, <<601:32>>, Record(601)},
+               ups:cursor_move(Cursor, [next])),
+  ok = ups:cursor_close(Cursor),
+  %% Retraining adds a version
+  {ok, #{version := 2}} = ups:db_train_codec(Db1, []),
+  ok = ups:db_insert(Db1, undefined, <<1:32>>, <<"new">>, [overwrite]),
+  ok = ups:db_close(Db1),
+  %% Only binary records of variable size are compressed
+  {ok, Db2} = ups:env_create_db(Env1, 2, [], [{record_type, ?UPS_TYPE_UINT32}]),
+  {error, inv_parameter} = ups:db_train_codec(Db2, []),
+  ok = ups:db_close(Db2),
+  ok = ups:env_close(Env1),
+  %% The dictionaries are stored in the Environment
+  {ok, Env2} = ups:env_open("test.db"),
+  {ok, Db3} = ups:env_open_db(Env2, 1),
+  ?assertEqual({ok, <<"new">>}, ups:db_find(Db3, <<1:32>>)),
+  lists:foreach(fun(I) -> ?assertEqual({ok, Record(I)},
+                                       ups:db_find(Db3, <<I:32>>))
+                end, lists:seq(2, 1000)),
+  ok = ups:db_close(Db3),
+  ok = ups:env_close(Env2),
+  true.
+
+%%
+%% This test stores Erlang terms as keys in term order.
+%%
+termkey1() ->
+  {ok, Env} = ups:env_create("test.db"),
+  {ok, Db} = ups:env_create_db(Env, 1, [], [{key_codec, term}]),
+  Keys = [-5, 1, 1.5, 2, foo, {1}, {1, a}, {1, a, 3}, {1, b}, {2, <<>>},
+          [], [1], "abc", <<0>>, <<0, 1>>, <<1>>],
+  lists:foreach(fun(K) -> ok = ups:db_insert(Db, K, term_to_binary(K)) end,
+                lists:reverse(Keys)),
+  ?assertEqual({ok, term_to_binary({1, a})}, ups:db_find(Db, {1, a})),
+  %% The keys are returned as terms, in term order
+  {ok, Cursor} = ups:cursor_create(Db),
+  {ok, Pairs, '$end_of_table'} = ups:cursor_fold(Cursor, undefined, undefined,
+                                                 100, forward),
+  ?assertEqual(Keys, [K || {K, _} <- Pairs]),
+  ok = ups:cursor_close(Cursor),
+  %% Prefix scans
+  Tenant = fun(T) -> [{T, U, Ts} || U <- [a, b], Ts <- lists:seq(1, 50)] end,
+  {ok, 300, []} = ups:db_insert_many(Db, [{K, <<>>}
+                                         || K <- Tenant(10) ++ Tenant(11)
+                                                 ++ Tenant(12)]),
+  {ok, Tenant11} = ups:prefix_scan(Db, undefined, {11}, [{chunk_size, 7}]),
+  ?assertEqual(Tenant(11), [K || {K, _} <- Tenant11]),
+  {ok, User} = ups:prefix_scan(Db, undefined, {11, b},
+                               [{direction, backward}, {limit, 3}]),
+  ?assertEqual([{11, b, 50}, {11, b, 49}, {11, b, 48}], [K || {K, _} <- User]),
+  ?assertEqual({ok, []}, ups:prefix_scan(Db, undefined, {13}, [])),
+  %% Only tuples and Databases with term keys
+  {ok, Db2} = ups:env_create_db(Env, 2),
+  ?assertEqual({error, inv_parameter},
+               ups:prefix_scan(Db2, undefined, {1}, [])),
+  ?assertError(badarg, ups:db_insert(Db, self(), <<>>)),
+  ok = ups:db_close(Db),
+  ok = ups:db_close(Db2),
+  %% The codec is stored in the Environment
+  {ok, Db3} = ups:env_open_db(Env, 1),
+  ?assertEqual({ok, term_to_binary({1, a})}, ups:db_find(Db3, {1, a})),
+  ok = ups:db_close(Db3),
+  ?assertEqual({error, inv_parameter},
+               ups:env_open_db(Env, 1, [], [{key_codec, binary}])),
+  ok = ups:env_close(Env),
+  true.
+
+%%
+%% This test erases a range of keys in chunks.
+%%
+erase_range1() ->
+  {ok, Env} = ups:env_create("test.db", [enable_transactions]),
+  {ok, Db} = ups:env_create_db(Env, 1, [], [{read_cache_size, 1000000}]),
+  {ok, 1000, []} = ups:db_insert_many(Db, [{<<I:32>>, <<"Record">>}
+                                           || I <- lists:seq(1, 1000)]),
+  {ok, <<"Record">>} = ups:db_find(Db, <<500:32>>),
+  ?assertMatch({ok, #{entries := 1}}, ups:db_cache_stats(Db)),
+  %% The end key is excluded; the read cache is invalidated
+  ?assertEqual({ok, 400},
+               ups:erase_range(Db, undefined, <<101:32>>, <<501:32>>,
+                               [{chunk_size, 7}, {sub_transactions, true}])),
+  ?assertMatch({ok, #{entries := 0}}, ups:db_cache_stats(Db)),
+  ?assertEqual({error, key_not_found}, ups:db_find(Db, <<500:32>>)),
+  {ok, <<"Record">>} = ups:db_find(Db, <<501:32>>),
+  {ok, 0} = ups:erase_range(Db, undefined, <<200:32>>, <<300:32>>, []),
+  %% Open bounds, and a Transaction which is aborted
+  {ok, Txn} = ups:txn_begin(Env),
+  {ok, 100} = ups:erase_range(Db, Txn, undefined, <<101:32>>, []),
+  ok = ups:txn_abort(Txn),
+  {ok, 500} = ups:erase_range(Db, undefined, <<501:32>>, undefined,
+                              [{chunk_size, 64}]),
+  {ok, Cursor} = ups:cursor_create(Db),
+  {ok, Pairs, '$end_of_table'} = ups:cursor_fold(Cursor, undefined, undefined,
+                                                 1000, forward),
+  ?assertEqual([<<I:32>> || I <- lists:seq(1, 100)], [K || {K, _} <- Pairs]),
+  ok = ups:cursor_close(Cursor),
+  %% Duplicate keys are erased with their key
+  {ok, Db2} = ups:env_create_db(Env, 2, [enable_duplicate_keys]),
+  lists:foreach(fun({K, V}) ->
+                  ok = ups:db_insert(Db2, undefined, K, V, [duplicate])
+                end, [{<<1>>, <<"a">>}, {<<1>>, <<"b">>}, {<<2>>, <<"a">>},
+                      {<<2>>, <<"b">>}, {<<2>>, <<"c">>}, {<<3>>, <<"a">>}]),
+  ?assertEqual({ok, 2}, ups:erase_range(Db2, undefined, <<1>>, <<3>>,
+                                        [{chunk_size, 1},
+                                         {sub_transactions, true}])),
+  ?assertEqual({error, key_not_found}, ups:db_find(Db2, <<2>>)),
+  {ok, <<"a">>} = ups:db_find(Db2, <<3>>),
+  ok = ups:db_close(Db2),
+  ok = ups:db_close(Db),
+  ok = ups:env_close(Env),
+  true.
+
+stream_all(Ref, Stream) ->
+  receive
+    {ups_stream, Ref, {data, Pairs}} ->
+      ok = ups:stream_ack(Stream, 1),
+      Pairs ++ stream_all(Ref, Stream);
+    {ups_stream, Ref, done} ->
+      []
+  after 5000 ->
+    erlang:error(timeout)
+  end.
+
+fold_all('$end_of_table') ->
+  [];
+fold_all(Cont) ->
+  {ok, Chunk, Next} = ups:cursor_fold(Cont),
+  Chunk ++ fold_all(Next).
+
 -endif.